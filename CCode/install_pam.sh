@@ -15,16 +15,15 @@ fi
 # Install dependencies
 echo "Installing dependencies..."
 if command -v dnf &> /dev/null; then
-    dnf install -y gcc make libcurl-devel cjson-devel pam-devel
+    dnf install -y gcc make libcurl-devel pam-devel
 elif command -v apt-get &> /dev/null; then
     apt-get update
-    apt-get install -y gcc make libcurl4-openssl-dev libcjson-dev libpam0g-dev
+    apt-get install -y gcc make libcurl4-openssl-dev libpam0g-dev
 else
     echo "Unsupported package manager. Please install dependencies manually:"
     echo "  - gcc"
     echo "  - make"
     echo "  - libcurl-devel (or libcurl4-openssl-dev)"
-    echo "  - cjson-devel (or libcjson-dev)"
     echo "  - pam-devel (or libpam0g-dev)"
     exit 1
 fi
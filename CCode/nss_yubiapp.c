@@ -0,0 +1,268 @@
+/*
+ * nss_yubiapp.c - Name service module for YubiApp accounts
+ *
+ * Answers passwd and group lookups from the index yubiappd maintains
+ * (yubiapp_users.h), so YubiApp users can log in without being copied into
+ * /etc/passwd. Nothing here talks to the broker or the API: a lookup is a
+ * search of the mapped index under a mutex, and while yubiappd cannot
+ * reach the API the last index it wrote keeps answering.
+ *
+ * Enable it after files in /etc/nsswitch.conf:
+ *     passwd: files yubiapp
+ *     group:  files yubiapp
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <grp.h>
+#include <nss.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "yubiapp_users.h"
+
+// How long to wait before looking for a missing index again
+#define REOPEN_INTERVAL 1
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ya_users index_map;
+static time_t retry_at;
+static uint32_t next_user, next_group;   /* getpwent/getgrent positions */
+
+// Map the index, or the newer one if the broker has replaced it. A stale
+// index is kept when the new one cannot be mapped. Called with lock held;
+// returns 0 when an index is mapped.
+static int ensure_index(void) {
+    if (index_map.header && !ya_users_stale(&index_map)) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    if (now < retry_at) {
+        return index_map.header ? 0 : -1;
+    }
+    struct ya_users fresh;
+    if (ya_users_open(&fresh, YA_USERS_PATH) != 0) {
+        retry_at = now + REOPEN_INTERVAL;
+        return index_map.header ? 0 : -1;
+    }
+    ya_users_close(&index_map);
+    index_map = fresh;
+    next_user = next_group = 0;
+    return 0;
+}
+
+// Copy a string into the caller's buffer, or NULL if it does not fit
+static char *copy_str(const char *s, char **buf, size_t *left) {
+    size_t len = strlen(s) + 1;
+
+    if (len > *left) {
+        return NULL;
+    }
+    char *dst = memcpy(*buf, s, len);
+    *buf += len;
+    *left -= len;
+    return dst;
+}
+
+static enum nss_status fill_passwd(const struct ya_users_user *e, struct passwd *pwd, char *buf, size_t buflen,
+                                   int *errnop) {
+    if (!(pwd->pw_name = copy_str(ya_users_str(&index_map, e->name), &buf, &buflen)) ||
+        !(pwd->pw_passwd = copy_str("x", &buf, &buflen)) ||
+        !(pwd->pw_gecos = copy_str(ya_users_str(&index_map, e->gecos), &buf, &buflen)) ||
+        !(pwd->pw_dir = copy_str(ya_users_str(&index_map, e->dir), &buf, &buflen)) ||
+        !(pwd->pw_shell = copy_str(ya_users_str(&index_map, e->shell), &buf, &buflen))) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    pwd->pw_uid = e->uid;
+    pwd->pw_gid = e->uid;
+    return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status fill_group(const struct ya_users_group *g, struct group *grp, char *buf, size_t buflen,
+                                  int *errnop) {
+    // The member array goes first, aligned for pointers
+    size_t pad = (sizeof(char *) - (uintptr_t)buf % sizeof(char *)) % sizeof(char *);
+    size_t array = ((size_t)g->member_count + 1) * sizeof(char *);
+
+    if (pad + array > buflen) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    char **mem = (char **)(buf + pad);
+    buf += pad + array;
+    buflen -= pad + array;
+
+    for (uint32_t i = 0; i < g->member_count; i++) {
+        const struct ya_users_user *e = &index_map.users[index_map.members[g->members + i]];
+        if (!(mem[i] = copy_str(ya_users_str(&index_map, e->name), &buf, &buflen))) {
+            *errnop = ERANGE;
+            return NSS_STATUS_TRYAGAIN;
+        }
+    }
+    mem[g->member_count] = NULL;
+    if (!(grp->gr_name = copy_str(ya_users_str(&index_map, g->name), &buf, &buflen)) ||
+        !(grp->gr_passwd = copy_str("x", &buf, &buflen))) {
+        *errnop = ERANGE;
+        return NSS_STATUS_TRYAGAIN;
+    }
+    grp->gr_gid = g->gid;
+    grp->gr_mem = mem;
+    return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_yubiapp_getpwnam_r(const char *name, struct passwd *pwd, char *buf, size_t buflen,
+                                        int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        const struct ya_users_user *e = ya_users_by_name(&index_map, name);
+        status = e ? fill_passwd(e, pwd, buf, buflen, errnop) : NSS_STATUS_NOTFOUND;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+enum nss_status _nss_yubiapp_getpwuid_r(uid_t uid, struct passwd *pwd, char *buf, size_t buflen, int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        const struct ya_users_user *e = ya_users_by_uid(&index_map, (uint32_t)uid);
+        status = e ? fill_passwd(e, pwd, buf, buflen, errnop) : NSS_STATUS_NOTFOUND;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+enum nss_status _nss_yubiapp_setpwent(int stayopen) {
+    (void)stayopen;
+    pthread_mutex_lock(&lock);
+    next_user = 0;
+    pthread_mutex_unlock(&lock);
+    return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_yubiapp_endpwent(void) {
+    return _nss_yubiapp_setpwent(0);
+}
+
+enum nss_status _nss_yubiapp_getpwent_r(struct passwd *pwd, char *buf, size_t buflen, int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        if (next_user >= index_map.header->user_count) {
+            status = NSS_STATUS_NOTFOUND;
+        } else if ((status = fill_passwd(&index_map.users[next_user], pwd, buf, buflen, errnop)) ==
+                   NSS_STATUS_SUCCESS) {
+            // A caller whose buffer was too small retries the same entry
+            next_user++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+enum nss_status _nss_yubiapp_getgrnam_r(const char *name, struct group *grp, char *buf, size_t buflen,
+                                        int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        const struct ya_users_group *g = ya_users_group_by_name(&index_map, name);
+        status = g ? fill_group(g, grp, buf, buflen, errnop) : NSS_STATUS_NOTFOUND;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+enum nss_status _nss_yubiapp_getgrgid_r(gid_t gid, struct group *grp, char *buf, size_t buflen, int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        const struct ya_users_group *g = ya_users_group_by_gid(&index_map, (uint32_t)gid);
+        status = g ? fill_group(g, grp, buf, buflen, errnop) : NSS_STATUS_NOTFOUND;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+enum nss_status _nss_yubiapp_setgrent(int stayopen) {
+    (void)stayopen;
+    pthread_mutex_lock(&lock);
+    next_group = 0;
+    pthread_mutex_unlock(&lock);
+    return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_yubiapp_endgrent(void) {
+    return _nss_yubiapp_setgrent(0);
+}
+
+enum nss_status _nss_yubiapp_getgrent_r(struct group *grp, char *buf, size_t buflen, int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() == 0) {
+        if (next_group >= index_map.header->group_count) {
+            status = NSS_STATUS_NOTFOUND;
+        } else if ((status = fill_group(&index_map.groups[next_group], grp, buf, buflen, errnop)) ==
+                   NSS_STATUS_SUCCESS) {
+            next_group++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+// Add the user's role groups to the list initgroups() is building, growing
+// it up to limit (if positive); the caller adds the primary group itself
+enum nss_status _nss_yubiapp_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size,
+                                            gid_t **groupsp, long int limit, int *errnop) {
+    enum nss_status status = NSS_STATUS_UNAVAIL;
+
+    pthread_mutex_lock(&lock);
+    if (ensure_index() != 0) {
+        goto out;
+    }
+    const struct ya_users_user *e = ya_users_by_name(&index_map, user);
+    if (!e) {
+        status = NSS_STATUS_NOTFOUND;
+        goto out;
+    }
+    status = NSS_STATUS_SUCCESS;
+    for (uint32_t i = 0; i < e->group_count; i++) {
+        gid_t gid = index_map.user_groups[e->groups + i];
+        if (gid == group) {
+            continue;
+        }
+        if (*start == *size) {
+            if (limit > 0 && *size >= limit) {
+                break;
+            }
+            long int grow = *size ? *size * 2 : 16;
+            if (limit > 0 && grow > limit) {
+                grow = limit;
+            }
+            gid_t *groups = realloc(*groupsp, (size_t)grow * sizeof(gid_t));
+            if (!groups) {
+                *errnop = ENOMEM;
+                status = NSS_STATUS_TRYAGAIN;
+                break;
+            }
+            *groupsp = groups;
+            *size = grow;
+        }
+        (*groupsp)[(*start)++] = gid;
+    }
+
+out:
+    pthread_mutex_unlock(&lock);
+    return status;
+}
@@ -0,0 +1,777 @@
+/*
+ * pam_bench.c - Load-test harness for pam_yubiapp.so
+ *
+ * Loads the module with dlopen() and calls pam_sm_authenticate() in a loop
+ * from several processes, each running several threads, the way the sshd
+ * children on a busy bastion would. The driver defines the few libpam
+ * functions the module calls; it is linked with -rdynamic, so they take
+ * precedence over libpam's own and no PAM service configuration is needed.
+ * Every login gets a fresh handle whose conversation function answers the
+ * OTP prompt with a new OTP.
+ *
+ * The API is a mock HTTP server forked from the driver, with configurable
+ * latency and injected errors. The wall time of every login is recorded in
+ * shared memory, and the driver reports throughput and latency percentiles.
+ * Each load process also records what loading the module cost it: the time
+ * dlopen() took, its peak resident set, and whether libcurl ended up mapped,
+ * which the built-in client (yubiapp_http.h) avoids for a loopback API
+ * like the mock; pass "-- curl" to compare.
+ *
+ * Usage: pam_bench [options] [-- module args...]
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+#define DEFAULT_MODULE "./pam_yubiapp.so"
+#define DEFAULT_PROCESSES 4
+#define DEFAULT_THREADS 1
+#define DEFAULT_LOGINS 200
+#define MAX_MODULE_ARGS 64
+#define MAX_PAM_DATA 16
+#define MAX_PAM_ENV 16
+#define OTP_LENGTH 44
+#define REQUEST_BUFFER_SIZE 8192
+
+// The mock API: per-request latency and the share of injected failures
+struct mock_config {
+    unsigned int latency_ms;   // added to every request
+    unsigned int jitter_ms;    // uniform random extra latency
+    unsigned int error_pct;    // answered with 503
+    unsigned int reject_pct;   // answered with 401, a rejected OTP
+    unsigned int drop_pct;     // connection closed without an answer
+};
+
+struct bench_config {
+    const char *module;
+    int processes;
+    int threads;
+    int logins;                // per thread
+    struct mock_config mock;
+};
+
+// How the logins ended, by PAM result
+enum {
+    RESULT_SUCCESS,
+    RESULT_AUTH_ERR,
+    RESULT_UNAVAILABLE,        // PAM_AUTHINFO_UNAVAIL
+    RESULT_OTHER,
+    RESULT_COUNT,
+};
+
+// Shared by every load process: one latency sample per login, and what
+// loading the module cost each process
+struct results {
+    uint64_t count;
+    uint64_t outcomes[RESULT_COUNT];
+    uint64_t loads;
+    uint64_t load_us_sum;
+    uint64_t load_us_max;
+    uint64_t rss_kb_sum;       // peak resident set of each process
+    uint64_t rss_kb_max;
+    uint64_t curl_loaded;      // processes that had libcurl mapped at the end
+    uint64_t samples_us[];
+};
+
+// Minimal PAM handle: the items, data and environment the module uses
+struct pam_handle {
+    const char *service;
+    const char *user;
+    const char *rhost;
+    const char *tty;
+    struct pam_conv conv;
+    struct {
+        char *name;
+        void *data;
+        void (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+    } data[MAX_PAM_DATA];
+    int data_count;
+    char *env[MAX_PAM_ENV];
+    int env_count;
+};
+
+static struct bench_config config = {
+    .module = DEFAULT_MODULE,
+    .processes = DEFAULT_PROCESSES,
+    .threads = DEFAULT_THREADS,
+    .logins = DEFAULT_LOGINS,
+};
+
+static struct results *results;
+
+typedef int (*pam_sm_fn)(pam_handle_t *pamh, int flags, int argc, const char **argv);
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * libpam, as far as the module uses it
+ */
+
+int pam_get_item(const pam_handle_t *pamh, int item_type, const void **item) {
+    switch (item_type) {
+    case PAM_SERVICE:
+        *item = pamh->service;
+        return PAM_SUCCESS;
+    case PAM_USER:
+        *item = pamh->user;
+        return PAM_SUCCESS;
+    case PAM_RHOST:
+        *item = pamh->rhost;
+        return PAM_SUCCESS;
+    case PAM_TTY:
+        *item = pamh->tty;
+        return PAM_SUCCESS;
+    case PAM_CONV:
+        *item = &pamh->conv;
+        return PAM_SUCCESS;
+    default:
+        *item = NULL;
+        return PAM_BAD_ITEM;
+    }
+}
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt) {
+    (void)prompt;
+    *user = pamh->user;
+    return PAM_SUCCESS;
+}
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name, void *data,
+                 void (*cleanup)(pam_handle_t *pamh, void *data, int error_status)) {
+    for (int i = 0; i < pamh->data_count; i++) {
+        if (strcmp(pamh->data[i].name, module_data_name) == 0) {
+            if (pamh->data[i].cleanup) {
+                pamh->data[i].cleanup(pamh, pamh->data[i].data, PAM_DATA_REPLACE);
+            }
+            pamh->data[i].data = data;
+            pamh->data[i].cleanup = cleanup;
+            return PAM_SUCCESS;
+        }
+    }
+    if (pamh->data_count == MAX_PAM_DATA) {
+        return PAM_BUF_ERR;
+    }
+    pamh->data[pamh->data_count].name = strdup(module_data_name);
+    pamh->data[pamh->data_count].data = data;
+    pamh->data[pamh->data_count].cleanup = cleanup;
+    pamh->data_count++;
+    return PAM_SUCCESS;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name, const void **data) {
+    for (int i = 0; i < pamh->data_count; i++) {
+        if (strcmp(pamh->data[i].name, module_data_name) == 0 && pamh->data[i].data) {
+            *data = pamh->data[i].data;
+            return PAM_SUCCESS;
+        }
+    }
+    return PAM_NO_MODULE_DATA;
+}
+
+int pam_putenv(pam_handle_t *pamh, const char *name_value) {
+    if (pamh->env_count == MAX_PAM_ENV) {
+        return PAM_BUF_ERR;
+    }
+    pamh->env[pamh->env_count++] = strdup(name_value);
+    return PAM_SUCCESS;
+}
+
+const char *pam_getenv(pam_handle_t *pamh, const char *name) {
+    size_t len = strlen(name);
+
+    for (int i = pamh->env_count - 1; i >= 0; i--) {
+        if (strncmp(pamh->env[i], name, len) == 0 && pamh->env[i][len] == '=') {
+            return pamh->env[i] + len + 1;
+        }
+    }
+    return NULL;
+}
+
+// The module's buffered log still goes to /dev/log, as it would in sshd;
+// only messages logged outside a PAM call's buffer come here
+void pam_vsyslog(const pam_handle_t *pamh, int priority, const char *fmt, va_list args) {
+    (void)pamh;
+    fprintf(stderr, "pam_bench: <%d> ", priority);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+}
+
+void pam_syslog(const pam_handle_t *pamh, int priority, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    pam_vsyslog(pamh, priority, fmt, args);
+    va_end(args);
+}
+
+// Route the prompt through the handle's conversation function, as libpam does
+int pam_vprompt(pam_handle_t *pamh, int style, char **response, const char *fmt, va_list args) {
+    char text[256];
+    struct pam_message msg = {style, text};
+    const struct pam_message *msgs[1] = {&msg};
+    struct pam_response *resp = NULL;
+
+    vsnprintf(text, sizeof(text), fmt, args);
+    int rc = pamh->conv.conv(1, msgs, &resp, pamh->conv.appdata_ptr);
+    if (rc != PAM_SUCCESS || !resp) {
+        return rc != PAM_SUCCESS ? rc : PAM_CONV_ERR;
+    }
+    if (response) {
+        *response = resp[0].resp;
+    } else {
+        free(resp[0].resp);
+    }
+    free(resp);
+    return PAM_SUCCESS;
+}
+
+int pam_prompt(pam_handle_t *pamh, int style, char **response, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int rc = pam_vprompt(pamh, style, response, fmt, args);
+    va_end(args);
+    return rc;
+}
+
+// Release the handle the way pam_end() would
+static void handle_end(pam_handle_t *pamh, int status) {
+    for (int i = 0; i < pamh->data_count; i++) {
+        if (pamh->data[i].cleanup) {
+            pamh->data[i].cleanup(pamh, pamh->data[i].data, status);
+        }
+        free(pamh->data[i].name);
+    }
+    for (int i = 0; i < pamh->env_count; i++) {
+        free(pamh->env[i]);
+    }
+}
+
+/*
+ * Scripted conversation: every prompt is answered with a fresh OTP
+ */
+
+struct conversation {
+    unsigned int seed;
+};
+
+static int bench_conv(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr) {
+    static const char modhex[] = "cbdefghijklnrtuv";
+    struct conversation *c = appdata_ptr;
+
+    struct pam_response *r = calloc((size_t)num_msg, sizeof(*r));
+    if (!r) {
+        return PAM_BUF_ERR;
+    }
+    for (int i = 0; i < num_msg; i++) {
+        if (msg[i]->msg_style != PAM_PROMPT_ECHO_OFF && msg[i]->msg_style != PAM_PROMPT_ECHO_ON) {
+            continue;
+        }
+        // A fixed 12-character public ID followed by a random token
+        char *otp = malloc(OTP_LENGTH + 1);
+        if (!otp) {
+            break;
+        }
+        memset(otp, 'c', 12);
+        for (int j = 12; j < OTP_LENGTH; j++) {
+            otp[j] = modhex[rand_r(&c->seed) % 16];
+        }
+        otp[OTP_LENGTH] = '\0';
+        r[i].resp = otp;
+    }
+    *resp = r;
+    return PAM_SUCCESS;
+}
+
+/*
+ * Mock API
+ */
+
+static const char success_body[] =
+    "{\"authenticated\":true,"
+    "\"user\":{\"id\":\"6f1c2f4e-8a53-4c8e-9a57-0d1b6c7e2a10\",\"email\":\"bench@example.com\","
+    "\"username\":\"bench\",\"first_name\":\"Bench\",\"last_name\":\"User\",\"active\":true,"
+    "\"roles\":[{\"id\":\"0b7e5a9c-3c55-4d0e-8f7a-5a2f8f0c6d31\",\"name\":\"admin\",\"description\":\"Administrators\"}]},"
+    "\"device\":{\"id\":\"9d3e1f7a-2b64-4c1d-8e95-7f0a3b6c5d42\",\"type\":\"yubikey\",\"identifier\":\"cccccccccccc\"}}";
+static const char reject_body[] = "{\"error\":\"OTP verification failed\"}";
+static const char error_body[] = "{\"error\":\"Service unavailable\"}";
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_response(int fd, int code, const char *reason, const char *body) {
+    char header[256];
+    size_t body_len = body ? strlen(body) : 0;
+
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+                       code, reason, body_len);
+    if (send_all(fd, header, (size_t)len) != 0) {
+        return -1;
+    }
+    return body_len ? send_all(fd, body, body_len) : 0;
+}
+
+// Value of Content-Length in a request header block, 0 if absent
+static size_t content_length(const char *headers) {
+    for (const char *p = strstr(headers, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0) {
+            return strtoul(p + 17, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// Serve one keep-alive connection until the client closes it
+static void *mock_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned int seed = (unsigned int)(monotonic_us() ^ (uint64_t)fd);
+    char buf[REQUEST_BUFFER_SIZE + 1];
+    size_t have = 0;
+
+    for (;;) {
+        char *end;
+
+        // Read a whole header block, then the body it announces
+        buf[have] = '\0';
+        while (!(end = strstr(buf, "\r\n\r\n"))) {
+            if (have == REQUEST_BUFFER_SIZE) {
+                goto done;
+            }
+            ssize_t n = recv(fd, buf + have, REQUEST_BUFFER_SIZE - have, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            have += (size_t)n;
+            buf[have] = '\0';
+        }
+        size_t request_len = (size_t)(end + 4 - buf) + content_length(buf);
+        if (request_len > REQUEST_BUFFER_SIZE) {
+            goto done;
+        }
+        while (have < request_len) {
+            ssize_t n = recv(fd, buf + have, request_len - have, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            have += (size_t)n;
+        }
+        int is_post = strncmp(buf, "POST ", 5) == 0;
+        memmove(buf, buf + request_len, have - request_len);
+        have -= request_len;
+
+        // Connection warm-ups (OPTIONS) are answered at once, like the API's CORS middleware
+        if (!is_post) {
+            if (send_response(fd, 204, "No Content", NULL) != 0) {
+                goto done;
+            }
+            continue;
+        }
+
+        unsigned int delay_ms = config.mock.latency_ms;
+        if (config.mock.jitter_ms) {
+            delay_ms += (unsigned int)rand_r(&seed) % (config.mock.jitter_ms + 1);
+        }
+        if (delay_ms) {
+            usleep(delay_ms * 1000);
+        }
+
+        unsigned int roll = (unsigned int)rand_r(&seed) % 100;
+        int rc;
+        if (roll < config.mock.drop_pct) {
+            goto done;
+        } else if ((roll -= config.mock.drop_pct) < config.mock.error_pct) {
+            rc = send_response(fd, 503, "Service Unavailable", error_body);
+        } else if ((roll -= config.mock.error_pct) < config.mock.reject_pct) {
+            rc = send_response(fd, 401, "Unauthorized", reject_body);
+        } else {
+            rc = send_response(fd, 200, "OK", success_body);
+        }
+        if (rc != 0) {
+            goto done;
+        }
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+// Mock server process: a thread per connection, until killed
+static void mock_main(int listen_fd) {
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        pthread_t thread;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        // Like Go's net/http: the header and body writes must not wait for
+        // a delayed ACK on a kept-alive connection
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (pthread_create(&thread, &attr, mock_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+}
+
+static int open_mock_listener(int *port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("mock server");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/*
+ * Load generation
+ */
+
+struct load_thread {
+    pthread_t thread;
+    pam_sm_fn authenticate;
+    int argc;
+    const char **argv;
+    unsigned int seed;
+};
+
+static void record(int retval, uint64_t us) {
+    int outcome = retval == PAM_SUCCESS ? RESULT_SUCCESS
+                  : retval == PAM_AUTH_ERR ? RESULT_AUTH_ERR
+                  : retval == PAM_AUTHINFO_UNAVAIL ? RESULT_UNAVAILABLE
+                  : RESULT_OTHER;
+    uint64_t i = __atomic_fetch_add(&results->count, 1, __ATOMIC_RELAXED);
+
+    results->samples_us[i] = us;
+    __atomic_fetch_add(&results->outcomes[outcome], 1, __ATOMIC_RELAXED);
+}
+
+static void *load_main(void *arg) {
+    struct load_thread *t = arg;
+    struct conversation conv = {t->seed};
+
+    for (int i = 0; i < config.logins; i++) {
+        struct pam_handle h = {
+            .service = "pam_bench",
+            .user = "bench",
+            .rhost = "127.0.0.1",
+            .tty = "ssh",
+            .conv = {bench_conv, &conv},
+        };
+        uint64_t start = monotonic_us();
+        int retval = t->authenticate(&h, 0, t->argc, t->argv);
+        handle_end(&h, retval);
+        record(retval, monotonic_us() - start);
+    }
+    return NULL;
+}
+
+static void atomic_max(uint64_t *p, uint64_t v) {
+    uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (cur < v && !__atomic_compare_exchange_n(p, &cur, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Record the load cost of this process once its logins are done
+static void record_load(uint64_t load_us) {
+    struct rusage ru;
+    uint64_t rss_kb = getrusage(RUSAGE_SELF, &ru) == 0 ? (uint64_t)ru.ru_maxrss : 0;
+    void *curl = dlopen("libcurl.so.4", RTLD_NOW | RTLD_NOLOAD);
+
+    __atomic_fetch_add(&results->loads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&results->load_us_sum, load_us, __ATOMIC_RELAXED);
+    atomic_max(&results->load_us_max, load_us);
+    __atomic_fetch_add(&results->rss_kb_sum, rss_kb, __ATOMIC_RELAXED);
+    atomic_max(&results->rss_kb_max, rss_kb);
+    if (curl) {
+        __atomic_fetch_add(&results->curl_loaded, 1, __ATOMIC_RELAXED);
+        dlclose(curl);
+    }
+}
+
+// One load process: load the module and run the threads
+static int load_process(int index, int argc, const char **argv) {
+    uint64_t load_start = monotonic_us();
+    void *module = dlopen(config.module, RTLD_NOW | RTLD_LOCAL);
+    uint64_t load_us = monotonic_us() - load_start;
+    if (!module) {
+        fprintf(stderr, "pam_bench: %s\n", dlerror());
+        return 1;
+    }
+    pam_sm_fn authenticate = (pam_sm_fn)dlsym(module, "pam_sm_authenticate");
+    if (!authenticate) {
+        fprintf(stderr, "pam_bench: %s has no pam_sm_authenticate\n", config.module);
+        return 1;
+    }
+
+    struct load_thread *threads = calloc((size_t)config.threads, sizeof(*threads));
+    if (!threads) {
+        return 1;
+    }
+    for (int i = 0; i < config.threads; i++) {
+        threads[i] = (struct load_thread){
+            .authenticate = authenticate,
+            .argc = argc,
+            .argv = argv,
+            .seed = (unsigned int)(index * 7919 + i) ^ (unsigned int)monotonic_us(),
+        };
+        if (pthread_create(&threads[i].thread, NULL, load_main, &threads[i]) != 0) {
+            fprintf(stderr, "pam_bench: cannot start thread\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    free(threads);
+    record_load(load_us);
+    return 0;
+}
+
+/*
+ * Report
+ */
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples, in milliseconds
+static double percentile_ms(const uint64_t *sorted, uint64_t n, double p) {
+    uint64_t rank = (uint64_t)(p * (double)n + 0.999999);
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+static void report(uint64_t elapsed_us) {
+    uint64_t n = results->count;
+    double seconds = (double)elapsed_us / 1e6;
+
+    printf("pam_bench: %d processes x %d threads x %d logins, mock latency %u+%u ms, "
+           "drop %u%% error %u%% reject %u%%\n",
+           config.processes, config.threads, config.logins, config.mock.latency_ms, config.mock.jitter_ms,
+           config.mock.drop_pct, config.mock.error_pct, config.mock.reject_pct);
+    printf("logins       %llu in %.3f s, %.1f logins/s\n", (unsigned long long)n, seconds,
+           seconds > 0 ? (double)n / seconds : 0.0);
+    printf("results      success %llu, auth_err %llu, unavailable %llu, other %llu\n",
+           (unsigned long long)results->outcomes[RESULT_SUCCESS],
+           (unsigned long long)results->outcomes[RESULT_AUTH_ERR],
+           (unsigned long long)results->outcomes[RESULT_UNAVAILABLE],
+           (unsigned long long)results->outcomes[RESULT_OTHER]);
+    if (results->loads > 0) {
+        printf("module load  dlopen mean %.2f ms  max %.2f ms, peak RSS mean %llu KiB  max %llu KiB, "
+               "libcurl loaded in %llu of %llu processes\n",
+               (double)results->load_us_sum / (double)results->loads / 1000.0,
+               (double)results->load_us_max / 1000.0,
+               (unsigned long long)(results->rss_kb_sum / results->loads),
+               (unsigned long long)results->rss_kb_max, (unsigned long long)results->curl_loaded,
+               (unsigned long long)results->loads);
+    }
+    if (n == 0) {
+        return;
+    }
+
+    qsort(results->samples_us, n, sizeof(uint64_t), compare_u64);
+    printf("latency ms   p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+           percentile_ms(results->samples_us, n, 0.50), percentile_ms(results->samples_us, n, 0.90),
+           percentile_ms(results->samples_us, n, 0.99), percentile_ms(results->samples_us, n, 0.999),
+           (double)results->samples_us[n - 1] / 1000.0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-m module] [-p processes] [-t threads] [-n logins] [-l ms] [-j ms]\n"
+            "       [-e pct] [-r pct] [-x pct] [-- module args...]\n"
+            "  -m module     PAM module to load (default %s)\n"
+            "  -p processes  concurrent load processes (default %d)\n"
+            "  -t threads    threads per process (default %d)\n"
+            "  -n logins     logins per thread (default %d)\n"
+            "  -l ms         mock API latency per request\n"
+            "  -j ms         extra random latency, uniform in [0, ms]\n"
+            "  -e pct        share of requests answered with 503\n"
+            "  -r pct        share of requests answered with 401 (OTP rejected)\n"
+            "  -x pct        share of connections closed without an answer\n"
+            "The module is given url= pointing at the mock API, nobroker, nometrics,\n"
+            "noratelimit and private state= and replay= files, followed by the module args.\n",
+            prog, DEFAULT_MODULE, DEFAULT_PROCESSES, DEFAULT_THREADS, DEFAULT_LOGINS);
+}
+
+static unsigned int parse_pct(const char *s) {
+    unsigned long v = strtoul(s, NULL, 10);
+    return v > 100 ? 100 : (unsigned int)v;
+}
+
+int main(int argc, char **argv) {
+    const char *module_argv[MAX_MODULE_ARGS];
+    char url_arg[96];
+    char state_dir[] = "/tmp/pam_bench.XXXXXX";
+    char state_arg[sizeof(state_dir) + 16];
+    char replay_arg[sizeof(state_dir) + 16];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:p:t:n:l:j:e:r:x:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            config.module = optarg;
+            break;
+        case 'p':
+            config.processes = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'n':
+            config.logins = atoi(optarg);
+            break;
+        case 'l':
+            config.mock.latency_ms = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            config.mock.jitter_ms = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            config.mock.error_pct = parse_pct(optarg);
+            break;
+        case 'r':
+            config.mock.reject_pct = parse_pct(optarg);
+            break;
+        case 'x':
+            config.mock.drop_pct = parse_pct(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.processes < 1 || config.threads < 1 || config.logins < 1 ||
+        config.mock.drop_pct + config.mock.error_pct + config.mock.reject_pct > 100 ||
+        argc - optind > MAX_MODULE_ARGS - 6) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    uint64_t total = (uint64_t)config.processes * (uint64_t)config.threads * (uint64_t)config.logins;
+    size_t results_size = sizeof(struct results) + total * sizeof(uint64_t);
+    results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED || !mkdtemp(state_dir)) {
+        perror("pam_bench");
+        return 1;
+    }
+
+    int port;
+    int listen_fd = open_mock_listener(&port);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    pid_t mock = fork();
+    if (mock == 0) {
+        mock_main(listen_fd);
+        _exit(0);
+    }
+    close(listen_fd);
+
+    // Point the module at the mock and keep it away from the host's shared state
+    int module_argc = 0;
+    snprintf(url_arg, sizeof(url_arg), "url=http://127.0.0.1:%d/api/v1/auth/device", port);
+    snprintf(state_arg, sizeof(state_arg), "state=%s/state", state_dir);
+    snprintf(replay_arg, sizeof(replay_arg), "replay=%s/replay", state_dir);
+    module_argv[module_argc++] = url_arg;
+    module_argv[module_argc++] = "nobroker";
+    module_argv[module_argc++] = "nometrics";
+    module_argv[module_argc++] = "noratelimit";
+    module_argv[module_argc++] = state_arg;
+    module_argv[module_argc++] = replay_arg;
+    for (int i = optind; i < argc; i++) {
+        module_argv[module_argc++] = argv[i];
+    }
+
+    uint64_t start = monotonic_us();
+    for (int i = 0; i < config.processes; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(load_process(i, module_argc, module_argv));
+        } else if (pid < 0) {
+            perror("fork");
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < config.processes; i++) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == mock) {
+            i--;
+            continue;
+        }
+        if (pid < 0) {
+            break;
+        }
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    uint64_t elapsed = monotonic_us() - start;
+
+    kill(mock, SIGTERM);
+    waitpid(mock, NULL, 0);
+    snprintf(state_arg, sizeof(state_arg), "%s/state", state_dir);
+    unlink(state_arg);
+    snprintf(replay_arg, sizeof(replay_arg), "%s/replay", state_dir);
+    unlink(replay_arg);
+    rmdir(state_dir);
+
+    report(elapsed);
+    munmap(results, results_size);
+    return failed;
+}
@@ -10,39 +10,362 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <curl/curl.h>
-#include <cjson/cJSON.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
 #include <syslog.h>
 
-#define YUBIAPP_URL "http://localhost:8080/api/v1/auth/device"
+#include "yubiapp_api.h"
+#include "yubiapp_cache.h"
+#include "yubiapp_curl.h"
+#include "yubiapp_endpoint.h"
+#include "yubiapp_events.h"
+#include "yubiapp_grant.h"
+#include "yubiapp_http.h"
+#include "yubiapp_json.h"
+#include "yubiapp_log.h"
+#include "yubiapp_metrics.h"
+#include "yubiapp_otp.h"
+#include "yubiapp_pool.h"
+#include "yubiapp_proto.h"
+#include "yubiapp_ratelimit.h"
+#include "yubiapp_replay.h"
+#include "yubiapp_wire.h"
+
 #define MAX_OTP_LENGTH 64
-#define MAX_RESPONSE_SIZE 4096
+#define BROKER_TIMEOUT_SEC 12
+
+// Result of the broker path when the broker is not running
+#define BROKER_UNAVAILABLE -1
+
+// Result of offline verification when the API has to decide instead
+#define OFFLINE_UNAVAILABLE -2
+
+// Result of the grant check when the user has to present an OTP
+#define GRANT_UNAVAILABLE -3
+
+// PAM data item holding the current call's log buffer
+#define LOG_DATA "pam_yubiapp_log"
+
+// PAM data item holding the last successful authentication (struct auth_result)
+#define RESULT_DATA "pam_yubiapp_result"
+#define RESULT_MAX_AGE_SEC 300
+#define MAX_ROLES 32
+
+// permission= may list several permissions, evaluated in one request
+#define MAX_PERMISSIONS 16
+#define MAX_PERMISSION_LIST 256
+
+// PAM data item holding the session UUID from pam_sm_open_session
+#define SESSION_DATA "pam_yubiapp_session"
 
-// Structure to hold response data for libcurl
-struct MemoryStruct {
-    char *memory;
-    size_t size;
+// Module arguments
+struct yubiapp_args {
+    const char *permission;     // one permission, or a comma-separated list
+    int permission_count;       // entries in permissions, -1 for a malformed list
+    const char *permissions[MAX_PERMISSIONS];
+    int require_any;            // a list needs one held permission, not all
+    char permission_buf[MAX_PERMISSION_LIST];
+    const char *broker_socket;  // NULL when the broker is disabled
+    const char *cache_path;     // shared TLS/DNS cache file, NULL when disabled
+    const char *urls;           // comma-separated API endpoints
+    const char *api_socket;     // reach the API over this Unix socket, NULL for TCP
+    const char *state_path;     // shared endpoint latency state
+    const char *metrics_path;   // shared latency histograms, NULL when disabled
+    int warmup;
+    int hedge;
+    unsigned int cb_threshold;  // consecutive failures that open the breaker, 0 = off
+    unsigned int cb_cooldown;   // seconds before a probe is let through
+    unsigned int timeout_min;   // floor of a request's adaptive deadline, ms
+    unsigned int timeout_max;   // its ceiling, ms
+    unsigned int timeout_factor;    // deadline = factor * estimated p99
+    int retries;                // retries of requests that were never sent
+    size_t max_response;        // largest API response accepted, in bytes
+    int compact;                // ask for the compact binary response encoding
+    int curl;                   // use libcurl even for local endpoints
+    int log_level;              // least severe syslog priority logged
+    unsigned int log_sample;    // log one in this many successful logins
+    const char *roles;          // account: comma-separated roles, one required
+    int match_user;             // account: PAM user must be the YubiApp username
+    unsigned int max_age;       // account: seconds an authentication stays usable
+    int events;                 // session: report open/close to the sessions API
+    const char *spool_path;     // session: events kept here when the broker is away
+    const char *offline_keys;   // key file for local OTP verification, NULL when off
+    const char *offline_state;  // highest OTP counter seen per offline device
+    const char *grant_key;      // API public key for grants, NULL when off
+    const char *grant_dir;      // root-only store of grants
+    const char *grant_permissions;  // further permissions to ask grants to cover
+    const char *replay_path;    // shared filter of recently seen OTPs, NULL when disabled
+    unsigned int replay_window; // seconds a seen OTP is refused
+    const char *ratelimit_path; // shared rate limiter buckets, NULL when disabled
+    struct ya_rate_limit rhost_limit;   // attempts per remote host
+    struct ya_rate_limit device_limit;  // attempts per device public ID
 };
 
-// Callback function for libcurl to write response data
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+// Rate limiter buckets one login has taken a token from; a name is empty
+// until its token is taken
+struct login_limits {
+    struct ya_rate_state *state;
+    char rhost[80];
+    char device[32];
+};
+
+// Metrics for one login: the shared state (NULL when disabled) and whether
+// the exchange ended because something timed out
+struct login_metrics {
+    struct ya_metrics_state *state;
+    int timed_out;
+};
+
+// Function to parse module arguments; every stage takes the same options
+static void parse_args(struct yubiapp_args *args, int argc, const char **argv) {
+    *args = (struct yubiapp_args){
+        .permission = "yubiapp:authenticate",  // Default permission
+        .broker_socket = YUBIAPP_BROKER_SOCKET,
+        .urls = YUBIAPP_URL,
+        .state_path = YA_ENDPOINT_STATE,
+        .metrics_path = YA_METRICS_STATE,
+        .warmup = 1,
+        .hedge = 1,
+        .cb_threshold = YA_BREAKER_THRESHOLD,
+        .cb_cooldown = YA_BREAKER_COOLDOWN_SEC,
+        .timeout_min = YA_TIMEOUT_MIN_MS,
+        .timeout_max = YA_TIMEOUT_MAX_MS,
+        .timeout_factor = YA_TIMEOUT_FACTOR,
+        .retries = YA_RETRIES,
+        .max_response = YUBIAPP_MAX_RESPONSE_SIZE,
+        .compact = 1,
+        .log_level = LOG_INFO,
+        .log_sample = 1,
+        .max_age = RESULT_MAX_AGE_SEC,
+        .events = 1,
+        .spool_path = YA_SPOOL_PATH,
+        .offline_state = YA_OTP_COUNTERS,
+        .grant_dir = YA_GRANT_DIR,
+        .replay_path = YA_REPLAY_STATE,
+        .replay_window = YA_REPLAY_WINDOW,
+        .ratelimit_path = YA_RATE_STATE,
+        .rhost_limit = {YA_RATE_RHOST_PER_MIN, YA_RATE_RHOST_BURST},
+        .device_limit = {YA_RATE_DEVICE_PER_MIN, YA_RATE_DEVICE_BURST},
+    };
+
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "permission=", 11) == 0) {
+            args->permission = argv[i] + 11;
+        } else if (strncmp(argv[i], "broker=", 7) == 0) {
+            args->broker_socket = argv[i] + 7;
+        } else if (strcmp(argv[i], "nobroker") == 0) {
+            args->broker_socket = NULL;
+        } else if (strcmp(argv[i], "nowarmup") == 0) {
+            args->warmup = 0;
+        } else if (strncmp(argv[i], "cache=", 6) == 0) {
+            args->cache_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "url=", 4) == 0) {
+            args->urls = argv[i] + 4;
+        } else if (strncmp(argv[i], "socket=", 7) == 0) {
+            args->api_socket = argv[i] + 7;
+        } else if (strncmp(argv[i], "state=", 6) == 0) {
+            args->state_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "metrics=", 8) == 0) {
+            args->metrics_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "nometrics") == 0) {
+            args->metrics_path = NULL;
+        } else if (strncmp(argv[i], "replay=", 7) == 0) {
+            args->replay_path = argv[i] + 7;
+        } else if (strcmp(argv[i], "noreplay") == 0) {
+            args->replay_path = NULL;
+        } else if (strncmp(argv[i], "replay_window=", 14) == 0) {
+            args->replay_window = (unsigned int)strtoul(argv[i] + 14, NULL, 10);
+        } else if (strncmp(argv[i], "ratelimit=", 10) == 0) {
+            args->ratelimit_path = argv[i] + 10;
+        } else if (strcmp(argv[i], "noratelimit") == 0) {
+            args->ratelimit_path = NULL;
+        } else if (strncmp(argv[i], "rhost_rate=", 11) == 0) {
+            args->rhost_limit.per_minute = (unsigned int)strtoul(argv[i] + 11, NULL, 10);
+        } else if (strncmp(argv[i], "rhost_burst=", 12) == 0) {
+            args->rhost_limit.burst = (unsigned int)strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "device_rate=", 12) == 0) {
+            args->device_limit.per_minute = (unsigned int)strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "device_burst=", 13) == 0) {
+            args->device_limit.burst = (unsigned int)strtoul(argv[i] + 13, NULL, 10);
+        } else if (strcmp(argv[i], "nohedge") == 0) {
+            args->hedge = 0;
+        } else if (strncmp(argv[i], "cb_threshold=", 13) == 0) {
+            args->cb_threshold = (unsigned int)strtoul(argv[i] + 13, NULL, 10);
+        } else if (strncmp(argv[i], "cb_cooldown=", 12) == 0) {
+            args->cb_cooldown = (unsigned int)strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "timeout_min=", 12) == 0) {
+            args->timeout_min = (unsigned int)strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "timeout_max=", 12) == 0) {
+            args->timeout_max = (unsigned int)strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "timeout_factor=", 15) == 0) {
+            args->timeout_factor = (unsigned int)strtoul(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "retries=", 8) == 0) {
+            args->retries = atoi(argv[i] + 8);
+        } else if (strcmp(argv[i], "debug") == 0) {
+            args->log_level = LOG_DEBUG;
+        } else if (strcmp(argv[i], "quiet") == 0) {
+            args->log_level = LOG_ERR;
+        } else if (strncmp(argv[i], "log_sample=", 11) == 0) {
+            args->log_sample = (unsigned int)strtoul(argv[i] + 11, NULL, 10);
+        } else if (strcmp(argv[i], "nocompact") == 0) {
+            args->compact = 0;
+        } else if (strcmp(argv[i], "curl") == 0) {
+            args->curl = 1;
+        } else if (strncmp(argv[i], "max_response=", 13) == 0) {
+            args->max_response = strtoul(argv[i] + 13, NULL, 10);
+        } else if (strncmp(argv[i], "role=", 5) == 0) {
+            args->roles = argv[i] + 5;
+        } else if (strcmp(argv[i], "match_user") == 0) {
+            args->match_user = 1;
+        } else if (strncmp(argv[i], "max_age=", 8) == 0) {
+            args->max_age = (unsigned int)strtoul(argv[i] + 8, NULL, 10);
+        } else if (strcmp(argv[i], "noevents") == 0) {
+            args->events = 0;
+        } else if (strncmp(argv[i], "spool=", 6) == 0) {
+            args->spool_path = argv[i] + 6;
+        } else if (strcmp(argv[i], "offline") == 0) {
+            args->offline_keys = YA_OTP_KEYS;
+        } else if (strncmp(argv[i], "offline=", 8) == 0) {
+            args->offline_keys = argv[i] + 8;
+        } else if (strncmp(argv[i], "offline_state=", 14) == 0) {
+            args->offline_state = argv[i] + 14;
+        } else if (strcmp(argv[i], "grant") == 0) {
+            args->grant_key = YA_GRANT_KEY;
+        } else if (strncmp(argv[i], "grant=", 6) == 0) {
+            args->grant_key = argv[i] + 6;
+        } else if (strncmp(argv[i], "grant_dir=", 10) == 0) {
+            args->grant_dir = argv[i] + 10;
+        } else if (strncmp(argv[i], "grant_permissions=", 18) == 0) {
+            args->grant_permissions = argv[i] + 18;
+        } else if (strcmp(argv[i], "require=any") == 0) {
+            args->require_any = 1;
+        } else if (strcmp(argv[i], "require=all") == 0) {
+            args->require_any = 0;
+        }
+    }
+
+    // Split a permission list; an empty entry or one too many makes it unusable
+    args->permission_count = 1;
+    args->permissions[0] = args->permission;
+    if (strchr(args->permission, ',')) {
+        size_t len = strlen(args->permission);
+        args->permission_count = -1;
+        if (len < sizeof(args->permission_buf) && args->permission[0] != ',' && args->permission[len - 1] != ',' &&
+            !strstr(args->permission, ",,")) {
+            memcpy(args->permission_buf, args->permission, len + 1);
+            char *save = NULL;
+            int n = 0;
+            for (char *p = strtok_r(args->permission_buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+                if (n == MAX_PERMISSIONS) {
+                    return;
+                }
+                args->permissions[n++] = p;
+            }
+            args->permission_count = n;
+        }
+    }
+}
+
+// Whether permission= is a list, evaluated by the API and enforced here
+static int args_permission_list(const struct yubiapp_args *args) {
+    return args->permission_count > 1;
+}
+
+// Function to tell whether per-permission results, in permission= order,
+// meet require=
+static int permission_list_met(const struct yubiapp_args *args, const unsigned char *held, int count) {
+    int n = 0;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr) {
-        printf("not enough memory (realloc returned NULL)\n");
+    if (count != args->permission_count) {
         return 0;
     }
+    for (int i = 0; i < count; i++) {
+        n += held[i] != 0;
+    }
+    return args->require_any ? n > 0 : n == count;
+}
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+// Accept header to send, NULL for the API default (JSON)
+static const char *args_accept(const struct yubiapp_args *args) {
+    return args->compact ? YA_WIRE_ACCEPT : NULL;
+}
 
-    return realsize;
+// Host name grants are issued for, in host (256 bytes); NULL when grants
+// are off or the name is unknown
+static const char *args_grant_audience(const struct yubiapp_args *args, char *host) {
+    if (!args->grant_key || gethostname(host, 256) != 0) {
+        return NULL;
+    }
+    host[255] = '\0';
+    return host[0] ? host : NULL;
+}
+
+// Background connection warm-up that runs while the user is prompted
+struct warmup {
+    CURL *curl;
+    struct ya_endpoint *ep;
+    pthread_t thread;
+    int started;
+    CURLcode result;
+};
+
+// Function to log a message. During a PAM call that set up a log buffer the
+// record is buffered until the call returns; otherwise it goes straight to
+// pam_syslog.
+static void log_msg(pam_handle_t *pamh, int priority, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void log_msg(pam_handle_t *pamh, int priority, const char *fmt, ...) {
+    const void *data = NULL;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (pam_get_data(pamh, LOG_DATA, &data) == PAM_SUCCESS && data) {
+        ya_log_vadd((struct ya_log *)data, priority, fmt, ap);
+    } else {
+        pam_vsyslog(pamh, priority, fmt, ap);
+    }
+    va_end(ap);
+}
+
+// Function to set up the per-call log buffer from the module arguments
+static void log_begin(pam_handle_t *pamh, struct ya_log *log, const struct yubiapp_args *args,
+                      const char *type) {
+    const void *service = NULL;
+    char prefix[sizeof(log->prefix)];
+
+    if (pam_get_item(pamh, PAM_SERVICE, &service) != PAM_SUCCESS || !service) {
+        service = "<unknown>";
+    }
+    snprintf(prefix, sizeof(prefix), "pam_yubiapp(%s:%s): ", (const char *)service, type);
+    ya_log_init(log, args->log_level, prefix);
+    pam_set_data(pamh, LOG_DATA, log, NULL);
+}
+
+// Function to send the buffered records and detach the buffer
+static void log_end(pam_handle_t *pamh, struct ya_log *log) {
+    pam_set_data(pamh, LOG_DATA, NULL, NULL);
+    ya_log_flush(log);
+}
+
+// Function to decide whether this login's success is logged (1 in n)
+static int log_sampled(unsigned int n) {
+    if (n <= 1) {
+        return 1;
+    }
+    uint64_t x = ya_monotonic_us() ^ ((uint64_t)getpid() << 32);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x % n == 0;
 }
 
 // Function to set environment variable
@@ -57,210 +380,1910 @@ static void set_env_var(pam_handle_t *pamh, const char *name, const char *value)
     }
 }
 
-// Function to parse JSON response and set environment variables
-static int parse_response_and_set_env(pam_handle_t *pamh, const char *json_response) {
-    cJSON *json = cJSON_Parse(json_response);
-    if (!json) {
-        pam_syslog(pamh, LOG_ERR, "Failed to parse JSON response: %s", json_response);
-        return PAM_SYSTEM_ERR;
+// Fields of a device auth response, whichever encoding it came in. The
+// strings point into the response buffer (or the id buffers below).
+struct auth_response {
+    int authenticated;
+    const char *error;
+    int has_user;
+    int active;                 // -1 if the response did not say
+    const char *user_id;
+    const char *first_name;
+    const char *last_name;
+    const char *email;
+    const char *username;
+    const char *device_id;
+    const char *device_type;
+    const char *device_identifier;
+    int role_count;
+    const char *roles[MAX_ROLES];
+    int roles_dropped;          // roles past MAX_ROLES, not kept
+    const unsigned char *grant; // signed grant, if the API sent one
+    size_t grant_len;
+    int held_count;             // -1 if the API did not evaluate a permission list
+    unsigned char held[MAX_PERMISSIONS];
+    char user_id_buf[37];       // compact responses carry raw UUIDs
+    char device_id_buf[37];
+};
+
+// What the account and session stages need of a successful authentication,
+// kept in the PAM handle under RESULT_DATA. One allocation: the strings
+// follow the struct.
+struct auth_result {
+    uint64_t authenticated_us;  // CLOCK_MONOTONIC
+    int active;
+    const char *user_id;
+    const char *username;
+    const char *email;
+    const char *device_id;
+    const char *device_type;
+    const char *device_identifier;
+    int role_count;
+    const char *roles[MAX_ROLES];
+    char strings[];
+};
+
+// Fields read from a JSON device auth response
+enum {
+    F_AUTHENTICATED,
+    F_ERROR,
+    F_USER,
+    F_USER_ID,
+    F_FIRST_NAME,
+    F_LAST_NAME,
+    F_EMAIL,
+    F_USERNAME,
+    F_ACTIVE,
+    F_ROLES,
+    F_DEVICE_ID,
+    F_DEVICE_TYPE,
+    F_DEVICE_IDENTIFIER,
+    F_GRANT,
+    F_PERMISSIONS,
+    F_COUNT
+};
+
+static const char *json_string(const struct ya_json_field *f) {
+    return f->type == YA_JSON_STRING ? f->value : NULL;
+}
+
+// Function to parse a JSON response in place; nothing is allocated
+static int parse_json_response(char *body, size_t len, struct auth_response *r) {
+    struct ya_json_field f[F_COUNT] = {
+        [F_AUTHENTICATED] = {.path = "authenticated"},
+        [F_ERROR] = {.path = "error"},
+        [F_USER] = {.path = "user"},
+        [F_USER_ID] = {.path = "user.id"},
+        [F_FIRST_NAME] = {.path = "user.first_name"},
+        [F_LAST_NAME] = {.path = "user.last_name"},
+        [F_EMAIL] = {.path = "user.email"},
+        [F_USERNAME] = {.path = "user.username"},
+        [F_ACTIVE] = {.path = "user.active"},
+        [F_ROLES] = {.path = "user.roles"},
+        [F_DEVICE_ID] = {.path = "device.id"},
+        [F_DEVICE_TYPE] = {.path = "device.type"},
+        [F_DEVICE_IDENTIFIER] = {.path = "device.identifier"},
+        [F_GRANT] = {.path = "grant"},
+        [F_PERMISSIONS] = {.path = "permissions"},
+    };
+
+    if (ya_json_extract(body, len, f, F_COUNT) != 0) {
+        return -1;
+    }
+
+    r->authenticated = f[F_AUTHENTICATED].type == YA_JSON_TRUE;
+    r->error = json_string(&f[F_ERROR]);
+    r->has_user = f[F_USER].type == YA_JSON_OBJECT;
+    r->active = -1;
+    if (r->has_user) {
+        r->user_id = json_string(&f[F_USER_ID]);
+        r->first_name = json_string(&f[F_FIRST_NAME]);
+        r->last_name = json_string(&f[F_LAST_NAME]);
+        r->email = json_string(&f[F_EMAIL]);
+        r->username = json_string(&f[F_USERNAME]);
+        if (f[F_ACTIVE].type == YA_JSON_TRUE || f[F_ACTIVE].type == YA_JSON_FALSE) {
+            r->active = f[F_ACTIVE].type == YA_JSON_TRUE;
+        }
     }
+    r->device_id = json_string(&f[F_DEVICE_ID]);
+    r->device_type = json_string(&f[F_DEVICE_TYPE]);
+    r->device_identifier = json_string(&f[F_DEVICE_IDENTIFIER]);
 
+    // The grant is base64; decode it in place
+    char *grant = (char *)json_string(&f[F_GRANT]);
+    int grant_len = grant ? ya_grant_base64_decode(grant, strlen(grant), (unsigned char *)grant, strlen(grant)) : -1;
+    if (grant_len > 0) {
+        r->grant = (const unsigned char *)grant;
+        r->grant_len = (size_t)grant_len;
+    }
+
+    // Which of a permission list the user holds, an array of booleans
+    struct ya_json_iter it;
+    char *held;
+    size_t held_len;
+    r->held_count = -1;
+    if (ya_json_array_begin(&it, &f[F_PERMISSIONS]) == 0) {
+        r->held_count = 0;
+        while (ya_json_array_next(&it, &held, &held_len) > 0) {
+            if (r->held_count == MAX_PERMISSIONS) {
+                return -1;
+            }
+            r->held[r->held_count++] = held_len == 4 && memcmp(held, "true", 4) == 0;
+        }
+    }
+
+    // Each role is an object; only its name is kept
+    char *role;
+    size_t role_len;
+    if (r->has_user && ya_json_array_begin(&it, &f[F_ROLES]) == 0) {
+        while (ya_json_array_next(&it, &role, &role_len) > 0) {
+            struct ya_json_field name = {.path = "name"};
+            if (r->role_count == MAX_ROLES) {
+                r->roles_dropped++;
+            } else if (ya_json_extract(role, role_len, &name, 1) == 0 && json_string(&name)) {
+                r->roles[r->role_count++] = name.value;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to format a raw 16-byte UUID in its canonical text form
+static const char *format_uuid(const unsigned char *b, size_t len, char out[37]) {
+    if (len != 16) {
+        return NULL;
+    }
+    snprintf(out, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+             b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+    return out;
+}
+
+// Function to check a compact body (and every role nested in it) without
+// modifying it
+static int check_compact_response(unsigned char *body, size_t len) {
+    struct ya_wire_iter it, nested;
+    unsigned char *value, *v;
+    size_t vlen, nlen;
+    int tag, ntag, rc;
+
+    if (ya_wire_begin(&it, body, len, 0) != 0) {
+        return -1;
+    }
+    while ((rc = ya_wire_next(&it, &tag, &value, &vlen)) > 0) {
+        if (tag != YA_WIRE_ROLE) {
+            continue;
+        }
+        ya_wire_begin(&nested, value, vlen, 1);
+        while ((rc = ya_wire_next(&nested, &ntag, &v, &nlen)) > 0) {
+        }
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    return rc;
+}
+
+// Function to read the name out of a compact role field
+static const char *compact_role_name(unsigned char *value, size_t len) {
+    struct ya_wire_iter it;
+    unsigned char *v;
+    size_t vlen;
+    int tag;
+
+    ya_wire_begin(&it, value, len, 1);
+    while (ya_wire_next(&it, &tag, &v, &vlen) > 0) {
+        if (tag == YA_WIRE_ROLE_NAME) {
+            return ya_wire_cstr(v, vlen);
+        }
+    }
+    return NULL;
+}
+
+// Function to parse a compact (TLV) response in place. The body is checked
+// in full before any string is terminated in place.
+static int parse_compact_response(char *body, size_t len, struct auth_response *r) {
+    struct ya_wire_iter it;
+    unsigned char *value;
+    size_t vlen;
+    int tag;
+
+    if (check_compact_response((unsigned char *)body, len) != 0) {
+        return -1;
+    }
+
+    r->active = -1;
+    r->held_count = -1;
+    ya_wire_begin(&it, (unsigned char *)body, len, 0);
+    while (ya_wire_next(&it, &tag, &value, &vlen) > 0) {
+        const char **str = NULL;
+        switch (tag) {
+        case YA_WIRE_AUTHENTICATED:
+            r->authenticated = vlen == 1 && value[0] == 1;
+            break;
+        case YA_WIRE_USER_ID:
+            r->has_user = 1;
+            if (!r->user_id) {
+                r->user_id = format_uuid(value, vlen, r->user_id_buf);
+            }
+            break;
+        case YA_WIRE_USER_ACTIVE:
+            if (vlen == 1 && r->active < 0) {
+                r->active = value[0] == 1;
+            }
+            break;
+        case YA_WIRE_ROLE:
+            if (r->role_count == MAX_ROLES) {
+                r->roles_dropped++;
+            } else if ((r->roles[r->role_count] = compact_role_name(value, vlen))) {
+                r->role_count++;
+            }
+            break;
+        case YA_WIRE_DEVICE_ID:
+            if (!r->device_id) {
+                r->device_id = format_uuid(value, vlen, r->device_id_buf);
+            }
+            break;
+        case YA_WIRE_DEVICE_TYPE:
+            str = &r->device_type;
+            break;
+        case YA_WIRE_PERMISSIONS:
+            if (vlen > MAX_PERMISSIONS) {
+                return -1;
+            }
+            if (r->held_count < 0) {
+                memcpy(r->held, value, vlen);
+                r->held_count = (int)vlen;
+            }
+            break;
+        case YA_WIRE_GRANT:
+            if (!r->grant) {
+                r->grant = value;
+                r->grant_len = vlen;
+            }
+            break;
+        case YA_WIRE_DEVICE_IDENTIFIER:
+            str = &r->device_identifier;
+            break;
+        case YA_WIRE_ERROR:
+            str = &r->error;
+            break;
+        case YA_WIRE_USER_FIRST_NAME:
+            str = &r->first_name;
+            break;
+        case YA_WIRE_USER_LAST_NAME:
+            str = &r->last_name;
+            break;
+        case YA_WIRE_USER_EMAIL:
+            str = &r->email;
+            break;
+        case YA_WIRE_USER_USERNAME:
+            str = &r->username;
+            break;
+        }
+        // As with JSON, the first occurrence wins
+        if (str && !*str && !(*str = ya_wire_cstr(value, vlen))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_pam_data(pam_handle_t *pamh, void *data, int error_status) {
+    (void)pamh;
+    (void)error_status;
+    free(data);
+}
+
+// Function to copy a string into the result's string area
+static const char *result_string(char **p, const char *s) {
+    if (!s) {
+        return NULL;
+    }
+    size_t n = strlen(s) + 1;
+    memcpy(*p, s, n);
+    *p += n;
+    return *p - n;
+}
+
+// Function to keep a successful authentication in the PAM handle for the
+// account and session stages
+static void store_auth_result(pam_handle_t *pamh, const struct auth_response *r) {
+    const char *strings[] = {r->user_id, r->username, r->email, r->device_id, r->device_type,
+                             r->device_identifier};
+    size_t size = sizeof(struct auth_result);
+
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        size += strings[i] ? strlen(strings[i]) + 1 : 0;
+    }
+    for (int i = 0; i < r->role_count; i++) {
+        size += strlen(r->roles[i]) + 1;
+    }
+
+    struct auth_result *res = calloc(1, size);
+    if (!res) {
+        log_msg(pamh, LOG_WARNING, "Failed to save authentication result for the account stage");
+        return;
+    }
+    char *p = res->strings;
+    res->authenticated_us = ya_monotonic_us();
+    res->active = r->active;
+    res->user_id = result_string(&p, r->user_id);
+    res->username = result_string(&p, r->username);
+    res->email = result_string(&p, r->email);
+    res->device_id = result_string(&p, r->device_id);
+    res->device_type = result_string(&p, r->device_type);
+    res->device_identifier = result_string(&p, r->device_identifier);
+    for (int i = 0; i < r->role_count; i++) {
+        res->roles[res->role_count++] = result_string(&p, r->roles[i]);
+    }
+
+    if (pam_set_data(pamh, RESULT_DATA, res, free_pam_data) != PAM_SUCCESS) {
+        log_msg(pamh, LOG_WARNING, "Failed to save authentication result for the account stage");
+        free(res);
+    }
+}
+
+// Function to get the authentication result saved by pam_sm_authenticate,
+// NULL if there is none
+static const struct auth_result *get_auth_result(pam_handle_t *pamh) {
+    const void *data = NULL;
+
+    if (pam_get_data(pamh, RESULT_DATA, &data) != PAM_SUCCESS) {
+        return NULL;
+    }
+    return (const struct auth_result *)data;
+}
+
+// Function to check the parsed response and set environment variables
+static int apply_auth_response(pam_handle_t *pamh, const struct auth_response *r) {
     // Check if authentication was successful
-    cJSON *authenticated = cJSON_GetObjectItem(json, "authenticated");
-    if (!authenticated || !cJSON_IsTrue(authenticated)) {
-        cJSON *error = cJSON_GetObjectItem(json, "error");
-        if (error && cJSON_IsString(error)) {
-            pam_syslog(pamh, LOG_ERR, "Authentication failed: %s", error->valuestring);
+    if (!r->authenticated) {
+        if (r->error) {
+            log_msg(pamh, LOG_ERR, "Authentication failed: %s", r->error);
         } else {
-            pam_syslog(pamh, LOG_ERR, "Authentication failed - authenticated field is false");
+            log_msg(pamh, LOG_ERR, "Authentication failed - authenticated field is false");
         }
-        cJSON_Delete(json);
         return PAM_AUTH_ERR;
     }
 
     // Get user information from the response
-    cJSON *user = cJSON_GetObjectItem(json, "user");
-    if (user && cJSON_IsObject(user)) {
-        cJSON *firstName = cJSON_GetObjectItem(user, "first_name");
-        cJSON *lastName = cJSON_GetObjectItem(user, "last_name");
-        cJSON *email = cJSON_GetObjectItem(user, "email");
-        cJSON *username = cJSON_GetObjectItem(user, "username");
-
+    if (r->has_user) {
         // Combine first and last name for YUBI_USER_NAME
-        if (firstName && cJSON_IsString(firstName) && lastName && cJSON_IsString(lastName)) {
-            char *fullName = malloc(strlen(firstName->valuestring) + strlen(lastName->valuestring) + 2);
+        if (r->first_name && r->last_name) {
+            char *fullName = malloc(strlen(r->first_name) + strlen(r->last_name) + 2);
             if (fullName) {
-                sprintf(fullName, "%s %s", firstName->valuestring, lastName->valuestring);
+                sprintf(fullName, "%s %s", r->first_name, r->last_name);
                 set_env_var(pamh, "YUBI_USER_NAME", fullName);
-                pam_syslog(pamh, LOG_INFO, "Set YUBI_USER_NAME=%s", fullName);
+                log_msg(pamh, LOG_DEBUG, "Set YUBI_USER_NAME=%s", fullName);
                 free(fullName);
             }
-        } else if (firstName && cJSON_IsString(firstName)) {
-            set_env_var(pamh, "YUBI_USER_NAME", firstName->valuestring);
-            pam_syslog(pamh, LOG_INFO, "Set YUBI_USER_NAME=%s", firstName->valuestring);
+        } else if (r->first_name) {
+            set_env_var(pamh, "YUBI_USER_NAME", r->first_name);
+            log_msg(pamh, LOG_DEBUG, "Set YUBI_USER_NAME=%s", r->first_name);
         } else {
-            pam_syslog(pamh, LOG_WARNING, "User name not found in response");
+            log_msg(pamh, LOG_WARNING, "User name not found in response");
         }
         
-        if (email && cJSON_IsString(email)) {
-            set_env_var(pamh, "YUBI_USER_EMAIL", email->valuestring);
-            pam_syslog(pamh, LOG_INFO, "Set YUBI_USER_EMAIL=%s", email->valuestring);
+        if (r->email) {
+            set_env_var(pamh, "YUBI_USER_EMAIL", r->email);
+            log_msg(pamh, LOG_DEBUG, "Set YUBI_USER_EMAIL=%s", r->email);
         } else {
-            pam_syslog(pamh, LOG_WARNING, "User email not found in response");
+            log_msg(pamh, LOG_WARNING, "User email not found in response");
         }
         
-        if (username && cJSON_IsString(username)) {
-            set_env_var(pamh, "YUBI_USER_USERNAME", username->valuestring);
-            pam_syslog(pamh, LOG_INFO, "Set YUBI_USER_USERNAME=%s", username->valuestring);
+        if (r->username) {
+            set_env_var(pamh, "YUBI_USER_USERNAME", r->username);
+            log_msg(pamh, LOG_DEBUG, "Set YUBI_USER_USERNAME=%s", r->username);
         } else {
-            pam_syslog(pamh, LOG_WARNING, "User username not found in response");
+            log_msg(pamh, LOG_WARNING, "User username not found in response");
         }
     } else {
-        pam_syslog(pamh, LOG_WARNING, "User object not found in response");
+        log_msg(pamh, LOG_WARNING, "User object not found in response");
     }
 
-    cJSON_Delete(json);
+    store_auth_result(pamh, r);
     return PAM_SUCCESS;
 }
 
-// Function to authenticate with YubiApp API
-static int authenticate_with_yubiapp(pam_handle_t *pamh, const char *otp, const char *permission) {
-    CURL *curl;
-    CURLcode res;
-    struct MemoryStruct chunk;
-    int result = PAM_AUTH_ERR;
+// Function to keep the grant that came with a successful authentication,
+// for later checks of the permissions it covers. Only a grant that verifies
+// with our key, is for this host and names the PAM user is stored.
+static void save_grant(pam_handle_t *pamh, const struct yubiapp_args *args, const unsigned char *token, size_t len) {
+    unsigned char key[32];
+    unsigned char copy[YA_GRANT_MAX_SIZE];
+    struct ya_grant g;
+    char host[256];
+    const void *item = NULL;
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    if (geteuid() != 0 || pam_get_item(pamh, PAM_USER, &item) != PAM_SUCCESS || !item || len > sizeof(copy)) {
+        return;
+    }
+    const char *user = (const char *)item;
 
-    curl = curl_easy_init();
-    if (!curl) {
-        pam_syslog(pamh, LOG_ERR, "Failed to initialize libcurl");
-        free(chunk.memory);
-        return PAM_SYSTEM_ERR;
+    if (ya_grant_load_key(args->grant_key, key) != 0) {
+        log_msg(pamh, LOG_WARNING, "Grant key %s is unusable (missing, not root-owned, or malformed)", args->grant_key);
+        return;
+    }
+    if (ya_grant_verify(key, token, len) != 0) {
+        log_msg(pamh, LOG_WARNING, "Grant from the API does not verify with %s, not stored", args->grant_key);
+        return;
+    }
+    memcpy(copy, token, len);
+    const char *audience = args_grant_audience(args, host);
+    if (ya_grant_parse(copy, len, &g) != 0 || !audience || strcmp(g.audience, audience) != 0 ||
+        strcmp(g.username, user) != 0) {
+        log_msg(pamh, LOG_DEBUG, "Grant is not for %s on this host, not stored", user);
+        return;
     }
 
-    // Prepare JSON request - use the format expected by the Go API
-    char json_request[512];
-    if (permission && strlen(permission) > 0) {
-        snprintf(json_request, sizeof(json_request), 
-                 "{\"device_type\":\"yubikey\",\"auth_code\":\"%s\",\"permission\":\"%s\"}", otp, permission);
+    for (int i = 0; i < g.permission_count; i++) {
+        if (!g.permissions[i][0]) {
+            continue;
+        }
+        if (ya_grant_store(args->grant_dir, user, g.permissions[i], token, len) != 0) {
+            log_msg(pamh, LOG_WARNING, "Failed to store grant in %s: %s", args->grant_dir, strerror(errno));
+            return;
+        }
+    }
+    log_msg(pamh, LOG_DEBUG, "Stored grant for %s covering %d permission(s), valid for %llu s", user,
+            g.permission_count, (unsigned long long)(g.expires - g.issued));
+}
+
+// Function to map an API response to a PAM result. body must be
+// NUL-terminated at body[len] and may be modified. The encoding is taken
+// from the response's Content-Type (NULL means JSON).
+static int handle_api_response(pam_handle_t *pamh, const struct yubiapp_args *args, long response_code,
+                               const char *content_type, char *body, size_t len) {
+    struct auth_response r;
+    int compact = ya_wire_is_compact(content_type);
+
+    if (compact) {
+        log_msg(pamh, LOG_DEBUG, "Received compact response from YubiApp API (HTTP %ld, %zu bytes)",
+                response_code, len);
     } else {
-        snprintf(json_request, sizeof(json_request), 
-                 "{\"device_type\":\"yubikey\",\"auth_code\":\"%s\"}", otp);
+        log_msg(pamh, LOG_DEBUG, "Received response from YubiApp API (HTTP %ld): %s",
+                response_code, body);
+    }
+
+    if (response_code == 200) {
+        // Parse response and set environment variables
+        memset(&r, 0, sizeof(r));
+        int rc = compact ? parse_compact_response(body, len, &r) : parse_json_response(body, len, &r);
+        if (rc != 0) {
+            if (compact) {
+                log_msg(pamh, LOG_ERR, "Failed to parse compact response (%zu bytes)", len);
+            } else {
+                log_msg(pamh, LOG_ERR, "Failed to parse JSON response: %s", body);
+            }
+            return PAM_SYSTEM_ERR;
+        }
+        if (r.roles_dropped > 0) {
+            log_msg(pamh, LOG_WARNING, "User %s has %d roles; only the first %d are matched by role=",
+                    r.username ? r.username : "(unknown)", r.role_count + r.roles_dropped, MAX_ROLES);
+        }
+        // The API only evaluates a permission list; require= is enforced here
+        if (r.authenticated && args_permission_list(args) && !permission_list_met(args, r.held, r.held_count)) {
+            if (r.held_count < 0) {
+                log_msg(pamh, LOG_ERR, "Authentication failed: the API did not evaluate permissions %s",
+                        args->permission);
+            } else {
+                log_msg(pamh, LOG_ERR, "Authentication failed: permission denied: %s (require=%s)",
+                        args->permission, args->require_any ? "any" : "all");
+            }
+            return PAM_AUTH_ERR;
+        }
+        int retval = apply_auth_response(pamh, &r);
+        // The API grants only a single checked permission; anything else is
+        // not stored
+        if (retval == PAM_SUCCESS && r.grant && args->grant_key && args->permission[0] &&
+            !args_permission_list(args)) {
+            save_grant(pamh, args, r.grant, r.grant_len);
+        }
+        return retval;
     }
 
-    pam_syslog(pamh, LOG_INFO, "Sending request to YubiApp API: %s", json_request);
+    log_msg(pamh, LOG_ERR, "HTTP error: %ld", response_code);
+    return PAM_AUTH_ERR;
+}
 
-    // Set up curl options
-    curl_easy_setopt(curl, CURLOPT_URL, YUBIAPP_URL);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_request);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+// Function to connect to the local broker socket
+static int connect_broker(const char *path) {
+    struct sockaddr_un addr;
 
-    // Set headers
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
 
-    // Perform the request
-    res = curl_easy_perform(curl);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
 
-    if (res == CURLE_OK) {
-        long response_code;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-        pam_syslog(pamh, LOG_INFO, "Received response from YubiApp API (HTTP %ld): %s", 
-                   response_code, chunk.memory);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
 
-        if (response_code == 200) {
-            // Parse response and set environment variables
-            result = parse_response_and_set_env(pamh, chunk.memory);
-        } else {
-            pam_syslog(pamh, LOG_ERR, "HTTP error: %ld", response_code);
-            result = PAM_AUTH_ERR;
+    struct timeval tv = { BROKER_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// Function to authenticate through the yubiappd broker.
+// Returns BROKER_UNAVAILABLE if the broker is not running so the caller
+// can fall back to talking to the API directly.
+static int authenticate_via_broker(pam_handle_t *pamh, const struct yubiapp_args *args,
+                                   struct login_metrics *metrics, const char *otp) {
+    unsigned char request_buf[YA_PROTO_HEADER_SIZE + YUBIAPP_MAX_REQUEST_SIZE];
+    struct ya_msg req, resp;
+    const char *socket_path = args->broker_socket;
+    const char *permission = args_permission_list(args) ? NULL : args->permission;
+    const char *permissions = args_permission_list(args) ? args->permission : NULL;
+    const char *accept = args_accept(args);
+    char host[256];
+    const char *audience = args_grant_audience(args, host);
+    int result = PAM_SYSTEM_ERR;
+
+    int fd = connect_broker(socket_path);
+    if (fd < 0) {
+        log_msg(pamh, LOG_DEBUG, "YubiApp broker not available at %s (%s), using direct API",
+                socket_path, strerror(errno));
+        return BROKER_UNAVAILABLE;
+    }
+
+    ya_msg_init(&req, request_buf, sizeof(request_buf), YA_MSG_AUTH_REQUEST);
+    if (ya_msg_put(&req, YA_TAG_OTP, otp, strlen(otp)) != 0 ||
+        (permission && ya_msg_put(&req, YA_TAG_PERMISSION, permission, strlen(permission)) != 0) ||
+        (permissions && ya_msg_put(&req, YA_TAG_PERMISSIONS, permissions, strlen(permissions)) != 0) ||
+        (accept && ya_msg_put(&req, YA_TAG_ACCEPT, accept, strlen(accept)) != 0) ||
+        (audience && ya_msg_put(&req, YA_TAG_GRANT_AUDIENCE, audience, strlen(audience)) != 0) ||
+        (audience && args->grant_permissions &&
+         ya_msg_put(&req, YA_TAG_GRANT_PERMISSIONS, args->grant_permissions, strlen(args->grant_permissions)) != 0)) {
+        log_msg(pamh, LOG_ERR, "Broker request too large");
+        close(fd);
+        return PAM_SYSTEM_ERR;
+    }
+
+    // Status, HTTP code, content type and body fields, each with a 3-byte
+    // TLV header
+    size_t cap = YA_PROTO_HEADER_SIZE + 3 + 1 + 3 + 2 + 3 + YA_PROTO_MAX_CONTENT_TYPE + 3 + args->max_response + 1;
+    unsigned char *response_buf = malloc(cap);
+    if (!response_buf) {
+        close(fd);
+        return PAM_BUF_ERR;
+    }
+    // Leave room for a terminating NUL after the body
+    ya_msg_init(&resp, response_buf, cap - 1, 0);
+
+    if (ya_msg_send(fd, &req) != 0 || ya_msg_recv(fd, &resp) != 0) {
+        int err = errno;
+        log_msg(pamh, LOG_ERR, "Broker exchange failed: %s", strerror(err));
+        metrics->timed_out = err == EAGAIN || err == EWOULDBLOCK;
+        goto out;
+    }
+
+    uint8_t status;
+    if (resp.type != YA_MSG_AUTH_RESPONSE || ya_msg_get_u8(&resp, YA_TAG_STATUS, &status) != 0) {
+        log_msg(pamh, LOG_ERR, "Malformed broker response");
+        goto out;
+    }
+
+    if (status != YA_BROKER_OK) {
+        log_msg(pamh, LOG_ERR, "Broker could not reach YubiApp API (status %u)", status);
+        if (status == YA_BROKER_UPSTREAM_ERROR || status == YA_BROKER_UPSTREAM_TIMEOUT) {
+            result = PAM_AUTHINFO_UNAVAIL;
         }
+        metrics->timed_out = status == YA_BROKER_UPSTREAM_TIMEOUT;
+        goto out;
+    }
+
+    uint16_t response_code;
+    const unsigned char *body;
+    size_t body_len;
+    if (ya_msg_get_u16(&resp, YA_TAG_HTTP_CODE, &response_code) != 0 ||
+        ya_msg_get(&resp, YA_TAG_BODY, &body, &body_len) != 0) {
+        log_msg(pamh, LOG_ERR, "Malformed broker response");
+        goto out;
+    }
+
+    char content_type[YA_PROTO_MAX_CONTENT_TYPE + 1] = "";
+    const unsigned char *ct;
+    size_t ct_len;
+    if (ya_msg_get(&resp, YA_TAG_CONTENT_TYPE, &ct, &ct_len) == 0 && ct_len <= YA_PROTO_MAX_CONTENT_TYPE) {
+        memcpy(content_type, ct, ct_len);
+        content_type[ct_len] = '\0';
+    }
+
+    // Nothing after the body is read any more, so NUL-terminate it in place
+    // (the receive buffer keeps one spare byte for this)
+    ((unsigned char *)body)[body_len] = '\0';
+    result = handle_api_response(pamh, args, response_code, content_type, (char *)body, body_len);
+
+out:
+    free(response_buf);
+    close(fd);
+    return result;
+}
+
+// Function to check whether the broker socket exists, without connecting
+static int broker_present(const char *socket_path) {
+    struct stat st;
+    return socket_path && stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+// Function to feed the connect-time estimate from a finished transfer that
+// opened a new connection: resolving, connecting and any TLS handshake,
+// which is what CURLOPT_CONNECTTIMEOUT bounds
+static void record_connect(struct ya_endpoint *ep, CURL *curl) {
+    curl_off_t connect = 0, tls = 0;
+    long new_connections = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    if (new_connections > 0 && connect > 0) {
+        ya_endpoint_record_connect(ep, (uint64_t)(tls > connect ? tls : connect));
+    }
+}
+
+// Warm-up thread: resolve, connect (and handshake) with a body-less OPTIONS
+// request so the connection sits in the handle's cache for the real POST.
+// The API's CORS middleware answers OPTIONS on any path with 204.
+static void *warmup_thread(void *arg) {
+    struct warmup *w = (struct warmup *)arg;
+    w->result = curl_easy_perform(w->curl);
+    return NULL;
+}
+
+// Function to start warming up a connection to the API in the background
+static void warmup_start(pam_handle_t *pamh, struct warmup *w, const struct ya_endpoints *eps,
+                         struct ya_endpoint *ep, const char *api_socket, struct ya_cache *cache) {
+    uint64_t connect_us, total_us;
+
+    memset(w, 0, sizeof(*w));
+    w->ep = ep;
+
+    w->curl = ya_pool_get();
+    if (!w->curl) {
+        return;
+    }
+
+    // The warm-up does the handshake, so it is the one that resumes sessions
+    ya_cache_attach(cache, w->curl);
+
+    ya_endpoint_deadlines(eps, ep, &connect_us, &total_us);
+    curl_easy_setopt(w->curl, CURLOPT_URL, ep->url);
+    if (api_socket) {
+        curl_easy_setopt(w->curl, CURLOPT_UNIX_SOCKET_PATH, api_socket);
+    }
+    curl_easy_setopt(w->curl, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+    curl_easy_setopt(w->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(w->curl, CURLOPT_TIMEOUT_MS, (long)(total_us / 1000));
+    curl_easy_setopt(w->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)(connect_us / 1000));
+    curl_easy_setopt(w->curl, CURLOPT_NOSIGNAL, 1L);
+
+    if (pthread_create(&w->thread, NULL, warmup_thread, w) == 0) {
+        w->started = 1;
     } else {
-        pam_syslog(pamh, LOG_ERR, "curl_easy_perform() failed: %s", curl_easy_strerror(res));
+        log_msg(pamh, LOG_WARNING, "Failed to start connection warm-up thread");
+    }
+}
+
+// Function to wait for the warm-up and hand back its handle for reuse.
+// The connection stays in the shared connection pool for the POST.
+static CURL *warmup_finish(pam_handle_t *pamh, struct warmup *w) {
+    if (!w->curl) {
+        return NULL;
+    }
+
+    if (w->started) {
+        pthread_join(w->thread, NULL);
+        if (w->result != CURLE_OK) {
+            log_msg(pamh, LOG_WARNING, "Connection warm-up failed: %s", curl_easy_strerror(w->result));
+        } else {
+            record_connect(w->ep, w->curl);
+        }
+    }
+
+    ya_pool_reset(w->curl);
+    CURL *curl = w->curl;
+    w->curl = NULL;
+    return curl;
+}
+
+// One request in a (possibly hedged) exchange with the API
+struct attempt {
+    CURL *curl;
+    struct ya_endpoint *ep;
+    struct MemoryStruct chunk;
+    uint64_t started_us;
+    uint64_t timeout_us;    // adaptive deadline of this request
+    int active;
+    int probe;      // holds the endpoint's half-open breaker probe
+    CURLcode res;
+    long response_code;
+};
+
+// What every attempt of one login shares
+struct request {
+    const struct ya_endpoints *eps;
+    const char *json;
+    const char *accept;
+    struct curl_slist *headers;
+    struct ya_cache *cache;
+    const char *api_socket;
+    struct ya_arena arena;      // request body and one response buffer per attempt
+    size_t max_response;
+};
+
+// Function to start a request on an endpoint. Takes ownership of curl,
+// which may be a pre-warmed handle or NULL for a fresh one.
+static int attempt_start(CURLM *multi, struct attempt *a, CURL *curl, struct ya_endpoint *ep, int probe,
+                         struct request *req) {
+    memset(a, 0, sizeof(*a));
+    a->ep = ep;
+    a->probe = probe;
+    ya_buffer_init(&a->chunk, ya_arena_alloc(&req->arena, req->max_response + 1), req->max_response);
+    a->curl = curl ? curl : ya_pool_get();
+    if (!a->curl) {
+        return -1;
+    }
+
+    ya_api_setup(a->curl, ep->url, req->json, req->accept, &a->chunk, &req->headers);
+    if (req->api_socket) {
+        curl_easy_setopt(a->curl, CURLOPT_UNIX_SOCKET_PATH, req->api_socket);
+    }
+    ya_cache_attach(req->cache, a->curl);
+
+    uint64_t connect_us;
+    ya_endpoint_deadlines(req->eps, ep, &connect_us, &a->timeout_us);
+    curl_easy_setopt(a->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)(connect_us / 1000));
+    curl_easy_setopt(a->curl, CURLOPT_TIMEOUT_MS, (long)(a->timeout_us / 1000));
+
+    if (curl_multi_add_handle(multi, a->curl) != CURLM_OK) {
+        return -1;
+    }
+    a->started_us = ya_monotonic_us();
+    a->active = 1;
+    return 0;
+}
+
+static void attempt_cleanup(CURLM *multi, struct attempt *a) {
+    if (a->probe) {
+        ya_endpoint_release_probe(a->ep);
+    }
+    if (a->curl) {
+        if (a->active) {
+            curl_multi_remove_handle(multi, a->curl);
+        }
+        ya_pool_put(a->curl);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+// Whether a failed request never reached the API, so that the OTP is unused
+// and sending it again is safe: no connection, or it timed out before the
+// request went out
+static int attempt_unsent(struct attempt *a) {
+    curl_off_t pretransfer = 0;
+
+    if (a->res == CURLE_COULDNT_RESOLVE_HOST || a->res == CURLE_COULDNT_CONNECT) {
+        return 1;
+    }
+    curl_easy_getinfo(a->curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    return a->res == CURLE_OPERATION_TIMEDOUT && pretransfer == 0;
+}
+
+// Function to pick the next endpoint in ranking order whose circuit breaker
+// lets a request through. Sets *probe when the request is a breaker probe.
+static struct ya_endpoint *next_endpoint(struct ya_endpoints *eps, int *next, int *probe) {
+    while (*next < eps->count) {
+        struct ya_endpoint *ep = &eps->list[eps->order[(*next)++]];
+        int allowed = ya_endpoint_allow(eps, ep);
+        if (allowed) {
+            *probe = allowed == 2;
+            return ep;
+        }
+    }
+    return NULL;
+}
+
+// Function to decide whether a request to ep that was never sent may be
+// retried: within the login's retries and the shared budget, and if the
+// jittered backoff still leaves the login time before deadline. Waits out
+// the backoff and returns ep with its breaker permission, or NULL.
+static struct ya_endpoint *retry_endpoint(pam_handle_t *pamh, const struct yubiapp_args *args,
+                                          struct ya_endpoints *eps, struct ya_endpoint *ep, int *retries,
+                                          int *probe, uint64_t deadline) {
+    if (!ep || *retries >= args->retries) {
+        return NULL;
+    }
+    uint64_t backoff = ya_retry_backoff_us(*retries);
+    if (ya_monotonic_us() + backoff >= deadline) {
+        return NULL;
+    }
+    if (!ya_retry_take(eps)) {
+        log_msg(pamh, LOG_WARNING, "Retry budget exhausted, not retrying %s", ep->url);
+        return NULL;
+    }
+
+    poll(NULL, 0, (int)((backoff + 999) / 1000));
+    int allowed = ya_endpoint_allow(eps, ep);
+    if (!allowed) {
+        return NULL;
+    }
+    *probe = allowed == 2;
+    (*retries)++;
+    log_msg(pamh, LOG_DEBUG, "Retrying %s after %llu ms", ep->url, (unsigned long long)(backoff / 1000));
+    return ep;
+}
+
+// Function to authenticate with YubiApp API. The request goes to the best
+// endpoint first; if it has not answered by its p95-derived deadline, a
+// hedged request goes to the next-best one, and a transport failure fails
+// over immediately. A 200 from any endpoint wins. Other answers are held
+// until every in-flight request is done, because an OTP is single-use and
+// the slower replica may only be reporting a replay of the faster one.
+// Endpoints whose circuit breaker is open are skipped; with none left the
+// result is PAM_AUTHINFO_UNAVAIL without sending anything. Each request's
+// deadlines adapt to the endpoint's latency, and once there is nothing left
+// to fail over to, a request that never reached the API is retried.
+static int authenticate_with_yubiapp(pam_handle_t *pamh, const struct yubiapp_args *args,
+                                     struct ya_endpoints *eps, CURL *curl, struct ya_cache *cache,
+                                     struct login_metrics *metrics, const char *otp) {
+    struct attempt attempts[YA_MAX_ENDPOINTS + YA_MAX_RETRIES];
+    struct request req = {
+        .eps = eps,
+        .accept = args_accept(args),
+        .cache = cache,
+        .api_socket = args->api_socket,
+        .max_response = args->max_response,
+    };
+    int hedge = args->hedge;
+    struct attempt *winner = NULL;
+    struct attempt *fallback = NULL;
+    struct ya_endpoint *ep;
+    struct ya_endpoint *unsent = NULL;
+    int launched = 0;
+    int next = 0;
+    int probe = 0;
+    int hedged = 0;
+    int retries = 0;
+    int result = PAM_AUTHINFO_UNAVAIL;
+
+    if (ya_curl_load() != 0) {
+        log_msg(pamh, LOG_ERR, "libcurl unavailable: %s", ya_curl_error());
+        return PAM_AUTHINFO_UNAVAIL;
+    }
+
+    memset(attempts, 0, sizeof(attempts));
+
+    ep = next_endpoint(eps, &next, &probe);
+    if (!ep) {
+        log_msg(pamh, LOG_ERR, "YubiApp API unavailable (circuit breaker open), failing fast");
+        if (curl) {
+            ya_pool_put(curl);
+        }
+        return PAM_AUTHINFO_UNAVAIL;
+    }
+
+    // One allocation for the request and every response buffer
+    if (ya_arena_init(&req.arena, YUBIAPP_MAX_REQUEST_SIZE + 16 +
+                                  (size_t)(eps->count + args->retries) *
+                                  ((req.max_response + 1 + 15) & ~(size_t)15)) != 0) {
+        log_msg(pamh, LOG_ERR, "Failed to allocate request buffers");
+        if (curl) {
+            ya_pool_put(curl);
+        }
+        return PAM_BUF_ERR;
+    }
+
+    // Prepare JSON request - use the format expected by the Go API
+    char *json_request = ya_arena_alloc(&req.arena, YUBIAPP_MAX_REQUEST_SIZE);
+    char host[256];
+    int list = args_permission_list(args);
+    if (ya_api_build_request(json_request, YUBIAPP_MAX_REQUEST_SIZE, otp, list ? NULL : args->permission,
+                             list ? args->permission : NULL, args_grant_audience(args, host),
+                             args->grant_permissions) < 0) {
+        log_msg(pamh, LOG_ERR, "Request too large");
+        if (curl) {
+            ya_pool_put(curl);
+        }
+        ya_arena_free(&req.arena);
+        return PAM_SYSTEM_ERR;
+    }
+    req.json = json_request;
+
+    if (args->log_level >= LOG_DEBUG) {
+        char otp_id[32];
+        log_msg(pamh, LOG_DEBUG, "Sending request for device %s to %s",
+                ya_log_otp_id(otp, otp_id, sizeof(otp_id)), ep->url);
+    }
+
+    CURLM *multi = curl_multi_init();
+    if (!multi) {
+        log_msg(pamh, LOG_ERR, "Failed to initialize libcurl");
+        if (curl) {
+            ya_pool_put(curl);
+        }
+        ya_arena_free(&req.arena);
+        return PAM_SYSTEM_ERR;
+    }
+
+    launched = 1;
+    if (attempt_start(multi, &attempts[0], curl, ep, probe, &req) != 0) {
+        log_msg(pamh, LOG_ERR, "Failed to initialize libcurl");
         result = PAM_SYSTEM_ERR;
+        goto out;
     }
+    ya_retry_earn(eps);
+
+    uint64_t login_deadline = attempts[0].started_us + eps->deadline.max_us;
+    uint64_t max_hedge_us = attempts[0].timeout_us / 2;
+    uint64_t deadline = attempts[0].started_us + ya_endpoint_hedge_delay_us(attempts[0].ep, max_hedge_us);
+
+    for (;;) {
+        int running = 0;
+        int failover = 0;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            struct attempt *a = NULL;
+            for (int i = 0; i < launched; i++) {
+                if (attempts[i].curl == msg->easy_handle) {
+                    a = &attempts[i];
+                }
+            }
+            if (!a) {
+                continue;
+            }
+
+            a->res = msg->data.result;
+            curl_multi_remove_handle(multi, a->curl);
+            a->active = 0;
+
+            if (a->res == CURLE_OK) {
+                curl_easy_getinfo(a->curl, CURLINFO_RESPONSE_CODE, &a->response_code);
+                ya_metrics_transfer(metrics->state, a->curl);
+                record_connect(a->ep, a->curl);
+            }
+
+            if (a->res == CURLE_OK && a->response_code < 500) {
+                curl_off_t total_us = 0;
+                curl_easy_getinfo(a->curl, CURLINFO_TOTAL_TIME_T, &total_us);
+                ya_endpoint_record(a->ep, (uint64_t)total_us);
+                ya_endpoint_success(a->ep);
+                a->probe = 0;
+                if (a->response_code == 200) {
+                    winner = a;
+                } else if (!fallback) {
+                    fallback = a;
+                }
+            } else {
+                // Failures cost their full deadline in the ranking, however
+                // fast they came back (a refused connection is not a fast
+                // endpoint)
+                ya_endpoint_record(a->ep, a->timeout_us);
+                ya_endpoint_failure(eps, a->ep);
+                a->probe = 0;
+                if (attempt_unsent(a)) {
+                    unsent = a->ep;
+                }
+                if (a->chunk.overflow || a->res == CURLE_FILESIZE_EXCEEDED) {
+                    log_msg(pamh, LOG_ERR, "Response from %s exceeds %zu bytes, aborted", a->ep->url, req.max_response);
+                } else if (a->res != CURLE_OK) {
+                    log_msg(pamh, LOG_ERR, "Request to %s failed: %s", a->ep->url, curl_easy_strerror(a->res));
+                    if (a->res == CURLE_OPERATION_TIMEDOUT) {
+                        metrics->timed_out = 1;
+                    }
+                    if (cache && a->res == CURLE_COULDNT_CONNECT) {
+                        // A cached address may be stale; make the next login resolve again
+                        ya_cache_forget_dns(cache);
+                    }
+                } else {
+                    log_msg(pamh, LOG_ERR, "Request to %s failed: HTTP %ld", a->ep->url, a->response_code);
+                }
+                failover = 1;
+            }
+        }
+
+        if (winner) {
+            break;
+        }
+
+        int active = 0;
+        for (int i = 0; i < launched; i++) {
+            active += attempts[i].active;
+        }
+
+        // Fail over after an error; hedge once when the deadline passes
+        uint64_t now = ya_monotonic_us();
+        int want_more = !fallback && next < eps->count &&
+                        (failover || active == 0 || (hedge && !hedged && now >= deadline));
+        if (want_more && (ep = next_endpoint(eps, &next, &probe))) {
+            struct attempt *a = &attempts[launched];
+            if (attempt_start(multi, a, NULL, ep, probe, &req) == 0) {
+                if (!failover && active > 0) {
+                    hedged = 1;
+                    log_msg(pamh, LOG_DEBUG, "No answer after %llu ms, hedging to %s",
+                            (unsigned long long)((now - attempts[0].started_us) / 1000), a->ep->url);
+                }
+                deadline = now + ya_endpoint_hedge_delay_us(a->ep, max_hedge_us);
+                active++;
+            } else {
+                attempt_cleanup(multi, a);
+            }
+            launched++;
+            continue;
+        }
 
-    // Cleanup
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    free(chunk.memory);
+        // Nothing left to fail over to: retry a request that never got out
+        if (active == 0 && !fallback &&
+            (ep = retry_endpoint(pamh, args, eps, unsent, &retries, &probe, login_deadline))) {
+            unsent = NULL;
+            struct attempt *a = &attempts[launched++];
+            if (attempt_start(multi, a, NULL, ep, probe, &req) != 0) {
+                attempt_cleanup(multi, a);
+            }
+            continue;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        int wait_ms = 1000;
+        if (hedge && !hedged && !fallback && next < eps->count) {
+            wait_ms = now >= deadline ? 0 : (int)((deadline - now + 999) / 1000);
+            if (wait_ms > 1000) {
+                wait_ms = 1000;
+            }
+        }
+        curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+    }
 
+    struct attempt *answer = winner ? winner : fallback;
+    if (answer) {
+        metrics->timed_out = 0;
+        if (cache && ya_cache_store(cache, answer->curl, answer->ep->url) != 0) {
+            log_msg(pamh, LOG_WARNING, "Failed to update client cache %s", cache->path);
+        }
+        char *content_type = NULL;
+        curl_easy_getinfo(answer->curl, CURLINFO_CONTENT_TYPE, &content_type);
+        result = handle_api_response(pamh, args, answer->response_code, content_type,
+                                     answer->chunk.memory, answer->chunk.size);
+    }
+
+    // Requests still in flight lose; record how long they had taken so far
+    // when that is already worse than their estimate
+    for (int i = 0; i < launched; i++) {
+        if (attempts[i].active) {
+            uint64_t elapsed = ya_monotonic_us() - attempts[i].started_us;
+            if (elapsed > ya_endpoint_p95_us(attempts[i].ep)) {
+                ya_endpoint_record(attempts[i].ep, elapsed);
+            }
+        }
+    }
+
+out:
+    for (int i = 0; i < launched; i++) {
+        attempt_cleanup(multi, &attempts[i]);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(req.headers);
+    ya_arena_free(&req.arena);
     return result;
 }
 
+// Whether every endpoint can be served by the built-in client
+static int endpoints_local(const struct ya_endpoints *eps, const char *api_socket) {
+    for (int i = 0; i < eps->count; i++) {
+        if (!ya_http_local(eps->list[i].url, api_socket)) {
+            return 0;
+        }
+    }
+    return eps->count > 0;
+}
+
+// Function to authenticate with a local YubiApp API through the built-in
+// client, without libcurl. Endpoints are tried in ranking order, failing
+// over after a transport error or a 5xx, and a request that never reached
+// the API is retried as in authenticate_with_yubiapp. Without hedging only
+// one request is ever in flight, so the first other answer is final.
+static int authenticate_with_http(pam_handle_t *pamh, const struct yubiapp_args *args,
+                                  struct ya_endpoints *eps, struct login_metrics *metrics, const char *otp) {
+    struct ya_http_request req = {
+        .unix_socket = args->api_socket,
+        .content_type = "application/json",
+        .accept = args_accept(args),
+    };
+    struct ya_http_response resp;
+    struct ya_endpoint *ep;
+    struct ya_endpoint *unsent = NULL;
+    int next = 0;
+    int probe = 0;
+    int retries = 0;
+    int result = PAM_AUTHINFO_UNAVAIL;
+
+    ep = next_endpoint(eps, &next, &probe);
+    if (!ep) {
+        log_msg(pamh, LOG_ERR, "YubiApp API unavailable (circuit breaker open), failing fast");
+        return PAM_AUTHINFO_UNAVAIL;
+    }
+
+    char json_request[YUBIAPP_MAX_REQUEST_SIZE];
+    char host[256];
+    int list = args_permission_list(args);
+    int len = ya_api_build_request(json_request, sizeof(json_request), otp, list ? NULL : args->permission,
+                                   list ? args->permission : NULL, args_grant_audience(args, host),
+                                   args->grant_permissions);
+    if (len < 0) {
+        log_msg(pamh, LOG_ERR, "Request too large");
+        if (probe) {
+            ya_endpoint_release_probe(ep);
+        }
+        return PAM_SYSTEM_ERR;
+    }
+    req.body = json_request;
+    req.body_len = (size_t)len;
+
+    // One buffer for every attempt's response, headers included
+    char *buf = malloc(args->max_response + YA_HTTP_MAX_HEADER + 1);
+    if (!buf) {
+        log_msg(pamh, LOG_ERR, "Failed to allocate response buffer");
+        if (probe) {
+            ya_endpoint_release_probe(ep);
+        }
+        return PAM_BUF_ERR;
+    }
+
+    if (args->log_level >= LOG_DEBUG) {
+        char otp_id[32];
+        log_msg(pamh, LOG_DEBUG, "Sending request for device %s to %s",
+                ya_log_otp_id(otp, otp_id, sizeof(otp_id)), ep->url);
+    }
+
+    uint64_t login_deadline = ya_monotonic_us() + eps->deadline.max_us;
+    ya_retry_earn(eps);
+
+    do {
+        uint64_t connect_us, total_us;
+        ya_endpoint_deadlines(eps, ep, &connect_us, &total_us);
+        req.url = ep->url;
+        req.connect_timeout_ms = (unsigned int)(connect_us / 1000);
+        req.timeout_ms = (unsigned int)(total_us / 1000);
+
+        int rc = ya_http_post(&req, buf, args->max_response, &resp);
+        if (rc == YA_HTTP_OK) {
+            ya_metrics_exchange(metrics->state, resp.connect_us, resp.first_byte_us, resp.total_us);
+        }
+        if (resp.connected) {
+            ya_endpoint_record_connect(ep, resp.connect_us);
+        }
+        if (rc == YA_HTTP_OK && resp.status < 500) {
+            ya_endpoint_record(ep, resp.total_us);
+            ya_endpoint_success(ep);
+            if (probe) {
+                ya_endpoint_release_probe(ep);
+            }
+            metrics->timed_out = 0;
+            result = handle_api_response(pamh, args, resp.status, resp.content_type, resp.body, resp.body_len);
+            break;
+        }
+
+        // As in authenticate_with_yubiapp, failures cost their full
+        // deadline in the ranking
+        ya_endpoint_record(ep, total_us);
+        ya_endpoint_failure(eps, ep);
+        if (probe) {
+            ya_endpoint_release_probe(ep);
+        }
+        if (rc == YA_HTTP_ERR_CONNECT || (rc == YA_HTTP_ERR_TIMEOUT && !resp.connected)) {
+            unsent = ep;
+        }
+        if (rc == YA_HTTP_ERR_TOO_LARGE) {
+            log_msg(pamh, LOG_ERR, "Response from %s exceeds %zu bytes, aborted", ep->url, args->max_response);
+        } else if (rc != YA_HTTP_OK) {
+            log_msg(pamh, LOG_ERR, "Request to %s failed: %s", ep->url, ya_http_strerror(rc));
+            if (rc == YA_HTTP_ERR_TIMEOUT) {
+                metrics->timed_out = 1;
+            }
+        } else {
+            log_msg(pamh, LOG_ERR, "Request to %s failed: HTTP %ld", ep->url, resp.status);
+        }
+
+        ep = next_endpoint(eps, &next, &probe);
+        if (!ep && (ep = retry_endpoint(pamh, args, eps, unsent, &retries, &probe, login_deadline))) {
+            unsent = NULL;
+        }
+    } while (ep);
+
+    free(buf);
+    return result;
+}
+
+// Function to hand an event to the broker without waiting: one write on a
+// non-blocking socket, and no reply is read. Returns 0 if the whole
+// message was written.
+static int send_event_to_broker(const char *socket_path, const char *event, size_t len) {
+    unsigned char buf[YA_PROTO_HEADER_SIZE + YA_EVENT_MAX_SIZE + 16];
+    struct ya_msg msg;
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    ya_msg_init(&msg, buf, sizeof(buf), YA_MSG_SESSION_EVENT);
+    if (ya_msg_put(&msg, YA_TAG_EVENT, event, len) != 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    // A full socket buffer fails the write rather than blocking; a
+    // truncated message is discarded by the broker, so the event is then
+    // only in the spool
+    int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 ? ya_msg_send(fd, &msg) : -1;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return rc;
+}
+
+// Function to get the session UUID shared by this session's open and close
+// events. Created by the open; NULL if the close has none to reuse.
+static const char *session_id(pam_handle_t *pamh, int create) {
+    const void *data = NULL;
+
+    if (pam_get_data(pamh, SESSION_DATA, &data) == PAM_SUCCESS && data) {
+        return data;
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    char *id = malloc(37);
+    if (!id || ya_event_uuid(id) != 0 || pam_set_data(pamh, SESSION_DATA, id, free_pam_data) != PAM_SUCCESS) {
+        free(id);
+        return NULL;
+    }
+    return id;
+}
+
+static const char *pam_item_string(pam_handle_t *pamh, int item) {
+    const void *value = NULL;
+
+    if (pam_get_item(pamh, item, &value) != PAM_SUCCESS) {
+        return NULL;
+    }
+    return value;
+}
+
+// Function to report an event to the YubiApp sessions API, filling in its
+// ID, time and the PAM items. Never fails the PAM call: the event goes to
+// the broker, else to the spool, else it is logged as lost.
+static void report_event(pam_handle_t *pamh, const struct yubiapp_args *args, struct ya_session_event *ev) {
+    char id[37];
+    char host[256];
+    char event[YA_EVENT_MAX_SIZE];
+
+    if (ya_event_uuid(id) != 0) {
+        log_msg(pamh, LOG_WARNING, "No entropy for an event ID, %s event not reported", ev->type);
+        return;
+    }
+    if (gethostname(host, sizeof(host)) != 0) {
+        host[0] = '\0';
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    ev->id = id;
+    ev->time = ya_now_sec();
+    ev->host = host;
+    ev->service = pam_item_string(pamh, PAM_SERVICE);
+    ev->user = pam_item_string(pamh, PAM_USER);
+    ev->rhost = pam_item_string(pamh, PAM_RHOST);
+    ev->tty = pam_item_string(pamh, PAM_TTY);
+    int len = ya_event_format(ev, event, sizeof(event));
+    if (len < 0) {
+        log_msg(pamh, LOG_WARNING, "The %s event is too large, not reported", ev->type);
+        return;
+    }
+
+    if (args->broker_socket && send_event_to_broker(args->broker_socket, event, (size_t)len) == 0) {
+        log_msg(pamh, LOG_DEBUG, "The %s event %s was queued with the broker", ev->type, id);
+        return;
+    }
+    if (args->spool_path && ya_spool_append(args->spool_path, event, (size_t)len) == 0) {
+        log_msg(pamh, LOG_DEBUG, "The %s event %s was spooled to %s", ev->type, id, args->spool_path);
+        return;
+    }
+    log_msg(pamh, LOG_WARNING, "The %s event %s was lost: broker unavailable and spool %s: %s", ev->type, id,
+            args->spool_path ? args->spool_path : "(none)", strerror(errno));
+}
+
+// Function to check an OTP's counter against the shared state. Returns 0,
+// PAM_AUTH_ERR for a replay, or OFFLINE_UNAVAILABLE without usable state.
+static int advance_offline_counter(pam_handle_t *pamh, const struct yubiapp_args *args,
+                                   const struct ya_otp_device *dev, uint32_t counter) {
+    struct ya_otp_counters *counters = ya_otp_counters_open(args->offline_state);
+
+    if (!counters) {
+        log_msg(pamh, LOG_WARNING, "Cannot map offline counter state %s, asking the API", args->offline_state);
+        return OFFLINE_UNAVAILABLE;
+    }
+    int rc = ya_otp_counter_advance(counters, dev->public_id, dev->counter, counter);
+    ya_otp_counters_close(counters);
+
+    if (rc == -2) {
+        log_msg(pamh, LOG_WARNING, "Offline counter state %s is full, asking the API", args->offline_state);
+        return OFFLINE_UNAVAILABLE;
+    }
+    if (rc != 0) {
+        log_msg(pamh, LOG_ERR, "Replayed OTP for offline device %s (counter %u)", dev->public_id, counter);
+        return PAM_AUTH_ERR;
+    }
+    return 0;
+}
+
+// Function to verify the OTP of a self-provisioned key locally, with the
+// AES key and identity from the offline key file. The use is reported to
+// the API afterwards, like a session event. Devices that are not in the
+// file go to the API as usual.
+static int authenticate_offline(pam_handle_t *pamh, const struct yubiapp_args *args, const char *otp) {
+    struct ya_otp_device dev;
+    struct ya_otp_token token;
+    char line[YA_OTP_LINE_MAX];
+    int retval;
+
+    int rc = ya_otp_find(args->offline_keys, otp, &dev, line, sizeof(line));
+    if (rc != 0) {
+        if (rc < 0) {
+            log_msg(pamh, LOG_WARNING, "Offline key file %s is unusable (missing, not root-only, or a "
+                    "malformed entry), asking the API", args->offline_keys);
+        }
+        return OFFLINE_UNAVAILABLE;
+    }
+
+    if (ya_otp_decrypt(otp, dev.aes_key, &token) != 0 ||
+        memcmp(token.private_id, dev.private_id, sizeof(dev.private_id)) != 0) {
+        log_msg(pamh, LOG_ERR, "OTP does not verify with the offline key of device %s", dev.public_id);
+        retval = PAM_AUTH_ERR;
+        goto out;
+    }
+
+    // Consume the OTP before the other checks, as the API does
+    retval = advance_offline_counter(pamh, args, &dev, token.counter);
+    if (retval != 0) {
+        goto out;
+    }
+
+    if (!dev.active) {
+        log_msg(pamh, LOG_ERR, "YubiApp user %s is not active", dev.username ? dev.username : "(unknown)");
+        retval = PAM_AUTH_ERR;
+        goto out;
+    }
+    if (args_permission_list(args)) {
+        unsigned char held[MAX_PERMISSIONS];
+        for (int i = 0; i < args->permission_count; i++) {
+            held[i] = (unsigned char)ya_otp_list_has(dev.permissions, args->permissions[i]);
+        }
+        if (!permission_list_met(args, held, args->permission_count)) {
+            log_msg(pamh, LOG_ERR, "Authentication failed: permission denied: %s (require=%s)",
+                    args->permission, args->require_any ? "any" : "all");
+            retval = PAM_AUTH_ERR;
+            goto out;
+        }
+    } else if (args->permission[0] && !ya_otp_list_has(dev.permissions, args->permission)) {
+        log_msg(pamh, LOG_ERR, "Authentication failed: permission denied: %s", args->permission);
+        retval = PAM_AUTH_ERR;
+        goto out;
+    }
+
+    struct auth_response r = {
+        .authenticated = 1,
+        .has_user = 1,
+        .active = dev.active,
+        .user_id = dev.user_id,
+        .first_name = dev.first_name,
+        .last_name = dev.last_name,
+        .email = dev.email,
+        .username = dev.username,
+        .device_id = dev.device_id,
+        .device_type = "yubikey",
+        .device_identifier = dev.public_id,
+    };
+    char *save = NULL;
+    for (char *role = dev.roles ? strtok_r(dev.roles, ",", &save) : NULL; role && r.role_count < MAX_ROLES;
+         role = strtok_r(NULL, ",", &save)) {
+        r.roles[r.role_count++] = role;
+    }
+    log_msg(pamh, LOG_DEBUG, "OTP verified offline for device %s (counter %u)", dev.public_id, token.counter);
+    retval = apply_auth_response(pamh, &r);
+
+    // Reported even with noevents: it is how the API and other hosts learn
+    // that the OTP has been used
+    if (retval == PAM_SUCCESS) {
+        struct ya_session_event ev = {
+            .type = "auth",
+            .user_id = dev.user_id,
+            .device_id = dev.device_id,
+            .permission = args->permission[0] ? args->permission : NULL,
+            .counter = token.counter,
+        };
+        report_event(pamh, args, &ev);
+    }
+
+out:
+    memset(&dev.aes_key, 0, sizeof(dev.aes_key));
+    memset(line, 0, sizeof(line));
+    return retval;
+}
+
+// Function to authenticate with a stored grant instead of an OTP. A grant
+// only stands in for a user re-authenticating from their own session: the
+// calling process must run as that (non-root) user, as sudo does, so a
+// grant never admits a new remote login. A permission list needs a grant
+// for each permission (require=all) or for one (require=any). Returns
+// GRANT_UNAVAILABLE when the user has to present an OTP.
+static int authenticate_with_grant(pam_handle_t *pamh, const struct yubiapp_args *args) {
+    unsigned char key[32];
+    unsigned char token[YA_GRANT_MAX_SIZE];
+    struct ya_grant g;
+    struct passwd pw, *found = NULL;
+    char pwbuf[16384];
+    char host[256];
+    const char *user = pam_item_string(pamh, PAM_USER);
+    const char *audience = args_grant_audience(args, host);
+    uint64_t now = ya_now_sec();
+    int have_key = 0, usable = 0;
+
+    if (!user || !audience || geteuid() != 0 || getpwnam_r(user, &pw, pwbuf, sizeof(pwbuf), &found) != 0 ||
+        !found || found->pw_uid == 0 || found->pw_uid != getuid() || args->permission_count < 1) {
+        return GRANT_UNAVAILABLE;
+    }
+
+    // token and g are left holding the last usable grant
+    for (int i = 0; i < args->permission_count && !(usable && args->require_any); i++) {
+        int len = ya_grant_load(args->grant_dir, user, args->permissions[i], token, sizeof(token));
+        if (len >= 0 && !have_key) {
+            if (ya_grant_load_key(args->grant_key, key) != 0) {
+                log_msg(pamh, LOG_WARNING, "Grant key %s is unusable (missing, not root-owned, or malformed)",
+                        args->grant_key);
+                return GRANT_UNAVAILABLE;
+            }
+            have_key = 1;
+        }
+        if (len >= 0 && ya_grant_verify(key, token, (size_t)len) == 0 && ya_grant_parse(token, (size_t)len, &g) == 0 &&
+            ya_grant_usable(&g, audience, user, args->permissions[i], now)) {
+            usable = 1;
+        } else if (!args->require_any) {
+            usable = 0;
+            break;
+        }
+    }
+    if (!usable) {
+        if (have_key) {
+            log_msg(pamh, LOG_DEBUG, "Stored grant for %s has expired or does not apply, asking for an OTP", user);
+        }
+        return GRANT_UNAVAILABLE;
+    }
+
+    struct auth_response r = {
+        .authenticated = 1,
+        .has_user = 1,
+        .active = 1,
+        .user_id = g.user_id ? format_uuid(g.user_id, 16, r.user_id_buf) : NULL,
+        .first_name = g.first_name,
+        .last_name = g.last_name,
+        .email = g.email,
+        .username = g.username,
+        .device_id = g.device_id ? format_uuid(g.device_id, 16, r.device_id_buf) : NULL,
+        .device_type = g.device_type,
+        .device_identifier = g.device_identifier,
+    };
+    for (int i = 0; i < g.role_count && r.role_count < MAX_ROLES; i++) {
+        r.roles[r.role_count++] = g.roles[i];
+    }
+    log_msg(pamh, LOG_INFO, "YubiApp authentication of %s by grant (expires in %llu s)", user,
+            (unsigned long long)(g.expires - now));
+    int retval = apply_auth_response(pamh, &r);
+
+    if (retval == PAM_SUCCESS && args->events && r.device_id) {
+        struct ya_session_event ev = {
+            .type = "grant",
+            .user_id = r.user_id,
+            .device_id = r.device_id,
+            .permission = args->permission[0] ? args->permission : NULL,
+        };
+        report_event(pamh, args, &ev);
+    }
+    return retval;
+}
+
+// Function to record an OTP in the shared replay filter. Returns 1 if this
+// host has seen it before; without usable filter state every OTP passes.
+static int check_replay(const struct yubiapp_args *args, const char *otp) {
+    struct ya_replay_state *replay = ya_replay_open(args->replay_path);
+    int seen = ya_replay_check(replay, otp, ya_now_sec(), args->replay_window);
+
+    ya_replay_close(replay);
+    return seen;
+}
+
+// Function to take a token for one attempt from the bucket named
+// prefix + value (value_len bytes). Returns 0 if the limit is exceeded.
+static int take_limit(struct login_limits *limits, char *name, size_t cap, const char *prefix,
+                      const char *value, size_t value_len, const struct ya_rate_limit *limit) {
+    char key[sizeof(limits->rhost)];
+
+    snprintf(key, sizeof(key), "%s%.*s", prefix, (int)value_len, value);
+    if (!ya_rate_take(limits->state, key, limit, ya_monotonic_us() / 1000)) {
+        return 0;
+    }
+    snprintf(name, cap, "%s", key);
+    return 1;
+}
+
+// Function to give back the tokens of a successful login
+static void refund_limits(const struct yubiapp_args *args, struct login_limits *limits) {
+    uint64_t now_ms = ya_monotonic_us() / 1000;
+
+    if (limits->rhost[0]) {
+        ya_rate_refund(limits->state, limits->rhost, &args->rhost_limit, now_ms);
+    }
+    if (limits->device[0]) {
+        ya_rate_refund(limits->state, limits->device, &args->device_limit, now_ms);
+    }
+}
+
+// Function to classify a login's PAM result for the outcome counters
+static enum ya_metrics_outcome login_outcome(int retval, const struct login_metrics *metrics) {
+    if (retval == PAM_SUCCESS) {
+        return YA_OUTCOME_SUCCESS;
+    }
+    if (retval == PAM_AUTH_ERR) {
+        return YA_OUTCOME_AUTH_ERR;
+    }
+    return metrics->timed_out ? YA_OUTCOME_TIMEOUT : YA_OUTCOME_SYSTEM_ERR;
+}
+
 // PAM authentication function
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
     char *otp = NULL;  // Changed from const char* to char* for pam_prompt
-    const char *permission = "yubiapp:authenticate";  // Default permission
+    struct yubiapp_args args;
+    struct ya_endpoints endpoints;
+    struct warmup warm;
+    struct ya_cache cache;
+    struct ya_cache *client_cache = NULL;
+    struct ya_log log;
+    struct login_metrics metrics = {NULL, 0};
+    struct login_limits limits = {NULL, "", ""};
+    const char *rhost;
+    uint64_t started_us;
+    char otp_id[32];
+    CURL *curl = NULL;
+    int use_broker;
+    int builtin;
+    int first = 0;
+    const char *permission;
     int retval = PAM_AUTH_ERR;
 
     (void)flags;  // Suppress unused parameter warning
 
-    // Parse module arguments
-    for (int i = 0; i < argc; i++) {
-        if (strncmp(argv[i], "permission=", 11) == 0) {
-            permission = argv[i] + 11;
-        }
+    parse_args(&args, argc, argv);
+
+    log_begin(pamh, &log, &args, "auth");
+
+    // A failed re-authentication must not leave an earlier success behind
+    pam_set_data(pamh, RESULT_DATA, NULL, NULL);
+
+    if (ya_endpoints_parse(&endpoints, args.urls) < 0) {
+        log_msg(pamh, LOG_ERR, "Invalid url= list (at most %d URLs)", YA_MAX_ENDPOINTS);
+        retval = PAM_SERVICE_ERR;
+        goto cleanup;
+    }
+    if (args.max_response < YUBIAPP_MIN_RESPONSE_SIZE || args.max_response > YUBIAPP_RESPONSE_LIMIT) {
+        log_msg(pamh, LOG_ERR, "Invalid max_response= (%d to %d bytes)",
+                YUBIAPP_MIN_RESPONSE_SIZE, YUBIAPP_RESPONSE_LIMIT);
+        retval = PAM_SERVICE_ERR;
+        goto cleanup;
+    }
+    endpoints.breaker.threshold = args.cb_threshold;
+    endpoints.breaker.cooldown_us = (uint64_t)args.cb_cooldown * 1000000ULL;
+    if (args.timeout_min == 0 || args.timeout_min > args.timeout_max || args.timeout_factor == 0 ||
+        args.retries < 0 || args.retries > YA_MAX_RETRIES) {
+        log_msg(pamh, LOG_ERR, "Invalid timeout_min=, timeout_max=, timeout_factor= or retries= "
+                "(0 < min <= max, factor >= 1, at most %d retries)", YA_MAX_RETRIES);
+        retval = PAM_SERVICE_ERR;
+        goto cleanup;
+    }
+    endpoints.deadline.min_us = (uint64_t)args.timeout_min * 1000;
+    endpoints.deadline.max_us = (uint64_t)args.timeout_max * 1000;
+    endpoints.deadline.factor = args.timeout_factor;
+    if (args.permission_count < 0) {
+        log_msg(pamh, LOG_ERR, "Invalid permission= list (at most %d permissions, no empty entries, "
+                "%d bytes)", MAX_PERMISSIONS, MAX_PERMISSION_LIST - 1);
+        retval = PAM_SERVICE_ERR;
+        goto cleanup;
+    }
+    permission = args.permission;
+
+    log_msg(pamh, LOG_DEBUG, "YubiApp PAM module starting authentication with permission: %s", permission);
+
+    metrics.state = ya_metrics_open(args.metrics_path);
+
+    // A stored grant answers a repeated check without an OTP
+    if (args.grant_key && authenticate_with_grant(pamh, &args) == PAM_SUCCESS) {
+        ya_metrics_outcome(metrics.state, YA_OUTCOME_GRANT);
+        retval = PAM_SUCCESS;
+        goto cleanup;
     }
 
-    pam_syslog(pamh, LOG_INFO, "YubiApp PAM module starting authentication with permission: %s", permission);
+    // A source over its limit fails before the user is asked for an OTP
+    limits.state = ya_rate_open(args.ratelimit_path);
+    rhost = pam_item_string(pamh, PAM_RHOST);
+    if (rhost && rhost[0] &&
+        !take_limit(&limits, limits.rhost, sizeof(limits.rhost), "rhost:", rhost, strlen(rhost), &args.rhost_limit)) {
+        log_msg(pamh, LOG_ERR, "Too many authentication attempts from %s", rhost);
+        ya_metrics_outcome(metrics.state, YA_OUTCOME_LIMITED);
+        retval = PAM_MAXTRIES;
+        goto cleanup;
+    }
+
+    // Without a broker, start connecting to the API while the user taps the
+    // key. Local endpoints are reached with the built-in client: there is
+    // nothing worth warming up or caching, and libcurl is never loaded.
+    use_broker = broker_present(args.broker_socket);
+    builtin = !args.curl && endpoints_local(&endpoints, args.api_socket);
+    if (!use_broker) {
+        ya_endpoints_open(&endpoints, args.state_path);
+
+        // Known-bad backend: fail before the user is asked to tap the key
+        first = ya_endpoints_first_available(&endpoints);
+        if (first < 0) {
+            log_msg(pamh, LOG_ERR, "YubiApp API unavailable (circuit breaker open), failing fast");
+            ya_metrics_outcome(metrics.state, YA_OUTCOME_SYSTEM_ERR);
+            retval = PAM_AUTHINFO_UNAVAIL;
+            goto cleanup;
+        }
+    }
+    if (!use_broker && !builtin && args.cache_path) {
+        if (ya_cache_open(&cache, args.cache_path, ya_pool_share()) == 0) {
+            client_cache = &cache;
+        } else {
+            log_msg(pamh, LOG_WARNING, "Failed to set up client cache %s", args.cache_path);
+        }
+    }
+    memset(&warm, 0, sizeof(warm));
+    if (!use_broker && !builtin && args.warmup) {
+        warmup_start(pamh, &warm, &endpoints, &endpoints.list[first], args.api_socket, client_cache);
+    }
 
     // Get OTP from user
     retval = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &otp, "Yubikey OTP: ");
+    curl = warmup_finish(pamh, &warm);
     if (retval != PAM_SUCCESS || !otp) {
-        pam_syslog(pamh, LOG_ERR, "Failed to get OTP from user");
-        return PAM_AUTH_ERR;
+        log_msg(pamh, LOG_ERR, "Failed to get OTP from user");
+        retval = PAM_AUTH_ERR;
+        goto cleanup;
     }
 
-    // Validate OTP format (basic check)
-    if (strlen(otp) < 12) {
-        pam_syslog(pamh, LOG_ERR, "Invalid OTP format (too short)");
-        return PAM_AUTH_ERR;
+    // Garbage and replays are refused here, before any network I/O
+    if (!ya_otp_well_formed(otp)) {
+        log_msg(pamh, LOG_ERR, "Invalid OTP format (expected %d modhex characters)", YA_OTP_LENGTH);
+        ya_metrics_outcome(metrics.state, YA_OUTCOME_REJECTED);
+        retval = PAM_AUTH_ERR;
+        goto cleanup;
+    }
+    if (!take_limit(&limits, limits.device, sizeof(limits.device), "device:", otp, 12, &args.device_limit)) {
+        ya_log_otp_id(otp, otp_id, sizeof(otp_id));
+        log_msg(pamh, LOG_ERR, "Too many authentication attempts for device %s", otp_id);
+        ya_metrics_outcome(metrics.state, YA_OUTCOME_LIMITED);
+        retval = PAM_MAXTRIES;
+        goto cleanup;
+    }
+    if (check_replay(&args, otp)) {
+        ya_log_otp_id(otp, otp_id, sizeof(otp_id));
+        log_msg(pamh, LOG_ERR, "Replayed OTP refused (device %s)", otp_id);
+        ya_metrics_outcome(metrics.state, YA_OUTCOME_REJECTED);
+        retval = PAM_AUTH_ERR;
+        goto cleanup;
     }
 
-    // Authenticate with YubiApp API
-    retval = authenticate_with_yubiapp(pamh, otp, permission);
+    // Authenticate through the broker when it is running, otherwise directly
+    // Self-provisioned keys in the offline key file are verified locally
+    started_us = ya_monotonic_us();
+    retval = args.offline_keys ? authenticate_offline(pamh, &args, otp) : OFFLINE_UNAVAILABLE;
+    if (retval == OFFLINE_UNAVAILABLE) {
+        retval = BROKER_UNAVAILABLE;
+        if (use_broker) {
+            retval = authenticate_via_broker(pamh, &args, &metrics, otp);
+        }
+        if (retval == BROKER_UNAVAILABLE) {
+            if (use_broker) {
+                ya_endpoints_open(&endpoints, args.state_path);
+            }
+            if (builtin) {
+                retval = authenticate_with_http(pamh, &args, &endpoints, &metrics, otp);
+            } else {
+                retval = authenticate_with_yubiapp(pamh, &args, &endpoints, curl, client_cache, &metrics, otp);
+                curl = NULL;
+            }
+        }
+    }
+    ya_metrics_login(metrics.state, login_outcome(retval, &metrics), ya_monotonic_us() - started_us);
+    if (retval == PAM_SUCCESS) {
+        refund_limits(&args, &limits);
+    }
 
+    // Failures are always logged, successes only when sampled
+    ya_log_otp_id(otp, otp_id, sizeof(otp_id));
     if (retval == PAM_SUCCESS) {
-        pam_syslog(pamh, LOG_INFO, "YubiApp authentication successful");
+        if (log_sampled(args.log_sample)) {
+            log_msg(pamh, LOG_INFO, "YubiApp authentication successful (device %s)", otp_id);
+        }
     } else {
-        pam_syslog(pamh, LOG_ERR, "YubiApp authentication failed");
+        log_msg(pamh, LOG_ERR, "YubiApp authentication failed (device %s)", otp_id);
     }
 
+cleanup:
+    if (curl) {
+        ya_pool_put(curl);
+    }
+    if (client_cache) {
+        ya_cache_close(client_cache);
+    }
+    ya_endpoints_close(&endpoints);
+    ya_metrics_close(metrics.state);
+    ya_rate_close(limits.state);
+    log_end(pamh, &log);
     return retval;
 }
 
-// PAM account management function
+// Function to check whether the result carries one of a comma-separated
+// list of roles
+static int has_any_role(const struct auth_result *res, const char *roles) {
+    const char *p = roles;
+
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        for (int i = 0; len > 0 && i < res->role_count; i++) {
+            if (strlen(res->roles[i]) == len && memcmp(res->roles[i], p, len) == 0) {
+                return 1;
+            }
+        }
+        if (!end) {
+            break;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+// Function to apply the account checks to a saved authentication result.
+// Everything needed came with the authentication, so nothing is sent.
+static int check_account(pam_handle_t *pamh, const struct yubiapp_args *args, const struct auth_result *res) {
+    const char *username = res->username ? res->username : "(unknown)";
+    uint64_t age_us = ya_monotonic_us() - res->authenticated_us;
+
+    if (args->max_age && age_us > (uint64_t)args->max_age * 1000000ULL) {
+        log_msg(pamh, LOG_ERR, "YubiApp authentication for %s is %llu s old (max_age=%u)",
+                username, (unsigned long long)(age_us / 1000000), args->max_age);
+        return PAM_AUTH_ERR;
+    }
+
+    if (res->active == 0) {
+        log_msg(pamh, LOG_ERR, "YubiApp user %s is not active", username);
+        return PAM_ACCT_EXPIRED;
+    }
+
+    if (args->match_user) {
+        const char *user = NULL;
+        if (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || !user || !res->username ||
+            strcmp(user, res->username) != 0) {
+            log_msg(pamh, LOG_ERR, "Login user %s is not YubiApp user %s", user ? user : "(unknown)", username);
+            return PAM_PERM_DENIED;
+        }
+    }
+
+    if (args->roles && !has_any_role(res, args->roles)) {
+        log_msg(pamh, LOG_ERR, "YubiApp user %s has none of the roles %s", username, args->roles);
+        return PAM_PERM_DENIED;
+    }
+
+    log_msg(pamh, LOG_DEBUG, "YubiApp account checks passed for %s", username);
+    return PAM_SUCCESS;
+}
+
+// PAM account management function. Uses the result pam_sm_authenticate
+// saved in this handle; without one (the user authenticated some other
+// way) the module has nothing to say and is ignored.
 PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv) {
-    (void)pamh;   // Suppress unused parameter warning
+    struct yubiapp_args args;
+    struct ya_log log;
+    int retval;
+
     (void)flags;  // Suppress unused parameter warning
-    (void)argc;   // Suppress unused parameter warning
-    (void)argv;   // Suppress unused parameter warning
+
+    parse_args(&args, argc, argv);
+    log_begin(pamh, &log, &args, "account");
+
+    const struct auth_result *res = get_auth_result(pamh);
+    if (!res) {
+        log_msg(pamh, LOG_DEBUG, "No YubiApp authentication in this PAM handle, ignoring");
+        retval = PAM_IGNORE;
+    } else {
+        retval = check_account(pamh, &args, res);
+    }
+
+    log_end(pamh, &log);
+    return retval;
+}
+
+// Function to log a session event with the identity from authentication
+// and report it to the sessions API
+static int session_event(pam_handle_t *pamh, int argc, const char **argv, const char *event,
+                         const char *type) {
+    struct yubiapp_args args;
+    struct ya_log log;
+
+    parse_args(&args, argc, argv);
+    log_begin(pamh, &log, &args, "session");
+
+    const struct auth_result *res = get_auth_result(pamh);
+    if (res) {
+        log_msg(pamh, LOG_INFO, "Session %s for YubiApp user %s (device %s)", event,
+                res->username ? res->username : "(unknown)",
+                res->device_identifier ? res->device_identifier : "(unknown)");
+        // The API keys events by device; without one there is nothing to record
+        if (args.events && res->device_id) {
+            struct ya_session_event ev = {
+                .type = type,
+                .session = session_id(pamh, strcmp(type, "open") == 0),
+                .user_id = res->user_id,
+                .device_id = res->device_id,
+            };
+            report_event(pamh, &args, &ev);
+        }
+    }
+
+    log_end(pamh, &log);
     return PAM_SUCCESS;
 }
 
 // PAM session management functions
 PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
-    (void)pamh;   // Suppress unused parameter warning
     (void)flags;  // Suppress unused parameter warning
-    (void)argc;   // Suppress unused parameter warning
-    (void)argv;   // Suppress unused parameter warning
-    return PAM_SUCCESS;
+    return session_event(pamh, argc, argv, "opened", "open");
 }
 
 PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
-    (void)pamh;   // Suppress unused parameter warning
     (void)flags;  // Suppress unused parameter warning
-    (void)argc;   // Suppress unused parameter warning
-    (void)argv;   // Suppress unused parameter warning
-    return PAM_SUCCESS;
+    return session_event(pamh, argc, argv, "closed", "close");
 }
 
 // PAM password management function
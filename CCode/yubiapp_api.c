@@ -0,0 +1,110 @@
+/*
+ * yubiapp_api.c - Helpers for talking to the YubiApp HTTP API with libcurl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yubiapp_api.h"
+
+int ya_arena_init(struct ya_arena *arena, size_t cap) {
+    arena->base = malloc(cap);
+    arena->cap = arena->base ? cap : 0;
+    arena->used = 0;
+    return arena->base ? 0 : -1;
+}
+
+void *ya_arena_alloc(struct ya_arena *arena, size_t len) {
+    size_t start = (arena->used + 15) & ~(size_t)15;
+
+    if (!arena->base || start > arena->cap || len > arena->cap - start) {
+        return NULL;
+    }
+    arena->used = start + len;
+    return arena->base + start;
+}
+
+void ya_arena_free(struct ya_arena *arena) {
+    free(arena->base);
+    memset(arena, 0, sizeof(*arena));
+}
+
+void ya_buffer_init(struct MemoryStruct *chunk, char *memory, size_t capacity) {
+    chunk->memory = memory;
+    chunk->size = 0;
+    chunk->capacity = memory ? capacity : 0;
+    chunk->overflow = 0;
+    if (memory) {
+        memory[0] = '\0';
+    }
+}
+
+// Callback function for libcurl to write response data
+size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+
+    if (!mem->memory || realsize > mem->capacity - mem->size) {
+        mem->overflow = 1;
+        return 0;
+    }
+
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size] = 0;
+
+    return realsize;
+}
+
+// Build the JSON request - use the format expected by the Go API
+int ya_api_build_request(char *buf, size_t len, const char *otp, const char *permission, const char *permissions,
+                         const char *grant_audience, const char *grant_permissions) {
+    int n = snprintf(buf, len, "{\"device_type\":\"yubikey\",\"auth_code\":\"%s\"", otp);
+
+    if (n >= 0 && (size_t)n < len && permission && strlen(permission) > 0) {
+        n += snprintf(buf + n, len - (size_t)n, ",\"permission\":\"%s\"", permission);
+    }
+    if (n >= 0 && (size_t)n < len && permissions && permissions[0]) {
+        n += snprintf(buf + n, len - (size_t)n, ",\"permissions\":\"%s\"", permissions);
+    }
+    if (n >= 0 && (size_t)n < len && grant_audience && grant_audience[0]) {
+        n += snprintf(buf + n, len - (size_t)n, ",\"grant_audience\":\"%s\"", grant_audience);
+    }
+    if (n >= 0 && (size_t)n < len && grant_audience && grant_audience[0] && grant_permissions && grant_permissions[0]) {
+        n += snprintf(buf + n, len - (size_t)n, ",\"grant_permissions\":\"%s\"", grant_permissions);
+    }
+    if (n >= 0 && (size_t)n < len) {
+        n += snprintf(buf + n, len - (size_t)n, "}");
+    }
+
+    if (n < 0 || (size_t)n >= len) {
+        return -1;
+    }
+    return n;
+}
+
+// Set up curl options shared by the module and the broker
+void ya_api_setup(CURL *curl, const char *url, const char *json_request, const char *accept,
+                  struct MemoryStruct *chunk, struct curl_slist **headers) {
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_request);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)chunk);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, YUBIAPP_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, YUBIAPP_CONNECT_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    // Refuse oversized responses up front when the length is announced
+    curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)chunk->capacity);
+
+    // Set headers
+    if (!*headers) {
+        *headers = curl_slist_append(*headers, "Content-Type: application/json");
+        if (accept && *headers) {
+            char line[256];
+            snprintf(line, sizeof(line), "Accept: %s", accept);
+            *headers = curl_slist_append(*headers, line);
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+}
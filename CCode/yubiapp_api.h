@@ -0,0 +1,67 @@
+/*
+ * yubiapp_api.h - Helpers for talking to the YubiApp HTTP API with libcurl
+ *
+ * Shared by the PAM module (direct path) and the yubiappd broker so both
+ * build the same request and collect the response the same way.
+ */
+
+#ifndef YUBIAPP_API_H
+#define YUBIAPP_API_H
+
+#include <stddef.h>
+
+#include "yubiapp_curl.h"
+
+#define YUBIAPP_URL "http://localhost:8080/api/v1/auth/device"
+#define YUBIAPP_CONNECT_TIMEOUT 5L
+#define YUBIAPP_TIMEOUT 10L
+#define YUBIAPP_MAX_REQUEST_SIZE 1024
+#define YUBIAPP_MAX_RESPONSE_SIZE 16384
+#define YUBIAPP_MIN_RESPONSE_SIZE 1024
+#define YUBIAPP_RESPONSE_LIMIT 65000   /* must fit in one broker protocol field */
+
+// Structure to hold response data for libcurl. The buffer has a fixed
+// capacity (plus one byte for a terminating NUL) and is never grown.
+struct MemoryStruct {
+    char *memory;
+    size_t size;
+    size_t capacity;
+    int overflow;   // the response did not fit and the transfer was aborted
+};
+
+// Bump allocator over a single allocation, so a login attempt touches the
+// heap once no matter how many buffers it needs
+struct ya_arena {
+    char *base;
+    size_t cap;
+    size_t used;
+};
+
+int ya_arena_init(struct ya_arena *arena, size_t cap);
+void *ya_arena_alloc(struct ya_arena *arena, size_t len);
+void ya_arena_free(struct ya_arena *arena);
+
+// Point chunk at a buffer of capacity + 1 bytes (NULL if allocation failed)
+void ya_buffer_init(struct MemoryStruct *chunk, char *memory, size_t capacity);
+
+// Callback function for libcurl to write response data. Returns 0, which
+// aborts the transfer with CURLE_WRITE_ERROR, once the buffer is full.
+size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp);
+
+// Build the JSON body expected by POST /api/v1/auth/device. permission is
+// required by the API; permissions (comma-separated) are only evaluated,
+// and the response says which the user holds. A grant (yubiapp_grant.h) is
+// asked for when grant_audience is set; the API adds those of
+// grant_permissions (comma-separated) the user holds.
+// Returns the body length, or -1 if it does not fit in buf.
+int ya_api_build_request(char *buf, size_t len, const char *otp, const char *permission, const char *permissions,
+                         const char *grant_audience, const char *grant_permissions);
+
+// Apply the options common to every auth request (URL, body, timeouts,
+// headers, sink). accept, if set, is sent as the Accept header. The header
+// list is built on the first call and reused when *headers is already set;
+// the caller frees it after the transfer.
+void ya_api_setup(CURL *curl, const char *url, const char *json_request, const char *accept,
+                  struct MemoryStruct *chunk, struct curl_slist **headers);
+
+#endif /* YUBIAPP_API_H */
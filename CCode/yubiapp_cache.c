@@ -0,0 +1,395 @@
+/*
+ * yubiapp_cache.c - TLS session and DNS cache shared across PAM processes
+ *
+ * File layout: "YAC1" followed by entries of
+ *   kind (1) | pad (1) | key_len (2) | a_len (2) | pad (2) | b_len (4) | expires (8)
+ *   key | a | b
+ * in host byte order (the file never leaves the host). DNS entries carry
+ * "host:port" and the address; TLS entries carry curl's session key, the
+ * salted hash (shmac) and the session data.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yubiapp_cache.h"
+
+#define CACHE_MAGIC "YAC1"
+#define CACHE_MAGIC_LEN 4
+#define TLS_DEFAULT_LIFETIME (24 * 3600)
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define HAVE_SSLS_EXPORT 1
+#endif
+
+enum entry_kind {
+    ENTRY_DNS = 1,
+    ENTRY_TLS = 2,
+};
+
+struct entry_hdr {
+    uint8_t kind;
+    uint8_t pad;
+    uint16_t key_len;
+    uint16_t a_len;
+    uint16_t pad2;
+    uint32_t b_len;
+    int64_t expires;
+};
+
+struct entry {
+    int kind;
+    const char *key;
+    size_t key_len;
+    const unsigned char *a;
+    size_t a_len;
+    const unsigned char *b;
+    size_t b_len;
+    int64_t expires;
+};
+
+// Buffer a new cache file is assembled in before it is written out
+struct writer {
+    unsigned char *buf;
+    size_t len;
+    size_t count;
+};
+
+// Iterate over entries; *pos starts at 0. Returns 1 while entries remain.
+static int next_entry(const unsigned char *data, size_t size, size_t *pos, struct entry *e) {
+    struct entry_hdr hdr;
+
+    if (*pos == 0) {
+        *pos = CACHE_MAGIC_LEN;
+    }
+    if (size < *pos + sizeof(hdr)) {
+        return 0;
+    }
+
+    memcpy(&hdr, data + *pos, sizeof(hdr));
+    size_t need = sizeof(hdr) + hdr.key_len + hdr.a_len + (size_t)hdr.b_len;
+    if (size - *pos < need) {
+        return 0;
+    }
+
+    const unsigned char *p = data + *pos + sizeof(hdr);
+    e->kind = hdr.kind;
+    e->key = (const char *)p;
+    e->key_len = hdr.key_len;
+    e->a = p + hdr.key_len;
+    e->a_len = hdr.a_len;
+    e->b = e->a + hdr.a_len;
+    e->b_len = hdr.b_len;
+    e->expires = hdr.expires;
+    *pos += need;
+    return 1;
+}
+
+static int writer_add(struct writer *w, int kind, const char *key, size_t key_len,
+                      const void *a, size_t a_len, const void *b, size_t b_len, int64_t expires) {
+    struct entry_hdr hdr;
+    size_t need = sizeof(hdr) + key_len + a_len + b_len;
+
+    if (w->count >= YA_CACHE_MAX_ENTRIES || key_len > 0xffff || a_len > 0xffff ||
+        w->len + need > YA_CACHE_MAX_FILE) {
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = (uint8_t)kind;
+    hdr.key_len = (uint16_t)key_len;
+    hdr.a_len = (uint16_t)a_len;
+    hdr.b_len = (uint32_t)b_len;
+    hdr.expires = expires;
+
+    unsigned char *p = w->buf + w->len;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    if (key_len) {
+        memcpy(p, key, key_len);
+    }
+    if (a_len) {
+        memcpy(p + key_len, a, a_len);
+    }
+    if (b_len) {
+        memcpy(p + key_len + a_len, b, b_len);
+    }
+    w->len += need;
+    w->count++;
+    return 0;
+}
+
+static int writer_init(struct writer *w) {
+    w->buf = malloc(YA_CACHE_MAX_FILE);
+    if (!w->buf) {
+        return -1;
+    }
+    memcpy(w->buf, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    w->len = CACHE_MAGIC_LEN;
+    w->count = 0;
+    return 0;
+}
+
+// Replace the cache file atomically: write a private temp file, then rename
+static int writer_commit(struct writer *w, const char *path) {
+    char tmp[4096];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t off = 0;
+    while (off < w->len) {
+        ssize_t n = write(fd, w->buf + off, w->len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        off += (size_t)n;
+    }
+
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the file, refusing anything another user could have written
+static int load_file(struct ya_cache *cache) {
+    struct stat st;
+
+    int fd = open(cache->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 077) != 0 || st.st_size < CACHE_MAGIC_LEN || st.st_size > YA_CACHE_MAX_FILE) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *data = malloc((size_t)st.st_size);
+    if (!data) {
+        close(fd);
+        return -1;
+    }
+
+    ssize_t n = read(fd, data, (size_t)st.st_size);
+    close(fd);
+    if (n != st.st_size || memcmp(data, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0) {
+        free(data);
+        return -1;
+    }
+
+    cache->data = data;
+    cache->size = (size_t)n;
+    return 0;
+}
+
+int ya_cache_open(struct ya_cache *cache, const char *path, CURLSH *share) {
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    if (ya_curl_load() != 0) {
+        return -1;
+    }
+
+    cache->share = share;
+    if (!cache->share) {
+        cache->share = curl_share_init();
+        if (!cache->share) {
+            return -1;
+        }
+        cache->own_share = 1;
+        curl_share_setopt(cache->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(cache->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    if (load_file(cache) != 0) {
+        return 0;
+    }
+
+    // Turn unexpired address entries into CURLOPT_RESOLVE pins
+    time_t now = time(NULL);
+    struct entry e;
+    size_t pos = 0;
+    while (next_entry(cache->data, cache->size, &pos, &e)) {
+        if (e.kind != ENTRY_DNS || e.expires <= now) {
+            continue;
+        }
+        char pin[512];
+        int n = snprintf(pin, sizeof(pin), "%.*s:%.*s", (int)e.key_len, e.key, (int)e.a_len, (const char *)e.a);
+        if (n > 0 && n < (int)sizeof(pin)) {
+            struct curl_slist *list = curl_slist_append(cache->resolve, pin);
+            if (list) {
+                cache->resolve = list;
+            }
+        }
+    }
+    return 0;
+}
+
+void ya_cache_attach(struct ya_cache *cache, CURL *curl) {
+    if (!cache || !cache->share) {
+        return;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, cache->share);
+    if (cache->resolve) {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, cache->resolve);
+    }
+
+#ifdef HAVE_SSLS_EXPORT
+    // Sessions land in the share, so importing once serves every handle
+    if (!cache->imported && cache->data) {
+        time_t now = time(NULL);
+        struct entry e;
+        size_t pos = 0;
+        char key[1024];
+
+        while (next_entry(cache->data, cache->size, &pos, &e)) {
+            if (e.kind != ENTRY_TLS || e.expires <= now || e.key_len >= sizeof(key)) {
+                continue;
+            }
+            memcpy(key, e.key, e.key_len);
+            key[e.key_len] = '\0';
+            curl_easy_ssls_import(curl, e.key_len ? key : NULL, e.a, e.a_len, e.b, e.b_len);
+        }
+    }
+#endif
+    cache->imported = 1;
+}
+
+#ifdef HAVE_SSLS_EXPORT
+static CURLcode export_session(CURL *handle, void *userptr, const char *session_key,
+                               const unsigned char *shmac, size_t shmac_len,
+                               const unsigned char *sdata, size_t sdata_len,
+                               curl_off_t valid_until, int ietf_tls_id,
+                               const char *alpn, size_t earlydata_max) {
+    struct writer *w = (struct writer *)userptr;
+    (void)handle;
+    (void)ietf_tls_id;
+    (void)alpn;
+    (void)earlydata_max;
+
+    int64_t expires = valid_until > 0 ? (int64_t)valid_until : (int64_t)time(NULL) + TLS_DEFAULT_LIFETIME;
+    writer_add(w, ENTRY_TLS, session_key, session_key ? strlen(session_key) : 0,
+               shmac, shmac_len, sdata, sdata_len, expires);
+    return CURLE_OK;
+}
+#endif
+
+// Record the address the transfer actually connected to, keyed by host:port.
+// The key is left in key_out (empty if nothing was recorded).
+static void add_primary_address(struct writer *w, CURL *curl, const char *url, char *key_out, size_t key_out_len) {
+    char *ip = NULL;
+    long port = 0;
+    char *host = NULL;
+
+    key_out[0] = '\0';
+    if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) != CURLE_OK || !ip || !*ip ||
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port) != CURLE_OK || port <= 0) {
+        return;
+    }
+
+    CURLU *u = curl_url();
+    if (!u) {
+        return;
+    }
+    if (curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK && host) {
+        char key[300];
+        char addr[64];
+        int is_v6 = strchr(ip, ':') != NULL;
+
+        // Literal addresses never need resolving
+        if (strcmp(host, ip) != 0 && host[0] != '[' &&
+            snprintf(key, sizeof(key), "%s:%ld", host, port) < (int)sizeof(key) &&
+            snprintf(addr, sizeof(addr), is_v6 ? "[%s]" : "%s", ip) < (int)sizeof(addr)) {
+            writer_add(w, ENTRY_DNS, key, strlen(key), addr, strlen(addr), NULL, 0,
+                       (int64_t)time(NULL) + YA_CACHE_DNS_TTL);
+            snprintf(key_out, key_out_len, "%s", key);
+        }
+        curl_free(host);
+    }
+    curl_url_cleanup(u);
+}
+
+int ya_cache_store(struct ya_cache *cache, CURL *curl, const char *url) {
+    struct writer w;
+
+    if (!cache || !cache->share || writer_init(&w) != 0) {
+        return -1;
+    }
+
+    char key[300];
+    add_primary_address(&w, curl, url, key, sizeof(key));
+
+    // Keep unexpired addresses of the other endpoints
+    if (cache->data) {
+        time_t now = time(NULL);
+        size_t key_len = strlen(key);
+        struct entry e;
+        size_t pos = 0;
+        while (next_entry(cache->data, cache->size, &pos, &e)) {
+            if (e.kind == ENTRY_DNS && e.expires > now &&
+                !(e.key_len == key_len && memcmp(e.key, key, key_len) == 0)) {
+                writer_add(&w, e.kind, e.key, e.key_len, e.a, e.a_len, e.b, e.b_len, e.expires);
+            }
+        }
+    }
+#ifdef HAVE_SSLS_EXPORT
+    curl_easy_ssls_export(curl, export_session, &w);
+#endif
+
+    int rc = writer_commit(&w, cache->path);
+    free(w.buf);
+    return rc;
+}
+
+int ya_cache_forget_dns(struct ya_cache *cache) {
+    struct writer w;
+
+    if (!cache || !cache->data || writer_init(&w) != 0) {
+        return -1;
+    }
+
+    struct entry e;
+    size_t pos = 0;
+    while (next_entry(cache->data, cache->size, &pos, &e)) {
+        if (e.kind != ENTRY_DNS) {
+            writer_add(&w, e.kind, e.key, e.key_len, e.a, e.a_len, e.b, e.b_len, e.expires);
+        }
+    }
+
+    int rc = writer_commit(&w, cache->path);
+    free(w.buf);
+    return rc;
+}
+
+void ya_cache_close(struct ya_cache *cache) {
+    if (cache->own_share) {
+        curl_share_cleanup(cache->share);
+    }
+    curl_slist_free_all(cache->resolve);
+    free(cache->data);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,53 @@
+/*
+ * yubiapp_cache.h - TLS session and DNS cache shared across PAM processes
+ *
+ * libcurl's session and DNS caches die with the process, and sshd forks a
+ * new process for every login. This cache persists both in a small file
+ * (best placed on tmpfs, e.g. /run/yubiapp/client.cache) that every forked
+ * process loads into a curl share before connecting and rewrites after a
+ * successful transfer. Writers replace the file atomically with rename(),
+ * so concurrent processes always see a complete snapshot without locking.
+ *
+ * TLS session export/import needs libcurl 8.12 or newer
+ * (curl_easy_ssls_export); with older versions only addresses are cached.
+ */
+
+#ifndef YUBIAPP_CACHE_H
+#define YUBIAPP_CACHE_H
+
+#include "yubiapp_curl.h"
+
+#define YA_CACHE_DNS_TTL 60
+#define YA_CACHE_MAX_FILE 65536
+#define YA_CACHE_MAX_ENTRIES 32
+
+struct ya_cache {
+    const char *path;
+    CURLSH *share;
+    int own_share;               // share created (and cleaned up) by the cache
+    struct curl_slist *resolve;  // "host:port:addr" entries for CURLOPT_RESOLVE
+    unsigned char *data;         // file contents as loaded
+    size_t size;
+    int imported;                // TLS sessions already imported into the share
+};
+
+// Load the file into share (which must share DNS and TLS sessions), or into
+// a share of its own if share is NULL. Returns 0 on success; an unreadable
+// or untrusted file is ignored (the cache starts empty).
+int ya_cache_open(struct ya_cache *cache, const char *path, CURLSH *share);
+
+// Attach the share and cached addresses to a handle. Call again after
+// curl_easy_reset().
+void ya_cache_attach(struct ya_cache *cache, CURL *curl);
+
+// Save the handle's TLS sessions and resolved address after a transfer.
+// Returns 0 on success.
+int ya_cache_store(struct ya_cache *cache, CURL *curl, const char *url);
+
+// Drop cached addresses (e.g. after a connect failure) so the next process
+// resolves the API host again.
+int ya_cache_forget_dns(struct ya_cache *cache);
+
+void ya_cache_close(struct ya_cache *cache);
+
+#endif /* YUBIAPP_CACHE_H */
@@ -0,0 +1,74 @@
+/*
+ * yubiapp_curl.c - libcurl loaded on first use
+ *
+ * The library is loaded RTLD_LOCAL, so its symbols never interpose on the
+ * host's, and it is never unloaded: libcurl and its TLS backend register
+ * process-wide state that does not survive dlclose().
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "yubiapp_curl.h"
+
+struct ya_curl_api ya_curl;
+
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+static int loaded;
+static char load_error[256];
+
+#define RESOLVE(field, name)                                                        \
+    if (!(*(void **)&ya_curl.field = dlsym(lib, name))) {                            \
+        snprintf(load_error, sizeof(load_error), "%s has no %s", YA_CURL_LIBRARY, name); \
+        return;                                                                     \
+    }
+
+static void load(void) {
+    void *lib = dlopen(YA_CURL_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        snprintf(load_error, sizeof(load_error), "%s", dlerror());
+        return;
+    }
+
+    RESOLVE(global_init, "curl_global_init");
+    RESOLVE(global_cleanup, "curl_global_cleanup");
+    RESOLVE(easy_init, "curl_easy_init");
+    RESOLVE(easy_cleanup, "curl_easy_cleanup");
+    RESOLVE(easy_reset, "curl_easy_reset");
+    RESOLVE(easy_setopt, "curl_easy_setopt");
+    RESOLVE(easy_getinfo, "curl_easy_getinfo");
+    RESOLVE(easy_perform, "curl_easy_perform");
+    RESOLVE(easy_strerror, "curl_easy_strerror");
+    RESOLVE(multi_init, "curl_multi_init");
+    RESOLVE(multi_cleanup, "curl_multi_cleanup");
+    RESOLVE(multi_add_handle, "curl_multi_add_handle");
+    RESOLVE(multi_remove_handle, "curl_multi_remove_handle");
+    RESOLVE(multi_perform, "curl_multi_perform");
+    RESOLVE(multi_info_read, "curl_multi_info_read");
+    RESOLVE(multi_poll, "curl_multi_poll");
+    RESOLVE(share_init, "curl_share_init");
+    RESOLVE(share_setopt, "curl_share_setopt");
+    RESOLVE(share_cleanup, "curl_share_cleanup");
+    RESOLVE(slist_append, "curl_slist_append");
+    RESOLVE(slist_free_all, "curl_slist_free_all");
+    RESOLVE(url, "curl_url");
+    RESOLVE(url_cleanup, "curl_url_cleanup");
+    RESOLVE(url_set, "curl_url_set");
+    RESOLVE(url_get, "curl_url_get");
+    RESOLVE(free, "curl_free");
+#ifdef YA_CURL_HAVE_SSLS
+    *(void **)&ya_curl.easy_ssls_import = dlsym(lib, "curl_easy_ssls_import");
+    *(void **)&ya_curl.easy_ssls_export = dlsym(lib, "curl_easy_ssls_export");
+#endif
+    loaded = 1;
+}
+
+int ya_curl_load(void) {
+    pthread_once(&load_once, load);
+    return loaded ? 0 : -1;
+}
+
+const char *ya_curl_error(void) {
+    return load_error;
+}
@@ -0,0 +1,132 @@
+/*
+ * yubiapp_curl.h - libcurl, linked or loaded on first use
+ *
+ * sshd loads the module into the process of every connection, including
+ * the many that never reach our PAM line, and a module linked against
+ * libcurl drags it and its TLS and resolver libraries in at load time:
+ * relocations on every fork and a larger resident set per connection. The
+ * module is therefore built with YA_CURL_LAZY and not linked against
+ * libcurl. Its curl_* calls go through a table that ya_curl_load() fills
+ * with dlopen() the first time a transfer needs libcurl, which logins
+ * through the broker or to a local API (yubiapp_http.h) never do.
+ *
+ * Include this header instead of <curl/curl.h>. With YA_CURL_LAZY it maps
+ * the functions the module uses onto the table, so the calling code is the
+ * same in both builds; without it (yubiappd) it is <curl/curl.h> and
+ * ya_curl_load() always succeeds.
+ */
+
+#ifndef YUBIAPP_CURL_H
+#define YUBIAPP_CURL_H
+
+#ifdef YA_CURL_LAZY
+
+// curl.h's type-checking wrappers are macros named like the functions and
+// would hide the table
+#define CURL_DISABLE_TYPECHECK 1
+#include <curl/curl.h>
+
+#ifndef YA_CURL_LIBRARY
+#define YA_CURL_LIBRARY "libcurl.so.4"
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define YA_CURL_HAVE_SSLS 1
+#endif
+
+struct ya_curl_api {
+    __typeof__(curl_global_init) *global_init;
+    __typeof__(curl_global_cleanup) *global_cleanup;
+    __typeof__(curl_easy_init) *easy_init;
+    __typeof__(curl_easy_cleanup) *easy_cleanup;
+    __typeof__(curl_easy_reset) *easy_reset;
+    __typeof__(curl_easy_setopt) *easy_setopt;
+    __typeof__(curl_easy_getinfo) *easy_getinfo;
+    __typeof__(curl_easy_perform) *easy_perform;
+    __typeof__(curl_easy_strerror) *easy_strerror;
+    __typeof__(curl_multi_init) *multi_init;
+    __typeof__(curl_multi_cleanup) *multi_cleanup;
+    __typeof__(curl_multi_add_handle) *multi_add_handle;
+    __typeof__(curl_multi_remove_handle) *multi_remove_handle;
+    __typeof__(curl_multi_perform) *multi_perform;
+    __typeof__(curl_multi_info_read) *multi_info_read;
+    __typeof__(curl_multi_poll) *multi_poll;
+    __typeof__(curl_share_init) *share_init;
+    __typeof__(curl_share_setopt) *share_setopt;
+    __typeof__(curl_share_cleanup) *share_cleanup;
+    __typeof__(curl_slist_append) *slist_append;
+    __typeof__(curl_slist_free_all) *slist_free_all;
+    __typeof__(curl_url) *url;
+    __typeof__(curl_url_cleanup) *url_cleanup;
+    __typeof__(curl_url_set) *url_set;
+    __typeof__(curl_url_get) *url_get;
+    __typeof__(curl_free) *free;
+#ifdef YA_CURL_HAVE_SSLS
+    // Optional: NULL when the installed libcurl is older than the headers
+    __typeof__(curl_easy_ssls_import) *easy_ssls_import;
+    __typeof__(curl_easy_ssls_export) *easy_ssls_export;
+#endif
+};
+
+extern struct ya_curl_api ya_curl;
+
+// Load libcurl and resolve the table, once per process. Returns 0 if it is
+// usable; no curl_* function may be called before that.
+int ya_curl_load(void);
+
+// Why ya_curl_load() failed, for logging
+const char *ya_curl_error(void);
+
+// curl.h wraps these in same-named macros that only check the arity
+#undef curl_easy_setopt
+#undef curl_easy_getinfo
+#undef curl_share_setopt
+
+#define curl_global_init ya_curl.global_init
+#define curl_global_cleanup ya_curl.global_cleanup
+#define curl_easy_init ya_curl.easy_init
+#define curl_easy_cleanup ya_curl.easy_cleanup
+#define curl_easy_reset ya_curl.easy_reset
+#define curl_easy_setopt ya_curl.easy_setopt
+#define curl_easy_getinfo ya_curl.easy_getinfo
+#define curl_easy_perform ya_curl.easy_perform
+#define curl_easy_strerror ya_curl.easy_strerror
+#define curl_multi_init ya_curl.multi_init
+#define curl_multi_cleanup ya_curl.multi_cleanup
+#define curl_multi_add_handle ya_curl.multi_add_handle
+#define curl_multi_remove_handle ya_curl.multi_remove_handle
+#define curl_multi_perform ya_curl.multi_perform
+#define curl_multi_info_read ya_curl.multi_info_read
+#define curl_multi_poll ya_curl.multi_poll
+#define curl_share_init ya_curl.share_init
+#define curl_share_setopt ya_curl.share_setopt
+#define curl_share_cleanup ya_curl.share_cleanup
+#define curl_slist_append ya_curl.slist_append
+#define curl_slist_free_all ya_curl.slist_free_all
+#define curl_url ya_curl.url
+#define curl_url_cleanup ya_curl.url_cleanup
+#define curl_url_set ya_curl.url_set
+#define curl_url_get ya_curl.url_get
+#define curl_free ya_curl.free
+#ifdef YA_CURL_HAVE_SSLS
+#define curl_easy_ssls_import(...) \
+    (ya_curl.easy_ssls_import ? ya_curl.easy_ssls_import(__VA_ARGS__) : CURLE_NOT_BUILT_IN)
+#define curl_easy_ssls_export(...) \
+    (ya_curl.easy_ssls_export ? ya_curl.easy_ssls_export(__VA_ARGS__) : CURLE_NOT_BUILT_IN)
+#endif
+
+#else /* !YA_CURL_LAZY */
+
+#include <curl/curl.h>
+
+static inline int ya_curl_load(void) {
+    return 0;
+}
+
+static inline const char *ya_curl_error(void) {
+    return "";
+}
+
+#endif /* YA_CURL_LAZY */
+
+#endif /* YUBIAPP_CURL_H */
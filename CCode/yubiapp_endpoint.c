@@ -0,0 +1,353 @@
+/*
+ * yubiapp_endpoint.c - API endpoint list with shared latency statistics
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "yubiapp_endpoint.h"
+
+#define ENDPOINT_MAGIC 0x59414550  /* "YAEP" */
+#define ENDPOINT_VERSION 1
+
+int ya_endpoints_parse(struct ya_endpoints *eps, const char *urls) {
+    memset(eps, 0, sizeof(*eps));
+    eps->breaker.threshold = YA_BREAKER_THRESHOLD;
+    eps->breaker.cooldown_us = (uint64_t)YA_BREAKER_COOLDOWN_SEC * 1000000ULL;
+    eps->deadline.min_us = (uint64_t)YA_TIMEOUT_MIN_MS * 1000;
+    eps->deadline.max_us = (uint64_t)YA_TIMEOUT_MAX_MS * 1000;
+    eps->deadline.factor = YA_TIMEOUT_FACTOR;
+
+    const char *p = urls;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len > 0) {
+            if (eps->count == YA_MAX_ENDPOINTS || len >= sizeof(eps->list[0].url)) {
+                return -1;
+            }
+            memcpy(eps->list[eps->count].url, p, len);
+            eps->list[eps->count].url[len] = '\0';
+            eps->order[eps->count] = eps->count;
+            eps->count++;
+        }
+
+        if (!end) {
+            break;
+        }
+        p = end + 1;
+    }
+
+    return eps->count > 0 ? eps->count : -1;
+}
+
+// Find the slot index for a URL, claiming a free one if needed
+static int find_slot(struct ya_endpoint_state *state, const char *url) {
+    uint64_t hash = ya_hash(url, strlen(url));
+
+    for (int i = 0; i < YA_ENDPOINT_SLOTS; i++) {
+        struct ya_endpoint_slot *slot = &state->slots[i];
+        uint64_t cur = __atomic_load_n(&slot->url_hash, __ATOMIC_ACQUIRE);
+        if (cur == hash) {
+            return i;
+        }
+        if (cur == 0) {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&slot->url_hash, &expected, hash, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == hash) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Ranking score: unknown endpoints score 0 so they get tried and measured
+static uint64_t endpoint_score(const struct ya_endpoint *ep) {
+    return ya_endpoint_p95_us(ep);
+}
+
+void ya_endpoints_open(struct ya_endpoints *eps, const char *state_path) {
+    if (state_path) {
+        eps->state = ya_shm_map(state_path, sizeof(struct ya_endpoint_state), ENDPOINT_MAGIC, ENDPOINT_VERSION);
+    }
+
+    if (eps->state) {
+        for (int i = 0; i < eps->count; i++) {
+            int idx = find_slot(eps->state, eps->list[i].url);
+            if (idx >= 0) {
+                eps->list[i].slot = &eps->state->slots[idx];
+                eps->list[i].breaker = &eps->state->breakers[idx];
+                eps->list[i].connect = &eps->state->connects[idx];
+            }
+        }
+    }
+
+    // Insertion sort by score; stable, so configuration order breaks ties
+    for (int i = 1; i < eps->count; i++) {
+        int idx = eps->order[i];
+        uint64_t score = endpoint_score(&eps->list[idx]);
+        int j = i - 1;
+        while (j >= 0 && endpoint_score(&eps->list[eps->order[j]]) > score) {
+            eps->order[j + 1] = eps->order[j];
+            j--;
+        }
+        eps->order[j + 1] = idx;
+    }
+}
+
+void ya_endpoints_close(struct ya_endpoints *eps) {
+    ya_shm_unmap(eps->state, sizeof(struct ya_endpoint_state));
+    eps->state = NULL;
+    for (int i = 0; i < eps->count; i++) {
+        eps->list[i].slot = NULL;
+        eps->list[i].breaker = NULL;
+        eps->list[i].connect = NULL;
+    }
+}
+
+// Apply new = old + (sample - old) / 2^shift with a CAS loop
+static uint64_t ewma_update(uint64_t *field, uint64_t sample, int shift, int first) {
+    uint64_t old = __atomic_load_n(field, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        if (first) {
+            next = sample;
+        } else if (sample >= old) {
+            next = old + ((sample - old) >> shift);
+        } else {
+            next = old - ((old - sample) >> shift);
+        }
+    } while (!__atomic_compare_exchange_n(field, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return old;
+}
+
+// Same gains as TCP's RTT estimator: 1/8 for the mean, 1/4 for the deviation
+void ya_endpoint_record(struct ya_endpoint *ep, uint64_t latency_us) {
+    struct ya_endpoint_slot *slot = ep->slot;
+    if (!slot) {
+        return;
+    }
+
+    int first = __atomic_fetch_add(&slot->samples, 1, __ATOMIC_RELAXED) == 0;
+    uint64_t mean = ewma_update(&slot->ewma_us, latency_us, 3, first);
+    uint64_t err = first ? latency_us / 2 : (latency_us > mean ? latency_us - mean : mean - latency_us);
+    ewma_update(&slot->dev_us, err, 2, first);
+    __atomic_store_n(&slot->updated, ya_now_sec(), __ATOMIC_RELAXED);
+}
+
+void ya_endpoint_record_connect(struct ya_endpoint *ep, uint64_t connect_us) {
+    struct ya_endpoint_connect *c = ep->connect;
+    if (!c) {
+        return;
+    }
+
+    int first = __atomic_fetch_add(&c->samples, 1, __ATOMIC_RELAXED) == 0;
+    uint64_t mean = ewma_update(&c->ewma_us, connect_us, 3, first);
+    uint64_t err = first ? connect_us / 2 : (connect_us > mean ? connect_us - mean : mean - connect_us);
+    ewma_update(&c->dev_us, err, 2, first);
+}
+
+uint64_t ya_endpoint_p95_us(const struct ya_endpoint *ep) {
+    if (!ep->slot || __atomic_load_n(&ep->slot->samples, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    return __atomic_load_n(&ep->slot->ewma_us, __ATOMIC_RELAXED) +
+           2 * __atomic_load_n(&ep->slot->dev_us, __ATOMIC_RELAXED);
+}
+
+// Clamp factor * (mean + 4 * deviation) into [min_us, max_us]; max_us
+// without samples
+static uint64_t deadline_us(uint64_t samples, uint64_t ewma, uint64_t dev, unsigned int factor,
+                            uint64_t min_us, uint64_t max_us) {
+    if (samples == 0) {
+        return max_us;
+    }
+    uint64_t us = (ewma + 4 * dev) * factor;
+    if (us < min_us) {
+        us = min_us;
+    }
+    return us < max_us ? us : max_us;
+}
+
+void ya_endpoint_deadlines(const struct ya_endpoints *eps, const struct ya_endpoint *ep,
+                           uint64_t *connect_us, uint64_t *total_us) {
+    const struct ya_deadline_config *cfg = &eps->deadline;
+    uint64_t connect_max = YA_CONNECT_TIMEOUT_MAX_US;
+
+    *total_us = cfg->max_us;
+    if (ep->slot) {
+        *total_us = deadline_us(__atomic_load_n(&ep->slot->samples, __ATOMIC_RELAXED),
+                                __atomic_load_n(&ep->slot->ewma_us, __ATOMIC_RELAXED),
+                                __atomic_load_n(&ep->slot->dev_us, __ATOMIC_RELAXED),
+                                cfg->factor, cfg->min_us, cfg->max_us);
+    }
+
+    if (connect_max > *total_us) {
+        connect_max = *total_us;
+    }
+    *connect_us = connect_max;
+    if (ep->connect) {
+        *connect_us = deadline_us(__atomic_load_n(&ep->connect->samples, __ATOMIC_RELAXED),
+                                  __atomic_load_n(&ep->connect->ewma_us, __ATOMIC_RELAXED),
+                                  __atomic_load_n(&ep->connect->dev_us, __ATOMIC_RELAXED),
+                                  cfg->factor, YA_CONNECT_TIMEOUT_MIN_US, connect_max);
+    }
+}
+
+uint64_t ya_endpoint_hedge_delay_us(const struct ya_endpoint *ep, uint64_t max_us) {
+    uint64_t delay = ya_endpoint_p95_us(ep);
+
+    if (delay == 0) {
+        delay = YA_HEDGE_DEFAULT_US;
+    }
+    if (delay < YA_HEDGE_MIN_US) {
+        delay = YA_HEDGE_MIN_US;
+    }
+    if (delay > max_us) {
+        delay = max_us;
+    }
+    return delay;
+}
+
+// Decide whether ep accepts a request (see ya_endpoint_allow); only with
+// claim set can the half-open probe be taken
+static int breaker_check(const struct ya_endpoints *eps, struct ya_breaker *b, int claim) {
+    if (!b || eps->breaker.threshold == 0) {
+        return 1;
+    }
+
+    uint64_t now = ya_monotonic_us();
+    uint32_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+
+    if (state == YA_BREAKER_CLOSED) {
+        return 1;
+    }
+
+    if (state == YA_BREAKER_OPEN) {
+        if (now - __atomic_load_n(&b->opened_us, __ATOMIC_RELAXED) < eps->breaker.cooldown_us) {
+            return 0;
+        }
+        if (!claim) {
+            return 1;
+        }
+        // Only the process that wins the transition sends the probe
+        uint32_t expected = YA_BREAKER_OPEN;
+        __atomic_store_n(&b->probe_us, now, __ATOMIC_RELAXED);
+        return __atomic_compare_exchange_n(&b->state, &expected, YA_BREAKER_HALF_OPEN, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? 2 : 0;
+    }
+
+    // Half-open: a probe is in flight; take it over only if it went silent
+    uint64_t probe = __atomic_load_n(&b->probe_us, __ATOMIC_RELAXED);
+    if (now - probe < YA_BREAKER_PROBE_TIMEOUT_US) {
+        return 0;
+    }
+    if (!claim) {
+        return 1;
+    }
+    return __atomic_compare_exchange_n(&b->probe_us, &probe, now, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? 2 : 0;
+}
+
+int ya_endpoint_allow(const struct ya_endpoints *eps, struct ya_endpoint *ep) {
+    return breaker_check(eps, ep->breaker, 1);
+}
+
+int ya_endpoints_first_available(const struct ya_endpoints *eps) {
+    for (int i = 0; i < eps->count; i++) {
+        if (breaker_check(eps, eps->list[eps->order[i]].breaker, 0)) {
+            return eps->order[i];
+        }
+    }
+    return -1;
+}
+
+void ya_endpoint_success(struct ya_endpoint *ep) {
+    struct ya_breaker *b = ep->breaker;
+    if (!b) {
+        return;
+    }
+
+    __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&b->state, __ATOMIC_ACQUIRE) != YA_BREAKER_CLOSED) {
+        __atomic_store_n(&b->state, YA_BREAKER_CLOSED, __ATOMIC_RELEASE);
+    }
+}
+
+void ya_endpoint_failure(const struct ya_endpoints *eps, struct ya_endpoint *ep) {
+    struct ya_breaker *b = ep->breaker;
+    if (!b || eps->breaker.threshold == 0) {
+        return;
+    }
+
+    uint64_t now = ya_monotonic_us();
+    uint32_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+
+    // A failed probe re-opens the breaker for another cooldown
+    if (state == YA_BREAKER_HALF_OPEN) {
+        __atomic_store_n(&b->opened_us, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->state, YA_BREAKER_OPEN, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint32_t failures = __atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED);
+    if (state == YA_BREAKER_CLOSED && failures >= eps->breaker.threshold) {
+        uint32_t expected = YA_BREAKER_CLOSED;
+        __atomic_store_n(&b->opened_us, now, __ATOMIC_RELAXED);
+        __atomic_compare_exchange_n(&b->state, &expected, YA_BREAKER_OPEN, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+}
+
+void ya_endpoint_release_probe(struct ya_endpoint *ep) {
+    struct ya_breaker *b = ep->breaker;
+    if (!b) {
+        return;
+    }
+
+    // Back to open with the old timestamp, so the next login probes again
+    uint32_t expected = YA_BREAKER_HALF_OPEN;
+    __atomic_compare_exchange_n(&b->state, &expected, YA_BREAKER_OPEN, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void ya_retry_earn(struct ya_endpoints *eps) {
+    if (!eps->state) {
+        return;
+    }
+
+    uint64_t *spent = &eps->state->retry.spent;
+    uint64_t old = __atomic_load_n(spent, __ATOMIC_RELAXED);
+    while (old > 0 && !__atomic_compare_exchange_n(spent, &old, old > YA_RETRY_RATIO ? old - YA_RETRY_RATIO : 0,
+                                                   1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+int ya_retry_take(struct ya_endpoints *eps) {
+    if (!eps->state) {
+        return 1;   /* only the per-login limit applies */
+    }
+
+    uint64_t *spent = &eps->state->retry.spent;
+    uint64_t old = __atomic_load_n(spent, __ATOMIC_RELAXED);
+    do {
+        if (old + 100 > (uint64_t)YA_RETRY_BURST * 100) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(spent, &old, old + 100, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+uint64_t ya_retry_backoff_us(int retry) {
+    uint64_t d = YA_RETRY_BACKOFF_US << (retry < 8 ? retry : 8);
+    uint64_t x = ya_monotonic_us() ^ ((uint64_t)getpid() << 32);
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return d / 2 + x % (d / 2 + 1);
+}
@@ -0,0 +1,179 @@
+/*
+ * yubiapp_endpoint.h - API endpoint list with shared latency statistics
+ *
+ * Every completed (or abandoned) request feeds a per-endpoint EWMA of
+ * latency and of its mean deviation, kept in a shared state file so that
+ * short-lived sshd children learn from each other. Endpoints are ranked by
+ * their estimated p95 (mean + 2 * deviation), which also sets the deadline
+ * after which a hedged request goes to the next-best endpoint.
+ *
+ * The same estimators, with a p99 of mean + 4 * deviation (TCP's RTO), set
+ * each request's deadlines: `factor` times the p99 of the whole request and
+ * of connecting, clamped between a floor and a ceiling, so a dead endpoint
+ * is given up on in about the time a healthy one would have answered
+ * rather than after the ceiling.
+ *
+ * Each endpoint also has a circuit breaker in the same file. After
+ * `threshold` consecutive failures it opens and requests fail fast; once
+ * `cooldown` has passed exactly one process is let through as a probe
+ * (half-open), and its outcome closes or re-opens the breaker.
+ *
+ * A request that was never sent (the connection was refused or timed out)
+ * may be retried after a jittered backoff, since the OTP was not used. The
+ * retries come out of a budget shared by every process, earned at
+ * YA_RETRY_RATIO per 100 logins, so an outage cannot multiply the load
+ * on the API.
+ */
+
+#ifndef YUBIAPP_ENDPOINT_H
+#define YUBIAPP_ENDPOINT_H
+
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_MAX_ENDPOINTS 4
+#define YA_ENDPOINT_SLOTS 16
+#define YA_ENDPOINT_STATE YA_STATE_DIR "/endpoints"
+
+#define YA_HEDGE_MIN_US 20000ULL        /* never hedge sooner than 20 ms */
+#define YA_HEDGE_DEFAULT_US 250000ULL   /* deadline before any samples exist */
+
+#define YA_TIMEOUT_MIN_MS 2000          /* floor of a request's deadline */
+#define YA_TIMEOUT_MAX_MS 10000         /* ceiling, and the deadline before any samples */
+#define YA_TIMEOUT_FACTOR 3             /* deadline = factor * estimated p99 */
+#define YA_CONNECT_TIMEOUT_MIN_US 250000ULL
+#define YA_CONNECT_TIMEOUT_MAX_US 5000000ULL
+
+#define YA_RETRIES 2                    /* retries per login */
+#define YA_MAX_RETRIES 4
+#define YA_RETRY_BACKOFF_US 25000ULL    /* before the first retry, doubling after */
+#define YA_RETRY_RATIO 10               /* retries earned per 100 logins */
+#define YA_RETRY_BURST 10               /* retries the shared budget holds */
+
+#define YA_BREAKER_THRESHOLD 5
+#define YA_BREAKER_COOLDOWN_SEC 30
+#define YA_BREAKER_PROBE_TIMEOUT_US 30000000ULL  /* reclaim a probe that never reported */
+
+struct ya_endpoint_slot {
+    uint64_t url_hash;     /* 0 = free slot */
+    uint64_t ewma_us;      /* smoothed latency */
+    uint64_t dev_us;       /* smoothed mean deviation */
+    uint64_t samples;
+    uint64_t updated;      /* unix seconds of last sample */
+};
+
+enum ya_breaker_state {
+    YA_BREAKER_CLOSED = 0,
+    YA_BREAKER_OPEN = 1,
+    YA_BREAKER_HALF_OPEN = 2,
+};
+
+struct ya_breaker {
+    uint32_t state;
+    uint32_t failures;      /* consecutive failures while closed */
+    uint64_t opened_us;     /* CLOCK_MONOTONIC, system-wide on Linux */
+    uint64_t probe_us;      /* when the current half-open probe started */
+};
+
+// Connect time of new connections, estimated like the slot's latency
+struct ya_endpoint_connect {
+    uint64_t ewma_us;
+    uint64_t dev_us;
+    uint64_t samples;
+};
+
+// Retries used, in hundredths; 0 is a full budget, so a fresh file has one
+struct ya_retry_budget {
+    uint64_t spent;
+};
+
+// New parts follow the old so that files from before they existed only
+// need to grow (new space is zero: closed breakers, no connect samples, a
+// full retry budget)
+struct ya_endpoint_state {
+    struct ya_shm_header hdr;
+    struct ya_endpoint_slot slots[YA_ENDPOINT_SLOTS];
+    struct ya_breaker breakers[YA_ENDPOINT_SLOTS];
+    struct ya_endpoint_connect connects[YA_ENDPOINT_SLOTS];
+    struct ya_retry_budget retry;
+};
+
+struct ya_endpoint {
+    char url[512];
+    struct ya_endpoint_slot *slot;  /* NULL without shared state */
+    struct ya_breaker *breaker;
+    struct ya_endpoint_connect *connect;
+};
+
+struct ya_breaker_config {
+    unsigned int threshold;         /* 0 disables the breaker */
+    uint64_t cooldown_us;
+};
+
+struct ya_deadline_config {
+    uint64_t min_us;
+    uint64_t max_us;
+    unsigned int factor;
+};
+
+struct ya_endpoints {
+    struct ya_endpoint list[YA_MAX_ENDPOINTS];
+    int count;
+    int order[YA_MAX_ENDPOINTS];    /* indexes into list, best first */
+    struct ya_endpoint_state *state;
+    struct ya_breaker_config breaker;
+    struct ya_deadline_config deadline;
+};
+
+// Parse a comma-separated URL list. Returns the number of endpoints, or a
+// negative value if the list is empty, too long or a URL does not fit.
+int ya_endpoints_parse(struct ya_endpoints *eps, const char *urls);
+
+// Map the shared state file (optional) and rank the endpoints
+void ya_endpoints_open(struct ya_endpoints *eps, const char *state_path);
+void ya_endpoints_close(struct ya_endpoints *eps);
+
+// Record a latency sample; failures should pass the time they cost
+void ya_endpoint_record(struct ya_endpoint *ep, uint64_t latency_us);
+
+// Record how long a new connection took to set up
+void ya_endpoint_record_connect(struct ya_endpoint *ep, uint64_t connect_us);
+
+// Estimated p95 latency, or 0 if there are no samples yet
+uint64_t ya_endpoint_p95_us(const struct ya_endpoint *ep);
+
+// Deadlines for a request to ep, from the start of the request: to be
+// connected, and to have the whole answer
+void ya_endpoint_deadlines(const struct ya_endpoints *eps, const struct ya_endpoint *ep,
+                           uint64_t *connect_us, uint64_t *total_us);
+
+// How long to wait on ep before sending a hedged request, capped at max_us
+uint64_t ya_endpoint_hedge_delay_us(const struct ya_endpoint *ep, uint64_t max_us);
+
+// Whether a request may go to ep now: 0 if its breaker is open, 1 if
+// allowed, 2 if the caller has claimed the half-open probe. Call it only
+// when the request is really sent.
+int ya_endpoint_allow(const struct ya_endpoints *eps, struct ya_endpoint *ep);
+
+// Index in eps->list of the best endpoint that would currently accept a
+// request, or -1 if every breaker is open. Claims nothing.
+int ya_endpoints_first_available(const struct ya_endpoints *eps);
+
+// Report the outcome of a request for the breaker
+void ya_endpoint_success(struct ya_endpoint *ep);
+void ya_endpoint_failure(const struct ya_endpoints *eps, struct ya_endpoint *ep);
+
+// Give back a claimed probe whose request was abandoned without an outcome
+void ya_endpoint_release_probe(struct ya_endpoint *ep);
+
+// Credit the shared retry budget for one login, and take one retry out
+// of it (returns 1 if the retry may go)
+void ya_retry_earn(struct ya_endpoints *eps);
+int ya_retry_take(struct ya_endpoints *eps);
+
+// Jittered exponential backoff before the retry'th retry (from 0): uniform
+// in [d / 2, d] for d = YA_RETRY_BACKOFF_US * 2^retry
+uint64_t ya_retry_backoff_us(int retry);
+
+#endif /* YUBIAPP_ENDPOINT_H */
@@ -0,0 +1,169 @@
+/*
+ * yubiapp_events.c - Session open/close events for the YubiApp sessions API
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "yubiapp_events.h"
+
+int ya_event_uuid(char out[37]) {
+    unsigned char b[16];
+
+    if (getrandom(b, sizeof(b), GRND_NONBLOCK) != (ssize_t)sizeof(b)) {
+        return -1;
+    }
+    b[6] = (unsigned char)((b[6] & 0x0f) | 0x40);  /* version 4 */
+    b[8] = (unsigned char)((b[8] & 0x3f) | 0x80);  /* RFC 4122 variant */
+    snprintf(out, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+             b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+    return 0;
+}
+
+struct output {
+    char *buf;
+    size_t cap;
+    size_t len;
+    int overflow;
+};
+
+static void put_char(struct output *out, char c) {
+    if (out->len + 1 >= out->cap) {
+        out->overflow = 1;
+        return;
+    }
+    out->buf[out->len++] = c;
+}
+
+static void put_raw(struct output *out, const char *s) {
+    while (*s && !out->overflow) {
+        put_char(out, *s++);
+    }
+}
+
+// "name":"value", with the value escaped; names and rhost or tty values
+// come from the PAM application, so nothing is trusted
+static void put_string(struct output *out, const char *name, const char *value) {
+    static const char hex[] = "0123456789abcdef";
+
+    put_raw(out, out->len > 1 ? ",\"" : "\"");
+    put_raw(out, name);
+    put_raw(out, "\":\"");
+    for (const unsigned char *p = (const unsigned char *)(value ? value : ""); *p && !out->overflow; p++) {
+        if (*p == '"' || *p == '\\') {
+            put_char(out, '\\');
+            put_char(out, (char)*p);
+        } else if (*p < 0x20 || *p == 0x7f) {
+            put_raw(out, "\\u00");
+            put_char(out, hex[*p >> 4]);
+            put_char(out, hex[*p & 0x0f]);
+        } else {
+            put_char(out, (char)*p);
+        }
+    }
+    put_char(out, '"');
+}
+
+int ya_event_format(const struct ya_session_event *ev, char *buf, size_t cap) {
+    struct output out = {buf, cap, 0, cap == 0};
+    char number[24];
+
+    put_char(&out, '{');
+    put_string(&out, "id", ev->id);
+    put_string(&out, "type", ev->type);
+    snprintf(number, sizeof(number), ",\"time\":%llu", (unsigned long long)ev->time);
+    put_raw(&out, number);
+    put_string(&out, "session", ev->session);
+    put_string(&out, "host", ev->host);
+    put_string(&out, "service", ev->service);
+    put_string(&out, "user", ev->user);
+    put_string(&out, "rhost", ev->rhost);
+    put_string(&out, "tty", ev->tty);
+    // Optional UUIDs are left out rather than sent empty
+    if (ev->user_id && ev->user_id[0]) {
+        put_string(&out, "user_id", ev->user_id);
+    }
+    put_string(&out, "device_id", ev->device_id);
+    if (ev->permission) {
+        put_string(&out, "permission", ev->permission);
+    }
+    if (ev->counter) {
+        snprintf(number, sizeof(number), ",\"counter\":%u", (unsigned int)ev->counter);
+        put_raw(&out, number);
+    }
+    put_char(&out, '}');
+
+    if (out.overflow) {
+        return -1;
+    }
+    buf[out.len] = '\0';
+    return (int)out.len;
+}
+
+int ya_event_valid(const char *data, size_t len) {
+    return len >= 2 && len <= YA_EVENT_MAX_SIZE && data[0] == '{' && data[len - 1] == '}' &&
+           !memchr(data, '\n', len) && !memchr(data, '\0', len);
+}
+
+// Open the spool with the same ownership rules as the shared state files:
+// a regular file owned by us with no group/other access
+static int open_checked(const char *path, int flags) {
+    struct stat st;
+
+    int fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 077) != 0) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
+}
+
+int ya_spool_append(const char *path, const char *event, size_t len) {
+    char dir[PATH_MAX];
+    struct stat st;
+
+    if (strlen(path) < sizeof(dir)) {
+        strcpy(dir, path);
+        mkdir(dirname(dir), 0700);
+    }
+
+    int fd = open_checked(path, O_WRONLY | O_APPEND | O_CREAT);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size + len + 1 > YA_SPOOL_MAX_SIZE) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+
+    // One write per event, so concurrent appenders never interleave lines
+    struct iovec iov[2] = {{(void *)event, len}, {"\n", 1}};
+    ssize_t n = writev(fd, iov, 2);
+    int err = errno;
+    close(fd);
+    if (n != (ssize_t)(len + 1)) {
+        errno = n < 0 ? err : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int ya_spool_open(const char *path) {
+    return open_checked(path, O_RDONLY);
+}
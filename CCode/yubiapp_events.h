@@ -0,0 +1,65 @@
+/*
+ * yubiapp_events.h - Session open/close events for the YubiApp sessions API
+ *
+ * pam_yubiapp reports each session it opens or closes without waiting for
+ * the API: the event is handed to yubiappd in one non-blocking write and
+ * the PAM call returns. The broker batches events to
+ * POST /api/v1/auth/session-events. Events that cannot be delivered right
+ * away (no broker, API down) are appended to a bounded spool file that the
+ * broker sends once the API is reachable again.
+ *
+ * An event travels as one JSON object, the same text the API receives as
+ * an element of "events"; the spool holds one object per line. Every event
+ * carries a random UUID, so the API can drop an event that is sent twice.
+ */
+
+#ifndef YUBIAPP_EVENTS_H
+#define YUBIAPP_EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YA_SPOOL_PATH "/var/spool/yubiapp/session-events"
+#define YA_SPOOL_MAX_SIZE (1024 * 1024)  /* events past this are dropped */
+#define YA_EVENT_MAX_SIZE 2048           /* one formatted event */
+
+// One session event; NULL strings are sent as empty. Offline
+// authentications (yubiapp_otp.h) are reported the same way, as "auth"
+// events carrying the OTP counter so the API can refuse a replay, and
+// authentications by a stored grant (yubiapp_grant.h) as "grant" events.
+struct ya_session_event {
+    const char *id;          /* event UUID */
+    const char *type;        /* "open", "close", "auth" or "grant" */
+    uint64_t time;           /* Unix time */
+    const char *session;     /* UUID shared by a session's open and close */
+    const char *host;
+    const char *service;
+    const char *user;
+    const char *rhost;
+    const char *tty;
+    const char *user_id;
+    const char *device_id;
+    const char *permission;  /* auth, grant: the permission checked */
+    uint32_t counter;        /* auth: OTP counter; 0 (and permission NULL) are left out */
+};
+
+// Generate a random (version 4) UUID. Returns 0, or -1 without entropy.
+int ya_event_uuid(char out[37]);
+
+// Format an event as a single-line JSON object. Returns the length, or -1
+// if it does not fit in cap.
+int ya_event_format(const struct ya_session_event *ev, char *buf, size_t cap);
+
+// Check that data looks like one formatted event: a single-line object
+int ya_event_valid(const char *data, size_t len);
+
+// Append one event to the spool, creating it (and its directory) if
+// needed. Returns -1 with errno set if the event could not be stored,
+// EFBIG when the spool is full.
+int ya_spool_append(const char *path, const char *event, size_t len);
+
+// Open the spool for reading, checked like ya_spool_append checks it.
+// Returns a file descriptor or -1.
+int ya_spool_open(const char *path);
+
+#endif /* YUBIAPP_EVENTS_H */
@@ -0,0 +1,811 @@
+/*
+ * yubiapp_grant.c - Short-lived signed authorization grants
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "yubiapp_grant.h"
+#include "yubiapp_wire.h"
+
+#define PEM_BEGIN "-----BEGIN PUBLIC KEY-----"
+#define PEM_END "-----END PUBLIC KEY-----"
+#define KEY_FILE_MAX 1024
+
+// DER prefix of an Ed25519 SubjectPublicKeyInfo; the raw key follows
+static const unsigned char spki_prefix[12] = {
+    0x30, 0x2a, 0x30, 0x05, 0x06, 0x03, 0x2b, 0x65, 0x70, 0x03, 0x21, 0x00,
+};
+
+/* SHA-512 (FIPS 180-4) */
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+struct sha512 {
+    uint64_t h[8];
+    unsigned char block[128];
+    size_t fill;
+    uint64_t total;
+};
+
+static uint64_t ror64(uint64_t x, int n) {
+    return (x >> n) | (x << (64 - n));
+}
+
+static uint64_t load64_be(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void sha512_block(struct sha512 *s, const unsigned char *p) {
+    uint64_t w[80], v[8];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = load64_be(p + 8 * i);
+    }
+    for (int i = 16; i < 80; i++) {
+        uint64_t s0 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, s->h, sizeof(v));
+    for (int i = 0; i < 80; i++) {
+        uint64_t t1 = v[7] + (ror64(v[4], 14) ^ ror64(v[4], 18) ^ ror64(v[4], 41)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha512_k[i] + w[i];
+        uint64_t t2 = (ror64(v[0], 28) ^ ror64(v[0], 34) ^ ror64(v[0], 39)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        s->h[i] += v[i];
+    }
+}
+
+static void sha512_init(struct sha512 *s) {
+    static const uint64_t iv[8] = {
+        0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+        0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->fill = 0;
+    s->total = 0;
+}
+
+static void sha512_update(struct sha512 *s, const unsigned char *p, size_t len) {
+    s->total += len;
+    while (len > 0) {
+        size_t n = sizeof(s->block) - s->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(s->block + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        len -= n;
+        if (s->fill == sizeof(s->block)) {
+            sha512_block(s, s->block);
+            s->fill = 0;
+        }
+    }
+}
+
+static void sha512_final(struct sha512 *s, unsigned char out[64]) {
+    uint64_t bits = s->total * 8;
+    unsigned char pad = 0x80;
+
+    sha512_update(s, &pad, 1);
+    pad = 0;
+    while (s->fill != 112) {
+        sha512_update(s, &pad, 1);
+    }
+    // The length is 128 bits; messages here never need the high half
+    memset(s->block + 112, 0, 8);
+    for (int i = 0; i < 8; i++) {
+        s->block[120 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha512_block(s, s->block);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            out[8 * i + j] = (unsigned char)(s->h[i] >> (56 - 8 * j));
+        }
+    }
+}
+
+/*
+ * Ed25519 verification, after TweetNaCl (public domain). Field elements are
+ * 16 limbs of 16 bits; points are extended coordinates (X, Y, Z, T).
+ * Only public data is handled, so nothing here needs to be constant time.
+ */
+
+typedef int64_t gf[16];
+
+static const gf gf0;
+static const gf gf1 = {1};
+static const gf ed_d = {0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+                        0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203};
+static const gf ed_d2 = {0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+                         0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406};
+static const gf ed_x = {0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+                        0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169};
+static const gf ed_y = {0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+                        0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666};
+static const gf sqrt_m1 = {0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+                           0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83};
+
+// The group order, little endian
+static const uint8_t order[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+};
+
+static void fe_copy(gf r, const gf a) {
+    memcpy(r, a, sizeof(gf));
+}
+
+static void fe_carry(gf o) {
+    for (int i = 0; i < 16; i++) {
+        o[i] += (int64_t)1 << 16;
+        int64_t c = o[i] >> 16;
+        if (i < 15) {
+            o[i + 1] += c - 1;
+        } else {
+            o[0] += 38 * (c - 1);
+        }
+        o[i] -= c * 65536;
+    }
+}
+
+// Swap p and q when b is 1
+static void fe_swap(gf p, gf q, int b) {
+    int64_t c = ~(int64_t)(b - 1);
+    for (int i = 0; i < 16; i++) {
+        int64_t t = c & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void fe_pack(uint8_t o[32], const gf n) {
+    gf m, t;
+
+    fe_copy(t, n);
+    fe_carry(t);
+    fe_carry(t);
+    fe_carry(t);
+    for (int j = 0; j < 2; j++) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int b = (int)((m[15] >> 16) & 1);
+        m[14] &= 0xffff;
+        fe_swap(t, m, 1 - b);
+    }
+    for (int i = 0; i < 16; i++) {
+        o[2 * i] = (uint8_t)(t[i] & 0xff);
+        o[2 * i + 1] = (uint8_t)(t[i] >> 8);
+    }
+}
+
+static int fe_differ(const gf a, const gf b) {
+    uint8_t c[32], d[32];
+    fe_pack(c, a);
+    fe_pack(d, b);
+    return memcmp(c, d, 32) != 0;
+}
+
+static int fe_parity(const gf a) {
+    uint8_t d[32];
+    fe_pack(d, a);
+    return d[0] & 1;
+}
+
+static void fe_unpack(gf o, const uint8_t n[32]) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+    }
+    o[15] &= 0x7fff;
+}
+
+static void fe_add(gf o, const gf a, const gf b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+static void fe_sub(gf o, const gf a, const gf b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] - b[i];
+    }
+}
+
+static void fe_mul(gf o, const gf a, const gf b) {
+    int64_t t[31] = {0};
+
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    for (int i = 0; i < 15; i++) {
+        t[i] += 38 * t[i + 16];
+    }
+    for (int i = 0; i < 16; i++) {
+        o[i] = t[i];
+    }
+    fe_carry(o);
+    fe_carry(o);
+}
+
+static void fe_sq(gf o, const gf a) {
+    fe_mul(o, a, a);
+}
+
+static void fe_inv(gf o, const gf in) {
+    gf c;
+    fe_copy(c, in);
+    for (int a = 253; a >= 0; a--) {
+        fe_sq(c, c);
+        if (a != 2 && a != 4) {
+            fe_mul(c, c, in);
+        }
+    }
+    fe_copy(o, c);
+}
+
+// in^((p - 5) / 8)
+static void fe_pow2523(gf o, const gf in) {
+    gf c;
+    fe_copy(c, in);
+    for (int a = 250; a >= 0; a--) {
+        fe_sq(c, c);
+        if (a != 1) {
+            fe_mul(c, c, in);
+        }
+    }
+    fe_copy(o, c);
+}
+
+static void ge_add(gf p[4], gf q[4]) {
+    gf a, b, c, d, t, e, f, g, h;
+
+    fe_sub(a, p[1], p[0]);
+    fe_sub(t, q[1], q[0]);
+    fe_mul(a, a, t);
+    fe_add(b, p[0], p[1]);
+    fe_add(t, q[0], q[1]);
+    fe_mul(b, b, t);
+    fe_mul(c, p[3], q[3]);
+    fe_mul(c, c, ed_d2);
+    fe_mul(d, p[2], q[2]);
+    fe_add(d, d, d);
+    fe_sub(e, b, a);
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+    fe_add(h, b, a);
+
+    fe_mul(p[0], e, f);
+    fe_mul(p[1], h, g);
+    fe_mul(p[2], g, f);
+    fe_mul(p[3], e, h);
+}
+
+static void ge_swap(gf p[4], gf q[4], int b) {
+    for (int i = 0; i < 4; i++) {
+        fe_swap(p[i], q[i], b);
+    }
+}
+
+static void ge_pack(uint8_t r[32], gf p[4]) {
+    gf tx, ty, zi;
+
+    fe_inv(zi, p[2]);
+    fe_mul(tx, p[0], zi);
+    fe_mul(ty, p[1], zi);
+    fe_pack(r, ty);
+    r[31] ^= (uint8_t)(fe_parity(tx) << 7);
+}
+
+// p = s * q; q is clobbered
+static void ge_scalarmult(gf p[4], gf q[4], const uint8_t s[32]) {
+    fe_copy(p[0], gf0);
+    fe_copy(p[1], gf1);
+    fe_copy(p[2], gf1);
+    fe_copy(p[3], gf0);
+    for (int i = 255; i >= 0; i--) {
+        int b = (s[i / 8] >> (i & 7)) & 1;
+        ge_swap(p, q, b);
+        ge_add(q, p);
+        ge_add(p, p);
+        ge_swap(p, q, b);
+    }
+}
+
+static void ge_scalarbase(gf p[4], const uint8_t s[32]) {
+    gf q[4];
+
+    fe_copy(q[0], ed_x);
+    fe_copy(q[1], ed_y);
+    fe_copy(q[2], gf1);
+    fe_mul(q[3], ed_x, ed_y);
+    ge_scalarmult(p, q, s);
+}
+
+// Decode a public key as its negation. Returns -1 if it is not a point.
+static int ge_unpack_neg(gf r[4], const uint8_t p[32]) {
+    gf t, chk, num, den, den2, den4, den6;
+
+    fe_copy(r[2], gf1);
+    fe_unpack(r[1], p);
+    fe_sq(num, r[1]);
+    fe_mul(den, num, ed_d);
+    fe_sub(num, num, r[2]);
+    fe_add(den, r[2], den);
+
+    fe_sq(den2, den);
+    fe_sq(den4, den2);
+    fe_mul(den6, den4, den2);
+    fe_mul(t, den6, num);
+    fe_mul(t, t, den);
+
+    fe_pow2523(t, t);
+    fe_mul(t, t, num);
+    fe_mul(t, t, den);
+    fe_mul(t, t, den);
+    fe_mul(r[0], t, den);
+
+    fe_sq(chk, r[0]);
+    fe_mul(chk, chk, den);
+    if (fe_differ(chk, num)) {
+        fe_mul(r[0], r[0], sqrt_m1);
+    }
+    fe_sq(chk, r[0]);
+    fe_mul(chk, chk, den);
+    if (fe_differ(chk, num)) {
+        return -1;
+    }
+    if (fe_parity(r[0]) == (p[31] >> 7)) {
+        fe_sub(r[0], gf0, r[0]);
+    }
+    fe_mul(r[3], r[0], r[1]);
+    return 0;
+}
+
+// Reduce a 64-byte little-endian number modulo the group order
+static void sc_reduce(uint8_t r[32], const uint8_t in[64]) {
+    int64_t x[64], carry;
+    int i, j;
+
+    for (i = 0; i < 64; i++) {
+        x[i] = in[i];
+    }
+    for (i = 63; i >= 32; --i) {
+        carry = 0;
+        for (j = i - 32; j < i - 12; ++j) {
+            x[j] += carry - 16 * x[i] * order[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+    carry = 0;
+    for (j = 0; j < 32; j++) {
+        x[j] += carry - (x[31] >> 4) * order[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for (j = 0; j < 32; j++) {
+        x[j] -= carry * order[j];
+    }
+    for (i = 0; i < 32; i++) {
+        x[i + 1] += x[i] >> 8;
+        r[i] = (uint8_t)(x[i] & 255);
+    }
+}
+
+// Whether a little-endian scalar is below the group order (RFC 8032 5.1.7)
+static int sc_canonical(const uint8_t s[32]) {
+    for (int i = 31; i >= 0; i--) {
+        if (s[i] != order[i]) {
+            return s[i] < order[i];
+        }
+    }
+    return 0;
+}
+
+static int ed25519_verify(const uint8_t pk[32], const uint8_t sig[64], const unsigned char *m, size_t len) {
+    gf p[4], q[4];
+    uint8_t digest[64], h[32], t[32];
+    struct sha512 sha;
+
+    if (!sc_canonical(sig + 32) || ge_unpack_neg(q, pk) != 0) {
+        return -1;
+    }
+
+    sha512_init(&sha);
+    sha512_update(&sha, sig, 32);
+    sha512_update(&sha, pk, 32);
+    sha512_update(&sha, m, len);
+    sha512_final(&sha, digest);
+    sc_reduce(h, digest);
+
+    // [s]B - [h]A must equal R
+    ge_scalarmult(p, q, h);
+    ge_scalarbase(q, sig + 32);
+    ge_add(p, q);
+    ge_pack(t, p);
+    return memcmp(t, sig, 32) == 0 ? 0 : -1;
+}
+
+/* Keys, tokens and the store */
+
+static int base64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+int ya_grant_base64_decode(const char *in, size_t len, unsigned char *out, size_t cap) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    size_t pad = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)in[i];
+        if (c == '\n' || c == '\r' || c == ' ' || c == '\t') {
+            continue;
+        }
+        if (c == '=') {
+            pad++;
+            continue;
+        }
+        int v = base64_value(c);
+        if (v < 0 || pad > 0) {
+            return -1;
+        }
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= cap) {
+                return -1;
+            }
+            // Output never overtakes input, so in and out may overlap
+            out[n++] = (unsigned char)(acc >> bits);
+        }
+    }
+    if (pad > 2 || bits >= 6 || (acc & ((1u << bits) - 1)) != 0) {
+        return -1;
+    }
+    return (int)n;
+}
+
+int ya_grant_load_key(const char *path, unsigned char key[32]) {
+    char text[KEY_FILE_MAX + 1];
+    unsigned char der[64];
+    struct stat st;
+
+    // A key someone else could replace would let them mint grants
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & 022) != 0) {
+        close(fd);
+        return -1;
+    }
+    ssize_t n = read(fd, text, KEY_FILE_MAX);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    text[n] = '\0';
+
+    char *body = text;
+    char *begin = strstr(text, PEM_BEGIN);
+    if (begin) {
+        body = begin + strlen(PEM_BEGIN);
+        char *end = strstr(body, PEM_END);
+        if (!end) {
+            return -1;
+        }
+        *end = '\0';
+    }
+
+    int len = ya_grant_base64_decode(body, strlen(body), der, sizeof(der));
+    if (len == 32) {
+        memcpy(key, der, 32);
+        return 0;
+    }
+    if (len == (int)sizeof(spki_prefix) + 32 && memcmp(der, spki_prefix, sizeof(spki_prefix)) == 0) {
+        memcpy(key, der + sizeof(spki_prefix), 32);
+        return 0;
+    }
+    return -1;
+}
+
+int ya_grant_verify(const unsigned char key[32], const unsigned char *token, size_t len) {
+    if (len < 4 + YA_GRANT_SIGNATURE_SIZE || len > YA_GRANT_MAX_SIZE ||
+        memcmp(token, "YAG", 3) != 0 || token[3] != YA_GRANT_VERSION) {
+        return -1;
+    }
+    size_t signed_len = len - YA_GRANT_SIGNATURE_SIZE;
+    return ed25519_verify(key, token + signed_len, token, signed_len);
+}
+
+static int read_time(const unsigned char *value, size_t len, uint64_t *out) {
+    if (len != 8) {
+        return -1;
+    }
+    *out = load64_be(value);
+    return 0;
+}
+
+int ya_grant_parse(unsigned char *token, size_t len, struct ya_grant *g) {
+    struct ya_wire_iter it;
+    unsigned char *value;
+    size_t vlen;
+    int tag, rc;
+
+    memset(g, 0, sizeof(*g));
+    if (len < 4 + YA_GRANT_SIGNATURE_SIZE) {
+        return -1;
+    }
+    ya_wire_begin(&it, token + 4, len - 4 - YA_GRANT_SIGNATURE_SIZE, 1);
+
+    // Check the framing in full before any string is terminated in place
+    while ((rc = ya_wire_next(&it, &tag, &value, &vlen)) > 0) {
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    ya_wire_begin(&it, token + 4, len - 4 - YA_GRANT_SIGNATURE_SIZE, 1);
+    while (ya_wire_next(&it, &tag, &value, &vlen) > 0) {
+        const char **str = NULL;
+        switch (tag) {
+        case YA_GRANT_ISSUED:
+            if (read_time(value, vlen, &g->issued) != 0) {
+                return -1;
+            }
+            break;
+        case YA_GRANT_EXPIRES:
+            if (read_time(value, vlen, &g->expires) != 0) {
+                return -1;
+            }
+            break;
+        case YA_GRANT_USER_ID:
+            g->user_id = vlen == 16 ? value : NULL;
+            break;
+        case YA_GRANT_DEVICE_ID:
+            g->device_id = vlen == 16 ? value : NULL;
+            break;
+        case YA_GRANT_PERMISSION:
+            if (g->permission_count < YA_GRANT_MAX_PERMISSIONS) {
+                str = &g->permissions[g->permission_count++];
+            }
+            break;
+        case YA_GRANT_ROLE:
+            if (g->role_count < YA_GRANT_MAX_ROLES) {
+                str = &g->roles[g->role_count++];
+            }
+            break;
+        case YA_GRANT_AUDIENCE:
+            str = &g->audience;
+            break;
+        case YA_GRANT_USER_EMAIL:
+            str = &g->email;
+            break;
+        case YA_GRANT_USER_USERNAME:
+            str = &g->username;
+            break;
+        case YA_GRANT_USER_FIRST_NAME:
+            str = &g->first_name;
+            break;
+        case YA_GRANT_USER_LAST_NAME:
+            str = &g->last_name;
+            break;
+        case YA_GRANT_DEVICE_TYPE:
+            str = &g->device_type;
+            break;
+        case YA_GRANT_DEVICE_IDENTIFIER:
+            str = &g->device_identifier;
+            break;
+        }
+        if (str && !(*str = ya_wire_cstr(value, vlen))) {
+            return -1;
+        }
+    }
+    return g->expires && g->audience && g->username ? 0 : -1;
+}
+
+int ya_grant_usable(const struct ya_grant *g, const char *audience, const char *user,
+                    const char *permission, uint64_t now) {
+    if (strcmp(g->audience, audience) != 0 || strcmp(g->username, user) != 0 ||
+        now >= g->expires || g->issued > now + YA_GRANT_CLOCK_SKEW) {
+        return 0;
+    }
+    for (int i = 0; i < g->permission_count; i++) {
+        if (strcmp(g->permissions[i], permission) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Path of the grant for user and permission. The name is a hash, so
+// neither needs to be a safe file name.
+static int grant_path(char *path, size_t cap, const char *dir, const char *user, const char *permission) {
+    char key[512];
+    int n = snprintf(key, sizeof(key), "%s\n%s", user, permission);
+
+    if (n < 0 || (size_t)n >= sizeof(key)) {
+        return -1;
+    }
+    n = snprintf(path, cap, "%s/%016llx", dir, (unsigned long long)ya_hash(key, (size_t)n));
+    return n < 0 || (size_t)n >= cap ? -1 : 0;
+}
+
+// The store must be a directory only we can write to
+static int check_dir(const char *dir) {
+    struct stat st;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int ya_grant_store(const char *dir, const char *user, const char *permission,
+                   const unsigned char *token, size_t len) {
+    char path[4096], tmp[4096 + 8];
+
+    if (check_dir(dir) != 0 || grant_path(path, sizeof(path), dir, user, permission) != 0) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    // Write a private temp file and rename it over the old grant
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, token + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int ya_grant_load(const char *dir, const char *user, const char *permission, unsigned char *buf, size_t cap) {
+    char path[4096];
+    struct stat st;
+
+    if (grant_path(path, sizeof(path), dir, user, permission) != 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 077) != 0 || st.st_size <= 0 || (size_t)st.st_size > cap) {
+        close(fd);
+        return -1;
+    }
+    ssize_t n = read(fd, buf, (size_t)st.st_size);
+    close(fd);
+    return n == st.st_size ? (int)n : -1;
+}
+
+// Whether the grant in fd names user_id or device_id
+static int grant_matches(int fd, const unsigned char *user_id, const unsigned char *device_id) {
+    unsigned char token[YA_GRANT_MAX_SIZE];
+    struct ya_grant g;
+
+    ssize_t n = read(fd, token, sizeof(token));
+    if (n <= 0 || ya_grant_parse(token, (size_t)n, &g) != 0) {
+        return 1;
+    }
+    return (user_id && g.user_id && memcmp(g.user_id, user_id, 16) == 0) ||
+           (device_id && g.device_id && memcmp(g.device_id, device_id, 16) == 0);
+}
+
+int ya_grant_revoke(const char *dir, const unsigned char *user_id, const unsigned char *device_id) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    int removed = 0;
+
+    if (!d) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((e = readdir(d)) != NULL) {
+        // Grants are named by a hex hash; skip dot files and the temp
+        // files of a store in progress
+        if (strchr(e->d_name, '.')) {
+            continue;
+        }
+        if (user_id || device_id) {
+            int fd = openat(dirfd(d), e->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            int match = grant_matches(fd, user_id, device_id);
+            close(fd);
+            if (!match) {
+                continue;
+            }
+        }
+        if (unlinkat(dirfd(d), e->d_name, 0) == 0) {
+            removed++;
+        }
+    }
+    closedir(d);
+    return removed;
+}
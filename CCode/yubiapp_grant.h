@@ -0,0 +1,117 @@
+/*
+ * yubiapp_grant.h - Short-lived signed authorization grants
+ *
+ * With grant_key= set, the module asks the API for a grant alongside each
+ * authentication: a statement, signed with the API's Ed25519 key, that a
+ * user passed a permission check on this host until a given time. Grants
+ * are kept in a root-only directory, one file per user and permission, so
+ * a later check of the same permission (sudo seconds after the SSH login
+ * that asked for it) is answered locally with a signature check instead of
+ * an OTP and an API round trip. Only the public key is on the host, so a
+ * grant cannot be minted here; the TTL, chosen by the API, bounds how long
+ * a revoked permission keeps working.
+ *
+ * Token:   "YAG" | version (1) | fields | Ed25519 signature (64)
+ * field:   tag (1) | length (2, BE) | value, as in yubiapp_wire.h
+ *
+ * The signature covers everything before it. Times are Unix seconds
+ * (8 bytes, BE), UUIDs 16 raw bytes, strings UTF-8; permissions and roles
+ * repeat. The encoder is internal/services/auth_grant.go.
+ *
+ * Verification is self-contained (SHA-512 and Ed25519 after TweetNaCl), like
+ * the AES in yubiapp_otp.c, and takes a few milliseconds.
+ */
+
+#ifndef YUBIAPP_GRANT_H
+#define YUBIAPP_GRANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_GRANT_KEY "/etc/yubiapp/grant.pub"
+#define YA_GRANT_DIR YA_STATE_DIR "/grants"
+#define YA_GRANT_VERSION 1
+#define YA_GRANT_SIGNATURE_SIZE 64
+#define YA_GRANT_MAX_SIZE 2048
+#define YA_GRANT_MAX_PERMISSIONS 16
+#define YA_GRANT_MAX_ROLES 32
+#define YA_GRANT_CLOCK_SKEW 60      /* seconds a grant may be issued in the future */
+
+enum ya_grant_tag {
+    YA_GRANT_AUDIENCE = 0x01,       /* host name the grant is for */
+    YA_GRANT_ISSUED = 0x02,         /* 8 bytes */
+    YA_GRANT_EXPIRES = 0x03,        /* 8 bytes */
+    YA_GRANT_PERMISSION = 0x04,     /* repeated; empty: authentication without a permission */
+
+    YA_GRANT_USER_ID = 0x10,        /* 16 bytes */
+    YA_GRANT_USER_EMAIL = 0x11,
+    YA_GRANT_USER_USERNAME = 0x12,
+    YA_GRANT_USER_FIRST_NAME = 0x13,
+    YA_GRANT_USER_LAST_NAME = 0x14,
+
+    YA_GRANT_ROLE = 0x20,           /* repeated role name */
+
+    YA_GRANT_DEVICE_ID = 0x30,      /* 16 bytes */
+    YA_GRANT_DEVICE_TYPE = 0x31,
+    YA_GRANT_DEVICE_IDENTIFIER = 0x32,
+};
+
+// A parsed grant; the strings point into the token
+struct ya_grant {
+    uint64_t issued;
+    uint64_t expires;
+    const char *audience;
+    const unsigned char *user_id;   /* 16 bytes, NULL if absent */
+    const char *email;
+    const char *username;
+    const char *first_name;
+    const char *last_name;
+    const unsigned char *device_id; /* 16 bytes, NULL if absent */
+    const char *device_type;
+    const char *device_identifier;
+    int permission_count;
+    const char *permissions[YA_GRANT_MAX_PERMISSIONS];
+    int role_count;
+    const char *roles[YA_GRANT_MAX_ROLES];
+};
+
+// Read the API's public key: a PEM "PUBLIC KEY" (openssl pkey -pubout) or
+// one line of base64 holding the raw 32 bytes. The file must be owned by
+// root and writable by nobody else. Returns 0 on success.
+int ya_grant_load_key(const char *path, unsigned char key[32]);
+
+// Decode standard base64 in place or into out (which may be in). Returns
+// the decoded length, or -1 if the input is malformed or does not fit.
+int ya_grant_base64_decode(const char *in, size_t len, unsigned char *out, size_t cap);
+
+// Check a token's signature. Returns 0 if it verifies with key.
+int ya_grant_verify(const unsigned char key[32], const unsigned char *token, size_t len);
+
+// Parse a verified token in place (its strings are NUL-terminated by
+// moving them, so the token no longer verifies afterwards). Returns 0, or
+// -1 if it is malformed.
+int ya_grant_parse(unsigned char *token, size_t len, struct ya_grant *g);
+
+// Whether a parsed grant stands in for checking permission (empty for none)
+// for user on host audience at Unix time now
+int ya_grant_usable(const struct ya_grant *g, const char *audience, const char *user,
+                    const char *permission, uint64_t now);
+
+// Store a token for user and permission in dir, which is created (0700)
+// if missing. Returns 0 on success.
+int ya_grant_store(const char *dir, const char *user, const char *permission,
+                   const unsigned char *token, size_t len);
+
+// Load the token stored for user and permission into buf. Returns its
+// length, or -1 if there is none or the file is not root-only.
+int ya_grant_load(const char *dir, const char *user, const char *permission, unsigned char *buf, size_t cap);
+
+// Remove the grants in dir that name user_id or device_id (16 raw bytes
+// each, either may be NULL), or every grant when both are NULL. Grants
+// that do not parse are removed too. Returns the number removed, or -1 if
+// dir cannot be read.
+int ya_grant_revoke(const char *dir, const unsigned char *user_id, const unsigned char *device_id);
+
+#endif /* YUBIAPP_GRANT_H */
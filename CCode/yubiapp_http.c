@@ -0,0 +1,468 @@
+/*
+ * yubiapp_http.c - Minimal HTTP/1.1 client for local API endpoints
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "yubiapp_http.h"
+#include "yubiapp_shm.h"
+
+#define MAX_HOST 255
+#define MAX_PATH 1024
+
+struct url_parts {
+    char host[MAX_HOST + 1];    /* without the brackets of an IPv6 literal */
+    int port;
+    const char *path;           /* "/" if the URL has none */
+    int ipv6;
+};
+
+static int parse_url(const char *url, struct url_parts *u) {
+    if (strncasecmp(url, "http://", 7) != 0) {
+        return -1;
+    }
+    const char *p = url + 7;
+    const char *host_end;
+
+    u->ipv6 = 0;
+    if (*p == '[') {
+        host_end = strchr(++p, ']');
+        if (!host_end) {
+            return -1;
+        }
+        u->ipv6 = 1;
+    } else {
+        host_end = p + strcspn(p, ":/?#");
+    }
+    size_t len = (size_t)(host_end - p);
+    if (len == 0 || len > MAX_HOST) {
+        return -1;
+    }
+    memcpy(u->host, p, len);
+    u->host[len] = '\0';
+    p = host_end + u->ipv6;
+
+    u->port = 80;
+    if (*p == ':') {
+        char *end;
+        long port = strtol(p + 1, &end, 10);
+        if (end == p + 1 || port <= 0 || port > 65535) {
+            return -1;
+        }
+        u->port = (int)port;
+        p = end;
+    }
+    if (*p != '\0' && *p != '/') {
+        return -1;
+    }
+    u->path = *p ? p : "/";
+    return strlen(u->path) <= MAX_PATH ? 0 : -1;
+}
+
+static int loopback_host(const struct url_parts *u) {
+    struct in_addr a4;
+    struct in6_addr a6;
+
+    if (strcasecmp(u->host, "localhost") == 0) {
+        return 1;
+    }
+    if (!u->ipv6 && inet_pton(AF_INET, u->host, &a4) == 1) {
+        return (ntohl(a4.s_addr) >> 24) == 127;
+    }
+    if (u->ipv6 && inet_pton(AF_INET6, u->host, &a6) == 1) {
+        return IN6_IS_ADDR_LOOPBACK(&a6);
+    }
+    return 0;
+}
+
+int ya_http_local(const char *url, const char *unix_socket) {
+    struct url_parts u;
+
+    if (!url || parse_url(url, &u) != 0) {
+        return 0;
+    }
+    return unix_socket || loopback_host(&u);
+}
+
+// Milliseconds left before deadline (CLOCK_MONOTONIC, microseconds), 0 if
+// it has passed
+static int remaining_ms(uint64_t deadline) {
+    uint64_t now = ya_monotonic_us();
+    return now >= deadline ? 0 : (int)((deadline - now + 999) / 1000);
+}
+
+static int wait_fd(int fd, short events, uint64_t deadline) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+
+    for (;;) {
+        int timeout = remaining_ms(deadline);
+        if (timeout == 0) {
+            return YA_HTTP_ERR_TIMEOUT;
+        }
+        int n = poll(&pfd, 1, timeout);
+        if (n > 0) {
+            return YA_HTTP_OK;
+        }
+        if (n == 0) {
+            return YA_HTTP_ERR_TIMEOUT;
+        }
+        if (errno != EINTR) {
+            return YA_HTTP_ERR_IO;
+        }
+    }
+}
+
+static int connect_addr(const struct sockaddr *addr, socklen_t addrlen, uint64_t deadline) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return YA_HTTP_ERR_CONNECT;
+    }
+    if (addr->sa_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (connect(fd, addr, addrlen) != 0) {
+        if (errno != EINPROGRESS && errno != EAGAIN) {
+            close(fd);
+            return YA_HTTP_ERR_CONNECT;
+        }
+        int rc = wait_fd(fd, POLLOUT, deadline);
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (rc == YA_HTTP_OK && (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0)) {
+            rc = YA_HTTP_ERR_CONNECT;
+        }
+        if (rc != YA_HTTP_OK) {
+            close(fd);
+            return rc;
+        }
+    }
+    return fd;
+}
+
+static int connect_endpoint(const struct url_parts *u, const char *unix_socket, uint64_t deadline) {
+    if (unix_socket) {
+        struct sockaddr_un sun = {.sun_family = AF_UNIX};
+        if (strlen(unix_socket) >= sizeof(sun.sun_path)) {
+            return YA_HTTP_ERR_CONNECT;
+        }
+        strcpy(sun.sun_path, unix_socket);
+        return connect_addr((struct sockaddr *)&sun, sizeof(sun), deadline);
+    }
+
+    // Literal addresses only: a name other than localhost would mean the
+    // resolver, which is libcurl's job
+    int localhost = strcasecmp(u->host, "localhost") == 0;
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons((uint16_t)u->port)};
+    struct sockaddr_in6 sin6 = {.sin6_family = AF_INET6, .sin6_port = htons((uint16_t)u->port)};
+    int rc = YA_HTTP_ERR_URL;
+
+    if (!u->ipv6 && inet_pton(AF_INET, localhost ? "127.0.0.1" : u->host, &sin.sin_addr) == 1) {
+        rc = connect_addr((struct sockaddr *)&sin, sizeof(sin), deadline);
+        if (rc >= 0 || !localhost || rc == YA_HTTP_ERR_TIMEOUT) {
+            return rc;
+        }
+    }
+    if ((u->ipv6 || localhost) && inet_pton(AF_INET6, localhost ? "::1" : u->host, &sin6.sin6_addr) == 1) {
+        rc = connect_addr((struct sockaddr *)&sin6, sizeof(sin6), deadline);
+    }
+    return rc;
+}
+
+static int send_all(int fd, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return YA_HTTP_ERR_IO;
+            }
+            int rc = wait_fd(fd, POLLOUT, deadline);
+            if (rc != YA_HTTP_OK) {
+                return rc;
+            }
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return YA_HTTP_OK;
+}
+
+// Value of header name in the header block [p, end), copied into out;
+// returns its length or -1 if absent
+static int header_value(const char *p, const char *end, const char *name, char *out, size_t cap) {
+    size_t name_len = strlen(name);
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+        if ((size_t)(eol - p) > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0) {
+            const char *v = p + name_len + 1;
+            const char *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t')) {
+                v_end--;
+            }
+            size_t len = (size_t)(v_end - v);
+            if (len >= cap) {
+                len = cap - 1;
+            }
+            memcpy(out, v, len);
+            out[len] = '\0';
+            return (int)len;
+        }
+        p = eol + 1;
+    }
+    return -1;
+}
+
+// Walk a chunked body, decoding it in place if decode is set (only once it
+// is complete). Returns the decoded length, -1 if the chunks are malformed,
+// or -2 if the last chunk has not arrived yet.
+static long dechunk(char *body, size_t len, int decode) {
+    size_t in = 0;
+    size_t out = 0;
+
+    for (;;) {
+        char *eol = memchr(body + in, '\n', len - in);
+        if (!eol) {
+            return -2;
+        }
+        char *end;
+        unsigned long size = strtoul(body + in, &end, 16);
+        if (end == body + in || (*end != '\r' && *end != '\n' && *end != ';')) {
+            return -1;
+        }
+        in = (size_t)(eol - body) + 1;
+        if (size == 0) {
+            return (long)out;   /* trailers are not needed */
+        }
+        if (size > len - in) {
+            return -2;
+        }
+        if (decode) {
+            memmove(body + out, body + in, size);
+        }
+        out += size;
+        in += size;
+        if (len - in < 1) {
+            return -2;
+        }
+        if (body[in] == '\r') {
+            in++;
+        }
+        if (len - in < 1) {
+            return -2;
+        }
+        if (body[in++] != '\n') {
+            return -1;
+        }
+    }
+}
+
+int ya_http_post(const struct ya_http_request *req, char *buf, size_t max_body, struct ya_http_response *resp) {
+    struct url_parts u;
+    uint64_t start = ya_monotonic_us();
+    uint64_t deadline = start + (uint64_t)req->timeout_ms * 1000;
+    uint64_t connect_deadline = start + (uint64_t)req->connect_timeout_ms * 1000;
+
+    memset(resp, 0, sizeof(*resp));
+    if (parse_url(req->url, &u) != 0) {
+        return YA_HTTP_ERR_URL;
+    }
+
+    int fd = connect_endpoint(&u, req->unix_socket, connect_deadline < deadline ? connect_deadline : deadline);
+    if (fd < 0) {
+        return fd;
+    }
+    resp->connected = 1;
+    resp->connect_us = ya_monotonic_us() - start;
+
+    char authority[MAX_HOST + 9];
+    char port[8] = "";
+    if (u.port != 80) {
+        snprintf(port, sizeof(port), ":%d", u.port);
+    }
+    snprintf(authority, sizeof(authority), u.ipv6 ? "[%s]%s" : "%s%s", u.host, port);
+
+    char header[MAX_PATH + MAX_HOST + 512];
+    int n = snprintf(header, sizeof(header),
+                     "POST %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "%s%s%s"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     u.path, authority, req->content_type, req->accept ? "Accept: " : "",
+                     req->accept ? req->accept : "", req->accept ? "\r\n" : "", req->body_len);
+    if (n < 0 || (size_t)n >= sizeof(header)) {
+        close(fd);
+        return YA_HTTP_ERR_URL;
+    }
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = (size_t)n},
+        {.iov_base = (void *)req->body, .iov_len = req->body_len},
+    };
+    int rc = send_all(fd, iov, req->body_len ? 2 : 1, deadline);
+    if (rc != YA_HTTP_OK) {
+        close(fd);
+        return rc;
+    }
+
+    // Read until the server closes the connection or the body is complete
+    size_t cap = max_body + YA_HTTP_MAX_HEADER;
+    size_t len = 0;
+    char *body = NULL;
+    long content_length = -1;
+    int chunked = 0;
+
+    for (;;) {
+        if (len == cap) {
+            rc = YA_HTTP_ERR_TOO_LARGE;
+            break;
+        }
+        ssize_t got = recv(fd, buf + len, cap - len, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                rc = YA_HTTP_ERR_IO;
+                break;
+            }
+            rc = wait_fd(fd, POLLIN, deadline);
+            if (rc != YA_HTTP_OK) {
+                break;
+            }
+            continue;
+        }
+        if (len == 0 && got > 0) {
+            resp->first_byte_us = ya_monotonic_us() - start;
+        }
+        len += (size_t)got;
+
+        if (!body) {
+            buf[len] = '\0';
+            char *blank = strstr(buf, "\r\n\r\n");
+            size_t sep = 4;
+            if (!blank) {
+                blank = strstr(buf, "\n\n");
+                sep = 2;
+            }
+            if (!blank) {
+                if (got == 0 || len >= YA_HTTP_MAX_HEADER) {
+                    rc = YA_HTTP_ERR_PROTOCOL;
+                    break;
+                }
+                continue;
+            }
+
+            int minor;
+            if (sscanf(buf, "HTTP/1.%d %ld", &minor, &resp->status) != 2 || resp->status < 100) {
+                rc = YA_HTTP_ERR_PROTOCOL;
+                break;
+            }
+            char value[64];
+            char *headers = strchr(buf, '\n') + 1;
+            if (header_value(headers, blank, "Content-Length", value, sizeof(value)) > 0) {
+                char *end;
+                content_length = strtol(value, &end, 10);
+                if (*end != '\0' || content_length < 0) {
+                    rc = YA_HTTP_ERR_PROTOCOL;
+                    break;
+                }
+            }
+            if (header_value(headers, blank, "Transfer-Encoding", value, sizeof(value)) > 0) {
+                chunked = strcasestr(value, "chunked") != NULL;
+            }
+            header_value(headers, blank, "Content-Type", resp->content_type, sizeof(resp->content_type));
+            body = blank + sep;
+        }
+
+        size_t body_len = len - (size_t)(body - buf);
+        if (chunked) {
+            long decoded = dechunk(body, body_len, 0);
+            if (decoded >= 0) {
+                dechunk(body, body_len, 1);
+                resp->body_len = (size_t)decoded;
+                break;
+            }
+            if (decoded == -1 || got == 0) {
+                rc = YA_HTTP_ERR_PROTOCOL;
+                break;
+            }
+        } else if (content_length >= 0 && body_len >= (size_t)content_length) {
+            resp->body_len = (size_t)content_length;
+            break;
+        } else if (got == 0) {
+            if (content_length >= 0) {
+                rc = YA_HTTP_ERR_PROTOCOL;
+                break;
+            }
+            resp->body_len = body_len;
+            break;
+        }
+    }
+    close(fd);
+    if (rc != YA_HTTP_OK) {
+        return rc;
+    }
+    if (resp->body_len > max_body) {
+        return YA_HTTP_ERR_TOO_LARGE;
+    }
+
+    resp->total_us = ya_monotonic_us() - start;
+    resp->body = body;
+    body[resp->body_len] = '\0';
+    return YA_HTTP_OK;
+}
+
+const char *ya_http_strerror(int err) {
+    switch (err) {
+    case YA_HTTP_OK:
+        return "no error";
+    case YA_HTTP_ERR_URL:
+        return "unsupported URL";
+    case YA_HTTP_ERR_CONNECT:
+        return "could not connect";
+    case YA_HTTP_ERR_TIMEOUT:
+        return "timed out";
+    case YA_HTTP_ERR_IO:
+        return "connection error";
+    case YA_HTTP_ERR_PROTOCOL:
+        return "malformed response";
+    case YA_HTTP_ERR_TOO_LARGE:
+        return "response too large";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,69 @@
+/*
+ * yubiapp_http.h - Minimal HTTP/1.1 client for local API endpoints
+ *
+ * When every endpoint is reached over a Unix socket (socket=) or a plain
+ * http:// URL on a loopback address, there is no TLS to negotiate, no name
+ * to resolve and no connection worth keeping, and libcurl is all cost. This
+ * client sends one POST per connection (Connection: close) with blocking
+ * I/O under a deadline, and reads the answer into the caller's buffer:
+ * status line, the headers it needs (Content-Length, Content-Type,
+ * Transfer-Encoding: chunked), and the body, decoded in place and
+ * NUL-terminated. "localhost" is taken as 127.0.0.1 (then ::1) without
+ * consulting the resolver.
+ */
+
+#ifndef YUBIAPP_HTTP_H
+#define YUBIAPP_HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YA_HTTP_MAX_HEADER 4096         /* status line and headers of a response */
+#define YA_HTTP_MAX_CONTENT_TYPE 128
+
+enum ya_http_error {
+    YA_HTTP_OK = 0,
+    YA_HTTP_ERR_URL = -1,       /* not an http:// URL this client can serve */
+    YA_HTTP_ERR_CONNECT = -2,
+    YA_HTTP_ERR_TIMEOUT = -3,
+    YA_HTTP_ERR_IO = -4,
+    YA_HTTP_ERR_PROTOCOL = -5,  /* malformed response */
+    YA_HTTP_ERR_TOO_LARGE = -6, /* response does not fit in the buffer */
+};
+
+struct ya_http_request {
+    const char *url;
+    const char *unix_socket;    /* connect here instead of the URL's host */
+    const char *body;
+    size_t body_len;
+    const char *content_type;
+    const char *accept;         /* NULL for none */
+    unsigned int connect_timeout_ms;
+    unsigned int timeout_ms;    /* for the whole exchange */
+};
+
+// A response; body points into the caller's buffer. Times are from the
+// start of the request.
+struct ya_http_response {
+    long status;
+    char content_type[YA_HTTP_MAX_CONTENT_TYPE + 1];
+    char *body;
+    size_t body_len;
+    int connected;              /* the request may have reached the server */
+    uint64_t connect_us;        /* connected */
+    uint64_t first_byte_us;     /* first response byte */
+    uint64_t total_us;          /* last response byte */
+};
+
+// Whether the client can serve url: http:// and either a Unix socket or a
+// loopback host (localhost, 127.0.0.0/8, ::1)
+int ya_http_local(const char *url, const char *unix_socket);
+
+// POST the request. buf must hold max_body + YA_HTTP_MAX_HEADER + 1 bytes;
+// a body larger than max_body fails with YA_HTTP_ERR_TOO_LARGE. Returns
+// YA_HTTP_OK or a negative enum ya_http_error.
+int ya_http_post(const struct ya_http_request *req, char *buf, size_t max_body, struct ya_http_response *resp);
+
+const char *ya_http_strerror(int err);
+
+#endif /* YUBIAPP_HTTP_H */
@@ -0,0 +1,461 @@
+/*
+ * yubiapp_json.c - Field-selective JSON parser for API responses
+ */
+
+#include <string.h>
+
+#include "yubiapp_json.h"
+
+struct parser {
+    char *p;
+    char *end;
+    struct ya_json_field *fields;
+    int nfields;
+};
+
+// Path of the value being parsed, as a dotted prefix of some field path.
+// Once no field can match any more the path is "dead" and stops growing.
+struct path {
+    const char *name;
+    size_t len;
+    int dead;
+};
+
+static void skip_ws(struct parser *ps) {
+    while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r')) {
+        ps->p++;
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static long read_hex4(const char *s) {
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hex_value(s[i]);
+        if (h < 0) {
+            return -1;
+        }
+        v = (v << 4) | h;
+    }
+    return v;
+}
+
+// Scan a string starting at the opening quote. On return *start/*stop
+// delimit the raw contents and ps->p is past the closing quote. Rejects
+// control characters and \u0000, which could truncate an environment value.
+static int scan_string(struct parser *ps, char **start, char **stop) {
+    char *s = ++ps->p;
+
+    while (ps->p < ps->end) {
+        unsigned char c = (unsigned char)*ps->p;
+        if (c == '"') {
+            *start = s;
+            *stop = ps->p++;
+            return 0;
+        }
+        if (c < 0x20) {
+            return -1;
+        }
+        if (c == '\\') {
+            if (ps->end - ps->p < 2) {
+                return -1;
+            }
+            char e = ps->p[1];
+            if (e == 'u') {
+                if (ps->end - ps->p < 6 || read_hex4(ps->p + 2) <= 0) {
+                    return -1;
+                }
+                ps->p += 6;
+                continue;
+            }
+            if (e == '\0' || !strchr("\"\\/bfnrt", e)) {
+                return -1;
+            }
+            ps->p += 2;
+            continue;
+        }
+        ps->p++;
+    }
+    return -1;
+}
+
+// Write cp as UTF-8 at out and return the number of bytes written
+static size_t put_utf8(char *out, unsigned long cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+// Unescape a scanned string in place (the result is never longer) and
+// NUL-terminate it where the closing quote was. Returns the length.
+static size_t unescape(char *s, char *stop) {
+    char *begin = s;
+    char *out = s;
+
+    while (s < stop) {
+        if (*s != '\\') {
+            *out++ = *s++;
+            continue;
+        }
+        char e = s[1];
+        s += 2;
+        switch (e) {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            unsigned long cp = (unsigned long)read_hex4(s);
+            s += 4;
+            if (cp >= 0xd800 && cp < 0xdc00 && stop - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+                long lo = read_hex4(s + 2);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + ((unsigned long)lo - 0xdc00);
+                    s += 6;
+                }
+            }
+            if (cp >= 0xd800 && cp < 0xe000) {
+                cp = 0xfffd;  /* unpaired surrogate */
+            }
+            out += put_utf8(out, cp);
+            break;
+        }
+        default: *out++ = e; break;
+        }
+    }
+    *out = '\0';
+    return (size_t)(out - begin);
+}
+
+static int match_literal(struct parser *ps, const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t)(ps->end - ps->p) < n || memcmp(ps->p, lit, n) != 0) {
+        return -1;
+    }
+    ps->p += n;
+    return 0;
+}
+
+static int scan_number(struct parser *ps) {
+    char *s = ps->p;
+
+    if (ps->p < ps->end && *ps->p == '-') {
+        ps->p++;
+    }
+    if (ps->p >= ps->end || *ps->p < '0' || *ps->p > '9') {
+        return -1;
+    }
+    if (*ps->p == '0') {
+        ps->p++;
+    } else {
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+    }
+    if (ps->p < ps->end && *ps->p == '.') {
+        ps->p++;
+        if (ps->p >= ps->end || *ps->p < '0' || *ps->p > '9') {
+            return -1;
+        }
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+    }
+    if (ps->p < ps->end && (*ps->p == 'e' || *ps->p == 'E')) {
+        ps->p++;
+        if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '-')) {
+            ps->p++;
+        }
+        if (ps->p >= ps->end || *ps->p < '0' || *ps->p > '9') {
+            return -1;
+        }
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+    }
+    return ps->p > s ? 0 : -1;
+}
+
+// Find the requested field whose path is exactly this one, if any
+static struct ya_json_field *find_field(struct parser *ps, const struct path *path) {
+    if (path->dead) {
+        return NULL;
+    }
+    for (int i = 0; i < ps->nfields; i++) {
+        const char *fp = ps->fields[i].path;
+        if (strlen(fp) == path->len && memcmp(fp, path->name, path->len) == 0) {
+            return &ps->fields[i];
+        }
+    }
+    return NULL;
+}
+
+// Path of a member: the field path that continues path with ".key", if any
+// requested field does
+static struct path child_path(struct parser *ps, const struct path *path, const char *key, size_t key_len) {
+    struct path child = {NULL, 0, 1};
+
+    if (path->dead || memchr(key, '\\', key_len)) {
+        return child;
+    }
+    for (int i = 0; i < ps->nfields; i++) {
+        const char *fp = ps->fields[i].path;
+        size_t off = path->len ? path->len + 1 : 0;
+        if (strlen(fp) < off + key_len) {
+            continue;
+        }
+        if (path->len && (memcmp(fp, path->name, path->len) != 0 || fp[path->len] != '.')) {
+            continue;
+        }
+        if (memcmp(fp + off, key, key_len) == 0 && (fp[off + key_len] == '\0' || fp[off + key_len] == '.')) {
+            child.name = fp;
+            child.len = off + key_len;
+            child.dead = 0;
+            return child;
+        }
+    }
+    return child;
+}
+
+static int parse_value(struct parser *ps, const struct path *path, int depth);
+
+static int parse_object(struct parser *ps, const struct path *path, int depth) {
+    ps->p++;
+    skip_ws(ps);
+    if (ps->p < ps->end && *ps->p == '}') {
+        ps->p++;
+        return 0;
+    }
+
+    for (;;) {
+        char *key, *key_end;
+        skip_ws(ps);
+        if (ps->p >= ps->end || *ps->p != '"' || scan_string(ps, &key, &key_end) != 0) {
+            return -1;
+        }
+        skip_ws(ps);
+        if (ps->p >= ps->end || *ps->p != ':') {
+            return -1;
+        }
+        ps->p++;
+
+        struct path child = child_path(ps, path, key, (size_t)(key_end - key));
+        if (parse_value(ps, &child, depth + 1) != 0) {
+            return -1;
+        }
+
+        skip_ws(ps);
+        if (ps->p < ps->end && *ps->p == ',') {
+            ps->p++;
+            continue;
+        }
+        if (ps->p < ps->end && *ps->p == '}') {
+            ps->p++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static int parse_array(struct parser *ps, int depth) {
+    struct path none = {NULL, 0, 1};
+
+    ps->p++;
+    skip_ws(ps);
+    if (ps->p < ps->end && *ps->p == ']') {
+        ps->p++;
+        return 0;
+    }
+
+    for (;;) {
+        if (parse_value(ps, &none, depth + 1) != 0) {
+            return -1;
+        }
+        skip_ws(ps);
+        if (ps->p < ps->end && *ps->p == ',') {
+            ps->p++;
+            continue;
+        }
+        if (ps->p < ps->end && *ps->p == ']') {
+            ps->p++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static int parse_value(struct parser *ps, const struct path *path, int depth) {
+    if (depth > YA_JSON_MAX_DEPTH) {
+        return -1;
+    }
+
+    skip_ws(ps);
+    if (ps->p >= ps->end) {
+        return -1;
+    }
+
+    // Only the first occurrence of a key is recorded
+    struct ya_json_field *field = find_field(ps, path);
+    if (field && field->type != YA_JSON_ABSENT) {
+        field = NULL;
+    }
+
+    char *start = ps->p;
+    int rc;
+
+    switch (*ps->p) {
+    case '{':
+        // Objects and arrays record their raw span for ya_json_array_next
+        rc = parse_object(ps, path, depth);
+        if (field) {
+            field->type = YA_JSON_OBJECT;
+            field->value = start;
+            field->len = (size_t)(ps->p - start);
+        }
+        return rc;
+    case '[':
+        rc = parse_array(ps, depth);
+        if (field) {
+            field->type = YA_JSON_ARRAY;
+            field->value = start;
+            field->len = (size_t)(ps->p - start);
+        }
+        return rc;
+    case '"': {
+        char *stop;
+        if (scan_string(ps, &start, &stop) != 0) {
+            return -1;
+        }
+        if (field) {
+            // Raw length for now; unescaped once the document is known valid
+            field->type = YA_JSON_STRING;
+            field->value = start;
+            field->len = (size_t)(stop - start);
+        }
+        return 0;
+    }
+    case 't':
+        if (field) {
+            field->type = YA_JSON_TRUE;
+        }
+        return match_literal(ps, "true");
+    case 'f':
+        if (field) {
+            field->type = YA_JSON_FALSE;
+        }
+        return match_literal(ps, "false");
+    case 'n':
+        if (field) {
+            field->type = YA_JSON_NULL;
+        }
+        return match_literal(ps, "null");
+    default:
+        rc = scan_number(ps);
+        if (field) {
+            field->type = YA_JSON_NUMBER;
+            field->value = start;
+            field->len = (size_t)(ps->p - start);
+        }
+        return rc;
+    }
+}
+
+int ya_json_extract(char *buf, size_t len, struct ya_json_field *fields, int nfields) {
+    struct parser ps = {buf, buf + len, fields, nfields};
+    struct path root = {"", 0, 0};
+
+    for (int i = 0; i < nfields; i++) {
+        fields[i].type = YA_JSON_ABSENT;
+        fields[i].value = NULL;
+        fields[i].len = 0;
+    }
+
+    if (parse_value(&ps, &root, 0) != 0) {
+        goto invalid;
+    }
+    skip_ws(&ps);
+    if (ps.p != ps.end) {
+        goto invalid;
+    }
+
+    // The document is valid: now it is safe to rewrite the matched strings
+    for (int i = 0; i < nfields; i++) {
+        if (fields[i].type == YA_JSON_STRING) {
+            fields[i].len = unescape(fields[i].value, fields[i].value + fields[i].len);
+        }
+    }
+    return 0;
+
+invalid:
+    for (int i = 0; i < nfields; i++) {
+        fields[i].type = YA_JSON_ABSENT;
+        fields[i].value = NULL;
+        fields[i].len = 0;
+    }
+    return -1;
+}
+
+int ya_json_array_begin(struct ya_json_iter *it, const struct ya_json_field *array) {
+    if (array->type != YA_JSON_ARRAY) {
+        return -1;
+    }
+    it->p = array->value + 1;
+    it->end = array->value + array->len - 1;   /* the closing bracket */
+    return 0;
+}
+
+int ya_json_array_next(struct ya_json_iter *it, char **value, size_t *len) {
+    struct parser ps = {it->p, it->end, NULL, 0};
+    struct path none = {NULL, 0, 1};
+
+    skip_ws(&ps);
+    if (ps.p < ps.end && *ps.p == ',') {
+        ps.p++;
+    }
+    skip_ws(&ps);
+    if (ps.p >= ps.end) {
+        it->p = ps.p;
+        return 0;
+    }
+
+    // The array was validated as part of its document, so this only finds
+    // where the element ends
+    *value = ps.p;
+    if (parse_value(&ps, &none, 0) != 0) {
+        it->p = it->end;
+        return 0;
+    }
+    *len = (size_t)(ps.p - *value);
+    it->p = ps.p;
+    return 1;
+}
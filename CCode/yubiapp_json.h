@@ -0,0 +1,61 @@
+/*
+ * yubiapp_json.h - Field-selective JSON parser for API responses
+ *
+ * The module only needs a handful of values out of each response, so rather
+ * than building a tree this scans the response buffer once, validating it,
+ * and records where the requested values are. Requested strings are then
+ * unescaped in place and NUL-terminated, so nothing is allocated and the
+ * values point into the caller's buffer. The buffer is only modified once
+ * the whole document has been found valid.
+ *
+ * Fields are named by dotted paths from the top-level object, e.g.
+ * "authenticated" or "user.email". Values inside arrays cannot be selected
+ * directly; instead the array's elements are walked with ya_json_array_next
+ * and each is passed to ya_json_extract on its own. As with
+ * cJSON_GetObjectItem, the first occurrence of a duplicate key wins.
+ */
+
+#ifndef YUBIAPP_JSON_H
+#define YUBIAPP_JSON_H
+
+#include <stddef.h>
+
+#define YA_JSON_MAX_DEPTH 32
+
+enum ya_json_type {
+    YA_JSON_ABSENT = 0,
+    YA_JSON_NULL,
+    YA_JSON_FALSE,
+    YA_JSON_TRUE,
+    YA_JSON_NUMBER,
+    YA_JSON_STRING,
+    YA_JSON_OBJECT,
+    YA_JSON_ARRAY,
+};
+
+struct ya_json_field {
+    const char *path;       /* in: dotted path */
+    enum ya_json_type type; /* out: YA_JSON_ABSENT if not present */
+    char *value;            /* out: strings unescaped and NUL-terminated; numbers,
+                               objects and arrays as their text (strings selected
+                               inside them are unescaped in place) */
+    size_t len;             /* out: length of value */
+};
+
+struct ya_json_iter {
+    char *p;
+    char *end;
+};
+
+// Parse buf[0..len) and fill in the requested fields. Returns 0 on success,
+// -1 if the buffer is not a single valid JSON value (buf is then untouched).
+int ya_json_extract(char *buf, size_t len, struct ya_json_field *fields, int nfields);
+
+// Walk the elements of an array field from a successful ya_json_extract.
+// ya_json_array_begin returns -1 if the field is not an array;
+// ya_json_array_next returns 1 with the element's raw text in value/len, or
+// 0 after the last element.
+int ya_json_array_begin(struct ya_json_iter *it, const struct ya_json_field *array);
+int ya_json_array_next(struct ya_json_iter *it, char **value, size_t *len);
+
+#endif /* YUBIAPP_JSON_H */
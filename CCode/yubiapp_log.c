@@ -0,0 +1,181 @@
+/*
+ * yubiapp_log.c - Buffered, level-gated logging for the PAM module
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "yubiapp_log.h"
+
+#define OTP_SECRET_LENGTH 32   /* encrypted part of a YubiKey OTP, in modhex */
+#define OTP_MAX_ID_LENGTH 16   /* longest public ID in front of it */
+
+void ya_log_init(struct ya_log *log, int max_priority, const char *prefix) {
+    log->max_priority = max_priority;
+    snprintf(log->prefix, sizeof(log->prefix), "%s", prefix ? prefix : "");
+    log->count = 0;
+    log->dropped = 0;
+    log->used = 0;
+}
+
+int ya_log_enabled(const struct ya_log *log, int priority) {
+    return LOG_PRI(priority) <= log->max_priority;
+}
+
+// Append a record. The last slot and a little space are kept back for the
+// "records dropped" notice added at flush time.
+static void add_record(struct ya_log *log, int priority, const char *fmt, va_list ap, int reserve) {
+    size_t room = sizeof(log->buf) - log->used;
+    size_t keep = reserve ? 64 : 0;
+
+    if (log->count >= YA_LOG_MAX_RECORDS - (reserve ? 1 : 0) || room <= keep + 1) {
+        log->dropped++;
+        return;
+    }
+
+    room -= keep;
+    if (room > YA_LOG_MAX_LINE) {
+        room = YA_LOG_MAX_LINE;
+    }
+
+    int n = vsnprintf(log->buf + log->used, room, fmt, ap);
+    if (n < 0) {
+        return;
+    }
+    size_t len = (size_t)n < room ? (size_t)n : room - 1;   /* truncated lines are kept */
+
+    struct ya_log_record *r = &log->records[log->count++];
+    r->priority = LOG_PRI(priority);
+    r->when = time(NULL);
+    r->offset = log->used;
+    r->len = len;
+    log->used += len;
+}
+
+void ya_log_vadd(struct ya_log *log, int priority, const char *fmt, va_list ap) {
+    if (!ya_log_enabled(log, priority)) {
+        return;
+    }
+    add_record(log, priority, fmt, ap, 1);
+}
+
+void ya_log_add(struct ya_log *log, int priority, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    ya_log_vadd(log, priority, fmt, ap);
+    va_end(ap);
+}
+
+static void add_notice(struct ya_log *log, int priority, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    add_record(log, priority, fmt, ap, 0);
+    va_end(ap);
+}
+
+// Non-blocking datagram socket connected to the log daemon, or -1
+static int open_log_socket(void) {
+    struct sockaddr_un addr;
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, YA_LOG_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void ya_log_flush(struct ya_log *log) {
+    char headers[YA_LOG_MAX_RECORDS][80];
+    struct iovec iov[YA_LOG_MAX_RECORDS][3];
+    struct mmsghdr msgs[YA_LOG_MAX_RECORDS];
+
+    if (log->dropped) {
+        add_notice(log, LOG_WARNING, "%u log records dropped (buffer full)", log->dropped);
+    }
+    if (log->count == 0) {
+        return;
+    }
+
+    int fd = open_log_socket();
+    if (fd < 0) {
+        for (int i = 0; i < log->count; i++) {
+            struct ya_log_record *r = &log->records[i];
+            syslog(LOG_AUTHPRIV | r->priority, "%s%.*s", log->prefix, (int)r->len, log->buf + r->offset);
+        }
+        goto out;
+    }
+
+    // RFC 3164 framing, as syslog(3) sends it
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < log->count; i++) {
+        struct ya_log_record *r = &log->records[i];
+        struct tm tm;
+        char stamp[32];
+
+        localtime_r(&r->when, &tm);
+        strftime(stamp, sizeof(stamp), "%b %e %T", &tm);
+        int n = snprintf(headers[i], sizeof(headers[i]), "<%d>%s %s[%d]: ",
+                         LOG_AUTHPRIV | r->priority, stamp, program_invocation_short_name, (int)getpid());
+        if (n < 0 || (size_t)n >= sizeof(headers[i])) {
+            n = (int)strlen(headers[i]);
+        }
+
+        iov[i][0].iov_base = headers[i];
+        iov[i][0].iov_len = (size_t)n;
+        iov[i][1].iov_base = log->prefix;
+        iov[i][1].iov_len = strlen(log->prefix);
+        iov[i][2].iov_base = log->buf + r->offset;
+        iov[i][2].iov_len = r->len;
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 3;
+    }
+
+    // One syscall for every record; a busy log daemon loses them instead of
+    // stalling the login
+    int sent = 0;
+    while (sent < log->count) {
+        int n = sendmmsg(fd, msgs + sent, (unsigned int)(log->count - sent), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += n;
+    }
+    close(fd);
+
+out:
+    log->count = 0;
+    log->dropped = 0;
+    log->used = 0;
+}
+
+const char *ya_log_otp_id(const char *otp, char *out, size_t out_len) {
+    size_t len = otp ? strlen(otp) : 0;
+
+    // Anything that is not a plausible OTP (e.g. a password typed at the
+    // prompt) is described by its length only
+    if (len <= OTP_SECRET_LENGTH || len > OTP_SECRET_LENGTH + OTP_MAX_ID_LENGTH ||
+        strspn(otp, "cbdefghijklnrtuvCBDEFGHIJKLNRTUV") != len) {
+        snprintf(out, out_len, "(%zu-character input)", len);
+        return out;
+    }
+    snprintf(out, out_len, "%.*s", (int)(len - OTP_SECRET_LENGTH), otp);
+    return out;
+}
@@ -0,0 +1,63 @@
+/*
+ * yubiapp_log.h - Buffered, level-gated logging for the PAM module
+ *
+ * Writing each log line with syslog() is a blocking send to /dev/log, so
+ * when journald falls behind every line adds to login latency. Records are
+ * instead collected in a fixed buffer during a PAM call and flushed once at
+ * the end, all of them in a single non-blocking sendmmsg() to /dev/log. If
+ * the log daemon cannot take them right away they are dropped rather than
+ * waited for. Without a datagram /dev/log, flushing falls back to syslog().
+ *
+ * The records look like those from pam_syslog(): facility LOG_AUTHPRIV,
+ * the host program's name as ident and a "pam_yubiapp(service:type): "
+ * prefix on the message.
+ */
+
+#ifndef YUBIAPP_LOG_H
+#define YUBIAPP_LOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+#define YA_LOG_MAX_RECORDS 32
+#define YA_LOG_BUFFER_SIZE 8192
+#define YA_LOG_MAX_LINE 1024
+#ifndef YA_LOG_PATH
+#define YA_LOG_PATH "/dev/log"
+#endif
+
+struct ya_log_record {
+    int priority;
+    time_t when;
+    size_t offset;
+    size_t len;
+};
+
+struct ya_log {
+    int max_priority;       /* records less severe than this are not kept */
+    char prefix[96];
+    struct ya_log_record records[YA_LOG_MAX_RECORDS];
+    int count;
+    unsigned int dropped;   /* records lost because the buffer was full */
+    char buf[YA_LOG_BUFFER_SIZE];
+    size_t used;
+};
+
+void ya_log_init(struct ya_log *log, int max_priority, const char *prefix);
+
+// Whether a record at this priority would be kept
+int ya_log_enabled(const struct ya_log *log, int priority);
+
+void ya_log_vadd(struct ya_log *log, int priority, const char *fmt, va_list ap);
+void ya_log_add(struct ya_log *log, int priority, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Send every buffered record and empty the buffer
+void ya_log_flush(struct ya_log *log);
+
+// Loggable form of an OTP: its public ID (the device identifier) only; the
+// one-time part is never logged. Returns out.
+const char *ya_log_otp_id(const char *otp, char *out, size_t out_len);
+
+#endif /* YUBIAPP_LOG_H */
@@ -0,0 +1,213 @@
+/*
+ * yubiapp_metrics.c - Shared login latency histograms and outcome counters
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "yubiapp_metrics.h"
+
+#define METRICS_MAGIC 0x59414d54  /* "YAMT" */
+#define METRICS_VERSION 4
+
+// Upper bounds of the finite buckets, in microseconds
+static const uint64_t bucket_bounds_us[YA_METRICS_BUCKETS - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000,
+};
+
+static const char *const phase_names[YA_PHASE_COUNT] = {
+    "dns", "connect", "tls", "server", "transfer", "total",
+};
+
+static const char *const outcome_names[YA_OUTCOME_COUNT] = {
+    "success", "auth_err", "system_err", "timeout", "rejected", "limited", "grant",
+};
+
+struct ya_metrics_state *ya_metrics_open(const char *path) {
+    if (!path) {
+        return NULL;
+    }
+    return ya_shm_map(path, sizeof(struct ya_metrics_state), METRICS_MAGIC, METRICS_VERSION);
+}
+
+void ya_metrics_close(struct ya_metrics_state *m) {
+    ya_shm_unmap(m, sizeof(struct ya_metrics_state));
+}
+
+void ya_metrics_observe(struct ya_histogram *h, uint64_t us) {
+    int i = 0;
+
+    if (!h) {
+        return;
+    }
+    while (i < YA_METRICS_BUCKETS - 1 && us > bucket_bounds_us[i]) {
+        i++;
+    }
+    __atomic_fetch_add(&h->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+}
+
+void ya_metrics_outcome(struct ya_metrics_state *m, enum ya_metrics_outcome outcome) {
+    if (m) {
+        __atomic_fetch_add(&m->outcomes[outcome], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void ya_metrics_login(struct ya_metrics_state *m, enum ya_metrics_outcome outcome, uint64_t us) {
+    if (!m) {
+        return;
+    }
+    ya_metrics_outcome(m, outcome);
+    ya_metrics_observe(&m->login, us);
+}
+
+// Difference of two cumulative curl timings, 0 if the later one is unset
+static uint64_t phase_us(curl_off_t from, curl_off_t to) {
+    return to > from ? (uint64_t)(to - from) : 0;
+}
+
+void ya_metrics_transfer(struct ya_metrics_state *m, CURL *curl) {
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, start = 0, total = 0;
+    long new_connections = 0;
+
+    if (!m) {
+        return;
+    }
+
+    // Each timing is measured from the start of the transfer
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &start);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+
+    // A reused connection would report (near) zero for the setup phases
+    if (new_connections > 0) {
+        ya_metrics_observe(&m->phases[YA_PHASE_DNS], (uint64_t)dns);
+        ya_metrics_observe(&m->phases[YA_PHASE_CONNECT], phase_us(dns, connect));
+        if (tls > 0) {
+            ya_metrics_observe(&m->phases[YA_PHASE_TLS], phase_us(connect, tls));
+        }
+    }
+    ya_metrics_observe(&m->phases[YA_PHASE_SERVER], phase_us(pretransfer, start));
+    ya_metrics_observe(&m->phases[YA_PHASE_TRANSFER], phase_us(start, total));
+    ya_metrics_observe(&m->phases[YA_PHASE_TOTAL], (uint64_t)total);
+}
+
+void ya_metrics_exchange(struct ya_metrics_state *m, uint64_t connect_us, uint64_t first_byte_us, uint64_t total_us) {
+    if (!m) {
+        return;
+    }
+    ya_metrics_observe(&m->phases[YA_PHASE_CONNECT], connect_us);
+    ya_metrics_observe(&m->phases[YA_PHASE_SERVER], first_byte_us > connect_us ? first_byte_us - connect_us : 0);
+    ya_metrics_observe(&m->phases[YA_PHASE_TRANSFER], total_us > first_byte_us ? total_us - first_byte_us : 0);
+    ya_metrics_observe(&m->phases[YA_PHASE_TOTAL], total_us);
+}
+
+struct output {
+    char *buf;
+    size_t cap;
+    size_t len;
+    int overflow;
+};
+
+static void emit(struct output *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void emit(struct output *out, const char *fmt, ...) {
+    va_list ap;
+
+    if (out->overflow) {
+        return;
+    }
+    va_start(ap, fmt);
+    int n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= out->cap - out->len) {
+        out->overflow = 1;
+        return;
+    }
+    out->len += (size_t)n;
+}
+
+// Seconds with microsecond precision, as Prometheus expects
+static void emit_seconds(struct output *out, uint64_t us) {
+    emit(out, "%llu.%06llu", (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+}
+
+// Bucket bound in its shortest form ("0.0025", "1"), so le labels match
+// what client libraries emit
+static void emit_bound(struct output *out, uint64_t us) {
+    char frac[8];
+    int n = snprintf(frac, sizeof(frac), "%06llu", (unsigned long long)(us % 1000000));
+
+    while (n > 0 && frac[n - 1] == '0') {
+        frac[--n] = '\0';
+    }
+    if (n > 0) {
+        emit(out, "%llu.%s", (unsigned long long)(us / 1000000), frac);
+    } else {
+        emit(out, "%llu", (unsigned long long)(us / 1000000));
+    }
+}
+
+// One histogram's series. label is either empty or `name="value",`.
+static void emit_histogram(struct output *out, const char *name, const char *label,
+                           const struct ya_histogram *h) {
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < YA_METRICS_BUCKETS; i++) {
+        cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        emit(out, "%s_bucket{%sle=\"", name, label);
+        if (i < YA_METRICS_BUCKETS - 1) {
+            emit_bound(out, bucket_bounds_us[i]);
+        } else {
+            emit(out, "+Inf");
+        }
+        emit(out, "\"} %llu\n", (unsigned long long)cumulative);
+    }
+
+    // The count is the +Inf bucket
+    uint64_t sum = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    if (label[0]) {
+        size_t n = strlen(label) - 1;  /* drop the trailing comma */
+        emit(out, "%s_sum{%.*s} ", name, (int)n, label);
+        emit_seconds(out, sum);
+        emit(out, "\n%s_count{%.*s} %llu\n", name, (int)n, label, (unsigned long long)cumulative);
+    } else {
+        emit(out, "%s_sum ", name);
+        emit_seconds(out, sum);
+        emit(out, "\n%s_count %llu\n", name, (unsigned long long)cumulative);
+    }
+}
+
+int ya_metrics_format(const struct ya_metrics_state *m, char *buf, size_t cap) {
+    struct output out = {buf, cap, 0, 0};
+    char label[32];
+
+    emit(&out, "# HELP yubiapp_logins_total PAM authentications by outcome.\n"
+               "# TYPE yubiapp_logins_total counter\n");
+    for (int i = 0; i < YA_OUTCOME_COUNT; i++) {
+        emit(&out, "yubiapp_logins_total{outcome=\"%s\"} %llu\n", outcome_names[i],
+             (unsigned long long)__atomic_load_n(&m->outcomes[i], __ATOMIC_RELAXED));
+    }
+
+    emit(&out, "# HELP yubiapp_login_duration_seconds Time from OTP entry to the PAM result.\n"
+               "# TYPE yubiapp_login_duration_seconds histogram\n");
+    emit_histogram(&out, "yubiapp_login_duration_seconds", "", &m->login);
+
+    emit(&out, "# HELP yubiapp_request_phase_duration_seconds API request time by phase.\n"
+               "# TYPE yubiapp_request_phase_duration_seconds histogram\n");
+    for (int i = 0; i < YA_PHASE_COUNT; i++) {
+        snprintf(label, sizeof(label), "phase=\"%s\",", phase_names[i]);
+        emit_histogram(&out, "yubiapp_request_phase_duration_seconds", label, &m->phases[i]);
+    }
+
+    if (out.overflow) {
+        return -1;
+    }
+    return (int)out.len;
+}
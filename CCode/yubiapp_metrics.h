@@ -0,0 +1,87 @@
+/*
+ * yubiapp_metrics.h - Shared login latency histograms and outcome counters
+ *
+ * Every PAM process (and the broker) adds to the same state file: one
+ * histogram per phase of the HTTP exchange, taken from libcurl's
+ * CURLINFO_*_TIME_T timings or the built-in client's, a histogram of the
+ * whole authentication as seen by the module, and a counter per outcome.
+ * Updates are relaxed __atomic adds, so recording never blocks and the
+ * counters only ever grow; a concurrent reader may see a bucket incremented
+ * before its sum, which Prometheus tolerates. yubiappd renders the file in
+ * the Prometheus text format.
+ */
+
+#ifndef YUBIAPP_METRICS_H
+#define YUBIAPP_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yubiapp_curl.h"
+#include "yubiapp_shm.h"
+
+#define YA_METRICS_STATE YA_STATE_DIR "/metrics"
+
+// Finite bucket bounds are in yubiapp_metrics.c; the last bucket is +Inf
+#define YA_METRICS_BUCKETS 15
+
+// Phases of one HTTP exchange. dns, connect and tls are only recorded for
+// requests that opened a new connection (tls only for HTTPS).
+enum ya_metrics_phase {
+    YA_PHASE_DNS = 0,       /* name resolution */
+    YA_PHASE_CONNECT,       /* TCP connect */
+    YA_PHASE_TLS,           /* TLS handshake */
+    YA_PHASE_SERVER,        /* request sent to first response byte: API and Yubico upstream */
+    YA_PHASE_TRANSFER,      /* first to last response byte */
+    YA_PHASE_TOTAL,         /* whole request */
+    YA_PHASE_COUNT,
+};
+
+// Final result of an authentication as the module saw it
+enum ya_metrics_outcome {
+    YA_OUTCOME_SUCCESS = 0,
+    YA_OUTCOME_AUTH_ERR,    /* the API rejected the OTP or permission */
+    YA_OUTCOME_SYSTEM_ERR,  /* no usable answer: API unreachable, 5xx, bad response */
+    YA_OUTCOME_TIMEOUT,     /* no answer in time */
+    YA_OUTCOME_REJECTED,    /* refused before any request: malformed or replayed OTP */
+    YA_OUTCOME_LIMITED,     /* refused before any request: source or device over its rate limit */
+    YA_OUTCOME_GRANT,       /* accepted locally with a stored grant, no OTP asked */
+    YA_OUTCOME_COUNT,
+};
+
+struct ya_histogram {
+    uint64_t buckets[YA_METRICS_BUCKETS];  /* not cumulative; their total is the count */
+    uint64_t sum_us;
+};
+
+struct ya_metrics_state {
+    struct ya_shm_header hdr;
+    uint64_t outcomes[YA_OUTCOME_COUNT];
+    struct ya_histogram login;              /* OTP entered to PAM result */
+    struct ya_histogram phases[YA_PHASE_COUNT];
+};
+
+// Map the state file; NULL (metrics off) on any error
+struct ya_metrics_state *ya_metrics_open(const char *path);
+void ya_metrics_close(struct ya_metrics_state *m);
+
+// Record one sample. Every function accepts a NULL state (or histogram).
+void ya_metrics_observe(struct ya_histogram *h, uint64_t us);
+void ya_metrics_outcome(struct ya_metrics_state *m, enum ya_metrics_outcome outcome);
+
+// Record an authentication that reached the API: its outcome and duration
+void ya_metrics_login(struct ya_metrics_state *m, enum ya_metrics_outcome outcome, uint64_t us);
+
+// Record the phase timings of a completed transfer
+void ya_metrics_transfer(struct ya_metrics_state *m, CURL *curl);
+
+// Record the timings of an exchange made by the built-in client
+// (yubiapp_http.h), each from its start: connected, first response byte,
+// last response byte. It resolves no names and speaks no TLS.
+void ya_metrics_exchange(struct ya_metrics_state *m, uint64_t connect_us, uint64_t first_byte_us, uint64_t total_us);
+
+// Render in the Prometheus text exposition format into buf. Returns the
+// length written, or -1 if cap is too small.
+int ya_metrics_format(const struct ya_metrics_state *m, char *buf, size_t cap);
+
+#endif /* YUBIAPP_METRICS_H */
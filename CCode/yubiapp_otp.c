@@ -0,0 +1,324 @@
+/*
+ * yubiapp_otp.c - Local Yubico OTP verification for offline mode
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "yubiapp_otp.h"
+
+#define COUNTERS_MAGIC 0x59414f43  /* "YAOC" */
+#define COUNTERS_VERSION 1
+
+static const char modhex_digits[] = "cbdefghijklnrtuv";
+
+static const unsigned char sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+// Multiply in GF(2^8) modulo the AES polynomial
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    unsigned char r = 0;
+
+    while (b) {
+        if (b & 1) {
+            r ^= a;
+        }
+        a = (unsigned char)((a << 1) ^ ((a & 0x80) ? 0x1b : 0));
+        b >>= 1;
+    }
+    return r;
+}
+
+// AES-128 key schedule: 11 round keys of 16 bytes
+static void aes_expand_key(const unsigned char key[16], unsigned char rk[176]) {
+    unsigned char rcon = 1;
+
+    memcpy(rk, key, 16);
+    for (int i = 16; i < 176; i += 4) {
+        unsigned char t[4] = {rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1]};
+        if (i % 16 == 0) {
+            unsigned char first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = gf_mul(rcon, 2);
+        }
+        for (int j = 0; j < 4; j++) {
+            rk[i + j] = rk[i - 16 + j] ^ t[j];
+        }
+    }
+}
+
+// Decrypt one block with AES-128. There is one block per login, so the
+// straightforward byte-wise form is fast enough.
+static void aes_decrypt_block(const unsigned char key[16], const unsigned char in[16], unsigned char out[16]) {
+    unsigned char rk[176];
+    unsigned char inv_sbox[256];
+    unsigned char s[16], t[16];
+
+    for (int i = 0; i < 256; i++) {
+        inv_sbox[sbox[i]] = (unsigned char)i;
+    }
+    aes_expand_key(key, rk);
+
+    for (int i = 0; i < 16; i++) {
+        s[i] = in[i] ^ rk[160 + i];
+    }
+    for (int round = 9; round >= 0; round--) {
+        // InvShiftRows and InvSubBytes; byte r + 4c is row r, column c
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                t[r + 4 * ((c + r) % 4)] = inv_sbox[s[r + 4 * c]];
+            }
+        }
+        for (int i = 0; i < 16; i++) {
+            s[i] = t[i] ^ rk[16 * round + i];
+        }
+        if (round == 0) {
+            break;
+        }
+        // InvMixColumns
+        for (int c = 0; c < 4; c++) {
+            unsigned char *col = s + 4 * c;
+            unsigned char a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+            col[0] = gf_mul(a0, 14) ^ gf_mul(a1, 11) ^ gf_mul(a2, 13) ^ gf_mul(a3, 9);
+            col[1] = gf_mul(a0, 9) ^ gf_mul(a1, 14) ^ gf_mul(a2, 11) ^ gf_mul(a3, 13);
+            col[2] = gf_mul(a0, 13) ^ gf_mul(a1, 9) ^ gf_mul(a2, 14) ^ gf_mul(a3, 11);
+            col[3] = gf_mul(a0, 11) ^ gf_mul(a1, 13) ^ gf_mul(a2, 9) ^ gf_mul(a3, 14);
+        }
+    }
+    memcpy(out, s, 16);
+    memset(rk, 0, sizeof(rk));
+}
+
+// CRC-16 (ISO 13239) as computed by the key; over a valid token, including
+// its own CRC, the residue is 0xf0b8
+static uint16_t otp_crc(const unsigned char *data, size_t len) {
+    uint16_t crc = 0xffff;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j++) {
+            int lsb = crc & 1;
+            crc >>= 1;
+            if (lsb) {
+                crc ^= 0x8408;
+            }
+        }
+    }
+    return crc;
+}
+
+static int modhex_decode(const char *in, size_t len, unsigned char *out) {
+    for (size_t i = 0; i < len; i++) {
+        const char *p = strchr(modhex_digits, in[i]);
+        if (!in[i] || !p) {
+            return -1;
+        }
+        int v = (int)(p - modhex_digits);
+        if (i % 2 == 0) {
+            out[i / 2] = (unsigned char)(v << 4);
+        } else {
+            out[i / 2] |= (unsigned char)v;
+        }
+    }
+    return 0;
+}
+
+static int hex_decode(const char *in, unsigned char *out, size_t out_len) {
+    if (strlen(in) != out_len * 2) {
+        return -1;
+    }
+    for (size_t i = 0; i < out_len; i++) {
+        unsigned int byte;
+        if (sscanf(in + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = (unsigned char)byte;
+    }
+    return 0;
+}
+
+int ya_otp_well_formed(const char *otp) {
+    size_t len = strspn(otp, modhex_digits);
+    return len == YA_OTP_LENGTH && otp[len] == '\0';
+}
+
+int ya_otp_decrypt(const char *otp, const unsigned char key[16], struct ya_otp_token *token) {
+    unsigned char cipher[16], plain[16];
+    size_t len = strlen(otp);
+
+    if (len < YA_OTP_TOKEN_LENGTH || len > YA_OTP_TOKEN_LENGTH + YA_OTP_MAX_PUBLIC_ID ||
+        modhex_decode(otp + len - YA_OTP_TOKEN_LENGTH, YA_OTP_TOKEN_LENGTH, cipher) != 0) {
+        return -1;
+    }
+    aes_decrypt_block(key, cipher, plain);
+    if (otp_crc(plain, sizeof(plain)) != 0xf0b8) {
+        return -1;
+    }
+
+    // uid(6) | use counter(2, LE) | timestamp(3, LE) | session counter(1) | random(2) | crc(2)
+    memcpy(token->private_id, plain, 6);
+    token->counter = ((uint32_t)plain[6] | (uint32_t)plain[7] << 8) << 8 | plain[11];
+    token->timestamp = (uint32_t)plain[8] | (uint32_t)plain[9] << 8 | (uint32_t)plain[10] << 16;
+    token->random = (uint16_t)(plain[12] | plain[13] << 8);
+    memset(plain, 0, sizeof(plain));
+    return 0;
+}
+
+// Split the next tab-separated field off *p; "-" reads as empty (NULL)
+static char *next_field(char **p) {
+    char *field = *p;
+
+    if (!field) {
+        return NULL;
+    }
+    char *tab = strchr(field, '\t');
+    if (tab) {
+        *tab = '\0';
+        *p = tab + 1;
+    } else {
+        *p = NULL;
+    }
+    return strcmp(field, "-") == 0 || !field[0] ? NULL : field;
+}
+
+static int parse_device(char *line, struct ya_otp_device *dev) {
+    char *p = line;
+    char *fields[13];
+
+    for (int i = 0; i < 13; i++) {
+        fields[i] = next_field(&p);
+    }
+    memset(dev, 0, sizeof(*dev));
+    dev->public_id = fields[0];
+    if (!fields[1] || hex_decode(fields[1], dev->aes_key, sizeof(dev->aes_key)) != 0 ||
+        !fields[2] || hex_decode(fields[2], dev->private_id, sizeof(dev->private_id)) != 0 ||
+        !fields[4]) {
+        return -1;
+    }
+    dev->counter = fields[3] ? (uint32_t)strtoul(fields[3], NULL, 10) : 0;
+    dev->device_id = fields[4];
+    dev->user_id = fields[5];
+    dev->username = fields[6];
+    dev->email = fields[7];
+    dev->first_name = fields[8];
+    dev->last_name = fields[9];
+    dev->active = fields[10] && strcmp(fields[10], "1") == 0;
+    dev->roles = fields[11];
+    dev->permissions = fields[12];
+    return 0;
+}
+
+int ya_otp_find(const char *path, const char *otp, struct ya_otp_device *dev, char *line, size_t line_len) {
+    struct stat st;
+    size_t len = strlen(otp);
+
+    if (len <= YA_OTP_TOKEN_LENGTH || len > YA_OTP_TOKEN_LENGTH + YA_OTP_MAX_PUBLIC_ID) {
+        return 1;  /* no public ID to look up */
+    }
+    size_t id_len = len - YA_OTP_TOKEN_LENGTH;
+
+    // The keys are secrets: only a root-owned file nobody else can read is used
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & 077) != 0) {
+        close(fd);
+        return -1;
+    }
+    FILE *f = fdopen(fd, "r");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+
+    int rc = 1;
+    while (fgets(line, (int)line_len, f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || strncmp(line, otp, id_len) != 0 || line[id_len] != '\t') {
+            continue;
+        }
+        rc = parse_device(line, dev) == 0 ? 0 : -1;
+        break;
+    }
+    fclose(f);
+    return rc;
+}
+
+int ya_otp_list_has(const char *list, const char *item) {
+    size_t len = strlen(item);
+
+    for (const char *p = list; p && *p;) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && memcmp(p, item, len) == 0) {
+            return 1;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+struct ya_otp_counters *ya_otp_counters_open(const char *path) {
+    return ya_shm_map(path, sizeof(struct ya_otp_counters), COUNTERS_MAGIC, COUNTERS_VERSION);
+}
+
+void ya_otp_counters_close(struct ya_otp_counters *c) {
+    ya_shm_unmap(c, sizeof(struct ya_otp_counters));
+}
+
+int ya_otp_counter_advance(struct ya_otp_counters *c, const char *public_id, uint32_t floor,
+                           uint32_t counter) {
+    uint64_t key = ya_hash(public_id, strlen(public_id));
+    struct ya_otp_slot *slot = NULL;
+
+    // Open addressing; a slot is claimed by setting its key
+    for (unsigned int i = 0; i < YA_OTP_COUNTER_SLOTS && !slot; i++) {
+        struct ya_otp_slot *s = &c->slots[(key + i) % YA_OTP_COUNTER_SLOTS];
+        uint64_t current = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (current == 0 &&
+            __atomic_compare_exchange_n(&s->key, &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            current = key;
+        }
+        if (current == key) {
+            slot = s;
+        }
+    }
+    if (!slot) {
+        return -2;
+    }
+
+    // Two logins racing with the same OTP: exactly one compare-and-swap wins
+    uint32_t seen = __atomic_load_n(&slot->counter, __ATOMIC_ACQUIRE);
+    do {
+        if (counter <= seen || counter <= floor) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&slot->counter, &seen, counter, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 0;
+}
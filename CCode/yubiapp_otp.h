@@ -0,0 +1,101 @@
+/*
+ * yubiapp_otp.h - Local Yubico OTP verification for offline mode
+ *
+ * For self-provisioned YubiKeys the AES key is ours, so an OTP can be
+ * checked without asking the API (and YubiCloud): decrypt the 16-byte
+ * token, check its CRC and private ID, and require the usage counter to be
+ * higher than any seen before. The keys and each device's identity come from
+ * a root-only file exported by `yubiapp-cli device export-offline`; the
+ * highest counter seen per device is kept in a shared state file outside
+ * tmpfs, so a replay is refused by every PAM process and across reboots.
+ *
+ * Key file: one device per line, tab-separated, `#` starts a comment:
+ *
+ *   public_id  aes_key  private_id  counter  device_id  user_id  username
+ *   email  first_name  last_name  active  roles  permissions
+ *
+ * aes_key and private_id are hex, counter is the highest counter the API
+ * has seen (a floor for the local state), roles and permissions are
+ * comma-separated (`resource:action`), and `-` marks an empty field.
+ */
+
+#ifndef YUBIAPP_OTP_H
+#define YUBIAPP_OTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_OTP_KEYS "/etc/yubiapp/offline-keys"
+#define YA_OTP_COUNTERS "/var/lib/yubiapp/otp-counters"
+#define YA_OTP_TOKEN_LENGTH 32      /* modhex characters after the public ID */
+#define YA_OTP_LENGTH 44            /* 12-character public ID + token, as the API requires */
+#define YA_OTP_MAX_PUBLIC_ID 16
+#define YA_OTP_COUNTER_SLOTS 1024
+#define YA_OTP_LINE_MAX 2048
+
+// A decrypted OTP token
+struct ya_otp_token {
+    unsigned char private_id[6];
+    uint32_t counter;               /* usage counter << 8 | session counter */
+    uint16_t random;
+    uint32_t timestamp;             /* 8 Hz, since the key was powered up */
+};
+
+// A device entry from the key file; the strings point into the line buffer
+struct ya_otp_device {
+    const char *public_id;
+    unsigned char aes_key[16];
+    unsigned char private_id[6];
+    uint32_t counter;
+    const char *device_id;
+    const char *user_id;
+    const char *username;
+    const char *email;
+    const char *first_name;
+    const char *last_name;
+    int active;
+    char *roles;                    /* comma-separated, NULL if none */
+    const char *permissions;        /* comma-separated, NULL if none */
+};
+
+struct ya_otp_slot {
+    uint64_t key;                   /* ya_hash of the public ID, 0 = free */
+    uint32_t counter;
+    uint32_t reserved;
+};
+
+struct ya_otp_counters {
+    struct ya_shm_header hdr;
+    struct ya_otp_slot slots[YA_OTP_COUNTER_SLOTS];
+};
+
+// Check that an OTP can be valid at all: YA_OTP_LENGTH modhex characters.
+// Anything else is rejected before it costs a request.
+int ya_otp_well_formed(const char *otp);
+
+// Decrypt and check an OTP (public ID + 32 modhex characters). Returns 0,
+// or -1 if it is malformed or its CRC does not match the key.
+int ya_otp_decrypt(const char *otp, const unsigned char key[16], struct ya_otp_token *token);
+
+// Find the key file entry for the OTP's public ID. line (at least
+// YA_OTP_LINE_MAX bytes) holds the entry afterwards. Returns 0 if found,
+// 1 if the device is not enrolled for offline use, -1 if the file cannot be
+// used (missing, not root-only, or a malformed entry for this device).
+int ya_otp_find(const char *path, const char *otp, struct ya_otp_device *dev, char *line, size_t line_len);
+
+// Check whether a comma-separated list contains item
+int ya_otp_list_has(const char *list, const char *item);
+
+// Map the counter state; NULL on error
+struct ya_otp_counters *ya_otp_counters_open(const char *path);
+void ya_otp_counters_close(struct ya_otp_counters *c);
+
+// Record counter as the latest for the device, unless it is not above both
+// the last one seen and floor. Returns 0, -1 for a replayed (or older) OTP,
+// -2 if the table is full.
+int ya_otp_counter_advance(struct ya_otp_counters *c, const char *public_id, uint32_t floor,
+                           uint32_t counter);
+
+#endif /* YUBIAPP_OTP_H */
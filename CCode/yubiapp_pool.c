@@ -0,0 +1,134 @@
+/*
+ * yubiapp_pool.c - Process-wide pool of libcurl handles
+ */
+
+#include <pthread.h>
+
+#include "yubiapp_pool.h"
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURL *idle[YA_POOL_MAX_IDLE];
+static int idle_count;
+
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static int initialized;
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle;
+    (void)userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+// Runs once, on the first request for a handle. curl_global_init is not
+// thread-safe (before libcurl 7.84), but only this module's threads can be
+// using libcurl, which it loaded itself.
+static void pool_setup(void) {
+    if (ya_curl_load() != 0 || curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        return;
+    }
+    initialized = 1;
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
+    share = curl_share_init();
+    if (!share) {
+        return;
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+// Whether libcurl is set up, setting it up on the first call
+static int pool_ready(void) {
+    pthread_once(&setup_once, pool_setup);
+    return initialized;
+}
+
+// Runs when the module is unloaded; no PAM call is in progress then
+__attribute__((destructor)) static void pool_fini(void) {
+    for (int i = 0; i < idle_count; i++) {
+        curl_easy_cleanup(idle[i]);
+    }
+    idle_count = 0;
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    if (initialized) {
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&share_locks[i]);
+        }
+        curl_global_cleanup();
+        initialized = 0;
+    }
+}
+
+// Function to set the options every pooled handle carries
+static void attach(CURL *curl) {
+    if (share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+}
+
+CURL *ya_pool_get(void) {
+    CURL *curl = NULL;
+
+    if (!pool_ready()) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (idle_count > 0) {
+        curl = idle[--idle_count];
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!curl) {
+        curl = curl_easy_init();
+        if (curl) {
+            attach(curl);
+        }
+    }
+    return curl;
+}
+
+void ya_pool_put(CURL *curl) {
+    if (!curl) {
+        return;
+    }
+    ya_pool_reset(curl);
+
+    pthread_mutex_lock(&pool_lock);
+    if (idle_count < YA_POOL_MAX_IDLE) {
+        idle[idle_count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
+void ya_pool_reset(CURL *curl) {
+    curl_easy_reset(curl);
+    attach(curl);
+}
+
+CURLSH *ya_pool_share(void) {
+    return pool_ready() ? share : NULL;
+}
@@ -0,0 +1,40 @@
+/*
+ * yubiapp_pool.h - Process-wide pool of libcurl handles
+ *
+ * sshd loads the module into a fresh process for every login, but other
+ * PAM hosts (VPN concentrators, RADIUS bridges) run many authentications
+ * at once on threads of one long-lived process. For them, setting up a
+ * handle and connecting to the API on every call is the main cost. The pool
+ * keeps idle easy handles for reuse, and all handles share one curl share
+ * holding the DNS cache, TLS sessions and connection pool, guarded by one
+ * mutex per kind of shared data. A login on one thread reuses the
+ * connection and TLS session a login on another thread set up.
+ *
+ * libcurl is loaded (yubiapp_curl.h) and its global state initialised the
+ * first time a handle or the share is asked for, under pthread_once, and
+ * released when the module is unloaded (a library destructor). Processes
+ * that never need libcurl never load it.
+ */
+
+#ifndef YUBIAPP_POOL_H
+#define YUBIAPP_POOL_H
+
+#include "yubiapp_curl.h"
+
+#define YA_POOL_MAX_IDLE 16   /* idle handles kept; more are cleaned up */
+
+// Get a handle attached to the shared caches; NULL on failure, including
+// when libcurl cannot be loaded
+CURL *ya_pool_get(void);
+
+// Return a handle to the pool (NULL is ignored). It must not be in a multi
+// handle.
+void ya_pool_put(CURL *curl);
+
+// Reset a handle's options, keeping it attached to the shared caches
+void ya_pool_reset(CURL *curl);
+
+// The process-wide share, NULL if it (or libcurl) could not be set up
+CURLSH *ya_pool_share(void);
+
+#endif /* YUBIAPP_POOL_H */
@@ -0,0 +1,186 @@
+/*
+ * yubiapp_proto.c - Wire protocol between pam_yubiapp and the yubiappd broker
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "yubiapp_proto.h"
+
+static void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void ya_msg_init(struct ya_msg *msg, unsigned char *buf, size_t cap, int type) {
+    msg->buf = buf;
+    msg->cap = cap;
+    msg->len = 0;
+    msg->type = type;
+}
+
+int ya_msg_put(struct ya_msg *msg, int tag, const void *data, size_t len) {
+    if (len > 0xffff || YA_PROTO_HEADER_SIZE + msg->len + 3 + len > msg->cap ||
+        msg->len + 3 + len > YA_PROTO_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    unsigned char *p = msg->buf + YA_PROTO_HEADER_SIZE + msg->len;
+    p[0] = (unsigned char)tag;
+    put_be16(p + 1, (uint16_t)len);
+    if (len > 0) {
+        memcpy(p + 3, data, len);
+    }
+    msg->len += 3 + len;
+    return 0;
+}
+
+int ya_msg_put_u8(struct ya_msg *msg, int tag, uint8_t value) {
+    return ya_msg_put(msg, tag, &value, 1);
+}
+
+int ya_msg_put_u16(struct ya_msg *msg, int tag, uint16_t value) {
+    unsigned char v[2];
+    put_be16(v, value);
+    return ya_msg_put(msg, tag, v, 2);
+}
+
+int ya_msg_get(const struct ya_msg *msg, int tag, const unsigned char **data, size_t *len) {
+    const unsigned char *p = msg->buf + YA_PROTO_HEADER_SIZE;
+    const unsigned char *end = p + msg->len;
+
+    while (end - p >= 3) {
+        size_t flen = get_be16(p + 1);
+        if ((size_t)(end - p - 3) < flen) {
+            break;
+        }
+        if (p[0] == tag) {
+            *data = p + 3;
+            *len = flen;
+            return 0;
+        }
+        p += 3 + flen;
+    }
+    return -1;
+}
+
+int ya_msg_get_u8(const struct ya_msg *msg, int tag, uint8_t *value) {
+    const unsigned char *data;
+    size_t len;
+
+    if (ya_msg_get(msg, tag, &data, &len) != 0 || len != 1) {
+        return -1;
+    }
+    *value = data[0];
+    return 0;
+}
+
+int ya_msg_get_u16(const struct ya_msg *msg, int tag, uint16_t *value) {
+    const unsigned char *data;
+    size_t len;
+
+    if (ya_msg_get(msg, tag, &data, &len) != 0 || len != 2) {
+        return -1;
+    }
+    *value = get_be16(data);
+    return 0;
+}
+
+// Write the whole buffer, retrying on EINTR and short writes. MSG_NOSIGNAL
+// keeps a dead peer from raising SIGPIPE in the host process (e.g. sshd).
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Read exactly len bytes. Returns 1 on EOF before the first byte.
+static int read_full(int fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            if (got == 0) {
+                return 1;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+int ya_msg_send(int fd, struct ya_msg *msg) {
+    msg->buf[0] = YA_PROTO_MAGIC;
+    msg->buf[1] = YA_PROTO_VERSION;
+    msg->buf[2] = (unsigned char)msg->type;
+    msg->buf[3] = 0;
+    put_be32(msg->buf + 4, (uint32_t)msg->len);
+    return write_full(fd, msg->buf, YA_PROTO_HEADER_SIZE + msg->len);
+}
+
+int ya_msg_recv(int fd, struct ya_msg *msg) {
+    int rc = read_full(fd, msg->buf, YA_PROTO_HEADER_SIZE);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (msg->buf[0] != YA_PROTO_MAGIC || msg->buf[1] != YA_PROTO_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    uint32_t len = get_be32(msg->buf + 4);
+    if (len > YA_PROTO_MAX_PAYLOAD || YA_PROTO_HEADER_SIZE + (size_t)len > msg->cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    msg->type = msg->buf[2];
+    msg->len = len;
+    if (len > 0) {
+        rc = read_full(fd, msg->buf + YA_PROTO_HEADER_SIZE, len);
+        if (rc != 0) {
+            if (rc == 1) {
+                errno = EPIPE;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
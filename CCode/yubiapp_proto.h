@@ -0,0 +1,81 @@
+/*
+ * yubiapp_proto.h - Wire protocol between pam_yubiapp and the yubiappd broker
+ *
+ * Every message is an 8-byte header followed by a payload of TLV fields:
+ *
+ *   header:  magic (1) | version (1) | type (1) | flags (1) | length (4, BE)
+ *   field:   tag (1) | length (2, BE) | value
+ *
+ * Unknown tags are skipped so new fields can be added without a version bump.
+ */
+
+#ifndef YUBIAPP_PROTO_H
+#define YUBIAPP_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YUBIAPP_BROKER_SOCKET "/run/yubiappd/yubiappd.sock"
+
+#define YA_PROTO_MAGIC 0x59  /* 'Y' */
+#define YA_PROTO_VERSION 1
+#define YA_PROTO_HEADER_SIZE 8
+#define YA_PROTO_MAX_PAYLOAD 65536
+#define YA_PROTO_MAX_CONTENT_TYPE 128  /* longest YA_TAG_CONTENT_TYPE relayed */
+
+// Message types
+enum ya_msg_type {
+    YA_MSG_AUTH_REQUEST = 1,
+    YA_MSG_AUTH_RESPONSE = 2,
+    YA_MSG_SESSION_EVENT = 3,  /* one YA_TAG_EVENT; the broker sends no reply */
+};
+
+// Field tags
+enum ya_field_tag {
+    YA_TAG_OTP = 0x01,
+    YA_TAG_PERMISSION = 0x02,
+    YA_TAG_ACCEPT = 0x03,     /* Accept header to send to the API */
+    YA_TAG_EVENT = 0x04,      /* session event, see yubiapp_events.h */
+    YA_TAG_GRANT_AUDIENCE = 0x05,     /* ask for a grant for this host, see yubiapp_grant.h */
+    YA_TAG_GRANT_PERMISSIONS = 0x06,  /* further permissions the grant should cover */
+    YA_TAG_PERMISSIONS = 0x07,        /* comma-separated permissions to evaluate, not require */
+    YA_TAG_STATUS = 0x10,     /* 1 byte, enum ya_broker_status */
+    YA_TAG_HTTP_CODE = 0x11,  /* 2 bytes, BE */
+    YA_TAG_BODY = 0x12,
+    YA_TAG_CONTENT_TYPE = 0x13,  /* Content-Type of the body, if the API sent one */
+};
+
+// Outcome of a brokered request, carried in YA_TAG_STATUS
+enum ya_broker_status {
+    YA_BROKER_OK = 0,                /* API answered; see HTTP code and body */
+    YA_BROKER_UPSTREAM_ERROR = 1,    /* API could not be reached */
+    YA_BROKER_BAD_REQUEST = 2,       /* malformed request from the client */
+    YA_BROKER_UPSTREAM_TIMEOUT = 3,  /* API did not answer in time */
+};
+
+// A message being built or parsed in a caller-owned buffer. The buffer
+// holds the header followed by the payload.
+struct ya_msg {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;   /* payload length */
+    int type;
+};
+
+void ya_msg_init(struct ya_msg *msg, unsigned char *buf, size_t cap, int type);
+int ya_msg_put(struct ya_msg *msg, int tag, const void *data, size_t len);
+int ya_msg_put_u8(struct ya_msg *msg, int tag, uint8_t value);
+int ya_msg_put_u16(struct ya_msg *msg, int tag, uint16_t value);
+
+// Look up the first field with the given tag. Returns 0 if found.
+int ya_msg_get(const struct ya_msg *msg, int tag, const unsigned char **data, size_t *len);
+int ya_msg_get_u8(const struct ya_msg *msg, int tag, uint8_t *value);
+int ya_msg_get_u16(const struct ya_msg *msg, int tag, uint16_t *value);
+
+// Blocking send/receive of a whole message. Timeouts are the caller's
+// responsibility (SO_SNDTIMEO / SO_RCVTIMEO). Return 0 on success, -1 on
+// error with errno set; ya_msg_recv returns 1 on a clean EOF before any byte.
+int ya_msg_send(int fd, struct ya_msg *msg);
+int ya_msg_recv(int fd, struct ya_msg *msg);
+
+#endif /* YUBIAPP_PROTO_H */
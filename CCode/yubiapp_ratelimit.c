@@ -0,0 +1,125 @@
+/*
+ * yubiapp_ratelimit.c - Shared token buckets per source address and device
+ */
+
+#include <string.h>
+
+#include "yubiapp_ratelimit.h"
+
+#define RATE_MAGIC 0x5941524c  /* "YARL" */
+#define RATE_VERSION 1
+
+#define TOKEN_SHIFT 10                          /* tokens are kept in 1/1024ths */
+#define TOKEN_ONE (1ULL << TOKEN_SHIFT)
+#define TOKENS_BITS 20                          /* deficit bits of a bucket word */
+#define TOKENS_MASK ((1ULL << TOKENS_BITS) - 1)
+#define MAX_ELAPSED_MS (24ULL * 3600 * 1000)    /* keeps the refill product small */
+
+struct ya_rate_state *ya_rate_open(const char *path) {
+    if (!path) {
+        return NULL;
+    }
+    return ya_shm_map(path, sizeof(struct ya_rate_state), RATE_MAGIC, RATE_VERSION);
+}
+
+void ya_rate_close(struct ya_rate_state *s) {
+    ya_shm_unmap(s, sizeof(struct ya_rate_state));
+}
+
+// Function to clamp a limit's burst to what a bucket word can hold
+static uint64_t burst_tokens(const struct ya_rate_limit *limit) {
+    unsigned int burst = limit->burst ? limit->burst : 1;
+    if (burst > YA_RATE_MAX_BURST) {
+        burst = YA_RATE_MAX_BURST;
+    }
+    return (uint64_t)burst << TOKEN_SHIFT;
+}
+
+// Function to compute how many tokens a bucket is short of full at now_ms.
+// Buckets store this deficit rather than the tokens left, so a free slot
+// (0) and a refilled bucket of any size both read as 0.
+static uint64_t bucket_deficit(uint64_t bucket, const struct ya_rate_limit *limit, uint64_t now_ms) {
+    uint64_t updated = bucket >> TOKENS_BITS;
+    uint64_t deficit = bucket & TOKENS_MASK;
+    uint64_t elapsed = now_ms > updated ? now_ms - updated : 0;
+
+    if (elapsed > MAX_ELAPSED_MS) {
+        elapsed = MAX_ELAPSED_MS;
+    }
+    uint64_t refill = elapsed * limit->per_minute * TOKEN_ONE / 60000;
+    return deficit > refill ? deficit - refill : 0;
+}
+
+// Function to find (or claim) the slot of a bucket; NULL if the table is
+// busy around it
+static struct ya_rate_slot *find_slot(struct ya_rate_state *s, uint64_t key,
+                                      const struct ya_rate_limit *limit, uint64_t now_ms) {
+    size_t base = (size_t)key & (YA_RATE_SLOTS - 1);
+
+    for (int p = 0; p < YA_RATE_PROBES; p++) {
+        struct ya_rate_slot *slot = &s->slots[(base + (size_t)p) & (YA_RATE_SLOTS - 1)];
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) {
+            return slot;
+        }
+    }
+
+    // Not present: take a free slot, or one whose bucket has refilled
+    for (int p = 0; p < YA_RATE_PROBES; p++) {
+        struct ya_rate_slot *slot = &s->slots[(base + (size_t)p) & (YA_RATE_SLOTS - 1)];
+        uint64_t cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        uint64_t bucket = __atomic_load_n(&slot->bucket, __ATOMIC_ACQUIRE);
+
+        if (cur != 0 && bucket_deficit(bucket, limit, now_ms) != 0) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&slot->key, &cur, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // Start the new key with a full bucket
+            __atomic_store_n(&slot->bucket, 0, __ATOMIC_RELEASE);
+            return slot;
+        }
+        if (cur == key) {
+            return slot;  // another process claimed it for the same bucket
+        }
+    }
+    return NULL;
+}
+
+// Function to take a token from (or give one back to) a bucket. Returns 0
+// if the bucket is empty.
+static int bucket_update(struct ya_rate_state *s, const char *name, const struct ya_rate_limit *limit,
+                         uint64_t now_ms, int take) {
+    if (!s || limit->per_minute == 0) {
+        return 1;
+    }
+
+    uint64_t key = ya_hash(name, strlen(name));
+    struct ya_rate_slot *slot = find_slot(s, key, limit, now_ms);
+    if (!slot) {
+        return 1;
+    }
+
+    uint64_t cur = __atomic_load_n(&slot->bucket, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t deficit = bucket_deficit(cur, limit, now_ms);
+        if (take) {
+            if (deficit + TOKEN_ONE > burst_tokens(limit)) {
+                return 0;
+            }
+            deficit += TOKEN_ONE;
+        } else {
+            deficit = deficit > TOKEN_ONE ? deficit - TOKEN_ONE : 0;
+        }
+        uint64_t next = deficit ? now_ms << TOKENS_BITS | deficit : 0;
+        if (__atomic_compare_exchange_n(&slot->bucket, &cur, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+}
+
+int ya_rate_take(struct ya_rate_state *s, const char *name, const struct ya_rate_limit *limit, uint64_t now_ms) {
+    return bucket_update(s, name, limit, now_ms, 1);
+}
+
+void ya_rate_refund(struct ya_rate_state *s, const char *name, const struct ya_rate_limit *limit, uint64_t now_ms) {
+    bucket_update(s, name, limit, now_ms, 0);
+}
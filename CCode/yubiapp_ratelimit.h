@@ -0,0 +1,67 @@
+/*
+ * yubiapp_ratelimit.h - Shared token buckets per source address and device
+ *
+ * Every authentication attempt takes a token from the bucket of its remote
+ * host (PAM_RHOST) and of the device public ID in the OTP; an attempt that
+ * finds either bucket empty fails at once, before it reaches the API. The
+ * buckets live in one shared state file used by all PAM processes, so a
+ * credential-stuffing burst spread over many sshd children is still counted
+ * once. A successful login gives its tokens back: busy hosts behind one
+ * address are only slowed down by their failures.
+ *
+ * A slot is a key (hash of the bucket name) and one 64-bit word holding the
+ * time of the last update (milliseconds, CLOCK_MONOTONIC) and how many
+ * tokens the bucket is short of full, in 1/1024ths, so a bucket is updated
+ * with a single compare and swap. A bucket that has filled up again is the
+ * same as no bucket, so its slot may be taken by another key. When every probed slot is busy the attempt
+ * is let through: the limiter never locks out a source because the table
+ * is full.
+ */
+
+#ifndef YUBIAPP_RATELIMIT_H
+#define YUBIAPP_RATELIMIT_H
+
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_RATE_STATE YA_STATE_DIR "/ratelimit"
+#define YA_RATE_SLOTS 4096          /* power of two */
+#define YA_RATE_PROBES 8
+#define YA_RATE_MAX_BURST 1000
+
+// Defaults: attempts per minute and burst size
+#define YA_RATE_RHOST_PER_MIN 30
+#define YA_RATE_RHOST_BURST 20
+#define YA_RATE_DEVICE_PER_MIN 10
+#define YA_RATE_DEVICE_BURST 5
+
+// A bucket's refill rate and size; per_minute 0 disables the limit
+struct ya_rate_limit {
+    unsigned int per_minute;
+    unsigned int burst;
+};
+
+struct ya_rate_slot {
+    uint64_t key;                   /* ya_hash of the bucket name, 0 = free */
+    uint64_t bucket;                /* updated_ms << 20 | missing tokens * 1024, 0 = full */
+};
+
+struct ya_rate_state {
+    struct ya_shm_header hdr;
+    struct ya_rate_slot slots[YA_RATE_SLOTS];
+};
+
+// Map the state file; NULL (limits off) on any error
+struct ya_rate_state *ya_rate_open(const char *path);
+void ya_rate_close(struct ya_rate_state *s);
+
+// Take a token from the named bucket. Returns 1 if the attempt may go
+// ahead, 0 if the bucket is empty. A NULL state or a disabled limit always
+// allows.
+int ya_rate_take(struct ya_rate_state *s, const char *name, const struct ya_rate_limit *limit, uint64_t now_ms);
+
+// Give back a token taken by ya_rate_take
+void ya_rate_refund(struct ya_rate_state *s, const char *name, const struct ya_rate_limit *limit, uint64_t now_ms);
+
+#endif /* YUBIAPP_RATELIMIT_H */
@@ -0,0 +1,74 @@
+/*
+ * yubiapp_replay.c - Shared filter of recently seen OTPs
+ */
+
+#include <string.h>
+
+#include "yubiapp_replay.h"
+
+#define REPLAY_MAGIC 0x59415250  /* "YARP" */
+#define REPLAY_VERSION 1
+#define REPLAY_RETRIES 4
+#define TAG_MASK 0xffffffff00000000ULL
+
+struct ya_replay_state *ya_replay_open(const char *path) {
+    if (!path) {
+        return NULL;
+    }
+    return ya_shm_map(path, sizeof(struct ya_replay_state), REPLAY_MAGIC, REPLAY_VERSION);
+}
+
+void ya_replay_close(struct ya_replay_state *s) {
+    ya_shm_unmap(s, sizeof(struct ya_replay_state));
+}
+
+// Function to check whether a slot value is still within the window
+static int entry_live(uint64_t entry, uint32_t now, uint32_t window) {
+    return entry != 0 && (uint32_t)(now - (uint32_t)entry) < window;
+}
+
+int ya_replay_check(struct ya_replay_state *s, const char *otp, uint64_t now, uint32_t window) {
+    if (!s) {
+        return 0;
+    }
+
+    uint64_t hash = ya_hash(otp, strlen(otp));
+    uint64_t tag = hash & TAG_MASK ? hash & TAG_MASK : 1ULL << 32;
+    uint32_t stamp = (uint32_t)now ? (uint32_t)now : 1;
+    uint64_t entry = tag | stamp;
+    size_t base = (size_t)hash & (YA_REPLAY_SLOTS - 1);
+
+    for (int attempt = 0; attempt < REPLAY_RETRIES; attempt++) {
+        uint64_t *victim = NULL;
+        uint64_t victim_entry = 0;
+
+        for (int p = 0; p < YA_REPLAY_PROBES; p++) {
+            uint64_t *slot = &s->slots[(base + (size_t)p) & (YA_REPLAY_SLOTS - 1)];
+            uint64_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+            if (entry_live(cur, stamp, window)) {
+                if ((cur & TAG_MASK) == tag) {
+                    return 1;
+                }
+                // Full neighbourhood: replace the oldest live entry
+                if (!victim || (entry_live(victim_entry, stamp, window) &&
+                                (uint32_t)(stamp - (uint32_t)cur) > (uint32_t)(stamp - (uint32_t)victim_entry))) {
+                    victim = slot;
+                    victim_entry = cur;
+                }
+            } else if (!victim || entry_live(victim_entry, stamp, window)) {
+                // The first free or expired slot is the one to claim
+                victim = slot;
+                victim_entry = cur;
+            }
+        }
+
+        // Losing the race means someone else changed the neighbourhood,
+        // possibly by recording this very OTP: look again
+        if (__atomic_compare_exchange_n(victim, &victim_entry, entry, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    return 0;
+}
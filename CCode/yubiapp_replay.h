@@ -0,0 +1,45 @@
+/*
+ * yubiapp_replay.h - Shared filter of recently seen OTPs
+ *
+ * A Yubico OTP is valid exactly once, so an OTP this host has already
+ * handed to the API (or verified offline) can be refused without asking
+ * again. Every PAM process records each well-formed OTP here before any
+ * network I/O and rejects one that is already present; replayed OTPs in a
+ * brute-force run are shed locally instead of costing an API and Yubico
+ * round trip each.
+ *
+ * Each slot is one 64-bit word, the high half of the OTP's hash and the
+ * Unix time it was seen, so a slot is claimed with a single compare and
+ * swap and two processes cannot both accept the same OTP. A lookup probes a
+ * few neighbouring slots; when all are taken the oldest entry is replaced.
+ * The filter only ever refuses OTPs that were really seen (or, once in about
+ * 2^44 lookups, one that collides): the API still checks everything it lets
+ * through.
+ */
+
+#ifndef YUBIAPP_REPLAY_H
+#define YUBIAPP_REPLAY_H
+
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_REPLAY_STATE YA_STATE_DIR "/replay"
+#define YA_REPLAY_SLOTS 8192        /* power of two */
+#define YA_REPLAY_PROBES 8
+#define YA_REPLAY_WINDOW 3600       /* seconds an OTP is remembered */
+
+struct ya_replay_state {
+    struct ya_shm_header hdr;
+    uint64_t slots[YA_REPLAY_SLOTS];    /* hash >> 32 << 32 | seen (Unix seconds), 0 = free */
+};
+
+// Map the state file; NULL (filter off) on any error
+struct ya_replay_state *ya_replay_open(const char *path);
+void ya_replay_close(struct ya_replay_state *s);
+
+// Record otp as seen at now. Returns 1 if it was already seen within
+// window seconds, 0 otherwise. Accepts a NULL state (returns 0).
+int ya_replay_check(struct ya_replay_state *s, const char *otp, uint64_t now, uint32_t window);
+
+#endif /* YUBIAPP_REPLAY_H */
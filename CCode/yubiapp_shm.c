@@ -0,0 +1,100 @@
+/*
+ * yubiapp_shm.c - Small shared state files mapped by every PAM process
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yubiapp_shm.h"
+
+// Create the parent directory (one level) if it is missing
+static void ensure_parent_dir(const char *path) {
+    char dir[PATH_MAX];
+
+    if (strlen(path) >= sizeof(dir)) {
+        return;
+    }
+    strcpy(dir, path);
+    mkdir(dirname(dir), 0700);
+}
+
+void *ya_shm_map(const char *path, size_t size, uint32_t magic, uint32_t version) {
+    struct stat st;
+
+    ensure_parent_dir(path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 077) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Growing a fresh file zero-fills it; concurrent creators agree on size
+    if ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Claim a fresh file, or check that an existing one has our layout
+    struct ya_shm_header *hdr = (struct ya_shm_header *)addr;
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&hdr->magic, &expected, magic, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        expected != magic) {
+        munmap(addr, size);
+        return NULL;
+    }
+    uint32_t ver = 0;
+    if (!__atomic_compare_exchange_n(&hdr->version, &ver, version, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        ver != version) {
+        munmap(addr, size);
+        return NULL;
+    }
+
+    return addr;
+}
+
+void ya_shm_unmap(void *addr, size_t size) {
+    if (addr) {
+        munmap(addr, size);
+    }
+}
+
+uint64_t ya_hash(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+uint64_t ya_now_sec(void) {
+    return (uint64_t)time(NULL);
+}
+
+uint64_t ya_monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
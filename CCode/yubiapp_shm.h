@@ -0,0 +1,36 @@
+/*
+ * yubiapp_shm.h - Small shared state files mapped by every PAM process
+ *
+ * Each file is mapped MAP_SHARED, so all sshd children (and the broker)
+ * see the same memory; updates use GCC __atomic builtins, never locks.
+ * Files live on tmpfs under YA_STATE_DIR by default and must be owned by
+ * the caller with no group/other access, or they are not used.
+ */
+
+#ifndef YUBIAPP_SHM_H
+#define YUBIAPP_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YA_STATE_DIR "/run/yubiapp"
+
+// Header at the start of every state file
+struct ya_shm_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Map (creating if needed) a state file of the given size whose header
+// must match magic/version. Returns NULL on error or layout mismatch.
+void *ya_shm_map(const char *path, size_t size, uint32_t magic, uint32_t version);
+void ya_shm_unmap(void *addr, size_t size);
+
+// 64-bit FNV-1a, used to key slots; never returns 0 (0 marks a free slot)
+uint64_t ya_hash(const void *data, size_t len);
+
+// Wall clock and monotonic time helpers
+uint64_t ya_now_sec(void);
+uint64_t ya_monotonic_us(void);
+
+#endif /* YUBIAPP_SHM_H */
@@ -0,0 +1,610 @@
+/*
+ * yubiapp_users.c - Index of YubiApp accounts served by nss_yubiapp
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yubiapp_users.h"
+
+/* Reading */
+
+int ya_users_open(struct ya_users *u, const char *path) {
+    struct stat st;
+
+    memset(u, 0, sizeof(*u));
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & 022) != 0 ||
+        (size_t)st.st_size < sizeof(struct ya_users_header) || (uint64_t)st.st_size > YA_USERS_MAX_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct ya_users_header *h = addr;
+    uint64_t users = h->user_count, groups = h->group_count;
+    uint64_t need = sizeof(*h) + users * (sizeof(struct ya_users_user) + 4) +
+                    groups * (sizeof(struct ya_users_group) + 4) +
+                    ((uint64_t)h->user_group_count + h->member_count) * 4 + h->strings_size;
+    if (h->shm.magic != YA_USERS_MAGIC || h->shm.version != YA_USERS_VERSION || need > size ||
+        h->strings_size == 0) {
+        munmap(addr, size);
+        return -1;
+    }
+
+    const char *p = (const char *)addr + sizeof(*h);
+    u->header = h;
+    u->size = size;
+    u->users = (const struct ya_users_user *)p;
+    p += users * sizeof(struct ya_users_user);
+    u->users_by_uid = (const uint32_t *)p;
+    p += users * 4;
+    u->groups = (const struct ya_users_group *)p;
+    p += groups * sizeof(struct ya_users_group);
+    u->groups_by_gid = (const uint32_t *)p;
+    p += groups * 4;
+    u->user_groups = (const uint32_t *)p;
+    p += (uint64_t)h->user_group_count * 4;
+    u->members = (const uint32_t *)p;
+    p += (uint64_t)h->member_count * 4;
+    u->strings = p;
+
+    // Check every reference once here, so lookups can follow them freely;
+    // string offsets are checked by ya_users_str
+    int ok = u->strings[h->strings_size - 1] == '\0';
+    for (uint32_t i = 0; ok && i < h->user_count; i++) {
+        const struct ya_users_user *e = &u->users[i];
+        ok = u->users_by_uid[i] < h->user_count && e->groups <= h->user_group_count &&
+             e->group_count <= h->user_group_count - e->groups;
+    }
+    for (uint32_t i = 0; ok && i < h->group_count; i++) {
+        const struct ya_users_group *g = &u->groups[i];
+        ok = u->groups_by_gid[i] < h->group_count && g->members <= h->member_count &&
+             g->member_count <= h->member_count - g->members;
+    }
+    for (uint32_t i = 0; ok && i < h->member_count; i++) {
+        ok = u->members[i] < h->user_count;
+    }
+    if (!ok) {
+        munmap(addr, size);
+        memset(u, 0, sizeof(*u));
+        return -1;
+    }
+    return 0;
+}
+
+void ya_users_close(struct ya_users *u) {
+    if (u->header) {
+        munmap((void *)u->header, u->size);
+    }
+    memset(u, 0, sizeof(*u));
+}
+
+int ya_users_stale(const struct ya_users *u) {
+    return __atomic_load_n(&u->header->superseded, __ATOMIC_ACQUIRE) != 0;
+}
+
+const struct ya_users_user *ya_users_by_name(const struct ya_users *u, const char *name) {
+    uint32_t lo = 0, hi = u->header->user_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, ya_users_str(u, u->users[mid].name));
+        if (cmp == 0) {
+            return &u->users[mid];
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+const struct ya_users_user *ya_users_by_uid(const struct ya_users *u, uint32_t uid) {
+    uint32_t lo = 0, hi = u->header->user_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct ya_users_user *e = &u->users[u->users_by_uid[mid]];
+        if (e->uid == uid) {
+            return e;
+        }
+        if (uid < e->uid) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+const struct ya_users_group *ya_users_group_by_name(const struct ya_users *u, const char *name) {
+    uint32_t lo = 0, hi = u->header->group_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, ya_users_str(u, u->groups[mid].name));
+        if (cmp == 0) {
+            return &u->groups[mid];
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+const struct ya_users_group *ya_users_group_by_gid(const struct ya_users *u, uint32_t gid) {
+    uint32_t lo = 0, hi = u->header->group_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct ya_users_group *g = &u->groups[u->groups_by_gid[mid]];
+        if (g->gid == gid) {
+            return g;
+        }
+        if (gid < g->gid) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Building */
+
+// A name as useradd would accept it: it must not need quoting anywhere a
+// user name ends up (passwd lines, paths, command lines)
+static int valid_name(const char *name) {
+    size_t len = name ? strlen(name) : 0;
+
+    if (len == 0 || len > YA_USERS_MAX_NAME || name[0] == '-') {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+              c == '.' || c == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct pool {
+    char *data;
+    size_t len, cap;
+    int failed;
+};
+
+// Append a string and return its offset. Out of memory, the pool is marked
+// failed and later strings are dropped.
+static uint32_t pool_add(struct pool *p, const char *s, size_t len) {
+    if (p->failed) {
+        return 0;
+    }
+    if (p->len + len + 1 > p->cap) {
+        size_t cap = p->cap ? p->cap : 4096;
+        while (cap < p->len + len + 1) {
+            cap *= 2;
+        }
+        char *data = cap <= YA_USERS_MAX_SIZE ? realloc(p->data, cap) : NULL;
+        if (!data) {
+            p->failed = 1;
+            return 0;
+        }
+        p->data = data;
+        p->cap = cap;
+    }
+    uint32_t offset = (uint32_t)p->len;
+    memcpy(p->data + p->len, s, len);
+    p->data[p->len + len] = '\0';
+    p->len += len + 1;
+    return offset;
+}
+
+// A user's gecos field can hold anything typed into the API; keep it to
+// printable text without the passwd field separator
+static uint32_t pool_add_gecos(struct pool *p, const char *gecos) {
+    char buf[YA_USERS_MAX_GECOS + 1];
+    size_t len = 0;
+
+    for (const unsigned char *s = (const unsigned char *)(gecos ? gecos : ""); *s && len < YA_USERS_MAX_GECOS;
+         s++) {
+        buf[len++] = (*s < 0x20 || *s == 0x7f || *s == ':') ? ' ' : (char)*s;
+    }
+    return pool_add(p, buf, len);
+}
+
+// A group while the index is built: a user's own group (user >= 0) or a
+// role's
+struct entry {
+    const char *name;
+    uint32_t gid;
+    int user;
+    int dropped;
+    uint32_t members, member_count;
+};
+
+static int entry_by_name(const void *a, const void *b) {
+    const struct entry *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    // A user's own group sorts ahead of a role's of the same name
+    if (cmp || (x->user >= 0) != (y->user >= 0)) {
+        return cmp ? cmp : (y->user >= 0) - (x->user >= 0);
+    }
+    return (x->gid > y->gid) - (x->gid < y->gid);
+}
+
+// Users by name then uid, and by uid then name, so that which of two
+// clashing users is kept does not depend on the order they were listed in
+static int input_by_name(const void *a, const void *b, void *arg) {
+    const struct ya_users_input *x = (const struct ya_users_input *)arg + *(const int *)a;
+    const struct ya_users_input *y = (const struct ya_users_input *)arg + *(const int *)b;
+    int cmp = strcmp(x->name, y->name);
+    return cmp ? cmp : (x->uid > y->uid) - (x->uid < y->uid);
+}
+
+static int input_by_uid(const void *a, const void *b, void *arg) {
+    const struct ya_users_input *x = (const struct ya_users_input *)arg + *(const int *)a;
+    const struct ya_users_input *y = (const struct ya_users_input *)arg + *(const int *)b;
+    return x->uid != y->uid ? (x->uid > y->uid) - (x->uid < y->uid) : strcmp(x->name, y->name);
+}
+
+static int record_by_uid(const void *a, const void *b, void *arg) {
+    const struct ya_users_user *users = arg;
+    uint32_t x = users[*(const uint32_t *)a].uid, y = users[*(const uint32_t *)b].uid;
+    return (x > y) - (x < y);
+}
+
+// Groups by gid, and groups sharing a gid in the order they win it
+static int record_by_gid(const void *a, const void *b, void *arg) {
+    const struct entry *groups = arg;
+    const struct entry *x = &groups[*(const uint32_t *)a], *y = &groups[*(const uint32_t *)b];
+    if (x->gid != y->gid) {
+        return (x->gid > y->gid) - (x->gid < y->gid);
+    }
+    if ((x->user >= 0) != (y->user >= 0)) {
+        return x->user >= 0 ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Find a group by gid through an index array sorted by gid
+static struct entry *find_gid(struct entry *groups, const uint32_t *by_gid, uint32_t count, uint32_t gid) {
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        struct entry *g = &groups[by_gid[mid]];
+        if (g->gid == gid) {
+            return g;
+        }
+        if (gid < g->gid) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+// Whether the index at path already holds data, apart from when it was
+// built. Rewriting it would only make every reader remap.
+static int unchanged(const char *path, const char *data, size_t size) {
+    struct stat st;
+    int same = 0;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == size) {
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            const struct ya_users_header *old = addr, *new = (const void *)data;
+            size_t counts = offsetof(struct ya_users_header, built) - offsetof(struct ya_users_header, user_count);
+            same = old->superseded == 0 && memcmp(&old->shm, &new->shm, sizeof(old->shm)) == 0 &&
+                   memcmp(&old->user_count, &new->user_count, counts) == 0 &&
+                   memcmp((const char *)addr + sizeof(*old), data + sizeof(*old), size - sizeof(*old)) == 0;
+            munmap(addr, size);
+        }
+    }
+    close(fd);
+    return same;
+}
+
+// Install data at path: write a temporary file, flush it to disk and rename
+// it into place, then tell readers of the old file to remap
+static int install(const char *path, const void *data, size_t size) {
+    char tmp[PATH_MAX], dir[PATH_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(dir, path);
+    dirname(dir);
+    mkdir(dir, 0755);
+
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    const char *p = data;
+    size_t left = size;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    if (left > 0 || fchmod(fd, 0644) != 0 || fsync(fd) != 0) {
+        int saved = left > 0 && errno == 0 ? EIO : errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+
+    // Map the index being replaced before the rename, so that it is the
+    // one marked
+    struct ya_users_header *old = NULL;
+    int ofd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (ofd >= 0) {
+        struct stat st;
+        if (fstat(ofd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(*old)) {
+            void *addr = mmap(NULL, sizeof(*old), PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+            old = addr == MAP_FAILED ? NULL : addr;
+        }
+        close(ofd);
+    }
+    if (rename(tmp, path) != 0) {
+        int saved = errno;
+        if (old) {
+            munmap(old, sizeof(*old));
+        }
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    if (old) {
+        if (old->shm.magic == YA_USERS_MAGIC) {
+            __atomic_store_n(&old->superseded, 1, __ATOMIC_RELEASE);
+        }
+        munmap(old, sizeof(*old));
+    }
+
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return 0;
+}
+
+int ya_users_write(const char *path, const struct ya_users_input *users, int user_count,
+                   const struct ya_users_input_group *groups, int group_count,
+                   const char *home, const char *shell) {
+    size_t n_in = (size_t)(user_count > 0 ? user_count : 0), g_in = (size_t)(group_count > 0 ? group_count : 0);
+    int *order = malloc(sizeof(int) * (n_in + 1));
+    char *keep = calloc(n_in + 1, 1);
+    struct entry *entries = malloc(sizeof(*entries) * (n_in + g_in + 1));
+    uint32_t *by_gid = malloc(sizeof(uint32_t) * (n_in + g_in + 1));
+    struct pool strings = {0};
+    char *out = NULL;
+    int result = -1;
+
+    if (!order || !keep || !entries || !by_gid) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    // Usable users, without the second of two with one name or uid
+    int n = 0;
+    for (size_t i = 0; i < n_in; i++) {
+        if (valid_name(users[i].name) && users[i].uid >= YA_USERS_MIN_ID) {
+            order[n++] = (int)i;
+            keep[i] = 1;
+        }
+    }
+    qsort_r(order, (size_t)n, sizeof(int), input_by_uid, (void *)users);
+    for (int i = 1; i < n; i++) {
+        if (users[order[i]].uid == users[order[i - 1]].uid) {
+            keep[order[i]] = 0;
+        }
+    }
+    qsort_r(order, (size_t)n, sizeof(int), input_by_name, (void *)users);
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (keep[order[i]] && (kept == 0 || strcmp(users[order[i]].name, users[order[kept - 1]].name) != 0)) {
+            order[kept++] = order[i];
+        }
+    }
+    n = kept;
+
+    // Each user's own group and every usable role group
+    uint32_t g = 0;
+    for (int i = 0; i < n; i++) {
+        entries[g++] = (struct entry){users[order[i]].name, users[order[i]].uid, i, 0, 0, 0};
+    }
+    for (size_t i = 0; i < g_in; i++) {
+        if (valid_name(groups[i].name) && groups[i].gid >= YA_USERS_MIN_ID) {
+            entries[g++] = (struct entry){groups[i].name, groups[i].gid, -1, 0, 0, 0};
+        }
+    }
+
+    // A role group loses to a user's group, or to the role group first in
+    // order of name, with its name or gid
+    qsort(entries, g, sizeof(*entries), entry_by_name);
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < g; i++) {
+        if (m > 0 && strcmp(entries[i].name, entries[m - 1].name) == 0) {
+            continue;
+        }
+        entries[m++] = entries[i];
+    }
+    for (uint32_t i = 0; i < m; i++) {
+        by_gid[i] = i;
+    }
+    qsort_r(by_gid, m, sizeof(uint32_t), record_by_gid, entries);
+    for (uint32_t i = 1; i < m; i++) {
+        if (entries[by_gid[i]].gid == entries[by_gid[i - 1]].gid) {
+            entries[by_gid[i]].dropped = 1;
+        }
+    }
+    g = 0;
+    for (uint32_t i = 0; i < m; i++) {
+        if (!entries[i].dropped) {
+            entries[g++] = entries[i];
+        }
+    }
+    for (uint32_t i = 0; i < g; i++) {
+        by_gid[i] = i;
+    }
+    qsort_r(by_gid, g, sizeof(uint32_t), record_by_gid, entries);
+
+    // Memberships, counted per group first
+    size_t links = 0;
+    for (int i = 0; i < n; i++) {
+        links += (size_t)(users[order[i]].gid_count > 0 ? users[order[i]].gid_count : 0);
+    }
+    size_t size = sizeof(struct ya_users_header) + (size_t)n * (sizeof(struct ya_users_user) + 4) +
+                  (size_t)g * (sizeof(struct ya_users_group) + 4) + links * 8;
+    if (size > YA_USERS_MAX_SIZE || !(out = calloc(1, size))) {
+        errno = ENOMEM;
+        goto done;
+    }
+    struct ya_users_header *h = (struct ya_users_header *)out;
+    struct ya_users_user *rec = (struct ya_users_user *)(h + 1);
+    uint32_t *rec_by_uid = (uint32_t *)(rec + n);
+    struct ya_users_group *grp = (struct ya_users_group *)(rec_by_uid + n);
+    uint32_t *grp_by_gid = (uint32_t *)(grp + g);
+    uint32_t *user_groups = grp_by_gid + g;
+    uint32_t ug = 0;
+
+    pool_add(&strings, "", 0);
+    uint32_t shell_off = pool_add(&strings, shell, strlen(shell));
+    for (int i = 0; i < n; i++) {
+        const struct ya_users_input *in = &users[order[i]];
+        char dir[PATH_MAX];
+        int len = snprintf(dir, sizeof(dir), "%s/%s", home, in->name);
+
+        rec[i].name = pool_add(&strings, in->name, strlen(in->name));
+        rec[i].gecos = pool_add_gecos(&strings, in->gecos);
+        rec[i].dir = pool_add(&strings, dir, len > 0 && (size_t)len < sizeof(dir) ? (size_t)len : 0);
+        rec[i].shell = shell_off;
+        rec[i].uid = in->uid;
+        rec[i].groups = ug;
+        for (int j = 0; j < in->gid_count; j++) {
+            struct entry *e = find_gid(entries, by_gid, g, in->gids[j]);
+            if (!e || e->user >= 0) {
+                continue;
+            }
+            int seen = 0;
+            for (uint32_t k = rec[i].groups; k < ug && !seen; k++) {
+                seen = user_groups[k] == e->gid;
+            }
+            if (!seen) {
+                user_groups[ug++] = e->gid;
+                e->member_count++;
+            }
+        }
+        rec[i].group_count = ug - rec[i].groups;
+        rec_by_uid[i] = (uint32_t)i;
+    }
+    qsort_r(rec_by_uid, (size_t)n, sizeof(uint32_t), record_by_uid, rec);
+
+    // Members follow the gid lists, each group's in order of name
+    uint32_t *members = user_groups + ug;
+    uint32_t mc = 0;
+    for (uint32_t i = 0; i < g; i++) {
+        entries[i].members = mc;
+        mc += entries[i].member_count;
+        entries[i].member_count = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        for (uint32_t k = rec[i].groups; k < rec[i].groups + rec[i].group_count; k++) {
+            struct entry *e = find_gid(entries, by_gid, g, user_groups[k]);
+            members[e->members + e->member_count++] = (uint32_t)i;
+        }
+    }
+    for (uint32_t i = 0; i < g; i++) {
+        grp[i].name = entries[i].user >= 0 ? rec[entries[i].user].name
+                                           : pool_add(&strings, entries[i].name, strlen(entries[i].name));
+        grp[i].gid = entries[i].gid;
+        grp[i].members = entries[i].members;
+        grp[i].member_count = entries[i].member_count;
+        grp_by_gid[i] = by_gid[i];
+    }
+    if (strings.failed) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    // The strings go where the unused part of the link space begins
+    size_t used = (size_t)((char *)(members + mc) - out);
+    if (used + strings.len > YA_USERS_MAX_SIZE) {
+        errno = ENOMEM;
+        goto done;
+    }
+    char *grown = realloc(out, used + strings.len);
+    if (!grown) {
+        errno = ENOMEM;
+        goto done;
+    }
+    out = grown;
+    memcpy(out + used, strings.data, strings.len);
+    h = (struct ya_users_header *)out;
+    h->shm.magic = YA_USERS_MAGIC;
+    h->shm.version = YA_USERS_VERSION;
+    h->user_count = (uint32_t)n;
+    h->group_count = g;
+    h->user_group_count = ug;
+    h->member_count = mc;
+    h->strings_size = (uint32_t)strings.len;
+    h->built = (uint64_t)time(NULL);
+
+    if (unchanged(path, out, used + strings.len) || install(path, out, used + strings.len) == 0) {
+        result = n;
+    }
+
+done:
+    free(out);
+    free(strings.data);
+    free(by_gid);
+    free(entries);
+    free(keep);
+    free(order);
+    return result;
+}
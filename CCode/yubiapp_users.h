@@ -0,0 +1,125 @@
+/*
+ * yubiapp_users.h - Index of YubiApp accounts served by nss_yubiapp
+ *
+ * sshd resolves an account with getpwnam() before pam_yubiapp runs, so
+ * YubiApp users must exist in the host's passwd database. yubiappd fetches
+ * the API's host directory (GET /auth/directory) and writes it here, as one
+ * file that nss_yubiapp maps read-only into every process that looks up a
+ * user or group. A lookup is a binary search over the mapped tables: no
+ * socket, no parsing, no system call, so it never waits on the network,
+ * and while the API is unreachable the last index written keeps answering.
+ *
+ * A new index is written to a temporary file and renamed over the old one;
+ * the broker then sets superseded in the old file, which readers check on
+ * every lookup and remap when it is set. The file is on persistent storage
+ * so accounts resolve from boot, before the broker has synced.
+ *
+ * Layout, in host byte order: the header, arrays of fixed-size records
+ * (users sorted by name, user indexes sorted by uid, groups sorted by
+ * name, group indexes sorted by gid, the gids of each user's groups, the
+ * user indexes of each group's members), then the NUL-terminated strings
+ * the records refer to by offset. Every user also has a group of its own
+ * name whose gid is its uid.
+ */
+
+#ifndef YUBIAPP_USERS_H
+#define YUBIAPP_USERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yubiapp_shm.h"
+
+#define YA_USERS_PATH "/var/lib/yubiapp/users"
+#define YA_USERS_MAGIC 0x59415558   /* "YAUX" */
+#define YA_USERS_VERSION 1
+#define YA_USERS_MIN_ID 1000        /* uids and gids below are never served */
+#define YA_USERS_MAX_NAME 32
+#define YA_USERS_MAX_GECOS 256
+#define YA_USERS_MAX_SIZE (256u << 20)
+
+struct ya_users_header {
+    struct ya_shm_header shm;
+    uint32_t superseded;            /* a newer index has replaced this file */
+    uint32_t user_count;
+    uint32_t group_count;
+    uint32_t user_group_count;      /* entries in the gid lists */
+    uint32_t member_count;          /* entries in the member lists */
+    uint32_t strings_size;
+    uint64_t built;                 /* Unix time of the sync that wrote it */
+};
+
+struct ya_users_user {
+    uint32_t name;                  /* string offsets */
+    uint32_t gecos;
+    uint32_t dir;
+    uint32_t shell;
+    uint32_t uid;                   /* also the gid of the user's own group */
+    uint32_t groups;                /* first of group_count gids */
+    uint32_t group_count;
+    uint32_t reserved;
+};
+
+struct ya_users_group {
+    uint32_t name;
+    uint32_t gid;
+    uint32_t members;               /* first of member_count user indexes */
+    uint32_t member_count;
+};
+
+// A mapped index
+struct ya_users {
+    const struct ya_users_header *header;
+    size_t size;
+    const struct ya_users_user *users;
+    const uint32_t *users_by_uid;
+    const struct ya_users_group *groups;
+    const uint32_t *groups_by_gid;
+    const uint32_t *user_groups;
+    const uint32_t *members;
+    const char *strings;
+};
+
+// Map the index at path. It must be a regular file owned by root and
+// writable by no one else. Returns 0, or -1 if it is missing or malformed.
+int ya_users_open(struct ya_users *u, const char *path);
+void ya_users_close(struct ya_users *u);
+
+// Whether the broker has replaced the mapped index since it was opened
+int ya_users_stale(const struct ya_users *u);
+
+const struct ya_users_user *ya_users_by_name(const struct ya_users *u, const char *name);
+const struct ya_users_user *ya_users_by_uid(const struct ya_users *u, uint32_t uid);
+const struct ya_users_group *ya_users_group_by_name(const struct ya_users *u, const char *name);
+const struct ya_users_group *ya_users_group_by_gid(const struct ya_users *u, uint32_t gid);
+
+static inline const char *ya_users_str(const struct ya_users *u, uint32_t offset) {
+    return offset < u->header->strings_size ? u->strings + offset : "";
+}
+
+// An account as the broker received it
+struct ya_users_input {
+    const char *name;
+    const char *gecos;
+    uint32_t uid;
+    const uint32_t *gids;           /* the groups it is a member of */
+    int gid_count;
+};
+
+// A group as the broker received it
+struct ya_users_input_group {
+    const char *name;
+    uint32_t gid;
+};
+
+// Build an index of users and groups and install it at path, with home
+// directories under home and the given login shell. Users and groups with
+// names that are not portable account names, ids below YA_USERS_MIN_ID or
+// a name or id already taken are left out. An index that would not change
+// is left in place. Returns the number of users in it, or -1 with errno
+// set.
+int ya_users_write(const char *path, const struct ya_users_input *users, int user_count,
+                   const struct ya_users_input_group *groups, int group_count,
+                   const char *home, const char *shell);
+
+#endif /* YUBIAPP_USERS_H */
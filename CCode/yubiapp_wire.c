@@ -0,0 +1,61 @@
+/*
+ * yubiapp_wire.c - Compact binary encoding of device auth responses
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "yubiapp_wire.h"
+
+int ya_wire_is_compact(const char *content_type) {
+    size_t n = strlen(YA_WIRE_CONTENT_TYPE);
+
+    if (!content_type || strncasecmp(content_type, YA_WIRE_CONTENT_TYPE, n) != 0) {
+        return 0;
+    }
+    return content_type[n] == '\0' || content_type[n] == ';' || content_type[n] == ' ';
+}
+
+int ya_wire_begin(struct ya_wire_iter *it, unsigned char *buf, size_t len, int nested) {
+    it->p = buf;
+    it->end = buf + len;
+
+    if (nested) {
+        return 0;
+    }
+    if (len < YA_WIRE_PREAMBLE_SIZE || memcmp(buf, "YAW", 3) != 0 || buf[3] != YA_WIRE_VERSION) {
+        return -1;
+    }
+    it->p += YA_WIRE_PREAMBLE_SIZE;
+    return 0;
+}
+
+int ya_wire_next(struct ya_wire_iter *it, int *tag, unsigned char **value, size_t *len) {
+    if (it->p == it->end) {
+        return 0;
+    }
+    if (it->end - it->p < 3) {
+        return -1;
+    }
+
+    size_t flen = ((size_t)it->p[1] << 8) | it->p[2];
+    if ((size_t)(it->end - it->p - 3) < flen) {
+        return -1;
+    }
+
+    *tag = it->p[0];
+    *value = it->p + 3;
+    *len = flen;
+    it->p += 3 + flen;
+    return 1;
+}
+
+char *ya_wire_cstr(unsigned char *value, size_t len) {
+    if (memchr(value, '\0', len)) {
+        return NULL;
+    }
+    char *s = (char *)value - 1;
+    memmove(s, value, len);
+    s[len] = '\0';
+    return s;
+}
@@ -0,0 +1,76 @@
+/*
+ * yubiapp_wire.h - Compact binary encoding of device auth responses
+ *
+ * Requested with "Accept: application/vnd.yubiapp.auth.v1+tlv"; servers that
+ * do not know it answer in JSON, so the decoder is chosen by the response's
+ * Content-Type. The body is "YAW" and a version byte, then fields in the
+ * same form as the broker protocol:
+ *
+ *   field:   tag (1) | length (2, BE) | value
+ *
+ * Strings are UTF-8, UUIDs 16 raw bytes, booleans one byte. Unknown tags are
+ * skipped. The encoder is internal/server/auth_wire.go.
+ */
+
+#ifndef YUBIAPP_WIRE_H
+#define YUBIAPP_WIRE_H
+
+#include <stddef.h>
+
+#define YA_WIRE_CONTENT_TYPE "application/vnd.yubiapp.auth.v1+tlv"
+#define YA_WIRE_ACCEPT YA_WIRE_CONTENT_TYPE ", application/json;q=0.5"
+#define YA_WIRE_VERSION 1
+#define YA_WIRE_PREAMBLE_SIZE 4
+
+enum ya_wire_tag {
+    YA_WIRE_AUTHENTICATED = 0x01,   /* 1 byte */
+    YA_WIRE_ERROR = 0x02,
+    YA_WIRE_NONCE = 0x03,
+    YA_WIRE_GRANT = 0x04,           /* signed grant, see yubiapp_grant.h */
+    YA_WIRE_PERMISSIONS = 0x05,     /* one byte per evaluated permission, in request order: 1 if held */
+
+    YA_WIRE_USER_ID = 0x10,         /* 16 bytes */
+    YA_WIRE_USER_EMAIL = 0x11,
+    YA_WIRE_USER_USERNAME = 0x12,
+    YA_WIRE_USER_FIRST_NAME = 0x13,
+    YA_WIRE_USER_LAST_NAME = 0x14,
+    YA_WIRE_USER_ACTIVE = 0x15,     /* 1 byte */
+
+    YA_WIRE_ROLE = 0x20,            /* nested, enum ya_wire_role_tag */
+
+    YA_WIRE_DEVICE_ID = 0x30,       /* 16 bytes */
+    YA_WIRE_DEVICE_TYPE = 0x31,
+    YA_WIRE_DEVICE_IDENTIFIER = 0x32,
+
+    YA_WIRE_BATCH_RESULT = 0x40,    /* batch responses: HTTP status (2, BE), then the item's body */
+};
+
+// Tags inside a YA_WIRE_ROLE field
+enum ya_wire_role_tag {
+    YA_WIRE_ROLE_ID = 0x01,         /* 16 bytes */
+    YA_WIRE_ROLE_NAME = 0x02,
+    YA_WIRE_ROLE_DESCRIPTION = 0x03,
+};
+
+struct ya_wire_iter {
+    unsigned char *p;
+    unsigned char *end;
+};
+
+// Whether a Content-Type header value names the compact encoding
+int ya_wire_is_compact(const char *content_type);
+
+// Start iterating over a response body (or a nested field's value when
+// nested is set, which has no preamble). Returns -1 on a bad preamble.
+int ya_wire_begin(struct ya_wire_iter *it, unsigned char *buf, size_t len, int nested);
+
+// Next field: returns 1 with tag/value/len set, 0 at the end, -1 if the
+// body is truncated
+int ya_wire_next(struct ya_wire_iter *it, int *tag, unsigned char **value, size_t *len);
+
+// NUL-terminate a string value in place by moving it one byte back over its
+// own length field. Valid only for the field ya_wire_next just returned, and
+// only once. Returns NULL if the string contains a NUL byte.
+char *ya_wire_cstr(unsigned char *value, size_t len);
+
+#endif /* YUBIAPP_WIRE_H */
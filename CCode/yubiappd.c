@@ -0,0 +1,1939 @@
+/*
+ * yubiappd.c - Local authentication broker for pam_yubiapp
+ *
+ * sshd forks a new process for every connection, so the PAM module can
+ * never reuse a connection to the YubiApp API. This daemon keeps a small
+ * pool of workers, each holding a long-lived libcurl handle (and therefore
+ * a warm keep-alive connection), and serves the PAM module over a Unix
+ * domain socket using the framing in yubiapp_proto.h.
+ *
+ * It also records the phase timings of its API requests in the shared
+ * metrics file and, with -p, serves that file to Prometheus over HTTP.
+ *
+ * Session events from the module are queued in memory and posted in
+ * batches by a separate thread, so a slow sessions API never holds up a
+ * worker; events it cannot deliver go to the spool and are resent later.
+ *
+ * Logins are coalesced the same way: a worker hands its request to the
+ * batch thread, which waits up to -b microseconds for more and sends them
+ * together to POST /auth/device/batch. The batch thread drives every batch
+ * on one curl multi handle, so with -2 (h2c) concurrent batches share one
+ * HTTP/2 connection. Each worker gets back its own item of the response,
+ * exactly the status and body /auth/device would have returned; an API
+ * without the batch endpoint is detected and logins go one by one again.
+ * The batch endpoint takes the agent token (-t); without one logins are
+ * never batched.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "yubiapp_api.h"
+#include "yubiapp_events.h"
+#include "yubiapp_grant.h"
+#include "yubiapp_json.h"
+#include "yubiapp_metrics.h"
+#include "yubiapp_proto.h"
+#include "yubiapp_shm.h"
+#include "yubiapp_users.h"
+#include "yubiapp_wire.h"
+
+#define DEFAULT_WORKERS 4
+#define QUEUE_SIZE 256
+#define CLIENT_TIMEOUT_SEC 15
+#define MAX_OTP_LENGTH 64
+#define MAX_PERMISSION_LENGTH 256
+#define MAX_ACCEPT_LENGTH 200
+#define MAX_AUDIENCE_LENGTH 255
+#define EXPORTER_TIMEOUT_SEC 5
+#define EXPORTER_DEFAULT_HOST "127.0.0.1"
+#define METRICS_TEXT_SIZE 32768
+#define EVENT_QUEUE_SIZE 1024
+#define EVENT_BATCH 64
+#define EVENT_FLUSH_SEC 1
+#define EVENT_BACKOFF_MAX_SEC 60
+#define EVENT_BODY_SIZE (EVENT_BATCH * (YA_EVENT_MAX_SIZE + 1) + 16)
+#define EVENT_RESPONSE_SIZE 4096
+#define MAX_TOKEN_LENGTH 512
+#define CHANGES_LINE_MAX 1024
+#define CHANGES_CONNECT_TIMEOUT_SEC 10
+#define CHANGES_IDLE_SEC 45
+#define CHANGES_BACKOFF_MAX_SEC 30
+#define DIRECTORY_MAX_SIZE (16 << 20)
+#define DIRECTORY_REFRESH_SEC 300
+#define DIRECTORY_TIMEOUT_SEC 60
+#define DIRECTORY_BACKOFF_MAX_SEC 300
+#define DIRECTORY_HOME "/home"
+#define DIRECTORY_SHELL "/bin/bash"
+#define BATCH_MAX 32                 /* logins per batch request */
+#define BATCH_WINDOW_US 2000         /* default wait for more logins */
+#define BATCH_INFLIGHT 8             /* batch requests in flight at once */
+#define BATCH_REQUEST_SIZE (BATCH_MAX * YUBIAPP_MAX_REQUEST_SIZE + 16)
+#define BATCH_RESPONSE_SIZE (BATCH_MAX * (YUBIAPP_MAX_RESPONSE_SIZE + 32))
+
+struct broker_config {
+    const char *socket_path;
+    const char *url;
+    const char *metrics_path;   // NULL when metrics are disabled
+    const char *exporter;       // [host:]port for Prometheus, NULL when off
+    const char *events_url;     // sessions API; derived from url when not given
+    const char *token_path;     // agent token for the sessions API
+    const char *spool_path;
+    const char *api_socket;     // reach the API over this Unix socket, NULL for TCP
+    const char *changes_url;    // change feed; derived from url when not given
+    const char *grant_dir;      // grant store to prune, NULL to leave it to expire
+    const char *directory_path; // account index for nss_yubiapp, NULL when off
+    char *directory_url;        // host directory, derived from url
+    const char *home_base;      // home directories are home_base/<user>
+    const char *shell;
+    char *batch_url;            // batch endpoint, derived from url
+    long batch_window_us;       // 0 sends every login on its own
+    int http2;                  // HTTP/2 with prior knowledge (h2c)
+    int workers;
+    int foreground;
+};
+
+// Bounded queue of accepted client sockets handed to the workers
+struct client_queue {
+    int fds[QUEUE_SIZE];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+// Session events waiting to be posted, each a malloc'd JSON object
+struct event_queue {
+    char *events[EVENT_QUEUE_SIZE];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_SENT,
+    JOB_DONE,     // the result is in the job
+    JOB_ALONE,    // not answered by a batch; the worker sends it itself
+};
+
+// A login waiting to go out in a batch. It lives on the worker's stack
+// while the worker waits on done.
+struct auth_job {
+    const char *json;           // the item, as POST /auth/device takes it
+    const char *accept;         // Accept header, NULL for none
+    uint64_t queued_us;
+    enum job_state state;
+    int status;                 // YA_BROKER_*, once JOB_DONE
+    long http_code;
+    char content_type[YA_PROTO_MAX_CONTENT_TYPE + 1];
+    char *body;                 // the worker's YUBIAPP_MAX_RESPONSE_SIZE + 1 buffer
+    size_t body_len;
+    struct auth_job *next;
+    pthread_cond_t done;
+};
+
+// One batch request on the multi handle
+struct batch_transfer {
+    CURL *curl;
+    struct auth_job *jobs[BATCH_MAX];
+    int n;
+    int busy;
+    char *request;              // BATCH_REQUEST_SIZE
+    char *response;             // BATCH_RESPONSE_SIZE + 1
+    struct MemoryStruct chunk;
+    struct curl_slist *headers;
+};
+
+// Logins waiting to be batched, in arrival order
+struct batch_queue {
+    struct auth_job *head;
+    struct auth_job *tail;
+    int count;
+    int closed;
+    int unsupported;            // the API has no batch endpoint
+    CURLM *multi;               // NULL when batching is off
+    pthread_mutex_t lock;
+};
+
+// Outcome of posting a batch of events
+enum post_result {
+    POST_OK,
+    POST_RETRY,   // not delivered, worth sending again later
+    POST_DROP,    // the API refused the batch; resending would not help
+};
+
+// The change feed stream being read, and where to resume it
+struct change_stream {
+    char line[CHANGES_LINE_MAX + 1];
+    size_t len;
+    int overflow;               // the current line is too long and is skipped
+    int received;               // the stream delivered something
+    char event[32];
+    char id[128];
+    char data[CHANGES_LINE_MAX + 1];
+    char last_id[128];          // of the last change applied, sent as Last-Event-ID
+};
+
+static struct broker_config config = {
+    .socket_path = YUBIAPP_BROKER_SOCKET,
+    .url = YUBIAPP_URL,
+    .metrics_path = YA_METRICS_STATE,
+    .spool_path = YA_SPOOL_PATH,
+    .grant_dir = YA_GRANT_DIR,
+    .directory_path = YA_USERS_PATH,
+    .home_base = DIRECTORY_HOME,
+    .shell = DIRECTORY_SHELL,
+    .batch_window_us = BATCH_WINDOW_US,
+    .workers = DEFAULT_WORKERS,
+    .foreground = 0,
+};
+
+static struct client_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+static struct event_queue events = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+static struct batch_queue batches = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Refreshes of the account index asked for by the change feed
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int requested;
+} directory = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t running = 1;
+
+// "Authorization: Bearer <token>" for the sessions API; empty when no
+// token is configured, in which case events are only spooled
+static char auth_header[MAX_TOKEN_LENGTH + 32];
+
+// Shared metrics, mapped once at startup; NULL when disabled
+static struct ya_metrics_state *metrics;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+// Queue a client; returns -1 if the queue is full so the caller can shed load
+static int queue_push(int fd) {
+    int rc = -1;
+
+    pthread_mutex_lock(&queue.lock);
+    if (queue.count < QUEUE_SIZE) {
+        queue.fds[(queue.head + queue.count) % QUEUE_SIZE] = fd;
+        queue.count++;
+        pthread_cond_signal(&queue.not_empty);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return rc;
+}
+
+// Wait for a client; returns -1 once the queue is closed and drained
+static int queue_pop(void) {
+    int fd = -1;
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0 && !queue.closed) {
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+    }
+    if (queue.count > 0) {
+        fd = queue.fds[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_SIZE;
+        queue.count--;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return fd;
+}
+
+static void queue_close(void) {
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Queue a copy of an event; returns -1 if the queue is full
+static int events_push(const unsigned char *data, size_t len) {
+    char *event = malloc(len + 1);
+    int rc = -1;
+
+    if (!event) {
+        return -1;
+    }
+    memcpy(event, data, len);
+    event[len] = '\0';
+
+    pthread_mutex_lock(&events.lock);
+    if (events.count < EVENT_QUEUE_SIZE && !events.closed) {
+        events.events[(events.head + events.count) % EVENT_QUEUE_SIZE] = event;
+        events.count++;
+        if (events.count >= EVENT_BATCH) {
+            pthread_cond_signal(&events.ready);
+        }
+        rc = 0;
+    }
+    pthread_mutex_unlock(&events.lock);
+    if (rc != 0) {
+        free(event);
+    }
+    return rc;
+}
+
+// Take up to max events, waiting until a full batch is queued or a flush
+// interval has passed. Returns the number taken, or -1 once the queue is
+// closed and empty.
+static int events_pop(char **out, int max) {
+    struct timespec deadline;
+    int n = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EVENT_FLUSH_SEC;
+
+    pthread_mutex_lock(&events.lock);
+    while (events.count < max && !events.closed) {
+        if (pthread_cond_timedwait(&events.ready, &events.lock, &deadline) != 0) {
+            break;
+        }
+    }
+    while (n < max && events.count > 0) {
+        out[n++] = events.events[events.head];
+        events.head = (events.head + 1) % EVENT_QUEUE_SIZE;
+        events.count--;
+    }
+    if (n == 0 && events.closed) {
+        n = -1;
+    }
+    pthread_mutex_unlock(&events.lock);
+    return n;
+}
+
+static void events_close(void) {
+    pthread_mutex_lock(&events.lock);
+    events.closed = 1;
+    pthread_cond_broadcast(&events.ready);
+    pthread_mutex_unlock(&events.lock);
+}
+
+// Copy a protocol field into a NUL-terminated buffer
+static int copy_field(const struct ya_msg *msg, int tag, char *out, size_t out_len, int required) {
+    const unsigned char *data;
+    size_t len;
+
+    if (ya_msg_get(msg, tag, &data, &len) != 0) {
+        out[0] = '\0';
+        return required ? -1 : 0;
+    }
+    if (len >= out_len || memchr(data, '\0', len)) {
+        return -1;
+    }
+    memcpy(out, data, len);
+    out[len] = '\0';
+    return 0;
+}
+
+static int send_status(int fd, unsigned char *buf, size_t cap, int status) {
+    struct ya_msg resp;
+
+    ya_msg_init(&resp, buf, cap, YA_MSG_AUTH_RESPONSE);
+    ya_msg_put_u8(&resp, YA_TAG_STATUS, (uint8_t)status);
+    return ya_msg_send(fd, &resp);
+}
+
+// Relay an API response to the client
+static int send_response(int fd, unsigned char *buf, size_t cap, long http_code,
+                         const char *content_type, const char *body, size_t len) {
+    struct ya_msg resp;
+
+    ya_msg_init(&resp, buf, cap, YA_MSG_AUTH_RESPONSE);
+    if (ya_msg_put_u8(&resp, YA_TAG_STATUS, YA_BROKER_OK) != 0 ||
+        ya_msg_put_u16(&resp, YA_TAG_HTTP_CODE, (uint16_t)http_code) != 0 ||
+        (content_type && strlen(content_type) <= YA_PROTO_MAX_CONTENT_TYPE &&
+         ya_msg_put(&resp, YA_TAG_CONTENT_TYPE, content_type, strlen(content_type)) != 0) ||
+        ya_msg_put(&resp, YA_TAG_BODY, body, len) != 0) {
+        syslog(LOG_ERR, "API response too large to relay (%zu bytes)", len);
+        return send_status(fd, buf, cap, YA_BROKER_UPSTREAM_ERROR);
+    }
+    return ya_msg_send(fd, &resp);
+}
+
+// Hand a login to the batch thread and wait for it. Returns 0 once the job
+// holds its result, or -1 if the worker has to send it on its own.
+static int batch_submit(struct auth_job *job) {
+    job->state = JOB_QUEUED;
+    job->next = NULL;
+    job->queued_us = ya_monotonic_us();
+    pthread_cond_init(&job->done, NULL);
+
+    pthread_mutex_lock(&batches.lock);
+    if (batches.closed || batches.unsupported) {
+        job->state = JOB_ALONE;
+    } else {
+        if (batches.tail) {
+            batches.tail->next = job;
+        } else {
+            batches.head = job;
+        }
+        batches.tail = job;
+        // The batch thread starts the window on the first login and sends
+        // early on a full batch
+        if (++batches.count == 1 || batches.count >= BATCH_MAX) {
+            curl_multi_wakeup(batches.multi);
+        }
+    }
+    while (job->state == JOB_QUEUED || job->state == JOB_SENT) {
+        pthread_cond_wait(&job->done, &batches.lock);
+    }
+    pthread_mutex_unlock(&batches.lock);
+
+    pthread_cond_destroy(&job->done);
+    return job->state == JOB_DONE ? 0 : -1;
+}
+
+// Whether the oldest queued login has waited out the window, or a batch is
+// full. Called with the lock held.
+static int batch_ready(uint64_t now) {
+    return batches.count > 0 &&
+           (batches.count >= BATCH_MAX || batches.closed ||
+            now - batches.head->queued_us >= (uint64_t)config.batch_window_us);
+}
+
+// Take up to BATCH_MAX queued logins with the same Accept header as the
+// oldest one. Called with the lock held.
+static int batch_take(struct auth_job **jobs) {
+    const char *accept = batches.head->accept;
+    struct auth_job **link = &batches.head;
+    struct auth_job *kept = NULL;
+    int n = 0;
+
+    while (*link && n < BATCH_MAX) {
+        struct auth_job *job = *link;
+        if (accept ? job->accept && strcmp(job->accept, accept) == 0 : !job->accept) {
+            *link = job->next;
+            job->state = JOB_SENT;
+            jobs[n++] = job;
+            batches.count--;
+        } else {
+            kept = job;
+            link = &job->next;
+        }
+    }
+    if (!*link) {
+        batches.tail = kept;
+    }
+    return n;
+}
+
+// Build a batch request from its jobs and add it to the multi handle
+static void batch_start(struct batch_transfer *t) {
+    size_t len = (size_t)snprintf(t->request, BATCH_REQUEST_SIZE, "{\"items\":[");
+    for (int i = 0; i < t->n; i++) {
+        size_t item_len = strlen(t->jobs[i]->json);
+        if (i > 0) {
+            t->request[len++] = ',';
+        }
+        memcpy(t->request + len, t->jobs[i]->json, item_len);
+        len += item_len;
+    }
+    memcpy(t->request + len, "]}", 3);
+
+    curl_slist_free_all(t->headers);
+    t->headers = NULL;
+    ya_buffer_init(&t->chunk, t->response, BATCH_RESPONSE_SIZE);
+    ya_api_setup(t->curl, config.batch_url, t->request, t->jobs[0]->accept, &t->chunk, &t->headers);
+    // The batch endpoint is only open to agents
+    t->headers = curl_slist_append(t->headers, auth_header);
+    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+    t->busy = 1;
+    curl_multi_add_handle(batches.multi, t->curl);
+}
+
+// Store one item of a batch response in its job
+static int job_set_result(struct auth_job *job, long http_code, const char *content_type,
+                          const void *body, size_t len) {
+    if (len > YUBIAPP_MAX_RESPONSE_SIZE) {
+        return -1;
+    }
+    memcpy(job->body, body, len);
+    job->body[len] = '\0';
+    job->body_len = len;
+    job->http_code = http_code;
+    snprintf(job->content_type, sizeof(job->content_type), "%s", content_type ? content_type : "");
+    return 0;
+}
+
+// Split a compact batch response: one YA_WIRE_BATCH_RESULT per item.
+// Returns the number of jobs given their result.
+static int batch_split_compact(struct batch_transfer *t) {
+    struct ya_wire_iter it;
+    unsigned char *value;
+    size_t len;
+    int tag;
+    int n = 0;
+
+    if (ya_wire_begin(&it, (unsigned char *)t->chunk.memory, t->chunk.size, 0) != 0) {
+        return 0;
+    }
+    while (n < t->n && ya_wire_next(&it, &tag, &value, &len) == 1) {
+        if (tag != YA_WIRE_BATCH_RESULT) {
+            continue;
+        }
+        if (len < 2 ||
+            job_set_result(t->jobs[n], (long)(value[0] << 8 | value[1]), YA_WIRE_CONTENT_TYPE, value + 2, len - 2) != 0) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Split a JSON batch response, {"results":[{"status":N,"body":{...}}, ...]}.
+// Each body is relayed as the API wrote it.
+static int batch_split_json(struct batch_transfer *t, const char *content_type) {
+    struct ya_json_field results = { .path = "results" };
+    struct ya_json_iter it;
+    char *item;
+    size_t item_len;
+    int n = 0;
+
+    if (ya_json_extract(t->chunk.memory, t->chunk.size, &results, 1) != 0 ||
+        ya_json_array_begin(&it, &results) != 0) {
+        return 0;
+    }
+    while (n < t->n && ya_json_array_next(&it, &item, &item_len) == 1) {
+        struct ya_json_field fields[] = { { .path = "status" }, { .path = "body" } };
+        if (ya_json_extract(item, item_len, fields, 2) != 0 ||
+            fields[0].type != YA_JSON_NUMBER || fields[1].type != YA_JSON_OBJECT ||
+            job_set_result(t->jobs[n], strtol(fields[0].value, NULL, 10), content_type,
+                           fields[1].value, fields[1].len) != 0) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Give each job of a finished batch its result. Jobs the response does not
+// answer are failed, or handed back to their worker when sending them on
+// their own might still work.
+static void batch_finish(struct batch_transfer *t, CURLcode res) {
+    enum job_state rest = JOB_DONE;
+    int rest_status = YA_BROKER_UPSTREAM_ERROR;
+    int unsupported = 0;
+    long code = 0;
+    int done = 0;
+
+    curl_multi_remove_handle(batches.multi, t->curl);
+    if (res == CURLE_OK) {
+        char *content_type = NULL;
+        ya_metrics_transfer(metrics, t->curl);
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(t->curl, CURLINFO_CONTENT_TYPE, &content_type);
+        if (code == 200) {
+            done = ya_wire_is_compact(content_type) ? batch_split_compact(t)
+                                                    : batch_split_json(t, content_type);
+            if (done < t->n) {
+                syslog(LOG_ERR, "Batch response answers %d of %d logins", done, t->n);
+            }
+        } else if (code == 404 || code == 405) {
+            syslog(LOG_WARNING, "No batch endpoint at %s, sending logins one at a time", config.batch_url);
+            unsupported = 1;
+            rest = JOB_ALONE;
+        } else if (code == 401 || code == 403) {
+            syslog(LOG_ERR, "Batch endpoint refused the agent token (HTTP %ld), sending logins one at a time", code);
+            unsupported = 1;
+            rest = JOB_ALONE;
+        } else {
+            syslog(LOG_WARNING, "Batch request answered HTTP %ld, sending its %d logins one at a time", code, t->n);
+            rest = JOB_ALONE;
+        }
+    } else if (t->chunk.overflow || res == CURLE_FILESIZE_EXCEEDED) {
+        syslog(LOG_WARNING, "Batch response exceeds %d bytes, sending its logins one at a time", BATCH_RESPONSE_SIZE);
+        rest = JOB_ALONE;
+    } else if (res == CURLE_HTTP2 || res == CURLE_HTTP2_STREAM) {
+        // A broken HTTP/2 connection says nothing about the API itself
+        syslog(LOG_WARNING, "Batch request failed: %s, sending its logins one at a time", curl_easy_strerror(res));
+        rest = JOB_ALONE;
+    } else {
+        syslog(LOG_ERR, "Batch request failed: %s", curl_easy_strerror(res));
+        rest_status = res == CURLE_OPERATION_TIMEDOUT ? YA_BROKER_UPSTREAM_TIMEOUT : YA_BROKER_UPSTREAM_ERROR;
+    }
+
+    pthread_mutex_lock(&batches.lock);
+    if (unsupported) {
+        batches.unsupported = 1;
+    }
+    for (int i = 0; i < t->n; i++) {
+        struct auth_job *job = t->jobs[i];
+        job->state = i < done ? JOB_DONE : rest;
+        job->status = i < done ? YA_BROKER_OK : rest_status;
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&batches.lock);
+    t->n = 0;
+    t->busy = 0;
+}
+
+// Batch thread: starts a batch whenever the window has passed or a batch
+// is full and a transfer is free, and completes the jobs of finished ones
+static void *batch_main(void *arg) {
+    struct batch_transfer *slots = arg;
+
+    for (;;) {
+        uint64_t now = ya_monotonic_us();
+        int timeout_ms = 1000;
+        int active = 0;
+        int still_running;
+        CURLMsg *msg;
+        int left;
+
+        pthread_mutex_lock(&batches.lock);
+        for (int i = 0; i < BATCH_INFLIGHT; i++) {
+            if (!slots[i].busy && batch_ready(now)) {
+                slots[i].n = batch_take(slots[i].jobs);
+                batch_start(&slots[i]);
+            }
+            active += slots[i].busy;
+        }
+        if (batches.count > 0 && !batch_ready(now)) {
+            uint64_t waited = now - batches.head->queued_us;
+            timeout_ms = (int)(((uint64_t)config.batch_window_us - waited + 999) / 1000);
+        }
+        int finished = batches.closed && batches.count == 0 && active == 0;
+        pthread_mutex_unlock(&batches.lock);
+        if (finished) {
+            break;
+        }
+
+        curl_multi_perform(batches.multi, &still_running);
+        while ((msg = curl_multi_info_read(batches.multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            for (int i = 0; i < BATCH_INFLIGHT; i++) {
+                if (slots[i].busy && slots[i].curl == msg->easy_handle) {
+                    batch_finish(&slots[i], msg->data.result);
+                    break;
+                }
+            }
+        }
+        curl_multi_poll(batches.multi, NULL, 0, timeout_ms, NULL);
+    }
+    return NULL;
+}
+
+// Set up the batch transfers and start the batch thread. Returns -1 (and
+// logins go one by one) if that fails.
+static int batch_open(pthread_t *thread, struct batch_transfer *slots) {
+    size_t url_len = strlen(config.url);
+
+    config.batch_url = malloc(url_len + sizeof("/batch"));
+    batches.multi = curl_multi_init();
+    if (!config.batch_url || !batches.multi) {
+        goto fail;
+    }
+    memcpy(config.batch_url, config.url, url_len);
+    strcpy(config.batch_url + url_len, "/batch");
+    curl_multi_setopt(batches.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    for (int i = 0; i < BATCH_INFLIGHT; i++) {
+        slots[i].curl = curl_easy_init();
+        slots[i].request = malloc(BATCH_REQUEST_SIZE);
+        slots[i].response = malloc(BATCH_RESPONSE_SIZE + 1);
+        if (!slots[i].curl || !slots[i].request || !slots[i].response) {
+            goto fail;
+        }
+        curl_easy_setopt(slots[i].curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        if (config.api_socket) {
+            curl_easy_setopt(slots[i].curl, CURLOPT_UNIX_SOCKET_PATH, config.api_socket);
+        }
+        if (config.http2) {
+            curl_easy_setopt(slots[i].curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+            // Wait for the shared connection rather than opening another
+            curl_easy_setopt(slots[i].curl, CURLOPT_PIPEWAIT, 1L);
+        }
+    }
+    if (pthread_create(thread, NULL, batch_main, slots) != 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "Failed to start the batch thread, sending logins one at a time");
+    for (int i = 0; i < BATCH_INFLIGHT; i++) {
+        if (slots[i].curl) {
+            curl_easy_cleanup(slots[i].curl);
+        }
+        free(slots[i].request);
+        free(slots[i].response);
+    }
+    if (batches.multi) {
+        curl_multi_cleanup(batches.multi);
+        batches.multi = NULL;
+    }
+    free(config.batch_url);
+    config.batch_url = NULL;
+    return -1;
+}
+
+// Stop the batch thread once it has sent everything queued. Called after
+// the workers are gone.
+static void batch_close(pthread_t thread, struct batch_transfer *slots) {
+    pthread_mutex_lock(&batches.lock);
+    batches.closed = 1;
+    pthread_mutex_unlock(&batches.lock);
+    curl_multi_wakeup(batches.multi);
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < BATCH_INFLIGHT; i++) {
+        curl_slist_free_all(slots[i].headers);
+        curl_easy_cleanup(slots[i].curl);
+        free(slots[i].request);
+        free(slots[i].response);
+    }
+    curl_multi_cleanup(batches.multi);
+    free(config.batch_url);
+}
+
+// Forward one auth request to the API, in a batch when batching is on or
+// else on the worker's persistent handle. The response is collected in the
+// worker's fixed body buffer.
+static int handle_auth_request(CURL *curl, int fd, const struct ya_msg *req,
+                               unsigned char *buf, size_t cap, char *body) {
+    char otp[MAX_OTP_LENGTH + 1];
+    char permission[MAX_PERMISSION_LENGTH + 1];
+    char permissions[MAX_PERMISSION_LENGTH + 1];
+    char accept[MAX_ACCEPT_LENGTH + 1];
+    char grant_audience[MAX_AUDIENCE_LENGTH + 1];
+    char grant_permissions[MAX_PERMISSION_LENGTH + 1];
+    char json_request[YUBIAPP_MAX_REQUEST_SIZE];
+    struct MemoryStruct chunk;
+    struct curl_slist *headers = NULL;
+    long response_code = 0;
+    int status;
+
+    if (copy_field(req, YA_TAG_OTP, otp, sizeof(otp), 1) != 0 ||
+        copy_field(req, YA_TAG_PERMISSION, permission, sizeof(permission), 0) != 0 ||
+        copy_field(req, YA_TAG_PERMISSIONS, permissions, sizeof(permissions), 0) != 0 ||
+        copy_field(req, YA_TAG_ACCEPT, accept, sizeof(accept), 0) != 0 ||
+        copy_field(req, YA_TAG_GRANT_AUDIENCE, grant_audience, sizeof(grant_audience), 0) != 0 ||
+        copy_field(req, YA_TAG_GRANT_PERMISSIONS, grant_permissions, sizeof(grant_permissions), 0) != 0 ||
+        ya_api_build_request(json_request, sizeof(json_request), otp, permission, permissions,
+                             grant_audience, grant_permissions) < 0) {
+        return send_status(fd, buf, cap, YA_BROKER_BAD_REQUEST);
+    }
+
+    if (batches.multi) {
+        struct auth_job job = {
+            .json = json_request,
+            .accept = accept[0] ? accept : NULL,
+            .body = body,
+        };
+        if (batch_submit(&job) == 0) {
+            return job.status == YA_BROKER_OK
+                       ? send_response(fd, buf, cap, job.http_code, job.content_type, job.body, job.body_len)
+                       : send_status(fd, buf, cap, job.status);
+        }
+    }
+
+    ya_buffer_init(&chunk, body, YUBIAPP_MAX_RESPONSE_SIZE);
+    ya_api_setup(curl, config.url, json_request, accept[0] ? accept : NULL, &chunk, &headers);
+    if (config.api_socket) {
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, config.api_socket);
+    }
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+
+    if (res == CURLE_OK) {
+        char *content_type = NULL;
+        ya_metrics_transfer(metrics, curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+        return send_response(fd, buf, cap, response_code, content_type, chunk.memory, chunk.size);
+    }
+    if (chunk.overflow || res == CURLE_FILESIZE_EXCEEDED) {
+        syslog(LOG_ERR, "API response exceeds %d bytes, aborted", YUBIAPP_MAX_RESPONSE_SIZE);
+        status = YA_BROKER_UPSTREAM_ERROR;
+    } else {
+        syslog(LOG_ERR, "curl_easy_perform() failed: %s", curl_easy_strerror(res));
+        status = res == CURLE_OPERATION_TIMEDOUT ? YA_BROKER_UPSTREAM_TIMEOUT : YA_BROKER_UPSTREAM_ERROR;
+    }
+    return send_status(fd, buf, cap, status);
+}
+
+// Queue a session event for the events thread. Nothing is sent back: the
+// module has already moved on. Past a full queue the event is spooled.
+static int handle_session_event(const struct ya_msg *req) {
+    const unsigned char *data;
+    size_t len;
+
+    if (ya_msg_get(req, YA_TAG_EVENT, &data, &len) != 0 || !ya_event_valid((const char *)data, len)) {
+        syslog(LOG_WARNING, "Discarding malformed session event");
+        return -1;
+    }
+    if (events_push(data, len) != 0 && ya_spool_append(config.spool_path, (const char *)data, len) != 0) {
+        syslog(LOG_ERR, "Session event lost: queue full and spool %s: %s", config.spool_path, strerror(errno));
+    }
+    return 0;
+}
+
+// Serve every request on one client connection until EOF or error
+static void serve_client(CURL *curl, int fd, unsigned char *buf, size_t cap, char *body) {
+    struct timeval tv = { CLIENT_TIMEOUT_SEC, 0 };
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    // Only root (sshd, sudo, ...) may ask the broker to authenticate
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != 0) {
+        syslog(LOG_WARNING, "Rejecting broker client with uid %d", cred_len == sizeof(cred) ? (int)cred.uid : -1);
+        return;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    for (;;) {
+        struct ya_msg req;
+        ya_msg_init(&req, buf, cap, 0);
+
+        int rc = ya_msg_recv(fd, &req);
+        if (rc != 0) {
+            if (rc < 0) {
+                syslog(LOG_WARNING, "Failed to read broker request: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if (req.type == YA_MSG_AUTH_REQUEST) {
+            rc = handle_auth_request(curl, fd, &req, buf, cap, body);
+        } else if (req.type == YA_MSG_SESSION_EVENT) {
+            rc = handle_session_event(&req);
+        } else {
+            rc = send_status(fd, buf, cap, YA_BROKER_BAD_REQUEST);
+        }
+        if (rc != 0) {
+            return;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    size_t cap = YA_PROTO_HEADER_SIZE + YA_PROTO_MAX_PAYLOAD;
+    unsigned char *buf = malloc(cap);
+    char *body = malloc(YUBIAPP_MAX_RESPONSE_SIZE + 1);
+    CURL *curl = curl_easy_init();
+    if (!buf || !body || !curl) {
+        syslog(LOG_ERR, "Failed to initialize broker worker");
+        free(buf);
+        free(body);
+        if (curl) {
+            curl_easy_cleanup(curl);
+        }
+        return NULL;
+    }
+
+    // Keep the pooled connection alive between logins
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    if (config.http2) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    }
+
+    int fd;
+    while ((fd = queue_pop()) >= 0) {
+        serve_client(curl, fd, buf, cap, body);
+        close(fd);
+    }
+
+    curl_easy_cleanup(curl);
+    free(body);
+    free(buf);
+    return NULL;
+}
+
+// Post one batch of events to the sessions API. Transport errors, 5xx, 408
+// and 429 are retried later; any other refusal drops the batch.
+static enum post_result post_events(CURL *curl, char *const *batch, int n, char *body) {
+    char response[EVENT_RESPONSE_SIZE + 1];
+    struct MemoryStruct chunk;
+    struct curl_slist *headers = NULL;
+    long code = 0;
+    size_t len = (size_t)snprintf(body, EVENT_BODY_SIZE, "{\"events\":[");
+    for (int i = 0; i < n; i++) {
+        size_t event_len = strlen(batch[i]);
+        if (i > 0) {
+            body[len++] = ',';
+        }
+        memcpy(body + len, batch[i], event_len);
+        len += event_len;
+    }
+    memcpy(body + len, "]}", 3);
+
+    ya_buffer_init(&chunk, response, EVENT_RESPONSE_SIZE);
+    ya_api_setup(curl, config.events_url, body, NULL, &chunk, &headers);
+    if (config.api_socket) {
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, config.api_socket);
+    }
+    headers = curl_slist_append(headers, auth_header);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+
+    if (res != CURLE_OK && !chunk.overflow) {
+        syslog(LOG_WARNING, "Posting %d session events failed: %s", n, curl_easy_strerror(res));
+        return POST_RETRY;
+    }
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code >= 200 && code < 300) {
+        return POST_OK;
+    }
+    syslog(LOG_WARNING, "Sessions API answered HTTP %ld to %d events", code, n);
+    return code >= 500 || code == 408 || code == 429 || code == 0 ? POST_RETRY : POST_DROP;
+}
+
+// Put undelivered events in the spool for a later attempt
+static void spool_events(char *const *batch, int n) {
+    for (int i = 0; i < n; i++) {
+        if (ya_spool_append(config.spool_path, batch[i], strlen(batch[i])) != 0) {
+            syslog(LOG_ERR, "Session event lost: spool %s: %s", config.spool_path, strerror(errno));
+        }
+    }
+}
+
+// Send the spooled events. The spool is first renamed to <spool>.sending,
+// so PAM processes append to a fresh file meanwhile. If a batch fails the
+// .sending file is kept and resent whole next time; the event IDs let the
+// API skip events it already has.
+static enum post_result drain_spool(CURL *curl, char *lines, char *body) {
+    char sending[PATH_MAX];
+    char *batch[EVENT_BATCH];
+    enum post_result rc = POST_OK;
+    int n = 0;
+
+    if (snprintf(sending, sizeof(sending), "%s.sending", config.spool_path) >= (int)sizeof(sending)) {
+        return POST_DROP;
+    }
+    if (access(sending, F_OK) != 0 && rename(config.spool_path, sending) != 0) {
+        return errno == ENOENT ? POST_OK : POST_RETRY;
+    }
+
+    int fd = ya_spool_open(sending);
+    FILE *f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!f) {
+        syslog(LOG_ERR, "Cannot read spool %s: %s", sending, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return POST_DROP;
+    }
+
+    for (;;) {
+        char *line = lines + (size_t)n * (YA_EVENT_MAX_SIZE + 2);
+        int more = fgets(line, YA_EVENT_MAX_SIZE + 2, f) != NULL;
+        if (more) {
+            size_t len = strcspn(line, "\n");
+            line[len] = '\0';
+            if (ya_event_valid(line, len)) {
+                batch[n++] = line;
+            }
+        }
+        if (n == EVENT_BATCH || (!more && n > 0)) {
+            rc = post_events(curl, batch, n, body);
+            n = 0;
+            if (rc == POST_RETRY) {
+                break;
+            }
+        }
+        if (!more) {
+            break;
+        }
+    }
+    fclose(f);
+
+    if (rc != POST_RETRY) {
+        unlink(sending);
+    }
+    return rc;
+}
+
+// Events thread: posts queued events in batches, spools them while the
+// API is failing (backing off 1 s, 2 s, ... up to EVENT_BACKOFF_MAX_SEC)
+// and drains the spool while it is healthy
+static void *events_main(void *arg) {
+    (void)arg;
+
+    char *body = malloc(EVENT_BODY_SIZE);
+    char *lines = malloc((size_t)EVENT_BATCH * (YA_EVENT_MAX_SIZE + 2));
+    CURL *curl = curl_easy_init();
+    char *batch[EVENT_BATCH];
+    unsigned int backoff = 0;
+    uint64_t retry_at = 0;
+    int n;
+
+    if (!body || !lines || !curl) {
+        syslog(LOG_ERR, "Failed to initialize the session events thread");
+        free(body);
+        free(lines);
+        if (curl) {
+            curl_easy_cleanup(curl);
+        }
+        return NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    while ((n = events_pop(batch, EVENT_BATCH)) >= 0) {
+        int deliver = running && auth_header[0] && config.events_url && ya_now_sec() >= retry_at;
+        enum post_result rc = POST_OK;
+
+        if (n > 0) {
+            rc = deliver ? post_events(curl, batch, n, body) : POST_RETRY;
+            if (rc == POST_RETRY) {
+                spool_events(batch, n);
+            }
+            for (int i = 0; i < n; i++) {
+                free(batch[i]);
+            }
+        }
+        if (!deliver) {
+            continue;
+        }
+        if (rc != POST_RETRY) {
+            rc = drain_spool(curl, lines, body);
+        }
+        if (rc == POST_RETRY) {
+            backoff = backoff ? backoff * 2 : 1;
+            if (backoff > EVENT_BACKOFF_MAX_SEC) {
+                backoff = EVENT_BACKOFF_MAX_SEC;
+            }
+            retry_at = ya_now_sec() + backoff;
+            syslog(LOG_WARNING, "Sessions API unavailable, spooling events for %u s", backoff);
+        } else {
+            backoff = 0;
+        }
+    }
+
+    curl_easy_cleanup(curl);
+    free(lines);
+    free(body);
+    return NULL;
+}
+
+// Read the agent token (the first line of path) for the sessions API
+static int load_token(const char *path) {
+    char token[MAX_TOKEN_LENGTH + 2];
+    FILE *f = fopen(path, "re");
+
+    if (!f) {
+        syslog(LOG_ERR, "Cannot read agent token %s: %s", path, strerror(errno));
+        return -1;
+    }
+    int ok = fgets(token, sizeof(token), f) != NULL;
+    fclose(f);
+
+    size_t len = ok ? strcspn(token, "\r\n") : 0;
+    if (len == 0 || len > MAX_TOKEN_LENGTH) {
+        syslog(LOG_ERR, "Invalid agent token in %s", path);
+        return -1;
+    }
+    token[len] = '\0';
+    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", token);
+    return 0;
+}
+
+// The sessions API and the change feed sit next to the device auth endpoint
+static char *sibling_url(const char *url, const char *path) {
+    static const char device[] = "/auth/device";
+    size_t len = strlen(url);
+    size_t base = len - (sizeof(device) - 1);
+
+    if (len < sizeof(device) - 1 || strcmp(url + base, device) != 0) {
+        return NULL;
+    }
+    char *sibling = malloc(base + strlen(path) + 1);
+    if (sibling) {
+        memcpy(sibling, url, base);
+        strcpy(sibling + base, path);
+    }
+    return sibling;
+}
+
+// Parse a UUID in its text form into 16 bytes
+static int parse_uuid(const char *text, unsigned char out[16]) {
+    int n = 0;
+
+    for (const char *p = text; *p && n < 32; p++) {
+        int v;
+        if (*p == '-' && (n == 8 || n == 12 || n == 16 || n == 20)) {
+            continue;
+        } else if (*p >= '0' && *p <= '9') {
+            v = *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            v = *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            v = *p - 'A' + 10;
+        } else {
+            return -1;
+        }
+        out[n / 2] = (unsigned char)(n % 2 ? out[n / 2] | v : v << 4);
+        n++;
+    }
+    return n == 32 && strlen(text) == 36 ? 0 : -1;
+}
+
+// Ask the directory thread to refetch the accounts now
+static void directory_request(void) {
+    pthread_mutex_lock(&directory.lock);
+    directory.requested = 1;
+    pthread_cond_signal(&directory.wake);
+    pthread_mutex_unlock(&directory.lock);
+}
+
+// A uid or gid from the directory; 0, which is never served, if it is not
+// a valid one
+static uint32_t directory_id(const char *text, size_t len) {
+    char buf[16];
+    char *end;
+
+    if (len == 0 || len >= sizeof(buf) || text[0] < '0' || text[0] > '9') {
+        return 0;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    unsigned long v = strtoul(buf, &end, 10);
+    return *end == '\0' && v <= UINT32_MAX ? (uint32_t)v : 0;
+}
+
+static int count_elements(const struct ya_json_field *array) {
+    struct ya_json_iter it;
+    char *value;
+    size_t len;
+    int n = 0;
+
+    if (ya_json_array_begin(&it, array) == 0) {
+        while (ya_json_array_next(&it, &value, &len) == 1) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// Write the accounts and groups of a GET /auth/directory response to the
+// index, returning how many accounts it holds. The counts listed are
+// returned in user_count and group_count.
+static int write_directory(char *body, size_t len, int *user_count, int *group_count) {
+    struct ya_json_field top[] = { {.path = "users"}, {.path = "groups"} };
+    struct ya_json_iter it, git;
+    char *value, *gid;
+    size_t value_len, gid_len;
+    int rc = -1;
+
+    if (ya_json_extract(body, len, top, 2) != 0 || top[0].type != YA_JSON_ARRAY || top[1].type != YA_JSON_ARRAY) {
+        errno = EPROTO;
+        return -1;
+    }
+    int nu = count_elements(&top[0]), ng = count_elements(&top[1]), nl = 0, cap = 256;
+    struct ya_users_input *users = calloc((size_t)nu + 1, sizeof(*users));
+    struct ya_users_input_group *groups = calloc((size_t)ng + 1, sizeof(*groups));
+    uint32_t *links = malloc(sizeof(uint32_t) * (size_t)cap);
+    int *first = calloc((size_t)nu + 1, sizeof(int));
+    if (!users || !groups || !links || !first) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    // Elements that are not objects, or lack a field, give entries that
+    // ya_users_write leaves out
+    int u = 0;
+    ya_json_array_begin(&it, &top[0]);
+    while (u < nu && ya_json_array_next(&it, &value, &value_len) == 1) {
+        struct ya_json_field f[] = { {.path = "username"}, {.path = "uid"}, {.path = "gecos"}, {.path = "groups"} };
+        struct ya_users_input *in = &users[u];
+        first[u++] = nl;
+        if (ya_json_extract(value, value_len, f, 4) != 0 || f[0].type != YA_JSON_STRING ||
+            f[1].type != YA_JSON_NUMBER) {
+            continue;
+        }
+        in->name = f[0].value;
+        in->uid = directory_id(f[1].value, f[1].len);
+        in->gecos = f[2].type == YA_JSON_STRING ? f[2].value : "";
+        if (ya_json_array_begin(&git, &f[3]) != 0) {
+            continue;
+        }
+        while (ya_json_array_next(&git, &gid, &gid_len) == 1) {
+            if (nl == cap) {
+                uint32_t *grown = realloc(links, sizeof(uint32_t) * (size_t)(cap *= 2));
+                if (!grown) {
+                    errno = ENOMEM;
+                    goto out;
+                }
+                links = grown;
+            }
+            links[nl++] = directory_id(gid, gid_len);
+        }
+        in->gid_count = nl - first[u - 1];
+    }
+    // links has stopped moving; point each user at its gids
+    for (int i = 0; i < u; i++) {
+        users[i].gids = links + first[i];
+    }
+
+    int g = 0;
+    ya_json_array_begin(&it, &top[1]);
+    while (g < ng && ya_json_array_next(&it, &value, &value_len) == 1) {
+        struct ya_json_field f[] = { {.path = "name"}, {.path = "gid"} };
+        if (ya_json_extract(value, value_len, f, 2) == 0 && f[0].type == YA_JSON_STRING &&
+            f[1].type == YA_JSON_NUMBER) {
+            groups[g].name = f[0].value;
+            groups[g].gid = directory_id(f[1].value, f[1].len);
+        }
+        g++;
+    }
+
+    *user_count = u;
+    *group_count = g;
+    rc = ya_users_write(config.directory_path, users, u, groups, g, config.home_base, config.shell);
+
+out:
+    free(first);
+    free(links);
+    free(groups);
+    free(users);
+    return rc;
+}
+
+// Fetch the host directory and rewrite the index from it
+static int sync_directory(CURL *curl, struct MemoryStruct *chunk) {
+    struct curl_slist *headers = NULL;
+    long code = 0;
+    int users = 0, groups = 0;
+    static int last_held = -1;
+
+    chunk->size = 0;
+    chunk->overflow = 0;
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, config.directory_url);
+    if (config.api_socket) {
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, config.api_socket);
+    }
+    headers = curl_slist_append(headers, auth_header);
+    headers = curl_slist_append(headers, "Accept: application/json");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)chunk);
+    curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)chunk->capacity);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, YUBIAPP_CONNECT_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)DIRECTORY_TIMEOUT_SEC);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+    if (res != CURLE_OK || code != 200) {
+        if (chunk->overflow || res == CURLE_FILESIZE_EXCEEDED) {
+            syslog(LOG_WARNING, "Directory %s is larger than %d bytes", config.directory_url, DIRECTORY_MAX_SIZE);
+        } else if (res != CURLE_OK) {
+            syslog(LOG_WARNING, "Directory %s failed: %s", config.directory_url, curl_easy_strerror(res));
+        } else {
+            syslog(LOG_WARNING, "Directory %s answered HTTP %ld", config.directory_url, code);
+        }
+        return -1;
+    }
+    int held = write_directory(chunk->memory, chunk->size, &users, &groups);
+    if (held < 0) {
+        syslog(LOG_WARNING, "Cannot update account index %s from %s: %s", config.directory_path,
+               config.directory_url, errno == EPROTO ? "malformed response" : strerror(errno));
+        return -1;
+    }
+    if (held != last_held) {
+        syslog(LOG_INFO, "Account index %s holds %d of %d users listed (%d groups)", config.directory_path, held,
+               users, groups);
+        last_held = held;
+    }
+    return 0;
+}
+
+// Keep the account index nss_yubiapp serves in step with the API: refetch
+// the directory every DIRECTORY_REFRESH_SEC and whenever the change feed
+// reports a user or role write. While the API is unreachable the index is
+// left as it is, so logins keep resolving the accounts last seen.
+static void *directory_main(void *arg) {
+    (void)arg;
+
+    struct MemoryStruct chunk;
+    CURL *curl = curl_easy_init();
+    char *body = malloc(DIRECTORY_MAX_SIZE + 1);
+    uint64_t next = 0, hold = 0;     /* when to refresh, and ignore requests until */
+    unsigned int backoff = 0;
+
+    if (!curl || !body) {
+        syslog(LOG_ERR, "Failed to initialize the directory thread");
+        curl_easy_cleanup(curl);
+        free(body);
+        return NULL;
+    }
+    ya_buffer_init(&chunk, body, DIRECTORY_MAX_SIZE);
+    while (running) {
+        pthread_mutex_lock(&directory.lock);
+        uint64_t now = ya_monotonic_us();
+        while (running && now < next && !(directory.requested && now >= hold)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&directory.wake, &directory.lock, &ts);
+            now = ya_monotonic_us();
+        }
+        directory.requested = 0;
+        pthread_mutex_unlock(&directory.lock);
+        if (!running) {
+            break;
+        }
+
+        if (sync_directory(curl, &chunk) == 0) {
+            backoff = 0;
+            hold = 0;
+            next = now + DIRECTORY_REFRESH_SEC * 1000000ULL;
+        } else {
+            backoff = backoff ? backoff * 2 : 1;
+            if (backoff > DIRECTORY_BACKOFF_MAX_SEC) {
+                backoff = DIRECTORY_BACKOFF_MAX_SEC;
+            }
+            hold = next = now + backoff * 1000000ULL;
+        }
+    }
+    curl_easy_cleanup(curl);
+    free(body);
+    return NULL;
+}
+
+// Drop the grants a change may have revoked: those of the user or device
+// it names, or all of them for a role, permission or resource change and
+// for a reset, after which anything may have changed. A user or role
+// change, or a reset, also refreshes the account index.
+static void apply_change(const char *event, char *data) {
+    unsigned char id[16];
+    const unsigned char *user_id = NULL, *device_id = NULL;
+    char what[48] = "a feed reset";
+    int accounts = 1;
+
+    if (strcmp(event, "invalidate") == 0) {
+        struct ya_json_field f[] = { {.path = "kind"}, {.path = "id"} };
+        if (ya_json_extract(data, strlen(data), f, 2) != 0 || f[0].type != YA_JSON_STRING) {
+            snprintf(what, sizeof(what), "an unreadable change");
+        } else {
+            snprintf(what, sizeof(what), "a %.20s change", f[0].value);
+            accounts = strcmp(f[0].value, "user") == 0 || strcmp(f[0].value, "role") == 0;
+            if (f[1].type == YA_JSON_STRING && parse_uuid(f[1].value, id) == 0) {
+                if (strcmp(f[0].value, "user") == 0) {
+                    user_id = id;
+                } else if (strcmp(f[0].value, "device") == 0) {
+                    device_id = id;
+                }
+            }
+        }
+    } else if (strcmp(event, "reset") != 0) {
+        return;
+    }
+
+    if (accounts && config.directory_url) {
+        directory_request();
+    }
+    if (!config.grant_dir) {
+        return;
+    }
+    int removed = ya_grant_revoke(config.grant_dir, user_id, device_id);
+    if (removed < 0) {
+        syslog(LOG_WARNING, "Cannot read grant store %s: %s", config.grant_dir, strerror(errno));
+    } else if (removed > 0) {
+        syslog(LOG_INFO, "Revoked %d grant(s) on %s", removed, what);
+    }
+}
+
+// One line of the change stream (text/event-stream): fields accumulate
+// until an empty line dispatches the event
+static void change_line(struct change_stream *s, char *line) {
+    if (*line == '\0') {
+        if (s->event[0] || s->data[0]) {
+            apply_change(s->event[0] ? s->event : "message", s->data);
+            if (s->id[0]) {
+                memcpy(s->last_id, s->id, sizeof(s->last_id));
+            }
+        }
+        s->event[0] = s->data[0] = s->id[0] = '\0';
+        return;
+    }
+    if (*line == ':') {
+        return;
+    }
+    char *value = strchr(line, ':');
+    if (value) {
+        *value++ = '\0';
+        value += *value == ' ';
+    } else {
+        value = line + strlen(line);
+    }
+    if (strcmp(line, "event") == 0) {
+        snprintf(s->event, sizeof(s->event), "%s", value);
+    } else if (strcmp(line, "data") == 0) {
+        snprintf(s->data, sizeof(s->data), "%s", value);
+    } else if (strcmp(line, "id") == 0) {
+        snprintf(s->id, sizeof(s->id), "%s", value);
+    }
+}
+
+static size_t change_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct change_stream *s = userp;
+    const char *p = contents;
+    size_t n = size * nmemb;
+
+    s->received = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '\n') {
+            s->line[s->len] = '\0';
+            if (s->len > 0 && s->line[s->len - 1] == '\r') {
+                s->line[s->len - 1] = '\0';
+            }
+            if (!s->overflow) {
+                change_line(s, s->line);
+            }
+            s->len = 0;
+            s->overflow = 0;
+        } else if (s->len < CHANGES_LINE_MAX) {
+            s->line[s->len++] = p[i];
+        } else {
+            s->overflow = 1;
+        }
+    }
+    return n;
+}
+
+// Called about once a second while the stream is open
+static int change_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)clientp;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return running ? 0 : 1;
+}
+
+// Follow the change feed until the stream ends, resuming after the last
+// change applied
+static CURLcode follow_changes(CURL *curl, struct change_stream *s) {
+    struct curl_slist *headers = NULL;
+    char last_id[sizeof(s->last_id) + 16];
+
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, config.changes_url);
+    if (config.api_socket) {
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, config.api_socket);
+    }
+    headers = curl_slist_append(headers, auth_header);
+    headers = curl_slist_append(headers, "Accept: text/event-stream");
+    if (s->last_id[0]) {
+        snprintf(last_id, sizeof(last_id), "Last-Event-ID: %s", s->last_id);
+        headers = curl_slist_append(headers, last_id);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CHANGES_CONNECT_TIMEOUT_SEC);
+    // The API sends a comment every 15 s; three missed mean a dead stream
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)CHANGES_IDLE_SEC);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, change_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, change_progress);
+
+    s->len = 0;
+    s->overflow = 0;
+    s->received = 0;
+    s->event[0] = s->data[0] = s->id[0] = '\0';
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    return res;
+}
+
+// Subscribe to the API's change feed and drop grants from the store as
+// soon as a write revokes them, rather than when their TTL runs out, and
+// refresh the account index
+static void *changes_main(void *arg) {
+    (void)arg;
+
+    static struct change_stream stream;
+    CURL *curl = curl_easy_init();
+    unsigned int backoff = 0;
+
+    if (!curl) {
+        syslog(LOG_ERR, "Failed to initialize the change feed thread");
+        return NULL;
+    }
+    while (running) {
+        CURLcode res = follow_changes(curl, &stream);
+        if (!running) {
+            break;
+        }
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+        backoff = stream.received ? 1 : backoff ? backoff * 2 : 1;
+        if (backoff > CHANGES_BACKOFF_MAX_SEC || code == 404) {
+            backoff = CHANGES_BACKOFF_MAX_SEC;
+        }
+        if (code >= 400) {
+            syslog(LOG_WARNING, "Change feed %s answered HTTP %ld, retrying in %u s", config.changes_url, code, backoff);
+        } else if (res != CURLE_OK) {
+            syslog(LOG_WARNING, "Change feed %s failed: %s, reconnecting in %u s", config.changes_url,
+                   curl_easy_strerror(res), backoff);
+        } else {
+            syslog(LOG_INFO, "Change feed %s ended, reconnecting in %u s", config.changes_url, backoff);
+        }
+        for (unsigned int i = 0; i < backoff && running; i++) {
+            sleep(1);
+        }
+    }
+    curl_easy_cleanup(curl);
+    return NULL;
+}
+
+// Answer one scrape. Only GET /metrics is served; the request body, if
+// any, is ignored.
+static void serve_scrape(int fd, char *text, size_t cap) {
+    struct timeval tv = { EXPORTER_TIMEOUT_SEC, 0 };
+    char request[1024];
+    char header[160];
+    const char *status = "404 Not Found";
+    int len = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) {
+        return;
+    }
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        len = ya_metrics_format(metrics, text, cap);
+        status = len >= 0 ? "200 OK" : "500 Internal Server Error";
+        if (len < 0) {
+            len = 0;
+        }
+    }
+
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %d\r\n"
+                        "Connection: close\r\n\r\n", status, len);
+    if (send(fd, header, (size_t)hlen, MSG_NOSIGNAL) == hlen && len > 0) {
+        send(fd, text, (size_t)len, MSG_NOSIGNAL);
+    }
+}
+
+// Prometheus exporter thread: one scrape at a time, which is all a
+// scraper needs
+static void *exporter_main(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    char *text = malloc(METRICS_TEXT_SIZE);
+
+    if (!text) {
+        syslog(LOG_ERR, "Failed to initialize metrics exporter");
+        return NULL;
+    }
+    while (running) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        serve_scrape(fd, text, METRICS_TEXT_SIZE);
+        close(fd);
+    }
+    free(text);
+    return NULL;
+}
+
+// Listen on [host:]port for the exporter; host defaults to loopback
+static int open_exporter(const char *spec) {
+    char host[256];
+    const char *port = strrchr(spec, ':');
+    struct addrinfo hints, *res;
+
+    if (port) {
+        size_t len = (size_t)(port - spec);
+        if (len >= sizeof(host)) {
+            syslog(LOG_ERR, "Invalid metrics address: %s", spec);
+            return -1;
+        }
+        memcpy(host, spec, len);
+        host[len] = '\0';
+        port++;
+    } else {
+        strcpy(host, EXPORTER_DEFAULT_HOST);
+        port = spec;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (rc != 0) {
+        syslog(LOG_ERR, "Invalid metrics address %s: %s", spec, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    int one = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, 16) != 0) {
+        syslog(LOG_ERR, "Failed to listen for metrics on %s: %s", spec, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Create the listening socket, replacing a stale one from a previous run
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Socket path too long: %s", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    mode_t old_umask = umask(0177);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (rc != 0 || listen(fd, SOMAXCONN) != 0) {
+        syslog(LOG_ERR, "Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-f] [-s socket] [-u url] [-w workers] [-m metrics|-M] [-p [host:]port] [-e]\n"
+            "       [-t tokenfile] [-E url] [-S spool] [-U socket] [-b usec] [-2] [-C url] [-G dir]\n"
+            "       [-D index] [-H home] [-L shell]\n"
+            "  -f          run in the foreground and log to stderr\n"
+            "  -s socket   Unix socket path (default %s)\n"
+            "  -u url      YubiApp device auth URL (default %s)\n"
+            "  -w workers  number of pooled API connections (default %d)\n"
+            "  -m metrics  shared metrics file (default %s)\n"
+            "  -M          do not record metrics\n"
+            "  -p port     serve metrics to Prometheus on [host:]port (host defaults to %s)\n"
+            "  -e          print the metrics in Prometheus format and exit\n"
+            "  -t file     agent token for posting session events (none: spool only)\n"
+            "  -E url      sessions API URL (default: -u with /auth/session-events)\n"
+            "  -S spool    undelivered session events (default %s)\n"
+            "  -U socket   reach the API over this Unix socket instead of TCP\n"
+            "  -b usec     wait this long for concurrent logins to batch (default %d, 0: no batching)\n"
+            "  -2          talk HTTP/2 without TLS (h2c) to the API, so batches share one connection\n"
+            "  -C url      change feed URL (default: -u with /auth/changes; needs -t)\n"
+            "  -G dir      grant store to prune on revocations (default %s, none: let grants expire)\n"
+            "  -D index    account index served by nss_yubiapp (default %s, none: do not sync; needs -t)\n"
+            "  -H home     base of the indexed users' home directories (default %s)\n"
+            "  -L shell    login shell of the indexed users (default %s)\n",
+            prog, YUBIAPP_BROKER_SOCKET, YUBIAPP_URL, DEFAULT_WORKERS, YA_METRICS_STATE,
+            EXPORTER_DEFAULT_HOST, YA_SPOOL_PATH, BATCH_WINDOW_US, YA_GRANT_DIR, YA_USERS_PATH,
+            DIRECTORY_HOME, DIRECTORY_SHELL);
+}
+
+// Print the metrics once, e.g. for node_exporter's textfile collector
+static int print_metrics(void) {
+    char *text = malloc(METRICS_TEXT_SIZE);
+    int len;
+
+    metrics = ya_metrics_open(config.metrics_path);
+    if (!metrics || !text || (len = ya_metrics_format(metrics, text, METRICS_TEXT_SIZE)) < 0) {
+        fprintf(stderr, "Cannot read metrics from %s\n", config.metrics_path ? config.metrics_path : "(none)");
+        free(text);
+        return 1;
+    }
+    fwrite(text, 1, (size_t)len, stdout);
+    free(text);
+    ya_metrics_close(metrics);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    int print_only = 0;
+
+    while ((opt = getopt(argc, argv, "fs:u:w:m:Mp:et:E:S:U:b:2C:G:D:H:L:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            config.foreground = 1;
+            break;
+        case 's':
+            config.socket_path = optarg;
+            break;
+        case 'u':
+            config.url = optarg;
+            break;
+        case 'w':
+            config.workers = atoi(optarg);
+            break;
+        case 'm':
+            config.metrics_path = optarg;
+            break;
+        case 'M':
+            config.metrics_path = NULL;
+            break;
+        case 'p':
+            config.exporter = optarg;
+            break;
+        case 'e':
+            print_only = 1;
+            break;
+        case 't':
+            config.token_path = optarg;
+            break;
+        case 'E':
+            config.events_url = optarg;
+            break;
+        case 'S':
+            config.spool_path = optarg;
+            break;
+        case 'U':
+            config.api_socket = optarg;
+            break;
+        case 'b':
+            config.batch_window_us = atol(optarg);
+            break;
+        case '2':
+            config.http2 = 1;
+            break;
+        case 'C':
+            config.changes_url = optarg;
+            break;
+        case 'G':
+            config.grant_dir = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'D':
+            config.directory_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'H':
+            config.home_base = optarg;
+            break;
+        case 'L':
+            config.shell = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.workers < 1 || config.batch_window_us < 0 || (config.exporter && !config.metrics_path) ||
+        config.home_base[0] != '/' || config.shell[0] != '/') {
+        usage(argv[0]);
+        return 1;
+    }
+    if (print_only) {
+        return print_metrics();
+    }
+
+    openlog("yubiappd", LOG_PID | (config.foreground ? LOG_PERROR : 0), LOG_AUTHPRIV);
+
+    if (!config.foreground && daemon(0, 0) != 0) {
+        syslog(LOG_ERR, "daemon() failed: %s", strerror(errno));
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        syslog(LOG_ERR, "Failed to initialize libcurl");
+        return 1;
+    }
+
+    int listen_fd = open_listener(config.socket_path);
+    if (listen_fd < 0) {
+        curl_global_cleanup();
+        return 1;
+    }
+
+    if (config.metrics_path) {
+        metrics = ya_metrics_open(config.metrics_path);
+        if (!metrics) {
+            syslog(LOG_WARNING, "Cannot map metrics file %s, metrics disabled", config.metrics_path);
+        }
+    }
+    if (config.exporter && metrics) {
+        pthread_t exporter;
+        int exporter_fd = open_exporter(config.exporter);
+        if (exporter_fd >= 0 &&
+            pthread_create(&exporter, NULL, exporter_main, (void *)(intptr_t)exporter_fd) == 0) {
+            pthread_detach(exporter);
+        } else if (exporter_fd >= 0) {
+            close(exporter_fd);
+        }
+    }
+
+    if (config.token_path && load_token(config.token_path) != 0) {
+        close(listen_fd);
+        curl_global_cleanup();
+        return 1;
+    }
+    if (!config.events_url) {
+        config.events_url = sibling_url(config.url, "/auth/session-events");
+    }
+    if (!auth_header[0] || !config.events_url) {
+        syslog(LOG_WARNING, "No %s for the sessions API, session events are only spooled to %s",
+               auth_header[0] ? "URL" : "agent token", config.spool_path);
+    }
+
+    pthread_t events_thread;
+    int events_started = pthread_create(&events_thread, NULL, events_main, NULL) == 0;
+
+    if (!config.changes_url) {
+        config.changes_url = sibling_url(config.url, "/auth/changes");
+    }
+    if (config.directory_path && auth_header[0]) {
+        config.directory_url = sibling_url(config.url, "/auth/directory");
+    }
+    pthread_t directory_thread;
+    int directory_started = 0;
+    if (config.directory_url) {
+        directory_started = pthread_create(&directory_thread, NULL, directory_main, NULL) == 0;
+    } else if (config.directory_path) {
+        syslog(LOG_WARNING, "No %s for the host directory, nss_yubiapp serves %s as last written",
+               auth_header[0] ? "URL" : "agent token", config.directory_path);
+    }
+
+    pthread_t changes_thread;
+    int changes_started = 0;
+    if ((config.grant_dir || config.directory_url) && auth_header[0] && config.changes_url) {
+        changes_started = pthread_create(&changes_thread, NULL, changes_main, NULL) == 0;
+    } else if (config.grant_dir) {
+        syslog(LOG_WARNING, "No %s for the change feed, grants in %s expire without revocation",
+               auth_header[0] ? "URL" : "agent token", config.grant_dir);
+    }
+
+    static struct batch_transfer batch_slots[BATCH_INFLIGHT];
+    pthread_t batch_thread;
+    int batch_started = 0;
+    if (config.batch_window_us > 0 && !auth_header[0]) {
+        syslog(LOG_WARNING, "No agent token for the batch endpoint, sending logins one at a time");
+    } else if (config.batch_window_us > 0) {
+        batch_started = batch_open(&batch_thread, batch_slots) == 0;
+    }
+
+    pthread_t *threads = calloc((size_t)config.workers, sizeof(pthread_t));
+    if (!threads) {
+        syslog(LOG_ERR, "Out of memory");
+        return 1;
+    }
+    for (int i = 0; i < config.workers; i++) {
+        pthread_create(&threads[i], NULL, worker_main, NULL);
+    }
+
+    syslog(LOG_INFO, "Listening on %s, forwarding to %s with %d workers",
+           config.socket_path, config.url, config.workers);
+
+    while (running) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                syslog(LOG_WARNING, "accept() failed: %s", strerror(errno));
+            }
+            continue;
+        }
+        if (queue_push(fd) != 0) {
+            syslog(LOG_WARNING, "Broker queue full, dropping client");
+            close(fd);
+        }
+    }
+
+    syslog(LOG_INFO, "Shutting down");
+    close(listen_fd);
+    unlink(config.socket_path);
+    queue_close();
+    for (int i = 0; i < config.workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    if (batch_started) {
+        batch_close(batch_thread, batch_slots);
+    }
+    events_close();
+    if (events_started) {
+        pthread_join(events_thread, NULL);
+    }
+    if (changes_started) {
+        pthread_join(changes_thread, NULL);
+    }
+    if (directory_started) {
+        pthread_mutex_lock(&directory.lock);
+        pthread_cond_signal(&directory.wake);
+        pthread_mutex_unlock(&directory.lock);
+        pthread_join(directory_thread, NULL);
+    }
+    ya_metrics_close(metrics);
+    curl_global_cleanup();
+    closelog();
+    return 0;
+}
@@ -1,7 +1,14 @@
 package main
 
 import (
+	"context"
+	"errors"
 	"log"
+	"net/http"
+	"os"
+	"os/signal"
+	"syscall"
+	"time"
 
 	"github.com/YubiApp/internal/config"
 	"github.com/YubiApp/internal/server"
@@ -16,7 +23,24 @@ func main() {
 
 	// Initialize and start the server
 	srv := server.New(cfg)
-	if err := srv.Start(); err != nil {
-		log.Fatalf("Failed to start server: %v", err)
+	errs := make(chan error, 1)
+	go func() { errs <- srv.Start() }()
+
+	// Shut down on SIGINT/SIGTERM so queued authentication logs are flushed
+	signals := make(chan os.Signal, 1)
+	signal.Notify(signals, syscall.SIGINT, syscall.SIGTERM)
+
+	select {
+	case err := <-errs:
+		if err != nil && !errors.Is(err, http.ErrServerClosed) {
+			log.Fatalf("Failed to start server: %v", err)
+		}
+	case sig := <-signals:
+		log.Printf("Received %s, shutting down", sig)
+		ctx, cancel := context.WithTimeout(context.Background(), 30*time.Second)
+		defer cancel()
+		if err := srv.Shutdown(ctx); err != nil {
+			log.Printf("Error shutting down server: %v", err)
+		}
 	}
-} 
\ No newline at end of file
+}
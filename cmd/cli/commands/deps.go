@@ -3,6 +3,7 @@ package commands
 import (
 	"github.com/YubiApp/cmd/cli/utils"
 	"github.com/YubiApp/internal/config"
+	"github.com/YubiApp/internal/services"
 	"github.com/spf13/cobra"
 	"gorm.io/gorm"
 )
@@ -26,7 +27,11 @@ func InitMigrationCommand() *cobra.Command {
 		Short: "Run database migrations",
 		Long:  "Run database migrations to ensure the database schema is up to date",
 		RunE: func(cmd *cobra.Command, args []string) error {
-			return utils.RunMigrations(DB)
+			if err := utils.RunMigrations(DB); err != nil {
+				return err
+			}
+			// Host directory ids of users and roles that have none
+			return services.AssignPosixIDs(DB, Cfg.Auth)
 		},
 	}
 	
@@ -2,9 +2,14 @@ package commands
 
 import (
 	"fmt"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
 	"time"
 
 	"github.com/YubiApp/internal/database"
+	"github.com/YubiApp/internal/services"
 	"github.com/google/uuid"
 	"github.com/spf13/cobra"
 )
@@ -130,6 +135,155 @@ var deleteDeviceCmd = &cobra.Command{
 	},
 }
 
+var setOTPKeyCmd = &cobra.Command{
+	Use:   "set-otp-key",
+	Short: "Store the AES key of a self-provisioned YubiKey",
+	Long: "Store the AES key and private ID a YubiKey was programmed with, so its OTPs are verified locally instead of by YubiCloud. " +
+		"A running API keeps verifying the key as before until its cached entry for the device expires (auth.device_cache_ttl); " +
+		"restart it to switch at once.",
+	Args:  cobra.ExactArgs(1),
+	RunE: func(cmd *cobra.Command, args []string) error {
+		identifier := args[0]
+		aesKey, _ := cmd.Flags().GetString("aes-key")
+		privateID, _ := cmd.Flags().GetString("private-id")
+
+		secret, err := services.FormatYubikeySecret(aesKey, privateID)
+		if err != nil {
+			return err
+		}
+
+		var device database.Device
+		if _, err := uuid.Parse(identifier); err == nil {
+			if err := DB.First(&device, "id = ?", identifier).Error; err != nil {
+				return fmt.Errorf("device not found: %w", err)
+			}
+		} else {
+			if err := DB.First(&device, "type = 'yubikey' AND (identifier = ? OR name = ? OR serial_number = ?)", identifier, identifier, identifier).Error; err != nil {
+				return fmt.Errorf("device not found: %w", err)
+			}
+		}
+		if device.Type != "yubikey" {
+			return fmt.Errorf("device %s is not a yubikey", device.Name)
+		}
+
+		if _, err := services.NewDeviceService(DB).UpdateDevice(device.ID, map[string]interface{}{"secret": secret}); err != nil {
+			return err
+		}
+
+		fmt.Printf("OTP key stored for device: %s (%s)\n", device.Name, device.ID)
+		return nil
+	},
+}
+
+var exportOfflineCmd = &cobra.Command{
+	Use:   "export-offline",
+	Short: "Export the key file for offline OTP verification",
+	Long:  "Write the AES keys, OTP counters and owners of active self-provisioned YubiKeys in the format read by pam_yubiapp's offline option",
+	RunE: func(cmd *cobra.Command, args []string) error {
+		output, _ := cmd.Flags().GetString("output")
+
+		var devices []database.Device
+		if err := DB.Preload("User.Roles.Permissions.Resource").
+			Where("type = ? AND active = ? AND secret LIKE ?", "yubikey", true, "%:%").
+			Find(&devices).Error; err != nil {
+			return fmt.Errorf("failed to fetch devices: %w", err)
+		}
+
+		var counters []struct {
+			ID      uuid.UUID
+			Counter int64
+		}
+		if err := DB.Raw(`SELECT id, COALESCE((properties->>'otp_counter')::bigint, 0) AS counter
+			FROM devices WHERE type = 'yubikey' AND deleted_at IS NULL`).Scan(&counters).Error; err != nil {
+			return fmt.Errorf("failed to fetch OTP counters: %w", err)
+		}
+		counterByDevice := make(map[uuid.UUID]int64, len(counters))
+		for _, c := range counters {
+			counterByDevice[c.ID] = c.Counter
+		}
+
+		var b strings.Builder
+		b.WriteString("# public_id\taes_key\tprivate_id\tcounter\tdevice_id\tuser_id\tusername\temail\tfirst_name\tlast_name\tactive\troles\tpermissions\n")
+		exported := 0
+		for _, device := range devices {
+			aesKey, privateID, _ := strings.Cut(device.Secret, ":")
+			if _, err := services.FormatYubikeySecret(aesKey, privateID); err != nil || len(device.Identifier) != 12 {
+				continue
+			}
+
+			var roles, permissions []string
+			seen := make(map[string]bool)
+			for _, role := range device.User.Roles {
+				roles = append(roles, role.Name)
+				for _, perm := range role.Permissions {
+					name := perm.Resource.Name + ":" + perm.Action
+					if perm.Effect == "allow" && !seen[name] {
+						seen[name] = true
+						permissions = append(permissions, name)
+					}
+				}
+			}
+			sort.Strings(permissions)
+
+			active := "0"
+			if device.User.Active {
+				active = "1"
+			}
+			fields := []string{
+				device.Identifier, aesKey, privateID, fmt.Sprint(counterByDevice[device.ID]),
+				device.ID.String(), device.UserID.String(), device.User.Username, device.User.Email,
+				device.User.FirstName, device.User.LastName, active,
+				strings.Join(roles, ","), strings.Join(permissions, ","),
+			}
+			for i, field := range fields {
+				fields[i] = offlineField(field)
+			}
+			b.WriteString(strings.Join(fields, "\t"))
+			b.WriteString("\n")
+			exported++
+		}
+
+		// Replace the file atomically; PAM processes may be reading it
+		tmp, err := os.CreateTemp(filepath.Dir(output), ".offline-keys-*")
+		if err != nil {
+			return fmt.Errorf("failed to create key file: %w", err)
+		}
+		defer os.Remove(tmp.Name())
+		if err := tmp.Chmod(0600); err != nil {
+			tmp.Close()
+			return fmt.Errorf("failed to create key file: %w", err)
+		}
+		if _, err := tmp.WriteString(b.String()); err != nil {
+			tmp.Close()
+			return fmt.Errorf("failed to write key file: %w", err)
+		}
+		if err := tmp.Close(); err != nil {
+			return fmt.Errorf("failed to write key file: %w", err)
+		}
+		if err := os.Rename(tmp.Name(), output); err != nil {
+			return fmt.Errorf("failed to write key file: %w", err)
+		}
+
+		fmt.Printf("Exported %d offline keys to %s\n", exported, output)
+		return nil
+	},
+}
+
+// offlineField makes a value safe for the tab-separated key file; "-" stands
+// for an empty field
+func offlineField(value string) string {
+	value = strings.Map(func(r rune) rune {
+		if r == '\t' || r == '\n' || r == '\r' {
+			return ' '
+		}
+		return r
+	}, value)
+	if value == "" {
+		return "-"
+	}
+	return value
+}
+
 // DeviceCmd represents the device command
 var DeviceCmd = &cobra.Command{
 	Use:   "device",
@@ -144,6 +298,8 @@ func InitDeviceCommands() {
 	DeviceCmd.AddCommand(listDevicesCmd)
 	DeviceCmd.AddCommand(updateDeviceCmd)
 	DeviceCmd.AddCommand(deleteDeviceCmd)
+	DeviceCmd.AddCommand(setOTPKeyCmd)
+	DeviceCmd.AddCommand(exportOfflineCmd)
 
 	// Create device flags
 	createDeviceCmd.Flags().String("name", "", "Device name")
@@ -160,4 +316,11 @@ func InitDeviceCommands() {
 
 	// List devices flags
 	listDevicesCmd.Flags().Bool("active-only", false, "Show only active devices")
-} 
\ No newline at end of file
+
+	// Offline OTP flags
+	setOTPKeyCmd.Flags().String("aes-key", "", "AES key the YubiKey was programmed with (32 hex characters)")
+	setOTPKeyCmd.Flags().String("private-id", "", "Private ID the YubiKey was programmed with (12 hex characters)")
+	setOTPKeyCmd.MarkFlagRequired("aes-key")
+	setOTPKeyCmd.MarkFlagRequired("private-id")
+	exportOfflineCmd.Flags().String("output", "/etc/yubiapp/offline-keys", "Key file to write")
+}
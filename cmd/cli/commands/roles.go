@@ -5,6 +5,7 @@ import (
 	"time"
 
 	"github.com/YubiApp/internal/database"
+	"github.com/YubiApp/internal/services"
 	"github.com/google/uuid"
 	"github.com/spf13/cobra"
 )
@@ -27,6 +28,9 @@ var createRoleCmd = &cobra.Command{
 		if err := DB.Create(&role).Error; err != nil {
 			return fmt.Errorf("failed to create role: %w", err)
 		}
+		if err := services.AssignPosixIDs(DB, Cfg.Auth); err != nil {
+			return fmt.Errorf("failed to assign gid: %w", err)
+		}
 
 		fmt.Printf("Role created: %s (%s)\n", role.Name, role.ID)
 		return nil
@@ -5,6 +5,7 @@ import (
 	"time"
 
 	"github.com/YubiApp/internal/database"
+	"github.com/YubiApp/internal/services"
 	"github.com/google/uuid"
 	"github.com/spf13/cobra"
 	"golang.org/x/crypto/bcrypt"
@@ -47,6 +48,9 @@ var createUserCmd = &cobra.Command{
 		if err := DB.Create(&user).Error; err != nil {
 			return fmt.Errorf("failed to create user: %w", err)
 		}
+		if err := services.AssignPosixIDs(DB, Cfg.Auth); err != nil {
+			return fmt.Errorf("failed to assign uid: %w", err)
+		}
 
 		fmt.Printf("User created: %s (%s)\n", user.Email, user.ID)
 		return nil
@@ -20,9 +20,16 @@ type Config struct {
 
 type ServerConfig struct {
 	Host    string        `mapstructure:"host"`
-	Port    int           `mapstructure:"port"`
+	Port    int           `mapstructure:"port"` // 0 disables the TCP listener
 	Timeout time.Duration `mapstructure:"timeout"`
 	Debug   bool          `mapstructure:"debug"`
+
+	// Also serve the API on a Unix socket, e.g. for pam_yubiapp socket=
+	UnixSocket     string `mapstructure:"unix_socket"`
+	UnixSocketMode string `mapstructure:"unix_socket_mode"` // octal, e.g. "0660"
+
+	// Accept HTTP/2 without TLS (h2c) next to HTTP/1.1, e.g. for yubiappd -2
+	H2C bool `mapstructure:"h2c"`
 }
 
 type DatabaseConfig struct {
@@ -48,12 +55,24 @@ type AuthConfig struct {
 	RefreshTokenExpiry  time.Duration `mapstructure:"refresh_token_expiry"`
 	AccessTokenExpiry   time.Duration `mapstructure:"access_token_expiry"`
 	SessionExpiry       time.Duration `mapstructure:"session_expiry"`
+	AgentToken          string        `mapstructure:"agent_token"`
+	DeviceCacheTTL      time.Duration `mapstructure:"device_cache_ttl"`   // 0 disables the device cache
+	DeviceCacheSize     int           `mapstructure:"device_cache_size"`  // devices kept
+	LogQueueSize        int           `mapstructure:"log_queue_size"`     // 0 writes authentication logs synchronously
+	LogBatchSize        int           `mapstructure:"log_batch_size"`     // log entries per insert
+	LogFlushInterval    time.Duration `mapstructure:"log_flush_interval"` // longest a queued entry waits
+	GrantKeyFile        string        `mapstructure:"grant_key_file"`     // Ed25519 key (PKCS#8 PEM) signing PAM grants; empty disables them
+	GrantTTL            time.Duration `mapstructure:"grant_ttl"`          // how long a grant stands in for an OTP
+	DirectoryUIDBase    int           `mapstructure:"directory_uid_base"` // first uid given to a user in the host directory
+	DirectoryGIDBase    int           `mapstructure:"directory_gid_base"` // first gid given to a role
 }
 
 type YubikeyConfig struct {
-	ClientID  string `mapstructure:"client_id"`
-	SecretKey string `mapstructure:"secret_key"`
-	APIURL    string `mapstructure:"api_url"`
+	ClientID  string        `mapstructure:"client_id"`
+	SecretKey string        `mapstructure:"secret_key"` // base64 API key; signs requests and checks responses
+	APIURL    string        `mapstructure:"api_url"`
+	APIURLs   []string      `mapstructure:"api_urls"` // queried in parallel; overrides api_url
+	Timeout   time.Duration `mapstructure:"timeout"`  // per verification, across all servers
 }
 
 type SMSConfig struct {
@@ -104,6 +123,9 @@ func setDefaults() {
 	viper.SetDefault("server.port", 8080)
 	viper.SetDefault("server.timeout", "30s")
 	viper.SetDefault("server.debug", false)
+	viper.SetDefault("server.unix_socket", "")
+	viper.SetDefault("server.unix_socket_mode", "0660")
+	viper.SetDefault("server.h2c", false)
 
 	viper.SetDefault("database.host", "localhost")
 	viper.SetDefault("database.port", 5432)
@@ -119,8 +141,17 @@ func setDefaults() {
 	viper.SetDefault("auth.refresh_token_expiry", "720h")
 	viper.SetDefault("auth.access_token_expiry", "15m")
 	viper.SetDefault("auth.session_expiry", "24h")
+	viper.SetDefault("auth.device_cache_ttl", "30s")
+	viper.SetDefault("auth.device_cache_size", 10000)
+	viper.SetDefault("auth.log_queue_size", 4096)
+	viper.SetDefault("auth.log_batch_size", 256)
+	viper.SetDefault("auth.log_flush_interval", "250ms")
+	viper.SetDefault("auth.grant_ttl", "5m")
+	viper.SetDefault("auth.directory_uid_base", 200000)
+	viper.SetDefault("auth.directory_gid_base", 300000)
 
 	viper.SetDefault("yubikey.api_url", "https://api.yubico.com/wsapi/2.0/verify")
+	viper.SetDefault("yubikey.timeout", "3s")
 
 	viper.SetDefault("email.smtp_port", 587)
 } 
\ No newline at end of file
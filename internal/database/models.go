@@ -21,6 +21,7 @@ type User struct {
 	FirstName string
 	LastName  string
 	Active    bool `gorm:"default:true"`
+	PosixUID  *int `gorm:"uniqueIndex"` // uid on hosts using nss_yubiapp, assigned on creation
 
 	Roles    []Role    `gorm:"many2many:user_roles;"`
 	Devices  []Device  `gorm:"foreignKey:UserID"`
@@ -34,6 +35,7 @@ type Role struct {
 	Name        string `gorm:"uniqueIndex"`
 	Description string
 	Active      bool `gorm:"default:true"`
+	PosixGID    *int `gorm:"uniqueIndex"` // gid of the role's group on hosts using nss_yubiapp
 	Permissions []Permission `gorm:"many2many:role_permissions;"`
 }
 
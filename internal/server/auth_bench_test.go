@@ -0,0 +1,289 @@
+package server
+
+import (
+	"bytes"
+	"context"
+	"flag"
+	"io"
+	"net/http"
+	"net/http/httptest"
+	"runtime"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+var (
+	yubicoLatency = flag.Duration("yubico.latency", 0, "round trip the YubiCloud stub adds to each verification")
+	loadDuration  = flag.Duration("load", 0, "run TestDeviceAuthLoad for this long")
+	loadWorkers   = flag.Int("load.workers", 64, "concurrent clients of TestDeviceAuthLoad")
+	loadCache     = flag.Bool("load.cache", true, "run TestDeviceAuthLoad with the device cache on")
+)
+
+// benchBatchSize is the items of one POST /auth/device/batch benchmark op
+const benchBatchSize = 16
+
+// benchStack is the API built over the fixture for one benchmark run
+type benchStack struct {
+	f       *benchFixture
+	server  *Server
+	handler http.Handler
+
+	// Fixture counters when the measured part began
+	queries       int64
+	yubicoQueries int64
+	mallocs       uint64
+}
+
+func (f *benchFixture) stack(cache bool) *benchStack {
+	s := newServer(f.config(cache), f.db)
+	return &benchStack{f: f, server: s, handler: s.httpServer.Handler}
+}
+
+// deviceAuthBody is the JSON of a login needing the device's permission
+func deviceAuthBody(otp, permission string) []byte {
+	return []byte(`{"device_type":"yubikey","auth_code":"` + otp + `","permission":"` + permission + `"}`)
+}
+
+// login sends one POST /auth/device in process and returns the response.
+// The device is held until the API has answered, so the OTPs of a
+// self-provisioned key arrive in the order they were generated.
+func (s *benchStack) login(d *benchDevice) *httptest.ResponseRecorder {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	req := httptest.NewRequest(http.MethodPost, "/api/v1/auth/device", bytes.NewReader(deviceAuthBody(d.otp(), d.permission)))
+	req.Header.Set("Content-Type", "application/json")
+	w := httptest.NewRecorder()
+	s.handler.ServeHTTP(w, req)
+	return w
+}
+
+// warm logs every device in once, so the measured logins find them cached
+func (s *benchStack) warm(tb testing.TB, devices []*benchDevice) {
+	for _, d := range devices {
+		if w := s.login(d); w.Code != http.StatusOK {
+			tb.Fatalf("login of %s: %d %s", d.identifier, w.Code, w.Body)
+		}
+	}
+}
+
+// start begins the measured part of a run
+func (s *benchStack) start(b *testing.B) {
+	b.ReportAllocs()
+	s.queries = s.f.queries.Load()
+	s.yubicoQueries = s.f.yubicoQueries.Load()
+	b.ResetTimer()
+}
+
+// stop ends the measured part and closes the stack, writing the queued
+// authentication logs first so their inserts count, and reports the
+// statements and YubiCloud requests per op
+func (s *benchStack) stop(b *testing.B) {
+	b.StopTimer()
+	s.close(b)
+	b.ReportMetric(float64(s.f.queries.Load()-s.queries)/float64(b.N), "queries/op")
+	b.ReportMetric(float64(s.f.yubicoQueries.Load()-s.yubicoQueries)/float64(b.N), "yubico/op")
+}
+
+func (s *benchStack) close(tb testing.TB) {
+	ctx, cancel := context.WithTimeout(context.Background(), 30*time.Second)
+	defer cancel()
+	if err := s.server.authService.Close(ctx); err != nil {
+		tb.Errorf("flushing authentication logs: %v", err)
+	}
+}
+
+// benchCases runs fn with the device cache warm and off, for keys verified
+// by YubiCloud and self-provisioned keys verified by the API
+func benchCases(b *testing.B, fn func(b *testing.B, s *benchStack, devices []*benchDevice)) {
+	f := fixture(b)
+	for _, cache := range []string{"warm", "off"} {
+		for _, verify := range []string{"yubico", "local"} {
+			devices := f.cloud
+			if verify == "local" {
+				devices = f.local
+			}
+			b.Run("cache="+cache+"/verify="+verify, func(b *testing.B) {
+				s := f.stack(cache == "warm")
+				if cache == "warm" {
+					s.warm(b, devices)
+				}
+				s.start(b)
+				fn(b, s, devices)
+				s.stop(b)
+			})
+		}
+	}
+}
+
+// BenchmarkDeviceAuth measures POST /auth/device from request parsing to the
+// authentication log, cycling through the seeded users
+func BenchmarkDeviceAuth(b *testing.B) {
+	benchCases(b, func(b *testing.B, s *benchStack, devices []*benchDevice) {
+		for i := 0; i < b.N; i++ {
+			if w := s.login(devices[i%len(devices)]); w.Code != http.StatusOK {
+				b.Fatalf("login: %d %s", w.Code, w.Body)
+			}
+		}
+	})
+}
+
+// BenchmarkDeviceAuthParallel is BenchmarkDeviceAuth with GOMAXPROCS
+// clients logging in at once, taking the devices in turn
+func BenchmarkDeviceAuthParallel(b *testing.B) {
+	benchCases(b, func(b *testing.B, s *benchStack, devices []*benchDevice) {
+		var next atomic.Int64
+		b.RunParallel(func(pb *testing.PB) {
+			for pb.Next() {
+				d := devices[int(next.Add(1))%len(devices)]
+				if w := s.login(d); w.Code != http.StatusOK {
+					b.Errorf("login: %d %s", w.Code, w.Body)
+					return
+				}
+			}
+		})
+	})
+}
+
+// BenchmarkDeviceAuthBatch measures POST /auth/device/batch, as yubiappd
+// posts it, with benchBatchSize logins of different users per op
+func BenchmarkDeviceAuthBatch(b *testing.B) {
+	benchCases(b, func(b *testing.B, s *benchStack, devices []*benchDevice) {
+		var body bytes.Buffer
+		for i := 0; i < b.N; i++ {
+			batch := make([]*benchDevice, benchBatchSize)
+			body.Reset()
+			body.WriteString(`{"items":[`)
+			for k := range batch {
+				batch[k] = devices[(i*benchBatchSize+k)%len(devices)]
+				batch[k].mu.Lock()
+				if k > 0 {
+					body.WriteByte(',')
+				}
+				body.Write(deviceAuthBody(batch[k].otp(), batch[k].permission))
+			}
+			body.WriteString(`]}`)
+
+			req := httptest.NewRequest(http.MethodPost, "/api/v1/auth/device/batch", &body)
+			req.Header.Set("Content-Type", "application/json")
+			req.Header.Set("Authorization", "Bearer "+benchAgentToken)
+			w := httptest.NewRecorder()
+			s.handler.ServeHTTP(w, req)
+			for _, d := range batch {
+				d.mu.Unlock()
+			}
+			if w.Code != http.StatusOK || bytes.Contains(w.Body.Bytes(), []byte(`"status":4`)) {
+				b.Fatalf("batch: %d %s", w.Code, w.Body)
+			}
+		}
+	})
+}
+
+// BenchmarkAuthenticateDevice measures AuthService.AuthenticateDevice alone,
+// without routing, binding and encoding the response
+func BenchmarkAuthenticateDevice(b *testing.B) {
+	benchCases(b, func(b *testing.B, s *benchStack, devices []*benchDevice) {
+		for i := 0; i < b.N; i++ {
+			d := devices[i%len(devices)]
+			if _, _, err := s.server.authService.AuthenticateDevice(context.Background(), "yubikey", d.otp(), d.permission); err != nil {
+				b.Fatalf("login: %v", err)
+			}
+		}
+	})
+}
+
+// TestDeviceAuthLoad is a load generator rather than a test: with -load set
+// it has -load.workers clients log in over TCP as fast as the API answers,
+// across all seeded users, and logs throughput and latency, e.g.
+//
+//	go test ./internal/server -run DeviceAuthLoad -load 30s -load.workers 128 -yubico.latency 40ms -v
+//
+// Queries per login include the authentication log inserts; allocations
+// per login include the clients' and the YubiCloud stub's.
+func TestDeviceAuthLoad(t *testing.T) {
+	if *loadDuration <= 0 {
+		t.Skip("set -load to run the load generator")
+	}
+	f := fixture(t)
+	devices := append(append([]*benchDevice(nil), f.cloud...), f.local...)
+
+	s := f.stack(*loadCache)
+	if *loadCache {
+		s.warm(t, devices)
+	}
+	api := httptest.NewServer(s.handler)
+	defer api.Close()
+	client := &http.Client{Transport: &http.Transport{MaxIdleConnsPerHost: *loadWorkers}}
+	defer client.CloseIdleConnections()
+
+	var before runtime.MemStats
+	runtime.ReadMemStats(&before)
+	s.queries, s.yubicoQueries, s.mallocs = f.queries.Load(), f.yubicoQueries.Load(), before.Mallocs
+
+	var (
+		next      atomic.Int64
+		failed    atomic.Int64
+		wg        sync.WaitGroup
+		latencies = make([][]time.Duration, *loadWorkers)
+	)
+	start := time.Now()
+	deadline := start.Add(*loadDuration)
+	for w := range latencies {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for time.Now().Before(deadline) {
+				d := devices[int(next.Add(1))%len(devices)]
+				begin := time.Now()
+				if !loadLogin(client, api.URL, d) {
+					failed.Add(1)
+				}
+				latencies[w] = append(latencies[w], time.Since(begin))
+			}
+		}(w)
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	var after runtime.MemStats
+	runtime.ReadMemStats(&after)
+	s.close(t)
+
+	var all []time.Duration
+	for _, l := range latencies {
+		all = append(all, l...)
+	}
+	if len(all) == 0 {
+		t.Fatal("no logins completed")
+	}
+	sort.Slice(all, func(i, j int) bool { return all[i] < all[j] })
+	pct := func(p float64) time.Duration { return all[int(p*float64(len(all)-1))] }
+	n := float64(len(all))
+
+	t.Logf("%d logins by %d workers in %v: %.0f/s, %d failed", len(all), *loadWorkers, elapsed.Round(time.Millisecond),
+		n/elapsed.Seconds(), failed.Load())
+	t.Logf("latency p50 %v, p90 %v, p99 %v, max %v", pct(0.50), pct(0.90), pct(0.99), all[len(all)-1])
+	t.Logf("per login: %.2f queries, %.2f YubiCloud requests, %.0f allocations",
+		float64(f.queries.Load()-s.queries)/n, float64(f.yubicoQueries.Load()-s.yubicoQueries)/n,
+		float64(after.Mallocs-s.mallocs)/n)
+	if failed.Load() > 0 {
+		t.Errorf("%d logins failed", failed.Load())
+	}
+}
+
+// loadLogin sends one POST /auth/device over the network and reports
+// whether it succeeded
+func loadLogin(client *http.Client, base string, d *benchDevice) bool {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	resp, err := client.Post(base+"/api/v1/auth/device", "application/json",
+		bytes.NewReader(deviceAuthBody(d.otp(), d.permission)))
+	if err != nil {
+		return false
+	}
+	defer resp.Body.Close()
+	io.Copy(io.Discard, resp.Body)
+	return resp.StatusCode == http.StatusOK
+}
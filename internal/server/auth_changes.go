@@ -0,0 +1,96 @@
+package server
+
+import (
+	"encoding/json"
+	"net/http"
+	"time"
+
+	"github.com/YubiApp/internal/services"
+	"github.com/gin-gonic/gin"
+)
+
+// authChangesHeartbeat is how often an idle change stream sends a comment,
+// so proxies keep it open and a subscriber notices a dead connection
+const authChangesHeartbeat = 15 * time.Second
+
+// handleAuthChanges streams the auth change feed as server-sent events.
+// Each write through the services that can change how a device
+// authenticates is sent as
+//
+//	id: <position>
+//	event: invalidate
+//	data: {"generation":N,"kind":"device","id":"..."}
+//
+// A subscriber that reconnects with Last-Event-ID (or ?since=) gets the
+// changes it missed. If they are no longer held, or it did not say where
+// it was, the stream starts with a "reset" event: anything it cached may
+// be stale.
+func handleAuthChanges() gin.HandlerFunc {
+	return func(c *gin.Context) {
+		since := c.GetHeader("Last-Event-ID")
+		if since == "" {
+			since = c.Query("since")
+		}
+		sub, replay, position, resumed := services.SubscribeAuthChanges(since)
+		if sub == nil {
+			errorResponse(c, http.StatusServiceUnavailable, "Server is shutting down")
+			return
+		}
+		defer sub.Close()
+
+		// The server's write timeout was lifted for this route before gin
+		// (see liftWriteDeadline)
+
+		c.Header("Content-Type", "text/event-stream")
+		c.Header("Cache-Control", "no-cache")
+		c.Header("X-Accel-Buffering", "no")
+		c.Status(http.StatusOK)
+
+		w := c.Writer
+		if !resumed {
+			w.WriteString("retry: 2000\nid: " + position + "\nevent: reset\ndata: {}\n\n")
+		}
+		for _, change := range replay {
+			writeAuthChange(w, change)
+		}
+		w.Flush()
+
+		heartbeat := time.NewTicker(authChangesHeartbeat)
+		defer heartbeat.Stop()
+		for {
+			select {
+			case change, ok := <-sub.C:
+				if !ok {
+					return
+				}
+				writeAuthChange(w, change)
+			case <-heartbeat.C:
+				w.WriteString(": ping\n\n")
+			case <-c.Request.Context().Done():
+				return
+			}
+			w.Flush()
+		}
+	}
+}
+
+func writeAuthChange(w gin.ResponseWriter, change services.AuthChange) {
+	data, _ := json.Marshal(change)
+	w.WriteString("id: " + change.Position() + "\nevent: invalidate\ndata: ")
+	w.Write(data)
+	w.WriteString("\n\n")
+}
+
+// handleAuthDirectory lists the accounts and groups nss_yubiapp serves on
+// PAM hosts. Brokers fetch it in bulk and again when the change feed
+// reports a user or role write. It only reads; ids are assigned on creation.
+func handleAuthDirectory(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		users, groups, err := authService.Directory()
+		if err != nil {
+			errorResponse(c, http.StatusInternalServerError, err.Error())
+			return
+		}
+		c.JSON(http.StatusOK, gin.H{"users": users, "groups": groups})
+	}
+}
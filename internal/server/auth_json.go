@@ -0,0 +1,216 @@
+package server
+
+import (
+	"encoding/base64"
+	"unicode/utf8"
+
+	"github.com/google/uuid"
+)
+
+// Hand-written JSON encoding of the device auth responses. These are
+// answered for every login on the fleet, and building them as gin.H maps
+// cost a map per object, a slice of maps for the roles and a reflective
+// encode, all garbage as soon as the response was written. The encoder
+// appends to a pooled buffer instead. Its output is what json.Marshal
+// produced for the maps: keys in sorted order, strings escaped the same
+// way (including <, > and &), UUIDs in their text form. auth_json_test.go
+// compares it with json.Marshal of the old maps; encoding/json writes \b and
+// \f as \u escapes up to Go 1.21 only, so that test also flags a toolchain
+// that changes what the old handlers would have sent.
+
+const jsonContentType = "application/json; charset=utf-8"
+
+// appendDeviceAuthJSON appends the body POST /auth/device returns for r:
+// the user, device and evaluated permissions on success, otherwise the
+// error, and the request's nonce either way
+func appendDeviceAuthJSON(dst []byte, r *deviceAuthResult, omit authOmit) []byte {
+	if r.status != 200 {
+		dst = append(dst, `{"error":`...)
+		dst = appendJSONString(dst, r.message)
+		if r.nonce != "" {
+			dst = append(dst, `,"nonce":`...)
+			dst = appendJSONString(dst, r.nonce)
+		}
+		return append(dst, '}')
+	}
+
+	dst = append(dst, `{"authenticated":true`...)
+	if omit&omitDevice == 0 {
+		dst = append(dst, `,"device":{"id":`...)
+		dst = appendJSONUUID(dst, r.device.ID)
+		dst = append(dst, `,"identifier":`...)
+		dst = appendJSONString(dst, r.device.Identifier)
+		dst = append(dst, `,"type":`...)
+		dst = appendJSONString(dst, r.device.Type)
+		dst = append(dst, '}')
+	}
+	if r.grant != nil {
+		dst = append(dst, `,"grant":"`...)
+		n := len(dst)
+		dst = growBytes(dst, base64.StdEncoding.EncodedLen(len(r.grant)))
+		base64.StdEncoding.Encode(dst[n:], r.grant)
+		dst = append(dst, '"')
+	}
+	if r.nonce != "" {
+		dst = append(dst, `,"nonce":`...)
+		dst = appendJSONString(dst, r.nonce)
+	}
+	if r.held != nil {
+		dst = append(dst, `,"permissions":[`...)
+		for i, h := range r.held {
+			if i > 0 {
+				dst = append(dst, ',')
+			}
+			dst = appendJSONBool(dst, h)
+		}
+		dst = append(dst, ']')
+	}
+
+	user := r.user
+	dst = append(dst, `,"user":{"active":`...)
+	dst = appendJSONBool(dst, user.Active)
+	dst = append(dst, `,"email":`...)
+	dst = appendJSONString(dst, user.Email)
+	dst = append(dst, `,"first_name":`...)
+	dst = appendJSONString(dst, user.FirstName)
+	dst = append(dst, `,"id":`...)
+	dst = appendJSONUUID(dst, user.ID)
+	dst = append(dst, `,"last_name":`...)
+	dst = appendJSONString(dst, user.LastName)
+	if omit&omitRoles == 0 {
+		dst = append(dst, `,"roles":[`...)
+		for i := range user.Roles {
+			role := &user.Roles[i]
+			if i > 0 {
+				dst = append(dst, ',')
+			}
+			dst = append(dst, `{"description":`...)
+			dst = appendJSONString(dst, role.Description)
+			dst = append(dst, `,"id":`...)
+			dst = appendJSONUUID(dst, role.ID)
+			dst = append(dst, `,"name":`...)
+			dst = appendJSONString(dst, role.Name)
+			dst = append(dst, '}')
+		}
+		dst = append(dst, ']')
+	}
+	dst = append(dst, `,"username":`...)
+	dst = appendJSONString(dst, user.Username)
+	return append(dst, "}}"...)
+}
+
+// appendDeviceAuthBatchJSON appends the body of a batch response: each
+// item's status and the body it would have had on its own
+func appendDeviceAuthBatchJSON(dst []byte, results []deviceAuthResult, omit authOmit) []byte {
+	dst = append(dst, `{"results":[`...)
+	for i := range results {
+		if i > 0 {
+			dst = append(dst, ',')
+		}
+		dst = append(dst, `{"body":`...)
+		dst = appendDeviceAuthJSON(dst, &results[i], omit)
+		dst = append(dst, `,"status":`...)
+		dst = appendJSONInt(dst, results[i].status)
+		dst = append(dst, '}')
+	}
+	return append(dst, "]}"...)
+}
+
+func appendJSONBool(dst []byte, v bool) []byte {
+	if v {
+		return append(dst, "true"...)
+	}
+	return append(dst, "false"...)
+}
+
+func appendJSONInt(dst []byte, v int) []byte {
+	if v < 0 {
+		dst = append(dst, '-')
+		v = -v
+	}
+	var b [20]byte
+	i := len(b)
+	for {
+		i--
+		b[i] = byte('0' + v%10)
+		v /= 10
+		if v == 0 {
+			break
+		}
+	}
+	return append(dst, b[i:]...)
+}
+
+// appendJSONUUID appends id in its canonical text form, as a JSON string
+func appendJSONUUID(dst []byte, id uuid.UUID) []byte {
+	const hex = "0123456789abcdef"
+	dst = append(dst, '"')
+	for i, b := range id {
+		if i == 4 || i == 6 || i == 8 || i == 10 {
+			dst = append(dst, '-')
+		}
+		dst = append(dst, hex[b>>4], hex[b&0x0f])
+	}
+	return append(dst, '"')
+}
+
+// appendJSONString appends s as a JSON string, escaped as encoding/json
+// does with HTML escaping on: control characters, <, >, &, U+2028 and
+// U+2029 as \u escapes, and invalid UTF-8 as U+FFFD
+func appendJSONString(dst []byte, s string) []byte {
+	const hex = "0123456789abcdef"
+	dst = append(dst, '"')
+	start := 0
+	for i := 0; i < len(s); {
+		if b := s[i]; b < utf8.RuneSelf {
+			if b >= 0x20 && b != '"' && b != '\\' && b != '<' && b != '>' && b != '&' {
+				i++
+				continue
+			}
+			dst = append(dst, s[start:i]...)
+			switch b {
+			case '"', '\\':
+				dst = append(dst, '\\', b)
+			case '\n':
+				dst = append(dst, '\\', 'n')
+			case '\r':
+				dst = append(dst, '\\', 'r')
+			case '\t':
+				dst = append(dst, '\\', 't')
+			default:
+				dst = append(dst, '\\', 'u', '0', '0', hex[b>>4], hex[b&0x0f])
+			}
+			i++
+			start = i
+			continue
+		}
+		c, size := utf8.DecodeRuneInString(s[i:])
+		if c == utf8.RuneError && size == 1 {
+			dst = append(dst, s[start:i]...)
+			dst = append(dst, `\ufffd`...)
+			i += size
+			start = i
+			continue
+		}
+		if c == '\u2028' || c == '\u2029' {
+			dst = append(dst, s[start:i]...)
+			dst = append(dst, '\\', 'u', '2', '0', '2', hex[c&0x0f])
+			i += size
+			start = i
+			continue
+		}
+		i += size
+	}
+	dst = append(dst, s[start:]...)
+	return append(dst, '"')
+}
+
+// growBytes extends dst by n bytes, reallocating only when it lacks room
+func growBytes(dst []byte, n int) []byte {
+	if cap(dst)-len(dst) < n {
+		grown := make([]byte, len(dst), 2*cap(dst)+n)
+		copy(grown, dst)
+		dst = grown
+	}
+	return dst[:len(dst)+n]
+}
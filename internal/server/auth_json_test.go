@@ -0,0 +1,153 @@
+package server
+
+import (
+	"encoding/base64"
+	"encoding/json"
+	"testing"
+
+	"github.com/YubiApp/internal/database"
+	"github.com/gin-gonic/gin"
+	"github.com/google/uuid"
+)
+
+// PAM modules and brokers parse these bodies, so the hand-written encoder
+// must keep producing exactly what json.Marshal produced for the gin.H maps
+// it replaced. The tests build those maps as the old handlers did and
+// compare bytes.
+
+var jsonTestStrings = []string{
+	"",
+	"plain",
+	`quote " and backslash \`,
+	"<script>alert('x')</script> & more",
+	"line\nbreak\rreturn\ttab",
+	"\x00\x01\x08\x0c\x1b\x1f\x7f",
+	"line\u2028separator\u2029paragraph",
+	"invalid \xff\xfe utf-8 \xc3",
+	"truncated \xe2\x80",
+	"ünïcødé 日本語 🔑",
+}
+
+func TestAppendJSONString(t *testing.T) {
+	for _, s := range jsonTestStrings {
+		want, err := json.Marshal(s)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if got := appendJSONString(nil, s); string(got) != string(want) {
+			t.Errorf("appendJSONString(%q) = %s, json.Marshal = %s", s, got, want)
+		}
+	}
+}
+
+// oldDeviceAuthBody is the body the gin.H handlers built for r, with the
+// parts omit leaves out deleted
+func oldDeviceAuthBody(r *deviceAuthResult, omit authOmit) gin.H {
+	if r.status != 200 {
+		body := gin.H{"error": r.message}
+		if r.nonce != "" {
+			body["nonce"] = r.nonce
+		}
+		return body
+	}
+
+	roles := make([]gin.H, len(r.user.Roles))
+	for i, role := range r.user.Roles {
+		roles[i] = gin.H{
+			"id":          role.ID,
+			"name":        role.Name,
+			"description": role.Description,
+		}
+	}
+	user := gin.H{
+		"id":         r.user.ID,
+		"email":      r.user.Email,
+		"username":   r.user.Username,
+		"first_name": r.user.FirstName,
+		"last_name":  r.user.LastName,
+		"active":     r.user.Active,
+		"roles":      roles,
+	}
+	body := gin.H{
+		"authenticated": true,
+		"user":          user,
+		"device": gin.H{
+			"id":         r.device.ID,
+			"type":       r.device.Type,
+			"identifier": r.device.Identifier,
+		},
+	}
+	if r.held != nil {
+		body["permissions"] = r.held
+	}
+	if r.grant != nil {
+		body["grant"] = base64.StdEncoding.EncodeToString(r.grant)
+	}
+	if r.nonce != "" {
+		body["nonce"] = r.nonce
+	}
+	if omit&omitRoles != 0 {
+		delete(user, "roles")
+	}
+	if omit&omitDevice != 0 {
+		delete(body, "device")
+	}
+	return body
+}
+
+func jsonTestResults() map[string]*deviceAuthResult {
+	user := &database.User{
+		ID: uuid.MustParse("0b9c1f52-8a4e-4f0e-9a51-3c2d7e6f8a90"), Email: "ada@example.com <ada>",
+		Username: "ada", FirstName: "Ada & \u2028", LastName: "Lovelace \xff", Active: true,
+	}
+	for i, s := range jsonTestStrings {
+		user.Roles = append(user.Roles, database.Role{ID: uuid.New(), Name: "role" + s, Description: s + string(rune('a'+i))})
+	}
+	device := &database.Device{ID: uuid.New(), Type: "yubikey", Identifier: "cccccccccccb"}
+	inactive := *user
+	inactive.Active, inactive.Roles = false, nil
+
+	return map[string]*deviceAuthResult{
+		"success":     {status: 200, user: user, device: device},
+		"everything":  {status: 200, user: user, device: device, held: []bool{true, false, true}, grant: []byte("\x00grant\xff"), nonce: "n<1>"},
+		"no roles":    {status: 200, user: &inactive, device: device, held: []bool{}, nonce: "nonce"},
+		"error":       {status: 401, message: "permission denied: <srv>:\x01read\u2029"},
+		"error nonce": {status: 400, message: "Invalid YubiKey OTP length", nonce: "abc&def"},
+	}
+}
+
+func TestAppendDeviceAuthJSON(t *testing.T) {
+	omissions := map[string]authOmit{
+		"":             0,
+		"roles":        omitRoles,
+		"device":       omitDevice,
+		"roles,device": omitRoles | omitDevice,
+	}
+	for name, r := range jsonTestResults() {
+		for omitName, omit := range omissions {
+			want, err := json.Marshal(oldDeviceAuthBody(r, omit))
+			if err != nil {
+				t.Fatal(err)
+			}
+			if got := appendDeviceAuthJSON(nil, r, omit); string(got) != string(want) {
+				t.Errorf("%s, omit=%s:\n got %s\nwant %s", name, omitName, got, want)
+			}
+		}
+	}
+}
+
+func TestAppendDeviceAuthBatchJSON(t *testing.T) {
+	var results []deviceAuthResult
+	var items []gin.H
+	for _, r := range jsonTestResults() {
+		results = append(results, *r)
+		items = append(items, gin.H{"status": r.status, "body": oldDeviceAuthBody(r, 0)})
+	}
+	want, err := json.Marshal(gin.H{"results": items})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if got := appendDeviceAuthBatchJSON(nil, results, 0); string(got) != string(want) {
+		t.Errorf("batch:\n got %s\nwant %s", got, want)
+	}
+}
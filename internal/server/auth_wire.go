@@ -0,0 +1,309 @@
+package server
+
+import (
+	"strings"
+	"sync"
+
+	"github.com/YubiApp/internal/database"
+	"github.com/gin-gonic/gin"
+)
+
+// Compact binary encoding of the POST /api/v1/auth/device response, used by
+// the PAM module when it asks for it in the Accept header. JSON remains the
+// default. The body is a 4-byte preamble ("YAW" and a version byte) followed
+// by fields of the form tag (1) | length (2, big endian) | value. Strings are
+// UTF-8, UUIDs are their 16 raw bytes, booleans one byte. Each role is a
+// nested field list carrying its id, name and description. Readers skip tags
+// they do not know. The tag values are mirrored in CCode/yubiapp_wire.h.
+const compactAuthContentType = "application/vnd.yubiapp.auth.v1+tlv"
+
+const compactAuthVersion = 1
+
+const (
+	wireAuthenticated = 0x01
+	wireError         = 0x02
+	wireNonce         = 0x03
+	wireGrant         = 0x04 // signed grant, see internal/services/auth_grant.go
+	wirePermissions   = 0x05 // one byte per evaluated permission, in request order: 1 if held
+
+	wireUserID        = 0x10
+	wireUserEmail     = 0x11
+	wireUserUsername  = 0x12
+	wireUserFirstName = 0x13
+	wireUserLastName  = 0x14
+	wireUserActive    = 0x15
+
+	wireRole            = 0x20
+	wireRoleID          = 0x01
+	wireRoleName        = 0x02
+	wireRoleDescription = 0x03
+
+	wireDeviceID         = 0x30
+	wireDeviceType       = 0x31
+	wireDeviceIdentifier = 0x32
+
+	// Batch responses: one field per item, in request order, holding the
+	// item's HTTP status (2 bytes, big endian) and then its response
+	wireBatchResult = 0x40
+)
+
+// wireWriter appends fields to a compact response
+type wireWriter struct {
+	buf []byte
+}
+
+func (w *wireWriter) field(tag byte, value []byte) {
+	if len(value) > 0xffff {
+		value = value[:0xffff]
+	}
+	w.buf = append(w.buf, tag, byte(len(value)>>8), byte(len(value)))
+	w.buf = append(w.buf, value...)
+}
+
+func (w *wireWriter) str(tag byte, value string) {
+	if len(value) > 0xffff {
+		value = value[:0xffff]
+	}
+	w.buf = append(w.buf, tag, byte(len(value)>>8), byte(len(value)))
+	w.buf = append(w.buf, value...)
+}
+
+func (w *wireWriter) bool(tag byte, value bool) {
+	var b byte
+	if value {
+		b = 1
+	}
+	w.buf = append(w.buf, tag, 0, 1, b)
+}
+
+// begin opens a nested field, to be closed by end with the value's start
+func (w *wireWriter) begin(tag byte) int {
+	w.buf = append(w.buf, tag, 0, 0)
+	return len(w.buf)
+}
+
+func (w *wireWriter) end(start int) {
+	n := len(w.buf) - start
+	if n > 0xffff {
+		n = 0xffff
+		w.buf = w.buf[:start+n]
+	}
+	w.buf[start-2], w.buf[start-1] = byte(n>>8), byte(n)
+}
+
+func (w *wireWriter) preamble() {
+	w.buf = append(w.buf, 'Y', 'A', 'W', compactAuthVersion)
+}
+
+// Response buffers are pooled: a device auth response is a few hundred
+// bytes, built and written once per login. Buffers grown past
+// maxPooledResponse by a large batch are left to the collector.
+const maxPooledResponse = 64 << 10
+
+var responseBufs = sync.Pool{
+	New: func() any {
+		buf := make([]byte, 0, 1024)
+		return &buf
+	},
+}
+
+// writeResponse writes body, then returns its buffer to the pool
+func writeResponse(c *gin.Context, statusCode int, contentType string, buf *[]byte, body []byte) {
+	c.Data(statusCode, contentType, body)
+	if cap(body) <= maxPooledResponse {
+		*buf = body[:0]
+		responseBufs.Put(buf)
+	}
+}
+
+// authOmit lists the parts of a successful device auth a client does not
+// need and asked to leave out
+type authOmit uint8
+
+const (
+	omitRoles authOmit = 1 << iota
+	omitDevice
+)
+
+// requestedOmissions reads ?omit=roles,device and Prefer: return=minimal
+// (which omits both and is acknowledged with Preference-Applied)
+func requestedOmissions(c *gin.Context) authOmit {
+	var omit authOmit
+	if c.Request.URL.RawQuery != "" {
+		for rest := c.Query("omit"); rest != ""; {
+			var name string
+			name, rest, _ = strings.Cut(rest, ",")
+			switch strings.TrimSpace(name) {
+			case "roles":
+				omit |= omitRoles
+			case "device":
+				omit |= omitDevice
+			}
+		}
+	}
+	if prefer := c.GetHeader("Prefer"); prefer != "" {
+		for rest := prefer; rest != ""; {
+			var pref string
+			pref, rest, _ = strings.Cut(rest, ",")
+			pref, _, _ = strings.Cut(pref, ";")
+			if strings.EqualFold(strings.TrimSpace(pref), "return=minimal") {
+				omit = omitRoles | omitDevice
+				c.Header("Preference-Applied", "return=minimal")
+				break
+			}
+		}
+	}
+	return omit
+}
+
+// wantsCompactAuth reports whether the client listed the compact media type
+// in its Accept header (with a non-zero quality)
+func wantsCompactAuth(c *gin.Context) bool {
+	accept := c.GetHeader("Accept")
+	if accept == "" {
+		return false
+	}
+	for _, part := range strings.Split(accept, ",") {
+		params := strings.Split(part, ";")
+		if !strings.EqualFold(strings.TrimSpace(params[0]), compactAuthContentType) {
+			continue
+		}
+		for _, p := range params[1:] {
+			p = strings.TrimSpace(p)
+			if p == "q=0" || p == "q=0.0" || p == "q=0.00" || p == "q=0.000" {
+				return false
+			}
+		}
+		return true
+	}
+	return false
+}
+
+// deviceAuth appends the compact form of r: the user, roles, device and
+// evaluated permissions on success, otherwise the error, and the nonce
+func (w *wireWriter) deviceAuth(r *deviceAuthResult, omit authOmit) {
+	w.preamble()
+	if r.status != 200 {
+		w.bool(wireAuthenticated, false)
+		w.str(wireError, r.message)
+		if r.nonce != "" {
+			w.str(wireNonce, r.nonce)
+		}
+		return
+	}
+
+	user := r.user
+	w.bool(wireAuthenticated, true)
+
+	w.field(wireUserID, user.ID[:])
+	w.str(wireUserEmail, user.Email)
+	w.str(wireUserUsername, user.Username)
+	w.str(wireUserFirstName, user.FirstName)
+	w.str(wireUserLastName, user.LastName)
+	w.bool(wireUserActive, user.Active)
+
+	if omit&omitRoles == 0 {
+		for i := range user.Roles {
+			role := &user.Roles[i]
+			start := w.begin(wireRole)
+			w.field(wireRoleID, role.ID[:])
+			w.str(wireRoleName, role.Name)
+			w.str(wireRoleDescription, role.Description)
+			w.end(start)
+		}
+	}
+
+	if omit&omitDevice == 0 {
+		w.field(wireDeviceID, r.device.ID[:])
+		w.str(wireDeviceType, r.device.Type)
+		w.str(wireDeviceIdentifier, r.device.Identifier)
+	}
+
+	if r.held != nil {
+		start := w.begin(wirePermissions)
+		for _, h := range r.held {
+			var b byte
+			if h {
+				b = 1
+			}
+			w.buf = append(w.buf, b)
+		}
+		w.end(start)
+	}
+	if r.grant != nil {
+		w.field(wireGrant, r.grant)
+	}
+	if r.nonce != "" {
+		w.str(wireNonce, r.nonce)
+	}
+}
+
+// deviceAuthResult is the outcome of one device auth, single or in a batch
+type deviceAuthResult struct {
+	status  int
+	message string // error, when status is not 200
+	user    *database.User
+	device  *database.Device
+	held    []bool
+	grant   []byte
+	nonce   string
+}
+
+// writeDeviceAuth writes r in the encoding the client asked for
+func writeDeviceAuth(c *gin.Context, r *deviceAuthResult) {
+	c.Header("Vary", "Accept, Prefer")
+	omit := requestedOmissions(c)
+	buf := responseBufs.Get().(*[]byte)
+	if wantsCompactAuth(c) {
+		w := wireWriter{buf: (*buf)[:0]}
+		w.deviceAuth(r, omit)
+		writeResponse(c, r.status, compactAuthContentType, buf, w.buf)
+		return
+	}
+	writeResponse(c, r.status, jsonContentType, buf, appendDeviceAuthJSON((*buf)[:0], r, omit))
+}
+
+// deviceAuthResponse writes a successful device auth response. held, if
+// set, says which of the evaluated permissions the user holds. grant, if
+// set, is included as is (compact) or in base64 (JSON).
+func deviceAuthResponse(c *gin.Context, user *database.User, device *database.Device, held []bool, grant []byte) {
+	writeDeviceAuth(c, &deviceAuthResult{
+		status: 200,
+		user:   user,
+		device: device,
+		held:   held,
+		grant:  grant,
+		nonce:  extractNonceFromRequest(c),
+	})
+}
+
+// deviceAuthError writes a device auth error
+func deviceAuthError(c *gin.Context, statusCode int, message string) {
+	writeDeviceAuth(c, &deviceAuthResult{
+		status:  statusCode,
+		message: message,
+		nonce:   extractNonceFromRequest(c),
+	})
+}
+
+// deviceAuthBatchResponse writes the results of a batch in the encoding the
+// client asked for. Each item carries exactly the body POST /auth/device
+// would have returned, so a broker can relay it unchanged.
+func deviceAuthBatchResponse(c *gin.Context, results []deviceAuthResult) {
+	c.Header("Vary", "Accept, Prefer")
+	omit := requestedOmissions(c)
+	buf := responseBufs.Get().(*[]byte)
+	if wantsCompactAuth(c) {
+		w := wireWriter{buf: (*buf)[:0]}
+		w.preamble()
+		for i := range results {
+			start := w.begin(wireBatchResult)
+			w.buf = append(w.buf, byte(results[i].status>>8), byte(results[i].status))
+			w.deviceAuth(&results[i], omit)
+			w.end(start)
+		}
+		writeResponse(c, 200, compactAuthContentType, buf, w.buf)
+		return
+	}
+	writeResponse(c, 200, jsonContentType, buf, appendDeviceAuthBatchJSON((*buf)[:0], results, omit))
+}
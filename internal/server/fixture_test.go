@@ -0,0 +1,322 @@
+package server
+
+import (
+	"crypto/aes"
+	"crypto/rand"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"io"
+	mathrand "math/rand"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/YubiApp/internal/config"
+	"github.com/YubiApp/internal/database"
+	"github.com/gin-gonic/gin"
+	"github.com/google/uuid"
+	"gorm.io/driver/postgres"
+	"gorm.io/gorm"
+	"gorm.io/gorm/logger"
+)
+
+// The benchmarks and the load test run the device auth path against a
+// real Postgres, in a schema of their own that is dropped afterwards. Point
+// YUBIAPP_BENCH_DSN at a database the user may create schemas in:
+//
+//	YUBIAPP_BENCH_DSN="host=localhost user=yubiapp password=yubiapp dbname=yubiapp sslmode=disable" \
+//		go test ./internal/server -run '^$' -bench DeviceAuth -benchmem
+//
+// Without it they are skipped. YubiCloud is replaced by a local stub that
+// accepts every OTP; half of the YubiKeys are self-provisioned instead and
+// verified by the API itself, with real OTPs generated here.
+
+const benchDSNEnv = "YUBIAPP_BENCH_DSN"
+
+// benchAgentToken is the agent token the batch benchmark posts as a broker
+const benchAgentToken = "bench-agent"
+
+// Shape of the seeded directory: each user holds every permission of a few
+// roles, so an uncached login loads rolesPerUser*permsPerRole permissions
+const (
+	benchResources    = 50
+	benchActions      = 4 // per resource
+	benchRoles        = 20
+	benchPermsPerRole = 25
+	benchUsers        = 1000
+	benchRolesPerUser = 3
+)
+
+var benchActionNames = [benchActions]string{"read", "write", "exec", "admin"}
+
+// benchDevice is a seeded YubiKey and what a client needs to log in with it
+type benchDevice struct {
+	identifier string // public ID, 12 modhex characters
+	key        []byte // AES key of a self-provisioned key; nil when YubiCloud verifies it
+	privateID  []byte
+	counter    atomic.Uint32 // of the last OTP generated
+	permission string        // one the device's user holds
+
+	mu sync.Mutex // held by a client from generating an OTP until it is answered
+}
+
+// otp returns a new OTP for the device. A self-provisioned key's OTPs carry
+// increasing counters, so they must reach the API in the order generated.
+func (d *benchDevice) otp() string {
+	var token [16]byte
+	if d.key == nil {
+		rand.Read(token[:])
+		return d.identifier + modhexEncode(token[:])
+	}
+
+	n := d.counter.Add(1)
+	copy(token[:6], d.privateID)
+	binary.LittleEndian.PutUint16(token[6:], uint16(n>>8+1)) // usage counter
+	token[8], token[9], token[10] = byte(n), byte(n>>8), byte(n>>16)
+	token[11] = byte(n) // session counter
+	rand.Read(token[12:14])
+	binary.LittleEndian.PutUint16(token[14:], ^yubikeyCRC(token[:14]))
+
+	block, _ := aes.NewCipher(d.key)
+	block.Encrypt(token[:], token[:])
+	return d.identifier + modhexEncode(token[:])
+}
+
+const modhexDigits = "cbdefghijklnrtuv"
+
+func modhexEncode(b []byte) string {
+	out := make([]byte, 2*len(b))
+	for i, c := range b {
+		out[2*i], out[2*i+1] = modhexDigits[c>>4], modhexDigits[c&0xf]
+	}
+	return string(out)
+}
+
+// yubikeyCRC is the ISO 13239 CRC of Yubico OTP tokens
+func yubikeyCRC(data []byte) uint16 {
+	crc := uint16(0xffff)
+	for _, b := range data {
+		crc ^= uint16(b)
+		for i := 0; i < 8; i++ {
+			lsb := crc & 1
+			crc >>= 1
+			if lsb != 0 {
+				crc ^= 0x8408
+			}
+		}
+	}
+	return crc
+}
+
+// benchFixture is the seeded database and the YubiCloud stub shared by
+// every benchmark of a run
+type benchFixture struct {
+	admin  *gorm.DB // outside the schema, to drop it
+	db     *gorm.DB
+	schema string
+	yubico *httptest.Server
+
+	cloud []*benchDevice // verified by the stub
+	local []*benchDevice // self-provisioned
+
+	queries       atomic.Int64 // statements sent to Postgres
+	yubicoQueries atomic.Int64
+}
+
+var (
+	benchOnce    sync.Once
+	benchShared  *benchFixture
+	benchFailure error
+)
+
+// TestMain drops the fixture's schema once every benchmark has run
+func TestMain(m *testing.M) {
+	code := m.Run()
+	if benchShared != nil {
+		benchShared.close()
+	}
+	os.Exit(code)
+}
+
+// fixture returns the shared fixture, seeding it on first use, or skips
+// the benchmark when no database is configured
+func fixture(tb testing.TB) *benchFixture {
+	dsn := os.Getenv(benchDSNEnv)
+	if dsn == "" {
+		tb.Skipf("set %s to run against Postgres", benchDSNEnv)
+	}
+	benchOnce.Do(func() {
+		benchShared, benchFailure = newBenchFixture(dsn)
+	})
+	if benchFailure != nil {
+		tb.Fatalf("fixture: %v", benchFailure)
+	}
+	return benchShared
+}
+
+func newBenchFixture(dsn string) (*benchFixture, error) {
+	quiet := &gorm.Config{Logger: logger.Default.LogMode(logger.Silent)}
+	admin, err := gorm.Open(postgres.Open(dsn), quiet)
+	if err != nil {
+		return nil, err
+	}
+	f := &benchFixture{admin: admin, schema: fmt.Sprintf("yubiapp_bench_%d", time.Now().UnixNano())}
+	if err := admin.Exec("CREATE SCHEMA " + f.schema).Error; err != nil {
+		return nil, fmt.Errorf("failed to create schema: %w", err)
+	}
+	// From here on a failure leaves the schema for close to drop
+	benchShared = f
+
+	if f.db, err = gorm.Open(postgres.Open(dsn+" search_path="+f.schema), quiet); err != nil {
+		return nil, err
+	}
+	if err := migrateDatabase(f.db); err != nil {
+		return nil, err
+	}
+	if err := f.seed(); err != nil {
+		return nil, fmt.Errorf("failed to seed: %w", err)
+	}
+	if err := f.countQueries(); err != nil {
+		return nil, err
+	}
+
+	f.yubico = httptest.NewServer(http.HandlerFunc(f.serveYubico))
+	gin.DefaultWriter = io.Discard // the request log stays in the measured path, unprinted
+	return f, nil
+}
+
+func (f *benchFixture) close() {
+	if f.yubico != nil {
+		f.yubico.Close()
+	}
+	f.admin.Exec("DROP SCHEMA IF EXISTS " + f.schema + " CASCADE")
+}
+
+// seed writes the directory: resources with an allow permission for each
+// action, roles over a random spread of them, and users in a few roles
+// with one YubiKey each. The spread is the same on every run.
+func (f *benchFixture) seed() error {
+	rng := mathrand.New(mathrand.NewSource(1))
+	now := time.Now()
+
+	var resources []database.Resource
+	var permissions []database.Permission
+	for i := 0; i < benchResources; i++ {
+		res := database.Resource{ID: uuid.New(), Name: fmt.Sprintf("srv-%03d", i), Type: "server", Active: true}
+		resources = append(resources, res)
+		for _, action := range benchActionNames {
+			permissions = append(permissions, database.Permission{
+				ID: uuid.New(), ResourceID: res.ID, Resource: res, Action: action, Effect: "allow",
+			})
+		}
+	}
+	if err := f.db.CreateInBatches(resources, 500).Error; err != nil {
+		return err
+	}
+	if err := f.db.Omit("Resource").CreateInBatches(permissions, 500).Error; err != nil {
+		return err
+	}
+
+	roles := make([]database.Role, benchRoles)
+	for i := range roles {
+		roles[i] = database.Role{ID: uuid.New(), Name: fmt.Sprintf("role-%02d", i), Active: true}
+		for _, p := range rng.Perm(len(permissions))[:benchPermsPerRole] {
+			roles[i].Permissions = append(roles[i].Permissions, permissions[p])
+		}
+	}
+	if err := f.db.Omit("Permissions.*").CreateInBatches(roles, 100).Error; err != nil {
+		return err
+	}
+
+	users := make([]database.User, benchUsers)
+	devices := make([]database.Device, benchUsers)
+	for i := range users {
+		users[i] = database.User{
+			ID: uuid.New(), Email: fmt.Sprintf("user%04d@bench.test", i), Username: fmt.Sprintf("user%04d", i),
+			FirstName: "Bench", LastName: fmt.Sprintf("User %d", i), Active: true,
+		}
+		for _, r := range rng.Perm(benchRoles)[:benchRolesPerUser] {
+			users[i].Roles = append(users[i].Roles, roles[r])
+		}
+		first := users[i].Roles[0].Permissions[0]
+
+		var id [6]byte
+		binary.BigEndian.PutUint32(id[2:], uint32(i))
+		bd := &benchDevice{
+			identifier: modhexEncode(id[:]),
+			permission: first.Resource.Name + ":" + first.Action,
+		}
+		devices[i] = database.Device{
+			ID: uuid.New(), UserID: users[i].ID, Name: "bench key", Type: "yubikey",
+			Identifier: bd.identifier, Active: true, VerifiedAt: now, LastUsedAt: now,
+		}
+		if i%2 == 1 {
+			bd.key, bd.privateID = make([]byte, 16), make([]byte, 6)
+			rng.Read(bd.key)
+			rng.Read(bd.privateID)
+			devices[i].Secret = hex.EncodeToString(bd.key) + ":" + hex.EncodeToString(bd.privateID)
+			f.local = append(f.local, bd)
+		} else {
+			f.cloud = append(f.cloud, bd)
+		}
+	}
+	if err := f.db.Omit("Roles.*").CreateInBatches(users, 500).Error; err != nil {
+		return err
+	}
+	return f.db.Omit("User").CreateInBatches(devices, 500).Error
+}
+
+// countQueries counts every statement gorm sends from now on, including
+// the preloads of one Find and the authentication log's batched inserts
+func (f *benchFixture) countQueries() error {
+	count := func(*gorm.DB) { f.queries.Add(1) }
+	cb := f.db.Callback()
+	for _, err := range []error{
+		cb.Create().After("gorm:create").Register("bench:count", count),
+		cb.Query().After("gorm:query").Register("bench:count", count),
+		cb.Update().After("gorm:update").Register("bench:count", count),
+		cb.Delete().After("gorm:delete").Register("bench:count", count),
+		cb.Row().After("gorm:row").Register("bench:count", count),
+		cb.Raw().After("gorm:raw").Register("bench:count", count),
+	} {
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// serveYubico answers a verification request the way YubiCloud answers a
+// valid OTP, unsigned (the fixture sets no API key)
+func (f *benchFixture) serveYubico(w http.ResponseWriter, r *http.Request) {
+	f.yubicoQueries.Add(1)
+	if *yubicoLatency > 0 {
+		time.Sleep(*yubicoLatency)
+	}
+	q := r.URL.Query()
+	fmt.Fprintf(w, "t=%s\r\notp=%s\r\nnonce=%s\r\nsl=100\r\nstatus=OK\r\n",
+		time.Now().UTC().Format("2006-01-02T15:04:05Z0000"), q.Get("otp"), q.Get("nonce"))
+}
+
+// config is the API's configuration for a benchmark: the defaults, with the
+// device cache on or off
+func (f *benchFixture) config(cache bool) *config.Config {
+	cfg := &config.Config{}
+	cfg.Auth.AgentToken = benchAgentToken
+	cfg.Auth.DeviceCacheSize = 10000
+	if cache {
+		cfg.Auth.DeviceCacheTTL = 30 * time.Second
+	}
+	cfg.Auth.LogQueueSize = 4096
+	cfg.Auth.LogBatchSize = 256
+	cfg.Auth.LogFlushInterval = 250 * time.Millisecond
+	cfg.Yubikey.ClientID = "1"
+	cfg.Yubikey.APIURL = f.yubico.URL + "/wsapi/2.0/verify"
+	cfg.Yubikey.Timeout = 3 * time.Second
+	return cfg
+}
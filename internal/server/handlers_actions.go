@@ -35,7 +35,7 @@ func handlePerformAction(authService *services.AuthService, actionService *servi
 		}
 
 		// Authenticate the user using the device code
-		user, device, err := authService.AuthenticateDevice("yubikey", deviceCode, "")
+		user, device, err := authService.AuthenticateDevice(c.Request.Context(), "yubikey", deviceCode, "")
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, "Authentication failed: "+err.Error())
 			return
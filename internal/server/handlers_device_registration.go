@@ -29,7 +29,7 @@ func handleRegisterDevice(authService *services.AuthService, deviceRegService *s
 		}
 
 		// Authenticate the registrar using the device code
-		registrarUser, _, err := authService.AuthenticateDevice("yubikey", deviceCode, "yubiapp:register-other")
+		registrarUser, _, err := authService.AuthenticateDevice(c.Request.Context(), "yubikey", deviceCode, "yubiapp:register-other")
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, "Authentication failed: "+err.Error())
 			return
@@ -136,7 +136,7 @@ func handleDeregisterDevice(authService *services.AuthService, deviceRegService
 		}
 
 		// Authenticate the deregistrar using the device code
-		registrarUser, _, err := authService.AuthenticateDevice("yubikey", deviceCode, "yubiapp:deregister-other")
+		registrarUser, _, err := authService.AuthenticateDevice(c.Request.Context(), "yubikey", deviceCode, "yubiapp:deregister-other")
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, "Authentication failed: "+err.Error())
 			return
@@ -229,7 +229,7 @@ func handleTransferDevice(authService *services.AuthService, deviceRegService *s
 
 		// Authenticate the transferrer using the device code
 		// Note: Transfer requires both register-other and deregister-other permissions
-		registrarUser, _, err := authService.AuthenticateDevice("yubikey", deviceCode, "yubiapp:register-other")
+		registrarUser, _, err := authService.AuthenticateDevice(c.Request.Context(), "yubikey", deviceCode, "yubiapp:register-other")
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, "Authentication failed: "+err.Error())
 			return
@@ -330,7 +330,7 @@ func handleGetDeviceHistory(authService *services.AuthService, deviceRegService
 		}
 
 		// Authenticate the user (any authenticated user can view device history)
-		_, _, err = authService.AuthenticateDevice("yubikey", deviceCode, "")
+		_, _, err = authService.AuthenticateDevice(c.Request.Context(), "yubikey", deviceCode, "")
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, "Authentication failed: "+err.Error())
 			return
@@ -1,12 +1,20 @@
 package server
 
 import (
+	"encoding/json"
 	"net/http"
+	"time"
 
+	"github.com/YubiApp/internal/database"
 	"github.com/YubiApp/internal/services"
 	"github.com/gin-gonic/gin"
+	"github.com/google/uuid"
+	"github.com/jackc/pgtype"
 )
 
+// maxSessionEvents bounds one /auth/session-events batch
+const maxSessionEvents = 1000
+
 // Session API handlers
 
 // handleCreateSession handles session creation after device authentication
@@ -28,7 +36,7 @@ func handleCreateSession(authService *services.AuthService, sessionService *serv
 		setRequestNonce(c, req.Nonce)
 
 		// Authenticate the device first
-		user, device, err := authService.AuthenticateDevice(req.DeviceType, req.AuthCode, req.Permission)
+		user, device, err := authService.AuthenticateDevice(c.Request.Context(), req.DeviceType, req.AuthCode, req.Permission)
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, err.Error())
 			return
@@ -128,4 +136,112 @@ func handleRefreshSession(sessionService *services.SessionService) gin.HandlerFu
 			"refresh_token": refreshToken,
 		})
 	}
-} 
\ No newline at end of file
+}
+
+// sessionEvent is one PAM session open or close, or an authentication the
+// module decided locally (offline OTP or grant), reported by yubiappd
+type sessionEvent struct {
+	ID       uuid.UUID  `json:"id" binding:"required"`
+	Type     string     `json:"type" binding:"required,oneof=open close auth grant"`
+	Time     int64      `json:"time" binding:"required"`
+	Host     string     `json:"host"`
+	Service  string     `json:"service"`
+	User     string     `json:"user"`
+	RHost    string     `json:"rhost"`
+	TTY      string     `json:"tty"`
+	Session  string     `json:"session"`
+	UserID   *uuid.UUID `json:"user_id"`
+	DeviceID uuid.UUID  `json:"device_id" binding:"required"`
+
+	// Offline and grant authentications only
+	Permission string `json:"permission"`
+	Counter    uint32 `json:"counter" binding:"required_if=Type auth"`
+}
+
+// handleAuthLogStats reports the authentication log writer's queue depth
+// and counters
+func handleAuthLogStats(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		c.JSON(http.StatusOK, authService.AuthLogStats())
+	}
+}
+
+// handleYubicoStats reports request counts and latency per YubiCloud
+// validation server
+func handleYubicoStats(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		c.JSON(http.StatusOK, gin.H{"upstreams": authService.YubicoStats()})
+	}
+}
+
+// handleSessionEvents records a batch of PAM session events as
+// authentication log entries. Event IDs make retried batches idempotent.
+func handleSessionEvents(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		var req struct {
+			Events []sessionEvent `json:"events" binding:"required,dive"`
+		}
+
+		if err := c.ShouldBindJSON(&req); err != nil {
+			errorResponse(c, http.StatusBadRequest, err.Error())
+			return
+		}
+		if len(req.Events) > maxSessionEvents {
+			errorResponse(c, http.StatusRequestEntityTooLarge, "Too many events in one batch")
+			return
+		}
+
+		events := make([]services.SessionEventLog, 0, len(req.Events))
+		for _, ev := range req.Events {
+			fields := map[string]interface{}{
+				"host":    ev.Host,
+				"service": ev.Service,
+				"user":    ev.User,
+				"tty":     ev.TTY,
+				"session": ev.Session,
+			}
+			logType := "login"
+			var counter uint32
+			switch ev.Type {
+			case "close":
+				logType = "logout"
+			case "auth":
+				logType = "mfa"
+				counter = ev.Counter
+				fields["offline"] = true
+				fields["otp_counter"] = ev.Counter
+				fields["permission_checked"] = ev.Permission
+			case "grant":
+				logType = "mfa"
+				fields["grant"] = true
+				fields["permission_checked"] = ev.Permission
+			}
+			details, err := json.Marshal(fields)
+			if err != nil {
+				errorResponse(c, http.StatusBadRequest, err.Error())
+				return
+			}
+			events = append(events, services.SessionEventLog{
+				Log: database.AuthenticationLog{
+					ID:        ev.ID,
+					UserID:    ev.UserID,
+					DeviceID:  ev.DeviceID,
+					Type:      logType,
+					Success:   true,
+					IPAddress: ev.RHost,
+					UserAgent: "pam_yubiapp",
+					Timestamp: time.Unix(ev.Time, 0),
+					Details:   pgtype.JSONB{Bytes: details, Status: pgtype.Present},
+				},
+				OTPCounter: counter,
+			})
+		}
+
+		if err := authService.RecordSessionEvents(events); err != nil {
+			errorResponse(c, http.StatusInternalServerError, "Failed to record session events")
+			return
+		}
+
+		successResponse(c, gin.H{"accepted": len(events)})
+	}
+}
@@ -10,6 +10,20 @@ import (
 	"github.com/gin-gonic/gin"
 )
 
+// agentAuthMiddleware admits host agents (yubiappd) that present the
+// configured agent token as "Authorization: Bearer <token>"
+func agentAuthMiddleware(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		token := strings.TrimPrefix(c.GetHeader("Authorization"), "Bearer ")
+		if !authService.ValidAgentToken(token) {
+			errorResponse(c, http.StatusUnauthorized, "Valid agent token required")
+			c.Abort()
+			return
+		}
+		c.Next()
+	}
+}
+
 // authMiddlewareRead handles authentication for read operations (GET methods)
 // Accepts both device-based and session-based authentication
 func authMiddlewareRead(authService *services.AuthService, sessionService *services.SessionService, requiredPermission string) gin.HandlerFunc {
@@ -92,7 +106,7 @@ func authMiddlewareRead(authService *services.AuthService, sessionService *servi
 			}
 
 			// Authenticate user and check permissions
-			user, device, err := authService.AuthenticateDevice(deviceType, authCode, requiredPermission)
+			user, device, err := authService.AuthenticateDevice(c.Request.Context(), deviceType, authCode, requiredPermission)
 			if err != nil {
 				errorResponse(c, http.StatusUnauthorized, fmt.Sprintf("Authentication failed: %v", err))
 				c.Abort()
@@ -152,7 +166,7 @@ func authMiddlewareWrite(authService *services.AuthService, requiredPermission s
 		}
 
 		// Authenticate user and check permissions
-		user, device, err := authService.AuthenticateDevice(deviceType, authCode, requiredPermission)
+		user, device, err := authService.AuthenticateDevice(c.Request.Context(), deviceType, authCode, requiredPermission)
 		if err != nil {
 			errorResponse(c, http.StatusUnauthorized, fmt.Sprintf("Authentication failed: %v", err))
 			c.Abort()
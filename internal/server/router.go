@@ -45,8 +45,14 @@ func setupRouter(
 	{
 		// Authentication endpoints
 		api.POST("/auth/device", handleDeviceAuth(authService))
+		api.POST("/auth/device/batch", agentAuthMiddleware(authService), handleDeviceAuthBatch(authService))
 		api.POST("/auth/session", handleCreateSession(authService, sessionService))
 		api.POST("/auth/session/refresh/:session_id", handleRefreshSession(sessionService))
+		api.POST("/auth/session-events", agentAuthMiddleware(authService), handleSessionEvents(authService))
+		api.GET("/auth/changes", agentAuthMiddleware(authService), handleAuthChanges())
+		api.GET("/auth/directory", agentAuthMiddleware(authService), handleAuthDirectory(authService))
+		api.GET("/auth/log-stats", authMiddlewareRead(authService, sessionService, "yubiapp:read"), handleAuthLogStats(authService))
+		api.GET("/auth/yubico-stats", authMiddlewareRead(authService, sessionService, "yubiapp:read"), handleYubicoStats(authService))
 
 		// Action endpoint - POST /auth/action/${action_name}
 		api.POST("/auth/action/:action_name", handlePerformAction(authService, actionService))
@@ -167,74 +173,144 @@ func setupRouter(
 	return router
 }
 
+// deviceAuthRequest is the body of POST /auth/device and one item of a batch
+type deviceAuthRequest struct {
+	DeviceType string `json:"device_type" binding:"required"`
+	AuthCode   string `json:"auth_code" binding:"required"`
+	Permission string `json:"permission"` // Optional permission to check
+	Nonce      string `json:"nonce"`      // Optional nonce for response signing
+
+	// Optional comma-separated permissions to evaluate without requiring
+	// them; the response says which the user holds, in this order
+	Permissions string `json:"permissions"`
+
+	// Optional: ask for a signed grant for this host (the audience) covering
+	// the checked permission and those of the comma-separated list the user
+	// holds. Only a login that checks a single permission gets one.
+	GrantAudience    string `json:"grant_audience"`
+	GrantPermissions string `json:"grant_permissions"`
+}
+
+// maxDeviceAuthBatch bounds the items of POST /auth/device/batch
+const maxDeviceAuthBatch = 64
+
+// maxDeviceAuthPermissions bounds the permissions one request evaluates
+const maxDeviceAuthPermissions = 16
+
+// permissionList splits a comma-separated permission list
+func permissionList(list string) []string {
+	if list == "" {
+		return nil
+	}
+	return strings.Split(list, ",")
+}
+
+// validateDeviceAuth checks device-specific requirements, returning an
+// error message for a malformed request
+func validateDeviceAuth(req *deviceAuthRequest) string {
+	if req.DeviceType == "yubikey" {
+		if len(req.AuthCode) != 44 {
+			return fmt.Sprintf("Invalid YubiKey OTP length. Expected 44 characters, got %d. Please ensure your YubiKey is properly inserted and tap the button to generate a complete OTP.", len(req.AuthCode))
+		}
+
+		// Validate that it contains only valid modhex characters
+		validModhexChars := "cbdefghijklnrtuvCBDEFGHIJKLNRTUV"
+		for _, char := range req.AuthCode {
+			if !strings.ContainsRune(validModhexChars, char) {
+				return "Invalid YubiKey OTP format. OTP should contain only modhex characters (c, b, d, e, f, g, h, i, j, k, l, n, r, t, u, v)."
+			}
+		}
+	}
+	if n := len(permissionList(req.Permissions)); n > maxDeviceAuthPermissions {
+		return fmt.Sprintf("Too many permissions: at most %d per request, got %d", maxDeviceAuthPermissions, n)
+	}
+	return ""
+}
+
 // handleDeviceAuth handles device-based authentication
 func handleDeviceAuth(authService *services.AuthService) gin.HandlerFunc {
 	return func(c *gin.Context) {
-		var req struct {
-			DeviceType string `json:"device_type" binding:"required"`
-			AuthCode   string `json:"auth_code" binding:"required"`
-			Permission string `json:"permission"` // Optional permission to check
-			Nonce      string `json:"nonce"`      // Optional nonce for response signing
-		}
+		var req deviceAuthRequest
 
 		if err := c.ShouldBindJSON(&req); err != nil {
-			errorResponse(c, 400, err.Error())
+			deviceAuthError(c, 400, err.Error())
 			return
 		}
 
 		// Validate device-specific requirements
-		if req.DeviceType == "yubikey" {
-			if len(req.AuthCode) != 44 {
-				errorResponse(c, 400, fmt.Sprintf("Invalid YubiKey OTP length. Expected 44 characters, got %d. Please ensure your YubiKey is properly inserted and tap the button to generate a complete OTP.", len(req.AuthCode)))
-				return
-			}
-
-			// Validate that it contains only valid modhex characters
-			validModhexChars := "cbdefghijklnrtuvCBDEFGHIJKLNRTUV"
-			for _, char := range req.AuthCode {
-				if !strings.ContainsRune(validModhexChars, char) {
-					errorResponse(c, 400, "Invalid YubiKey OTP format. OTP should contain only modhex characters (c, b, d, e, f, g, h, i, j, k, l, n, r, t, u, v).")
-					return
-				}
-			}
+		if msg := validateDeviceAuth(&req); msg != "" {
+			deviceAuthError(c, 400, msg)
+			return
 		}
 
 		// Store nonce in context for response functions to use
 		setRequestNonce(c, req.Nonce)
 
-		user, device, err := authService.AuthenticateDevice(req.DeviceType, req.AuthCode, req.Permission)
-		if err != nil {
-			errorResponse(c, 401, err.Error())
+		r := authService.AuthenticateDeviceFor(c.Request.Context(), req.service())
+		if r.Err != nil {
+			deviceAuthError(c, 401, r.Err.Error())
 			return
 		}
 
-		// Build roles list
-		roles := make([]gin.H, len(user.Roles))
-		for i, role := range user.Roles {
-			roles[i] = gin.H{
-				"id":          role.ID,
-				"name":        role.Name,
-				"description": role.Description,
+		deviceAuthResponse(c, r.User, r.Device, r.Held, r.Grant)
+	}
+}
+
+// service is the request as the auth service takes it
+func (req *deviceAuthRequest) service() services.DeviceAuthRequest {
+	return services.DeviceAuthRequest{
+		DeviceType:       req.DeviceType,
+		AuthCode:         req.AuthCode,
+		Permission:       req.Permission,
+		Permissions:      permissionList(req.Permissions),
+		GrantAudience:    req.GrantAudience,
+		GrantPermissions: permissionList(req.GrantPermissions),
+	}
+}
+
+// handleDeviceAuthBatch authenticates several device requests in one call,
+// for brokers that coalesce concurrent logins. Each item gets the status
+// and body POST /auth/device would have returned for it. One call verifies
+// up to maxDeviceAuthBatch OTPs, so only agents may make it.
+func handleDeviceAuthBatch(authService *services.AuthService) gin.HandlerFunc {
+	return func(c *gin.Context) {
+		var req struct {
+			Items []deviceAuthRequest `json:"items" binding:"required,min=1,dive"`
+		}
+
+		if err := c.ShouldBindJSON(&req); err != nil {
+			deviceAuthError(c, 400, err.Error())
+			return
+		}
+		if len(req.Items) > maxDeviceAuthBatch {
+			deviceAuthError(c, 413, fmt.Sprintf("at most %d items per batch", maxDeviceAuthBatch))
+			return
+		}
+
+		results := make([]deviceAuthResult, len(req.Items))
+		var pending []services.DeviceAuthRequest
+		var pendingIdx []int
+		for i := range req.Items {
+			item := &req.Items[i]
+			results[i].nonce = item.Nonce
+			if msg := validateDeviceAuth(item); msg != "" {
+				results[i].status, results[i].message = 400, msg
+				continue
+			}
+			pending = append(pending, item.service())
+			pendingIdx = append(pendingIdx, i)
+		}
+
+		for k, r := range authService.AuthenticateDevices(c.Request.Context(), pending) {
+			res := &results[pendingIdx[k]]
+			if r.Err != nil {
+				res.status, res.message = 401, r.Err.Error()
+				continue
 			}
+			res.status, res.user, res.device, res.held, res.grant = 200, r.User, r.Device, r.Held, r.Grant
 		}
 
-		successResponse(c, gin.H{
-			"authenticated": true,
-			"user": gin.H{
-				"id":         user.ID,
-				"email":      user.Email,
-				"username":   user.Username,
-				"first_name": user.FirstName,
-				"last_name":  user.LastName,
-				"active":     user.Active,
-				"roles":      roles,
-			},
-			"device": gin.H{
-				"id":         device.ID,
-				"type":       device.Type,
-				"identifier": device.Identifier,
-			},
-		})
+		deviceAuthBatchResponse(c, results)
 	}
 }
 
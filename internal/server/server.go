@@ -2,14 +2,22 @@ package server
 
 import (
 	"context"
+	"errors"
 	"fmt"
 	"log"
+	"net"
 	"net/http"
+	"os"
+	"strconv"
+	"sync"
+	"time"
 
 	"github.com/YubiApp/internal/config"
 	"github.com/YubiApp/internal/database"
 	"github.com/YubiApp/internal/services"
 	"github.com/gin-gonic/gin"
+	"golang.org/x/net/http2"
+	"golang.org/x/net/http2/h2c"
 	"gorm.io/driver/postgres"
 	"gorm.io/gorm"
 )
@@ -39,11 +47,19 @@ func New(cfg *config.Config) *Server {
 	if err != nil {
 		log.Fatalf("Failed to initialize database: %v", err)
 	}
+	// Users and roles created before the host directory, or by the CLI
+	if err := services.AssignPosixIDs(db, cfg.Auth); err != nil {
+		log.Fatalf("Failed to assign host directory ids: %v", err)
+	}
+	return newServer(cfg, db)
+}
 
+// newServer builds the services and router over an open, migrated database
+func newServer(cfg *config.Config, db *gorm.DB) *Server {
 	// Initialize services
 	authService := services.NewAuthService(db, cfg)
-	userService := services.NewUserService(db)
-	roleService := services.NewRoleService(db)
+	userService := services.NewUserService(db, cfg)
+	roleService := services.NewRoleService(db, cfg)
 	resourceService := services.NewResourceService(db)
 	permissionService := services.NewPermissionService(db)
 	deviceService := services.NewDeviceService(db)
@@ -62,14 +78,21 @@ func New(cfg *config.Config) *Server {
 	// Setup router
 	router := setupRouter(authService, userService, roleService, resourceService, permissionService, deviceService, actionService, deviceRegService, sessionService, locationService, userStatusService, userActivityService)
 
-	// Create HTTP server
+	// Create HTTP server. The change feed must outlive the write timeout;
+	// h2c is set up here rather than by gin so that exemption applies to
+	// HTTP/2 streams too.
+	var handler http.Handler = liftWriteDeadline(router, cfg.Server.Timeout, "/api/v1/auth/changes")
+	if cfg.Server.H2C {
+		handler = h2c.NewHandler(handler, &http2.Server{})
+	}
 	httpServer := &http.Server{
 		Addr:         fmt.Sprintf("%s:%d", cfg.Server.Host, cfg.Server.Port),
-		Handler:      router,
+		Handler:      handler,
 		ReadTimeout:  cfg.Server.Timeout,
 		WriteTimeout: cfg.Server.Timeout,
 		IdleTimeout:  cfg.Server.Timeout * 2,
 	}
+	httpServer.RegisterOnShutdown(services.CloseAuthChanges)
 
 	return &Server{
 		config:                cfg,
@@ -90,21 +113,103 @@ func New(cfg *config.Config) *Server {
 	}
 }
 
-// Start starts the HTTP server
+// liftWriteDeadline serves the streams at paths without the server's write
+// timeout. It clears the deadline before gin wraps the writer: gin 1.9's
+// writer has no Unwrap, so http.ResponseController cannot reach the
+// connection through it. If the writer net/http handed out cannot clear it
+// either, the failure is logged once; those streams then end at the timeout
+// and subscribers resume from their last event.
+func liftWriteDeadline(next http.Handler, timeout time.Duration, paths ...string) http.Handler {
+	if timeout <= 0 {
+		return next
+	}
+	var warned sync.Once
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		for _, path := range paths {
+			if r.URL.Path != path {
+				continue
+			}
+			if err := http.NewResponseController(w).SetWriteDeadline(time.Time{}); err != nil {
+				warned.Do(func() {
+					log.Printf("Cannot lift the write timeout for %s (%v): streams end after %v", path, err, timeout)
+				})
+			}
+			break
+		}
+		next.ServeHTTP(w, r)
+	})
+}
+
+// Start starts the HTTP server on TCP and, if configured, on a Unix socket.
+// It returns when either listener fails or the server is shut down.
 func (s *Server) Start() error {
-	log.Printf("Starting server on %s", s.httpServer.Addr)
-	return s.httpServer.ListenAndServe()
+	errs := make(chan error, 2)
+	listeners := 0
+
+	if path := s.config.Server.UnixSocket; path != "" {
+		ln, err := listenUnix(path, s.config.Server.UnixSocketMode)
+		if err != nil {
+			return err
+		}
+		log.Printf("Starting server on unix:%s", path)
+		listeners++
+		go func() { errs <- s.httpServer.Serve(ln) }()
+	}
+	if s.config.Server.Port != 0 {
+		log.Printf("Starting server on %s", s.httpServer.Addr)
+		listeners++
+		go func() { errs <- s.httpServer.ListenAndServe() }()
+	}
+	if listeners == 0 {
+		return fmt.Errorf("no listener configured: set server.port or server.unix_socket")
+	}
+
+	return <-errs
 }
 
-// Shutdown gracefully shuts down the server
+// listenUnix listens on a Unix socket with the given octal mode, replacing a
+// stale socket left behind by an earlier run
+func listenUnix(path, mode string) (net.Listener, error) {
+	perm, err := strconv.ParseUint(mode, 8, 32)
+	if err != nil {
+		return nil, fmt.Errorf("invalid server.unix_socket_mode %q: %w", mode, err)
+	}
+	if info, err := os.Lstat(path); err == nil {
+		if info.Mode()&os.ModeSocket == 0 {
+			return nil, fmt.Errorf("%s exists and is not a socket", path)
+		}
+		if err := os.Remove(path); err != nil {
+			return nil, fmt.Errorf("failed to remove stale socket: %w", err)
+		}
+	} else if !errors.Is(err, os.ErrNotExist) {
+		return nil, err
+	}
+
+	ln, err := net.Listen("unix", path)
+	if err != nil {
+		return nil, fmt.Errorf("failed to listen on %s: %w", path, err)
+	}
+	if err := os.Chmod(path, os.FileMode(perm)); err != nil {
+		ln.Close()
+		return nil, fmt.Errorf("failed to set socket mode: %w", err)
+	}
+	return ln, nil
+}
+
+// Shutdown gracefully shuts down the server. Requests in flight finish
+// first, then the queued authentication log is flushed.
 func (s *Server) Shutdown(ctx context.Context) error {
+	err := s.httpServer.Shutdown(ctx)
+	if err := s.authService.Close(ctx); err != nil {
+		log.Printf("Error flushing authentication log: %v", err)
+	}
 	// Close session service (Redis connection)
 	if s.sessionService != nil {
 		if err := s.sessionService.Close(); err != nil {
 			log.Printf("Error closing session service: %v", err)
 		}
 	}
-	return s.httpServer.Shutdown(ctx)
+	return err
 }
 
 // initDatabase initializes the database connection
@@ -116,8 +221,15 @@ func initDatabase(cfg config.DatabaseConfig) (*gorm.DB, error) {
 	if err != nil {
 		return nil, fmt.Errorf("failed to connect to database: %w", err)
 	}
+	if err := migrateDatabase(db); err != nil {
+		return nil, err
+	}
 
-	// Auto migrate database models
+	return db, nil
+}
+
+// migrateDatabase creates or updates the tables of every model
+func migrateDatabase(db *gorm.DB) error {
 	if err := db.AutoMigrate(
 		&database.User{},
 		&database.Role{},
@@ -132,8 +244,7 @@ func initDatabase(cfg config.DatabaseConfig) (*gorm.DB, error) {
 		&database.UserStatus{},
 		&database.UserActivityHistory{},
 	); err != nil {
-		return nil, fmt.Errorf("failed to migrate database: %w", err)
+		return fmt.Errorf("failed to migrate database: %w", err)
 	}
-
-	return db, nil
+	return nil
 } 
\ No newline at end of file
@@ -0,0 +1,144 @@
+package services
+
+import (
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/YubiApp/internal/database"
+	"github.com/google/uuid"
+)
+
+// authGeneration is bumped by every write that can change how a device
+// authenticates: users, roles, permissions, resources and devices. Cached
+// entries from an older generation are not used, so a write through any
+// service takes effect on the next login. Writes that bypass the services
+// (the CLI, another API instance) are picked up when the TTL expires.
+var authGeneration atomic.Uint64
+
+// invalidateAuthCache marks every cached device resolution as stale and
+// publishes the write to the change feed (auth_changes.go)
+func invalidateAuthCache(kind string, id uuid.UUID) {
+	publishAuthChange(kind, id)
+}
+
+// authEntry is a device resolved to its user, with the user's permissions
+// precomputed for the login-time check
+type authEntry struct {
+	device        database.Device
+	user          database.User
+	permissions   map[string]struct{} // "resource:action" with effect allow
+	permissionIDs map[uuid.UUID]struct{}
+	generation    uint64
+	expires       time.Time
+}
+
+func newAuthEntry(device *database.Device, user *database.User, generation uint64, ttl time.Duration) *authEntry {
+	entry := &authEntry{
+		device:        *device,
+		user:          *user,
+		permissions:   make(map[string]struct{}),
+		permissionIDs: make(map[uuid.UUID]struct{}),
+		generation:    generation,
+		expires:       time.Now().Add(ttl),
+	}
+	for _, role := range user.Roles {
+		for _, perm := range role.Permissions {
+			if perm.Effect == "allow" {
+				entry.permissions[perm.Resource.Name+":"+perm.Action] = struct{}{}
+				entry.permissionIDs[perm.ID] = struct{}{}
+			}
+		}
+	}
+	return entry
+}
+
+// hasPermission checks a "resource:action" permission
+func (e *authEntry) hasPermission(resourceName, action string) bool {
+	_, ok := e.permissions[resourceName+":"+action]
+	return ok
+}
+
+// hasPermissionID checks a permission by UUID
+func (e *authEntry) hasPermissionID(permissionID uuid.UUID) bool {
+	_, ok := e.permissionIDs[permissionID]
+	return ok
+}
+
+// allows checks a permission given as a UUID or resource:action; a
+// malformed one is not held
+func (e *authEntry) allows(permission string) bool {
+	if permissionID, err := uuid.Parse(permission); err == nil {
+		return e.hasPermissionID(permissionID)
+	}
+	resourceName, action, ok := strings.Cut(permission, ":")
+	if !ok || strings.Contains(action, ":") {
+		return false
+	}
+	return e.hasPermission(resourceName, action)
+}
+
+// authCache maps "type:identifier" to a resolved device, bounded by size
+// and TTL. A TTL of zero disables it.
+type authCache struct {
+	mu      sync.RWMutex
+	entries map[string]*authEntry
+	ttl     time.Duration
+	size    int
+}
+
+func newAuthCache(ttl time.Duration, size int) *authCache {
+	return &authCache{
+		entries: make(map[string]*authEntry),
+		ttl:     ttl,
+		size:    size,
+	}
+}
+
+func (c *authCache) enabled() bool {
+	return c.ttl > 0 && c.size > 0
+}
+
+// get returns a fresh entry for key, or nil
+func (c *authCache) get(key string) *authEntry {
+	if !c.enabled() {
+		return nil
+	}
+	c.mu.RLock()
+	entry := c.entries[key]
+	c.mu.RUnlock()
+
+	if entry == nil || entry.generation != authGeneration.Load() || time.Now().After(entry.expires) {
+		return nil
+	}
+	return entry
+}
+
+// put stores an entry resolved at generation. When the cache is full,
+// stale entries are dropped first, then arbitrary ones.
+func (c *authCache) put(key string, entry *authEntry) {
+	if !c.enabled() || entry.generation != authGeneration.Load() {
+		return
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if _, ok := c.entries[key]; !ok && len(c.entries) >= c.size {
+		now := time.Now()
+		generation := authGeneration.Load()
+		for k, e := range c.entries {
+			if e.generation != generation || now.After(e.expires) {
+				delete(c.entries, k)
+			}
+		}
+		// Map iteration order is random, so this evicts a random entry
+		for k := range c.entries {
+			if len(c.entries) < c.size {
+				break
+			}
+			delete(c.entries, k)
+		}
+	}
+	c.entries[key] = entry
+}
@@ -0,0 +1,145 @@
+package services
+
+import (
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/google/uuid"
+)
+
+// Kinds of AuthChange: what was written. A user change covers the user's
+// roles; a role, permission or resource change can affect any user.
+const (
+	ChangeUser       = "user"
+	ChangeDevice     = "device"
+	ChangeRole       = "role"
+	ChangePermission = "permission"
+	ChangeResource   = "resource"
+)
+
+// AuthChange is a write that invalidated cached authentication state. It
+// is published to the change feed as the auth cache generation is bumped,
+// so clients outside the API (brokers and their grant stores) can drop
+// what they cached within a round trip instead of waiting for a TTL.
+type AuthChange struct {
+	Generation uint64    `json:"generation"`
+	Kind       string    `json:"kind"`
+	ID         uuid.UUID `json:"id"`
+}
+
+const (
+	authChangeHistory = 1024 // changes kept for subscribers that reconnect
+	authChangeBuffer  = 64   // changes queued per subscriber before it is cut off
+)
+
+// authChangeEpoch identifies this process's generations, which restart at
+// zero with it: a position from another epoch cannot be resumed
+var authChangeEpoch = strconv.FormatInt(time.Now().UnixNano(), 36)
+
+// authChangeFeed fans changes out to subscribers. Publishing takes mu
+// around the generation bump, so the history and every subscriber see
+// changes in generation order.
+type authChangeFeed struct {
+	mu          sync.Mutex
+	history     [authChangeHistory]AuthChange // indexed by generation
+	subscribers map[*AuthChangeSubscription]struct{}
+	closed      bool
+}
+
+var authChanges = authChangeFeed{subscribers: make(map[*AuthChangeSubscription]struct{})}
+
+// AuthChangeSubscription receives the changes published after it was
+// opened. C is closed when the subscriber falls behind by more than it can
+// queue or the feed is shut down; the subscriber then resumes from the
+// last change it saw, or starts over if that is no longer held.
+type AuthChangeSubscription struct {
+	C  <-chan AuthChange
+	ch chan AuthChange
+}
+
+// publishAuthChange bumps the auth cache generation and publishes it
+func publishAuthChange(kind string, id uuid.UUID) {
+	feed := &authChanges
+	feed.mu.Lock()
+	defer feed.mu.Unlock()
+
+	change := AuthChange{Generation: authGeneration.Add(1), Kind: kind, ID: id}
+	feed.history[change.Generation%authChangeHistory] = change
+	for sub := range feed.subscribers {
+		select {
+		case sub.ch <- change:
+		default:
+			delete(feed.subscribers, sub)
+			close(sub.ch)
+		}
+	}
+}
+
+// Position is the feed position just after the change, as "epoch.generation"
+func (c AuthChange) Position() string {
+	return authChangeEpoch + "." + strconv.FormatUint(c.Generation, 10)
+}
+
+// SubscribeAuthChanges opens a subscription. since is the position of the
+// last change the subscriber saw, or the position it was given when it
+// subscribed; the changes after it that are still held are returned to be
+// delivered first. resumed is false if since is empty, from another epoch
+// or too old, and the subscriber must assume anything may have changed.
+// sub is nil once the feed is closed.
+func SubscribeAuthChanges(since string) (sub *AuthChangeSubscription, replay []AuthChange, position string, resumed bool) {
+	feed := &authChanges
+	feed.mu.Lock()
+	defer feed.mu.Unlock()
+
+	if feed.closed {
+		return nil, nil, "", false
+	}
+	current := authGeneration.Load()
+	if epoch, gen, ok := parseAuthChangePosition(since); ok && epoch == authChangeEpoch && gen <= current &&
+		current-gen <= authChangeHistory {
+		resumed = true
+		for g := gen + 1; g <= current; g++ {
+			replay = append(replay, feed.history[g%authChangeHistory])
+		}
+	}
+
+	ch := make(chan AuthChange, authChangeBuffer)
+	sub = &AuthChangeSubscription{C: ch, ch: ch}
+	feed.subscribers[sub] = struct{}{}
+	return sub, replay, AuthChange{Generation: current}.Position(), resumed
+}
+
+// Close ends the subscription
+func (s *AuthChangeSubscription) Close() {
+	feed := &authChanges
+	feed.mu.Lock()
+	defer feed.mu.Unlock()
+	if _, ok := feed.subscribers[s]; ok {
+		delete(feed.subscribers, s)
+		close(s.ch)
+	}
+}
+
+// CloseAuthChanges ends every subscription and refuses new ones, so that
+// streaming responses finish and a graceful shutdown is not held up
+func CloseAuthChanges() {
+	feed := &authChanges
+	feed.mu.Lock()
+	defer feed.mu.Unlock()
+	feed.closed = true
+	for sub := range feed.subscribers {
+		delete(feed.subscribers, sub)
+		close(sub.ch)
+	}
+}
+
+func parseAuthChangePosition(position string) (epoch string, generation uint64, ok bool) {
+	i := strings.LastIndexByte(position, '.')
+	if i < 0 {
+		return "", 0, false
+	}
+	generation, err := strconv.ParseUint(position[i+1:], 10, 64)
+	return position[:i], generation, err == nil
+}
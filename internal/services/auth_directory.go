@@ -0,0 +1,126 @@
+package services
+
+import (
+	"errors"
+	"fmt"
+	"sort"
+	"strings"
+
+	"github.com/YubiApp/internal/config"
+	"github.com/YubiApp/internal/database"
+	"github.com/google/uuid"
+	"gorm.io/gorm"
+)
+
+// The host directory is what nss_yubiapp serves on PAM hosts, in place of
+// YubiApp users copied into /etc/passwd: every active user as an account
+// and every active role as a group of its members. Brokers fetch it in
+// bulk and refetch it when the change feed reports a user or role write.
+//
+// Users and roles are given a uid or gid when they are created, the next
+// free one from the configured base, and keep it, so every host sees the
+// same ids and files a user owns stay theirs. Those created before the
+// directory existed, or outside the API, get theirs from AssignPosixIDs
+// when the API starts or the CLI migrates; listing never writes.
+
+// DirectoryUser is an account in the host directory
+type DirectoryUser struct {
+	Username string `json:"username"`
+	UID      int    `json:"uid"`
+	Gecos    string `json:"gecos"`
+	Groups   []int  `json:"groups"` // gids of the user's roles
+}
+
+// DirectoryGroup is a role's group in the host directory
+type DirectoryGroup struct {
+	Name string `json:"name"`
+	GID  int    `json:"gid"`
+}
+
+// Directory lists the host directory. Users and roles not yet given an id
+// are left out until they are.
+func (s *AuthService) Directory() ([]DirectoryUser, []DirectoryGroup, error) {
+	var roles []database.Role
+	if err := s.db.Where("active = ? AND posix_gid IS NOT NULL", true).Find(&roles).Error; err != nil {
+		return nil, nil, fmt.Errorf("failed to fetch roles: %w", err)
+	}
+	var users []database.User
+	if err := s.db.Preload("Roles").Where("active = ? AND posix_uid IS NOT NULL", true).Find(&users).Error; err != nil {
+		return nil, nil, fmt.Errorf("failed to fetch users: %w", err)
+	}
+
+	gids := make(map[uuid.UUID]int, len(roles))
+	groups := make([]DirectoryGroup, 0, len(roles))
+	for _, role := range roles {
+		gids[role.ID] = *role.PosixGID
+		groups = append(groups, DirectoryGroup{Name: role.Name, GID: *role.PosixGID})
+	}
+
+	dir := make([]DirectoryUser, 0, len(users))
+	for _, user := range users {
+		entry := DirectoryUser{
+			Username: user.Username,
+			UID:      *user.PosixUID,
+			Gecos:    strings.TrimSpace(user.FirstName + " " + user.LastName),
+			Groups:   []int{},
+		}
+		for _, role := range user.Roles {
+			if gid, ok := gids[role.ID]; ok {
+				entry.Groups = append(entry.Groups, gid)
+			}
+		}
+		sort.Ints(entry.Groups)
+		dir = append(dir, entry)
+	}
+	return dir, groups, nil
+}
+
+// AssignPosixIDs gives every user and role without a uid or gid one, in
+// order of creation
+func AssignPosixIDs(db *gorm.DB, cfg config.AuthConfig) error {
+	for _, t := range []struct {
+		model         interface{}
+		table, column string
+		base          int
+	}{
+		{&database.User{}, "users", "posix_uid", cfg.DirectoryUIDBase},
+		{&database.Role{}, "roles", "posix_gid", cfg.DirectoryGIDBase},
+	} {
+		var ids []uuid.UUID
+		if err := db.Model(t.model).Where(t.column+" IS NULL").Order("created_at").Pluck("id", &ids).Error; err != nil {
+			return fmt.Errorf("failed to fetch %s without %s: %w", t.table, t.column, err)
+		}
+		for _, id := range ids {
+			if _, err := assignPosixID(db, t.table, t.column, t.base, id); err != nil && !errors.Is(err, gorm.ErrRecordNotFound) {
+				return err
+			}
+		}
+	}
+	return nil
+}
+
+// assignPosixID gives the row id of table the next free value of column,
+// at least base. Another API instance assigning at the same time can take
+// the same value first; the unique index refuses the second and it is
+// retried with the next. Fails with gorm.ErrRecordNotFound if the row is
+// gone.
+func assignPosixID(db *gorm.DB, table, column string, base int, id uuid.UUID) (int, error) {
+	query := fmt.Sprintf("UPDATE %[1]s SET %[2]s = (SELECT GREATEST(COALESCE(MAX(%[2]s) + 1, ?), ?) FROM %[1]s) "+
+		"WHERE id = ? AND %[2]s IS NULL", table, column)
+	var err error
+	for attempt := 0; attempt < 3; attempt++ {
+		if err = db.Exec(query, base, base, id).Error; err != nil {
+			continue
+		}
+		var assigned struct{ Value *int }
+		if err = db.Table(table).Select(column+" AS value").Where("id = ?", id).Take(&assigned).Error; err != nil {
+			return 0, err
+		}
+		if assigned.Value == nil {
+			err = errors.New("not assigned")
+			continue
+		}
+		return *assigned.Value, nil
+	}
+	return 0, fmt.Errorf("failed to assign %s: %w", column, err)
+}
@@ -0,0 +1,166 @@
+package services
+
+import (
+	"crypto/ed25519"
+	"crypto/x509"
+	"encoding/binary"
+	"encoding/pem"
+	"fmt"
+	"log"
+	"os"
+	"time"
+
+	"github.com/YubiApp/internal/config"
+	"github.com/YubiApp/internal/database"
+)
+
+// Grants are short-lived statements, signed with the API's Ed25519 key,
+// that a user passed a permission check on a host. pam_yubiapp keeps them
+// in a root-only store and accepts one instead of an OTP when the same
+// user checks the same permission again before it expires, so a sudo right
+// after an SSH login needs no round trip. The host only holds the public
+// key. The format is documented in CCode/yubiapp_grant.h:
+//
+//	"YAG" | version | tag (1) | length (2, BE) | value ... | signature (64)
+const grantVersion = 1
+
+const (
+	grantAudience   = 0x01
+	grantIssued     = 0x02
+	grantExpires    = 0x03
+	grantPermission = 0x04
+
+	grantUserID        = 0x10
+	grantUserEmail     = 0x11
+	grantUserUsername  = 0x12
+	grantUserFirstName = 0x13
+	grantUserLastName  = 0x14
+
+	grantRole = 0x20
+
+	grantDeviceID         = 0x30
+	grantDeviceType       = 0x31
+	grantDeviceIdentifier = 0x32
+)
+
+// Limits on what a client may ask a grant to cover
+const (
+	maxGrantAudience    = 255
+	maxGrantPermissions = 16
+)
+
+type grantSigner struct {
+	key ed25519.PrivateKey
+	ttl time.Duration
+}
+
+// newGrantSigner loads the signing key; nil (no grants) if none is
+// configured or it cannot be read
+func newGrantSigner(cfg config.AuthConfig) *grantSigner {
+	if cfg.GrantKeyFile == "" || cfg.GrantTTL <= 0 {
+		return nil
+	}
+	key, err := loadGrantKey(cfg.GrantKeyFile)
+	if err != nil {
+		log.Printf("Grants disabled: %v", err)
+		return nil
+	}
+	return &grantSigner{key: key, ttl: cfg.GrantTTL}
+}
+
+// loadGrantKey reads a PKCS#8 PEM Ed25519 private key, as written by
+// openssl genpkey -algorithm ed25519
+func loadGrantKey(path string) (ed25519.PrivateKey, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, fmt.Errorf("failed to read grant key: %w", err)
+	}
+	block, _ := pem.Decode(data)
+	if block == nil || block.Type != "PRIVATE KEY" {
+		return nil, fmt.Errorf("grant key %s is not a PEM private key", path)
+	}
+	parsed, err := x509.ParsePKCS8PrivateKey(block.Bytes)
+	if err != nil {
+		return nil, fmt.Errorf("failed to parse grant key: %w", err)
+	}
+	key, ok := parsed.(ed25519.PrivateKey)
+	if !ok {
+		return nil, fmt.Errorf("grant key %s is not an Ed25519 key", path)
+	}
+	return key, nil
+}
+
+// issueGrant signs the grant req asked for after entry's user passed the
+// check of req.Permission: nil if it asked for none, names no single
+// permission, or grants are off. Besides the checked permission it covers
+// those of req.Permissions and req.GrantPermissions the user holds. A grant
+// that cannot be issued does not fail the login.
+func (s *AuthService) issueGrant(entry *authEntry, device *database.Device, req DeviceAuthRequest) []byte {
+	if s.grants == nil || req.GrantAudience == "" || req.Permission == "" {
+		return nil
+	}
+	user := &entry.user
+	if len(req.GrantAudience) > maxGrantAudience {
+		log.Printf("Failed to issue grant for %s: invalid grant audience", user.Username)
+		return nil
+	}
+
+	now := time.Now()
+	g := grantWriter{buf: make([]byte, 0, 256+32*len(user.Roles))}
+	g.buf = append(g.buf, 'Y', 'A', 'G', grantVersion)
+	g.str(grantAudience, req.GrantAudience)
+	g.time(grantIssued, now)
+	g.time(grantExpires, now.Add(s.grants.ttl))
+
+	g.str(grantPermission, req.Permission)
+	extra := 0
+	for _, list := range [][]string{req.Permissions, req.GrantPermissions} {
+		for _, perm := range list {
+			if extra == maxGrantPermissions {
+				break
+			}
+			if perm != "" && perm != req.Permission && entry.allows(perm) {
+				g.str(grantPermission, perm)
+				extra++
+			}
+		}
+	}
+
+	g.field(grantUserID, user.ID[:])
+	g.str(grantUserEmail, user.Email)
+	g.str(grantUserUsername, user.Username)
+	g.str(grantUserFirstName, user.FirstName)
+	g.str(grantUserLastName, user.LastName)
+	for _, role := range user.Roles {
+		g.str(grantRole, role.Name)
+	}
+
+	g.field(grantDeviceID, device.ID[:])
+	g.str(grantDeviceType, device.Type)
+	g.str(grantDeviceIdentifier, device.Identifier)
+
+	return append(g.buf, ed25519.Sign(s.grants.key, g.buf)...)
+}
+
+// grantWriter appends tag/length/value fields
+type grantWriter struct {
+	buf []byte
+}
+
+func (w *grantWriter) field(tag byte, value []byte) {
+	if len(value) > 0xffff {
+		value = value[:0xffff]
+	}
+	w.buf = append(w.buf, tag, byte(len(value)>>8), byte(len(value)))
+	w.buf = append(w.buf, value...)
+}
+
+func (w *grantWriter) str(tag byte, value string) {
+	w.field(tag, []byte(value))
+}
+
+func (w *grantWriter) time(tag byte, t time.Time) {
+	var b [8]byte
+	binary.BigEndian.PutUint64(b[:], uint64(t.Unix()))
+	w.field(tag, b[:])
+}
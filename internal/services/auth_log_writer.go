@@ -0,0 +1,239 @@
+package services
+
+import (
+	"context"
+	"fmt"
+	"log"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/YubiApp/internal/database"
+	"github.com/google/uuid"
+	"gorm.io/gorm"
+)
+
+// authLogWriter takes the authentication log and the devices' last-used
+// times off the login path. Log entries go to a bounded queue and are
+// inserted in batches; last-used times are coalesced per device and written
+// with one statement per flush, or per thousand devices. When the queue is full an entry is written
+// synchronously instead, so nothing is lost and the caller sees the
+// backpressure as latency.
+type authLogWriter struct {
+	db            *gorm.DB
+	queue         chan database.AuthenticationLog
+	batchSize     int
+	flushInterval time.Duration
+
+	mu       sync.Mutex
+	lastUsed map[uuid.UUID]time.Time
+
+	stop chan struct{}
+	done chan struct{}
+	once sync.Once
+
+	stats authLogStats
+}
+
+type authLogStats struct {
+	queued          atomic.Uint64
+	overflowed      atomic.Uint64
+	written         atomic.Uint64
+	failed          atomic.Uint64
+	batches         atomic.Uint64
+	devicesTouched  atomic.Uint64
+	lastUsedWritten atomic.Uint64
+}
+
+// AuthLogStats is a snapshot of the log writer's counters
+type AuthLogStats struct {
+	Async           bool   `json:"async"`
+	QueueLength     int    `json:"queue_length"`
+	QueueCapacity   int    `json:"queue_capacity"`
+	Queued          uint64 `json:"queued"`            // entries accepted by the queue
+	Overflowed      uint64 `json:"overflowed"`        // entries written synchronously, queue full
+	Written         uint64 `json:"written"`           // entries inserted by the writer
+	Failed          uint64 `json:"failed"`            // entries whose insert failed
+	Batches         uint64 `json:"batches"`           // insert statements issued
+	PendingDevices  int    `json:"pending_devices"`   // last-used times waiting for a flush
+	DevicesTouched  uint64 `json:"devices_touched"`   // last-used updates requested
+	LastUsedWritten uint64 `json:"last_used_written"` // last-used times written after coalescing
+}
+
+// newAuthLogWriter starts a writer; nil (synchronous writes) if queueSize
+// is 0
+func newAuthLogWriter(db *gorm.DB, queueSize, batchSize int, flushInterval time.Duration) *authLogWriter {
+	if queueSize <= 0 {
+		return nil
+	}
+	if batchSize <= 0 {
+		batchSize = 1
+	}
+	if flushInterval <= 0 {
+		flushInterval = 250 * time.Millisecond
+	}
+	w := &authLogWriter{
+		db:            db,
+		queue:         make(chan database.AuthenticationLog, queueSize),
+		batchSize:     batchSize,
+		flushInterval: flushInterval,
+		lastUsed:      make(map[uuid.UUID]time.Time),
+		stop:          make(chan struct{}),
+		done:          make(chan struct{}),
+	}
+	go w.run()
+	return w
+}
+
+// enqueue hands an entry to the writer, or writes it now if the queue is
+// full or the writer has been closed
+func (w *authLogWriter) enqueue(entry database.AuthenticationLog) error {
+	select {
+	case <-w.stop:
+	default:
+		select {
+		case w.queue <- entry:
+			w.stats.queued.Add(1)
+			return nil
+		default:
+		}
+	}
+	w.stats.overflowed.Add(1)
+	return w.db.Create(&entry).Error
+}
+
+// touchDevice records that a device was used at t; only the latest time
+// per device is written
+func (w *authLogWriter) touchDevice(deviceID uuid.UUID, t time.Time) {
+	w.stats.devicesTouched.Add(1)
+	w.mu.Lock()
+	if prev, ok := w.lastUsed[deviceID]; !ok || t.After(prev) {
+		w.lastUsed[deviceID] = t
+	}
+	w.mu.Unlock()
+}
+
+func (w *authLogWriter) run() {
+	defer close(w.done)
+	ticker := time.NewTicker(w.flushInterval)
+	defer ticker.Stop()
+
+	batch := make([]database.AuthenticationLog, 0, w.batchSize)
+	for {
+		select {
+		case entry := <-w.queue:
+			batch = append(batch, entry)
+			if len(batch) >= w.batchSize {
+				batch = w.writeLogs(batch)
+			}
+		case <-ticker.C:
+			batch = w.writeLogs(batch)
+			w.writeLastUsed()
+		case <-w.stop:
+			// Drain what was queued before the stop
+			for drained := false; !drained; {
+				select {
+				case entry := <-w.queue:
+					batch = append(batch, entry)
+					if len(batch) >= w.batchSize {
+						batch = w.writeLogs(batch)
+					}
+				default:
+					drained = true
+				}
+			}
+			w.writeLogs(batch)
+			w.writeLastUsed()
+			return
+		}
+	}
+}
+
+// writeLogs inserts a batch in one statement and returns it emptied
+func (w *authLogWriter) writeLogs(batch []database.AuthenticationLog) []database.AuthenticationLog {
+	if len(batch) == 0 {
+		return batch
+	}
+	w.stats.batches.Add(1)
+	if err := w.db.Create(&batch).Error; err != nil {
+		w.stats.failed.Add(uint64(len(batch)))
+		log.Printf("Failed to write %d authentication log entries: %v", len(batch), err)
+	} else {
+		w.stats.written.Add(uint64(len(batch)))
+	}
+	clear(batch)
+	return batch[:0]
+}
+
+// lastUsedChunk bounds the devices of one last-used UPDATE, two bind
+// parameters each, well under Postgres' 65535
+const lastUsedChunk = 1000
+
+// writeLastUsed writes the pending last-used times, in one UPDATE per
+// lastUsedChunk devices. A time older than the stored one is ignored.
+func (w *authLogWriter) writeLastUsed() {
+	w.mu.Lock()
+	if len(w.lastUsed) == 0 {
+		w.mu.Unlock()
+		return
+	}
+	pending := w.lastUsed
+	w.lastUsed = make(map[uuid.UUID]time.Time, len(pending))
+	w.mu.Unlock()
+
+	values := make([]string, 0, min(len(pending), lastUsedChunk))
+	args := make([]interface{}, 0, 2*cap(values))
+	flush := func() {
+		query := fmt.Sprintf(`UPDATE devices SET last_used_at = v.t
+			FROM (VALUES %s) AS v(id, t)
+			WHERE devices.id = v.id AND (devices.last_used_at IS NULL OR devices.last_used_at < v.t)`,
+			strings.Join(values, ", "))
+		if err := w.db.Exec(query, args...).Error; err != nil {
+			log.Printf("Failed to update last used time of %d devices: %v", len(values), err)
+		} else {
+			w.stats.lastUsedWritten.Add(uint64(len(values)))
+		}
+		values, args = values[:0], args[:0]
+	}
+	for id, t := range pending {
+		values = append(values, "(?::uuid, ?::timestamptz)")
+		args = append(args, id, t)
+		if len(values) == lastUsedChunk {
+			flush()
+		}
+	}
+	if len(values) > 0 {
+		flush()
+	}
+}
+
+// close stops the writer after flushing everything queued, or when ctx ends
+func (w *authLogWriter) close(ctx context.Context) error {
+	w.once.Do(func() { close(w.stop) })
+	select {
+	case <-w.done:
+		return nil
+	case <-ctx.Done():
+		return fmt.Errorf("authentication log not flushed: %w", ctx.Err())
+	}
+}
+
+func (w *authLogWriter) snapshot() AuthLogStats {
+	w.mu.Lock()
+	pending := len(w.lastUsed)
+	w.mu.Unlock()
+	return AuthLogStats{
+		Async:           true,
+		QueueLength:     len(w.queue),
+		QueueCapacity:   cap(w.queue),
+		Queued:          w.stats.queued.Load(),
+		Overflowed:      w.stats.overflowed.Load(),
+		Written:         w.stats.written.Load(),
+		Failed:          w.stats.failed.Load(),
+		Batches:         w.stats.batches.Load(),
+		PendingDevices:  pending,
+		DevicesTouched:  w.stats.devicesTouched.Load(),
+		LastUsedWritten: w.stats.lastUsedWritten.Load(),
+	}
+}
@@ -1,18 +1,19 @@
 package services
 
 import (
-	"crypto/rand"
-	"encoding/hex"
+	"context"
+	"crypto/subtle"
 	"fmt"
-	"io"
-	"net/http"
-	"net/url"
+	"log"
 	"strings"
+	"sync"
+	"time"
 
 	"github.com/YubiApp/internal/config"
 	"github.com/YubiApp/internal/database"
 	"github.com/google/uuid"
 	"gorm.io/gorm"
+	"gorm.io/gorm/clause"
 	"github.com/jackc/pgtype"
 )
 
@@ -20,6 +21,10 @@ type AuthService struct {
 	db            *gorm.DB
 	deviceService *DeviceService
 	config        *config.Config
+	cache         *authCache
+	logWriter     *authLogWriter // nil: logs are written synchronously
+	yubico        *yubicoClient
+	grants        *grantSigner // nil: no grants issued
 }
 
 func NewAuthService(db *gorm.DB, config *config.Config) *AuthService {
@@ -27,18 +32,101 @@ func NewAuthService(db *gorm.DB, config *config.Config) *AuthService {
 		db:            db,
 		deviceService: NewDeviceService(db),
 		config:        config,
+		cache:         newAuthCache(config.Auth.DeviceCacheTTL, config.Auth.DeviceCacheSize),
+		logWriter:     newAuthLogWriter(db, config.Auth.LogQueueSize, config.Auth.LogBatchSize, config.Auth.LogFlushInterval),
+		yubico:        newYubicoClient(config.Yubikey),
+		grants:        newGrantSigner(config.Auth),
 	}
 }
 
+// Close flushes the authentication log queue
+func (s *AuthService) Close(ctx context.Context) error {
+	if s.logWriter == nil {
+		return nil
+	}
+	return s.logWriter.close(ctx)
+}
+
+// AuthLogStats reports the authentication log writer's queue and counters
+func (s *AuthService) AuthLogStats() AuthLogStats {
+	if s.logWriter == nil {
+		return AuthLogStats{}
+	}
+	return s.logWriter.snapshot()
+}
+
 // AuthenticateDevice authenticates a user using a device and checks permissions
-// Returns both user and device information
-func (s *AuthService) AuthenticateDevice(deviceType, authCode, requiredPermission string) (*database.User, *database.Device, error) {
+// Returns both user and device information. Verification with Yubico
+// servers is abandoned when ctx ends.
+func (s *AuthService) AuthenticateDevice(ctx context.Context, deviceType, authCode, requiredPermission string) (*database.User, *database.Device, error) {
+	r := s.authenticateDevice(ctx, DeviceAuthRequest{
+		DeviceType: deviceType,
+		AuthCode:   authCode,
+		Permission: requiredPermission,
+	}, s.resolveDevice)
+	return r.User, r.Device, r.Err
+}
+
+// AuthenticateDeviceFor authenticates like AuthenticateDevice and also
+// reports, in order, which of req.Permissions the user holds. Those do not
+// fail the authentication; the caller decides whether it needs all or any.
+// With req.GrantAudience set it also signs a grant; see issueGrant.
+func (s *AuthService) AuthenticateDeviceFor(ctx context.Context, req DeviceAuthRequest) DeviceAuthResult {
+	return s.authenticateDevice(ctx, req, s.resolveDevice)
+}
+
+// DeviceAuthRequest is one device authentication, alone or in a batch
+type DeviceAuthRequest struct {
+	DeviceType  string
+	AuthCode    string
+	Permission  string
+	Permissions []string // evaluated, not required; see AuthenticateDeviceFor
+
+	// Host to sign a grant for, and further permissions it may cover
+	GrantAudience    string
+	GrantPermissions []string
+}
+
+// DeviceAuthResult is the outcome of one device authentication
+type DeviceAuthResult struct {
+	User   *database.User
+	Device *database.Device
+	Held   []bool // which of the request's Permissions the user holds
+	Grant  []byte // nil unless one was asked for and could be issued
+	Err    error
+}
+
+// AuthenticateDevices authenticates a batch of requests. The YubiKeys the
+// cache does not know are looked up, with their users and permissions, in
+// one query for the whole batch; the OTPs are then verified concurrently.
+func (s *AuthService) AuthenticateDevices(ctx context.Context, reqs []DeviceAuthRequest) []DeviceAuthResult {
+	lookup := s.resolveYubikeys(reqs)
+	results := make([]DeviceAuthResult, len(reqs))
+
+	var wg sync.WaitGroup
+	for i := range reqs {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			results[i] = s.authenticateDevice(ctx, reqs[i], lookup)
+		}(i)
+	}
+	wg.Wait()
+	return results
+}
+
+// authenticateDevice is AuthenticateDevice with the device lookup supplied
+// by the caller
+func (s *AuthService) authenticateDevice(ctx context.Context, req DeviceAuthRequest,
+	lookup func(deviceType, identifier string) (*authEntry, error)) DeviceAuthResult {
+	deviceType, authCode, requiredPermission := req.DeviceType, req.AuthCode, req.Permission
+	var entry *authEntry
 	var device *database.Device
 	var err error
 
 	switch deviceType {
 	case "yubikey":
-		device, err = s.authenticateYubikey(authCode)
+		entry, err = s.authenticateYubikey(ctx, authCode, lookup)
 	case "totp":
 		device, err = s.authenticateTOTP(authCode)
 	case "sms":
@@ -46,18 +134,23 @@ func (s *AuthService) AuthenticateDevice(deviceType, authCode, requiredPermissio
 	case "email":
 		device, err = s.authenticateEmail(authCode)
 	default:
-		return nil, nil, fmt.Errorf("unsupported device type: %s", deviceType)
+		return DeviceAuthResult{Err: fmt.Errorf("unsupported device type: %s", deviceType)}
 	}
 
 	if err != nil {
-		return nil, nil, err
+		return DeviceAuthResult{Err: err}
 	}
 
 	// Get user associated with the device
-	var user database.User
-	if err := s.db.Preload("Roles.Permissions.Resource").Where("id = ?", device.UserID).First(&user).Error; err != nil {
-		return nil, nil, fmt.Errorf("failed to find user: %w", err)
+	if entry == nil {
+		if entry, err = s.resolveUser(device, authGeneration.Load()); err != nil {
+			return DeviceAuthResult{Err: err}
+		}
 	}
+	// Copies: the cached entry is shared by concurrent logins
+	user := entry.user
+	deviceCopy := entry.device
+	device = &deviceCopy
 
 	details := map[string]interface{}{
 		"user": user.Username,
@@ -70,17 +163,36 @@ func (s *AuthService) AuthenticateDevice(deviceType, authCode, requiredPermissio
 
 	// Check if user and device are active
 	if !user.Active {
-		return nil, nil, fmt.Errorf("user is not active")
+		return DeviceAuthResult{Err: fmt.Errorf("user is not active")}
 	}
 	if !device.Active {
-		return nil, nil, fmt.Errorf("device is not active")
+		return DeviceAuthResult{Err: fmt.Errorf("device is not active")}
 	}
 
-	// If no permission required, just return the user and device
+	// Permissions the caller only wants evaluated, in request order; logged
+	// as checked when no permission is required
+	checked := requiredPermission
+	var held []bool
+	if len(req.Permissions) > 0 {
+		held = make([]bool, len(req.Permissions))
+		results := make(map[string]bool, len(req.Permissions))
+		for i, perm := range req.Permissions {
+			held[i] = entry.allows(perm)
+			results[perm] = held[i]
+		}
+		details["permissions_held"] = results
+		if checked == "" {
+			checked = strings.Join(req.Permissions, ",")
+			details["permission_checked"] = checked
+		}
+	}
+
+	// If no permission required, just return the user and device; no grant,
+	// as one covers a permission that was checked
 	if requiredPermission == "" {
-		s.deviceService.UpdateDeviceLastUsed(device.ID)
-		s.logAuthentication(device, &user, true, requiredPermission, "", details)
-		return &user, device, nil
+		s.touchDevice(device.ID)
+		s.logAuthentication(device, &user, true, checked, "", details)
+		return DeviceAuthResult{User: &user, Device: device, Held: held}
 	}
 
 	// Check if user has the required permission
@@ -89,29 +201,29 @@ func (s *AuthService) AuthenticateDevice(deviceType, authCode, requiredPermissio
 	// Try to parse as UUID first
 	if permissionID, err := uuid.Parse(requiredPermission); err == nil {
 		// It's a UUID, check if user has this specific permission
-		hasPermission = s.checkUserHasPermissionByID(&user, permissionID)
+		hasPermission = entry.hasPermissionID(permissionID)
 	} else {
 		// It's not a UUID, try to parse as resource:action format
 		parts := strings.Split(requiredPermission, ":")
 		if len(parts) != 2 {
-			return nil, nil, fmt.Errorf("invalid permission format: %s (expected 'resource:action' or permission UUID)", requiredPermission)
+			return DeviceAuthResult{Err: fmt.Errorf("invalid permission format: %s (expected 'resource:action' or permission UUID)", requiredPermission)}
 		}
 		resourceName, action := parts[0], parts[1]
-		hasPermission = s.checkUserHasPermissionByResourceAction(&user, resourceName, action)
+		hasPermission = entry.hasPermission(resourceName, action)
 	}
 
 	if !hasPermission {
 		s.logAuthentication(device, &user, false, requiredPermission, "permission denied", details)
-		return nil, nil, fmt.Errorf("permission denied: %s", requiredPermission)
+		return DeviceAuthResult{Err: fmt.Errorf("permission denied: %s", requiredPermission)}
 	}
 
 	// Update device last used timestamp
-	s.deviceService.UpdateDeviceLastUsed(device.ID)
+	s.touchDevice(device.ID)
 
 	// Log successful authentication
 	s.logAuthentication(device, &user, true, requiredPermission, "", details)
 
-	return &user, device, nil
+	return DeviceAuthResult{User: &user, Device: device, Held: held, Grant: s.issueGrant(entry, device, req)}
 }
 
 // checkUserHasPermissionByID checks if a user has a specific permission by UUID
@@ -140,21 +252,105 @@ func (s *AuthService) checkUserHasPermissionByResourceAction(user *database.User
 	return false
 }
 
+// resolveDevice finds a device and its user with permissions, from the
+// cache when a fresh entry is there
+func (s *AuthService) resolveDevice(deviceType, identifier string) (*authEntry, error) {
+	key := deviceType + ":" + identifier
+	if entry := s.cache.get(key); entry != nil {
+		return entry, nil
+	}
+
+	// Read the generation first: a write during the lookup must not be missed
+	generation := authGeneration.Load()
+	device, err := s.deviceService.GetDeviceByIdentifier(deviceType, identifier)
+	if err != nil {
+		return nil, err
+	}
+	entry, err := s.resolveUser(device, generation)
+	if err != nil {
+		return nil, err
+	}
+	s.cache.put(key, entry)
+	return entry, nil
+}
+
+// resolveYubikeys looks up the YubiKeys of a batch that are not cached, in
+// one query, and returns a lookup over the batch's devices
+func (s *AuthService) resolveYubikeys(reqs []DeviceAuthRequest) func(deviceType, identifier string) (*authEntry, error) {
+	resolved := make(map[string]*authEntry, len(reqs))
+	var missing []string
+	for _, r := range reqs {
+		if r.DeviceType != "yubikey" || len(r.AuthCode) < 12 {
+			continue
+		}
+		id := r.AuthCode[:12]
+		if _, seen := resolved[id]; seen {
+			continue
+		}
+		resolved[id] = s.cache.get("yubikey:" + id)
+		if resolved[id] == nil {
+			missing = append(missing, id)
+		}
+	}
+
+	var lookupErr error
+	if len(missing) > 0 {
+		generation := authGeneration.Load()
+		var devices []database.Device
+		lookupErr = s.db.Preload("User.Roles.Permissions.Resource").
+			Where("type = ? AND identifier IN ?", "yubikey", missing).Find(&devices).Error
+		for i := range devices {
+			d := &devices[i]
+			entry := newAuthEntry(d, &d.User, generation, s.cache.ttl)
+			s.cache.put("yubikey:"+d.Identifier, entry)
+			resolved[d.Identifier] = entry
+		}
+	}
+
+	return func(deviceType, identifier string) (*authEntry, error) {
+		if lookupErr != nil {
+			return nil, fmt.Errorf("device not found: %w", lookupErr)
+		}
+		if entry := resolved[identifier]; entry != nil {
+			return entry, nil
+		}
+		return nil, fmt.Errorf("device not found: %w", gorm.ErrRecordNotFound)
+	}
+}
+
+// resolveUser loads a device's user with roles and permissions
+func (s *AuthService) resolveUser(device *database.Device, generation uint64) (*authEntry, error) {
+	var user database.User
+	if err := s.db.Preload("Roles.Permissions.Resource").Where("id = ?", device.UserID).First(&user).Error; err != nil {
+		return nil, fmt.Errorf("failed to find user: %w", err)
+	}
+	return newAuthEntry(device, &user, generation, s.cache.ttl), nil
+}
+
 // authenticateYubikey authenticates using YubiKey OTP
-func (s *AuthService) authenticateYubikey(otp string) (*database.Device, error) {
+func (s *AuthService) authenticateYubikey(ctx context.Context, otp string, lookup func(deviceType, identifier string) (*authEntry, error)) (*authEntry, error) {
 	// Extract device ID from OTP (first 12 characters)
 	if len(otp) < 12 {
 		return nil, fmt.Errorf("invalid YubiKey OTP format")
 	}
 	deviceID := otp[:12]
 
-	// Verify OTP with Yubico servers
-	if err := s.verifyYubikeyOTP(otp); err != nil {
-		return nil, fmt.Errorf("OTP verification failed: %w", err)
+	// Find the device in our database
+	entry, err := lookup("yubikey", deviceID)
+	if err != nil {
+		return nil, err
 	}
+	device := &entry.device
 
-	// Find the device in our database
-	return s.deviceService.GetDeviceByIdentifier("yubikey", deviceID)
+	// Self-provisioned keys are verified locally, the rest by Yubico servers
+	if key, privateID, ok := parseYubikeySecret(device.Secret); ok {
+		if err := verifyLocalYubikeyOTP(s.db, device.ID, otp, key, privateID); err != nil {
+			return nil, fmt.Errorf("OTP verification failed: %w", err)
+		}
+	} else if err := s.verifyYubikeyOTP(ctx, otp); err != nil {
+		return nil, fmt.Errorf("OTP verification failed: %w", err)
+	}
+	return entry, nil
 }
 
 // authenticateTOTP authenticates using TOTP
@@ -177,63 +373,30 @@ func (s *AuthService) authenticateEmail(code string) (*database.Device, error) {
 	return nil, fmt.Errorf("Email authentication not yet implemented")
 }
 
-// verifyYubikeyOTP verifies the OTP with Yubico servers
-func (s *AuthService) verifyYubikeyOTP(otp string) error {
-	params := url.Values{}
-	params.Add("id", s.config.Yubikey.ClientID)
-	params.Add("otp", otp)
-	
-	// Generate alphanumeric nonce (16-40 characters, no hyphens)
-	nonceBytes := make([]byte, 20)
-	rand.Read(nonceBytes)
-	nonce := hex.EncodeToString(nonceBytes)
-	params.Add("nonce", nonce)
-
-	resp, err := http.Get(fmt.Sprintf("%s?%s", s.config.Yubikey.APIURL, params.Encode()))
-	if err != nil {
-		return fmt.Errorf("failed to verify OTP with Yubico: %w", err)
-	}
-	defer resp.Body.Close()
-
-	// Read the response as plain text
-	body, err := io.ReadAll(resp.Body)
-	if err != nil {
-		return fmt.Errorf("failed to read Yubico response: %w", err)
-	}
+// verifyYubikeyOTP verifies the OTP with Yubico servers, until ctx ends
+func (s *AuthService) verifyYubikeyOTP(ctx context.Context, otp string) error {
+	return s.yubico.verify(ctx, otp)
+}
 
-	// Parse key-value pairs
-	lines := strings.Split(string(body), "\n")
-	status := ""
-	for _, line := range lines {
-		if strings.HasPrefix(line, "status=") {
-			status = strings.TrimSpace(strings.TrimPrefix(line, "status="))
-			break
-		}
-	}
+// YubicoStats reports request counts and latency per validation server
+func (s *AuthService) YubicoStats() []YubicoUpstreamStats {
+	return s.yubico.snapshot()
+}
 
-	switch strings.ToLower(status) {
-	case "ok":
-		return nil
-	case "replayed_otp":
-		return fmt.Errorf("replayed OTP detected")
-	case "bad_otp":
-		return fmt.Errorf("invalid OTP format")
-	case "missing_parameter":
-		return fmt.Errorf("missing parameter in OTP verification")
-	case "no_such_client":
-		return fmt.Errorf("invalid client ID")
-	case "operation_not_allowed":
-		return fmt.Errorf("operation not allowed")
-	case "backend_error":
-		return fmt.Errorf("Yubico backend error")
-	default:
-		return fmt.Errorf("Yubico verification failed with status: %s", status)
+// touchDevice updates a device's last used time, through the log writer if
+// there is one
+func (s *AuthService) touchDevice(deviceID uuid.UUID) {
+	if s.logWriter == nil {
+		s.deviceService.UpdateDeviceLastUsed(deviceID)
+		return
 	}
+	s.logWriter.touchDevice(deviceID, time.Now())
 }
 
-// logAuthentication logs the authentication attempt
+// logAuthentication logs the authentication attempt. It does not wait for
+// the database when the log writer is enabled.
 func (s *AuthService) logAuthentication(device *database.Device, user *database.User, success bool, permissionChecked, errorMsg string, details map[string]interface{}) {
-	s.LogAuthentication(map[string]interface{}{
+	authLog, err := newAuthLog(map[string]interface{}{
 		"user_id": user.ID,
 		"device_id": device.ID,
 		"type": "mfa",
@@ -242,12 +405,32 @@ func (s *AuthService) logAuthentication(device *database.Device, user *database.
 		"error_msg": errorMsg,
 		"details": details,
 	})
+	if err != nil {
+		log.Printf("Failed to log authentication: %v", err)
+		return
+	}
+	if s.logWriter == nil {
+		s.db.Create(&authLog)
+		return
+	}
+	s.logWriter.enqueue(authLog)
 }
 
 // LogAuthentication logs an authentication event with custom data
 func (s *AuthService) LogAuthentication(logData map[string]interface{}) error {
+	authLog, err := newAuthLog(logData)
+	if err != nil {
+		return err
+	}
+	return s.db.Create(&authLog).Error
+}
+
+// newAuthLog builds an authentication log entry from logData. CreatedAt is
+// set here, so an entry written later by the log writer keeps its time.
+func newAuthLog(logData map[string]interface{}) (database.AuthenticationLog, error) {
 	authLog := database.AuthenticationLog{
 		ID:        uuid.New(),
+		CreatedAt: time.Now(),
 		Type:      "action", // Use 'action' for action events
 		Success:   true,
 		IPAddress: "",
@@ -256,7 +439,7 @@ func (s *AuthService) LogAuthentication(logData map[string]interface{}) error {
 
 	// Extract fields from logData
 	if userID, ok := logData["user_id"].(uuid.UUID); ok {
-		authLog.UserID = userID
+		authLog.UserID = &userID // nullable: action logs may have no user
 	}
 	if deviceID, ok := logData["device_id"].(uuid.UUID); ok {
 		authLog.DeviceID = deviceID
@@ -277,7 +460,7 @@ func (s *AuthService) LogAuthentication(logData map[string]interface{}) error {
 	// Set Details as JSONB only if we have data
 	if details, ok := logData["details"].(map[string]interface{}); ok && len(details) > 0 {
 		if err := detailsJSONB.Set(details); err != nil {
-			return fmt.Errorf("failed to convert details to JSONB: %w", err)
+			return authLog, fmt.Errorf("failed to convert details to JSONB: %w", err)
 		}
 	}
 	if detailsJSONB.Status != pgtype.Present {
@@ -290,7 +473,50 @@ func (s *AuthService) LogAuthentication(logData map[string]interface{}) error {
 	// Set type to "action" for action events
 	authLog.Type = logData["type"].(string)
 
-	return s.db.Create(&authLog).Error
+	return authLog, nil
+}
+
+// ValidAgentToken reports whether token is the configured agent token used by
+// yubiappd to report PAM session events. An empty configured token disables
+// agent access.
+func (s *AuthService) ValidAgentToken(token string) bool {
+	expected := s.config.Auth.AgentToken
+	if expected == "" || token == "" {
+		return false
+	}
+	return subtle.ConstantTimeCompare([]byte(token), []byte(expected)) == 1
+}
+
+// SessionEventLog is a PAM event to record. OTPCounter is set for an
+// authentication the PAM module verified offline.
+type SessionEventLog struct {
+	Log        database.AuthenticationLog
+	OTPCounter uint32
+}
+
+// RecordSessionEvents stores a batch of PAM session events as authentication
+// log entries. Entries whose ID already exists are skipped, so a batch that
+// is retried after a lost response is not recorded twice. An offline
+// authentication raises the device's OTP counter; one that does not (its OTP
+// was already used elsewhere) is recorded as failed.
+func (s *AuthService) RecordSessionEvents(events []SessionEventLog) error {
+	if len(events) == 0 {
+		return nil
+	}
+	return s.db.Transaction(func(tx *gorm.DB) error {
+		logs := make([]database.AuthenticationLog, 0, len(events))
+		for _, ev := range events {
+			if ev.OTPCounter != 0 {
+				advanced, err := advanceOTPCounter(tx, ev.Log.DeviceID, ev.OTPCounter)
+				if err != nil {
+					return err
+				}
+				ev.Log.Success = advanced
+			}
+			logs = append(logs, ev.Log)
+		}
+		return tx.Clauses(clause.OnConflict{DoNothing: true}).Create(&logs).Error
+	})
 }
 
 // CheckUserPermissionByResourceAction checks if a user has a specific permission by resource name and action
@@ -108,6 +108,7 @@ func (s *DeviceRegistrationService) RegisterDevice(
 	if err := tx.Commit().Error; err != nil {
 		return nil, fmt.Errorf("failed to commit transaction: %w", err)
 	}
+	invalidateAuthCache(ChangeDevice, device.ID)
 
 	return &registration, nil
 }
@@ -172,6 +173,7 @@ func (s *DeviceRegistrationService) DeregisterDevice(
 	if err := tx.Commit().Error; err != nil {
 		return nil, fmt.Errorf("failed to commit transaction: %w", err)
 	}
+	invalidateAuthCache(ChangeDevice, device.ID)
 
 	return &registration, nil
 }
@@ -273,6 +275,7 @@ func (s *DeviceRegistrationService) TransferDevice(
 	if err := tx.Commit().Error; err != nil {
 		return nil, fmt.Errorf("failed to commit transaction: %w", err)
 	}
+	invalidateAuthCache(ChangeDevice, device.ID)
 
 	return &regRecord, nil
 }
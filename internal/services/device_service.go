@@ -144,6 +144,7 @@ func (s *DeviceService) UpdateDevice(deviceID uuid.UUID, updates map[string]inte
 	if err := s.db.Model(&device).Updates(updates).Error; err != nil {
 		return nil, fmt.Errorf("failed to update device: %w", err)
 	}
+	invalidateAuthCache(ChangeDevice, deviceID)
 
 	// Reload device with user
 	if err := s.db.Preload("User").Where("id = ?", deviceID).First(&device).Error; err != nil {
@@ -163,6 +164,7 @@ func (s *DeviceService) DeleteDevice(deviceID uuid.UUID) error {
 	if err := s.db.Delete(&device).Error; err != nil {
 		return fmt.Errorf("failed to delete device: %w", err)
 	}
+	invalidateAuthCache(ChangeDevice, deviceID)
 
 	return nil
 }
@@ -70,6 +70,7 @@ func (s *PermissionService) DeletePermission(permissionID uuid.UUID) error {
 	if err := s.db.Delete(&permission).Error; err != nil {
 		return fmt.Errorf("failed to delete permission: %w", err)
 	}
+	invalidateAuthCache(ChangePermission, permissionID)
 
 	return nil
 }
@@ -121,6 +121,7 @@ func (s *ResourceService) UpdateResource(resourceID uuid.UUID, updates map[strin
 	if err := s.db.Model(&resource).Updates(updates).Error; err != nil {
 		return nil, fmt.Errorf("failed to update resource: %w", err)
 	}
+	invalidateAuthCache(ChangeResource, resourceID)
 
 	// Reload resource
 	if err := s.db.Where("id = ?", resourceID).First(&resource).Error; err != nil {
@@ -140,6 +141,7 @@ func (s *ResourceService) DeleteResource(resourceID uuid.UUID) error {
 	if err := s.db.Delete(&resource).Error; err != nil {
 		return fmt.Errorf("failed to delete resource: %w", err)
 	}
+	invalidateAuthCache(ChangeResource, resourceID)
 
 	return nil
 } 
\ No newline at end of file
@@ -2,18 +2,21 @@ package services
 
 import (
 	"fmt"
+	"log"
 
+	"github.com/YubiApp/internal/config"
 	"github.com/YubiApp/internal/database"
 	"github.com/google/uuid"
 	"gorm.io/gorm"
 )
 
 type RoleService struct {
-	db *gorm.DB
+	db     *gorm.DB
+	config *config.Config
 }
 
-func NewRoleService(db *gorm.DB) *RoleService {
-	return &RoleService{db: db}
+func NewRoleService(db *gorm.DB, config *config.Config) *RoleService {
+	return &RoleService{db: db, config: config}
 }
 
 // CreateRole creates a new role
@@ -27,6 +30,13 @@ func (s *RoleService) CreateRole(name, description string) (*database.Role, erro
 	if err := s.db.Create(&role).Error; err != nil {
 		return nil, fmt.Errorf("failed to create role: %w", err)
 	}
+	// Before the change is published, so brokers refetch the directory with it
+	if gid, err := assignPosixID(s.db, "roles", "posix_gid", s.config.Auth.DirectoryGIDBase, role.ID); err != nil {
+		log.Printf("Role %s has no gid until the API restarts or the CLI migrates: %v", role.Name, err)
+	} else {
+		role.PosixGID = &gid
+	}
+	invalidateAuthCache(ChangeRole, role.ID)
 
 	return &role, nil
 }
@@ -68,6 +78,7 @@ func (s *RoleService) UpdateRole(roleID uuid.UUID, updates map[string]interface{
 	if err := s.db.Model(&role).Updates(updates).Error; err != nil {
 		return nil, fmt.Errorf("failed to update role: %w", err)
 	}
+	invalidateAuthCache(ChangeRole, roleID)
 
 	// Reload role with permissions
 	if err := s.db.Preload("Permissions.Resource").Where("id = ?", roleID).First(&role).Error; err != nil {
@@ -87,6 +98,7 @@ func (s *RoleService) DeleteRole(roleID uuid.UUID) error {
 	if err := s.db.Delete(&role).Error; err != nil {
 		return fmt.Errorf("failed to delete role: %w", err)
 	}
+	invalidateAuthCache(ChangeRole, roleID)
 
 	return nil
 }
@@ -116,6 +128,7 @@ func (s *RoleService) AssignPermissionToRole(roleID, permissionID uuid.UUID) err
 	if err := s.db.Model(&role).Association("Permissions").Append(&permission); err != nil {
 		return fmt.Errorf("failed to assign permission to role: %w", err)
 	}
+	invalidateAuthCache(ChangeRole, roleID)
 
 	return nil
 }
@@ -135,6 +148,7 @@ func (s *RoleService) RemovePermissionFromRole(roleID, permissionID uuid.UUID) e
 	if err := s.db.Model(&role).Association("Permissions").Delete(&permission); err != nil {
 		return fmt.Errorf("failed to remove permission from role: %w", err)
 	}
+	invalidateAuthCache(ChangeRole, roleID)
 
 	return nil
 } 
\ No newline at end of file
@@ -2,7 +2,9 @@ package services
 
 import (
 	"fmt"
+	"log"
 
+	"github.com/YubiApp/internal/config"
 	"github.com/YubiApp/internal/database"
 	"github.com/google/uuid"
 	"golang.org/x/crypto/bcrypt"
@@ -10,11 +12,12 @@ import (
 )
 
 type UserService struct {
-	db *gorm.DB
+	db     *gorm.DB
+	config *config.Config
 }
 
-func NewUserService(db *gorm.DB) *UserService {
-	return &UserService{db: db}
+func NewUserService(db *gorm.DB, config *config.Config) *UserService {
+	return &UserService{db: db, config: config}
 }
 
 // CreateUser creates a new user
@@ -37,6 +40,13 @@ func (s *UserService) CreateUser(email, username, password, firstName, lastName
 	if err := s.db.Create(&user).Error; err != nil {
 		return nil, fmt.Errorf("failed to create user: %w", err)
 	}
+	// Before the change is published, so brokers refetch the directory with it
+	if uid, err := assignPosixID(s.db, "users", "posix_uid", s.config.Auth.DirectoryUIDBase, user.ID); err != nil {
+		log.Printf("User %s has no uid until the API restarts or the CLI migrates: %v", user.Username, err)
+	} else {
+		user.PosixUID = &uid
+	}
+	invalidateAuthCache(ChangeUser, user.ID)
 
 	return &user, nil
 }
@@ -96,6 +106,7 @@ func (s *UserService) UpdateUser(userID uuid.UUID, updates map[string]interface{
 	if err := s.db.Model(&user).Updates(updates).Error; err != nil {
 		return nil, fmt.Errorf("failed to update user: %w", err)
 	}
+	invalidateAuthCache(ChangeUser, userID)
 
 	// Reload user with roles
 	if err := s.db.Preload("Roles").Where("id = ?", userID).First(&user).Error; err != nil {
@@ -115,6 +126,7 @@ func (s *UserService) DeleteUser(userID uuid.UUID) error {
 	if err := s.db.Delete(&user).Error; err != nil {
 		return fmt.Errorf("failed to delete user: %w", err)
 	}
+	invalidateAuthCache(ChangeUser, userID)
 
 	return nil
 }
@@ -143,6 +155,7 @@ func (s *UserService) AssignUserToRole(userID, roleID uuid.UUID) error {
 	if err := s.db.Model(&user).Association("Roles").Append(&role); err != nil {
 		return fmt.Errorf("failed to assign user to role: %w", err)
 	}
+	invalidateAuthCache(ChangeUser, userID)
 
 	return nil
 }
@@ -162,6 +175,7 @@ func (s *UserService) RemoveUserFromRole(userID, roleID uuid.UUID) error {
 	if err := s.db.Model(&user).Association("Roles").Delete(&role); err != nil {
 		return fmt.Errorf("failed to remove user from role: %w", err)
 	}
+	invalidateAuthCache(ChangeUser, userID)
 
 	return nil
 } 
\ No newline at end of file
@@ -0,0 +1,357 @@
+package services
+
+import (
+	"context"
+	"crypto/hmac"
+	"crypto/rand"
+	"crypto/sha1"
+	"encoding/base64"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"net/http"
+	"net/url"
+	"sort"
+	"strings"
+	"sync/atomic"
+	"time"
+
+	"github.com/YubiApp/internal/config"
+)
+
+// yubicoClient verifies OTPs against YubiCloud (or a compatible validation
+// server) the way ykclient does: the request goes to every configured server
+// at once, the first authoritative answer wins and the other requests are
+// cancelled. Connections are kept alive between logins, and every request
+// has a deadline, so one slow server is not on the login's critical path.
+type yubicoClient struct {
+	clientID  string
+	key       []byte // HMAC-SHA1 API key; nil sends unsigned requests
+	timeout   time.Duration
+	http      *http.Client
+	upstreams []*yubicoUpstream
+}
+
+type yubicoUpstream struct {
+	url   string
+	stats yubicoStats
+}
+
+// Latency buckets, upper bounds in milliseconds; the last bucket is open
+var yubicoLatencyBuckets = [...]int64{10, 25, 50, 100, 250, 500, 1000, 2500}
+
+type yubicoStats struct {
+	requests  atomic.Uint64
+	wins      atomic.Uint64 // answered first with an authoritative status
+	answers   atomic.Uint64 // authoritative answers, first or not
+	deferred  atomic.Uint64 // answers another server may overrule (BACKEND_ERROR, ...)
+	failures  atomic.Uint64 // transport errors, bad responses, timeouts
+	cancelled atomic.Uint64 // abandoned after another server answered
+	latencyNS atomic.Uint64 // total, of completed requests
+	maxNS     atomic.Uint64
+	buckets   [len(yubicoLatencyBuckets) + 1]atomic.Uint64
+}
+
+// YubicoUpstreamStats is a snapshot of one validation server's counters
+type YubicoUpstreamStats struct {
+	URL          string   `json:"url"`
+	Requests     uint64   `json:"requests"`
+	Wins         uint64   `json:"wins"`
+	Answers      uint64   `json:"answers"`
+	Deferred     uint64   `json:"deferred"`
+	Failures     uint64   `json:"failures"`
+	Cancelled    uint64   `json:"cancelled"`
+	MeanMS       float64  `json:"mean_ms"`
+	MaxMS        float64  `json:"max_ms"`
+	BucketsMS    []int64  `json:"buckets_ms"` // upper bounds; the last count is above them all
+	BucketCounts []uint64 `json:"bucket_counts"`
+}
+
+// yubicoAnswer is one server's reply
+type yubicoAnswer struct {
+	upstream *yubicoUpstream
+	status   string
+	err      error
+}
+
+func newYubicoClient(cfg config.YubikeyConfig) *yubicoClient {
+	urls := cfg.APIURLs
+	if len(urls) == 0 {
+		urls = []string{cfg.APIURL}
+	}
+	timeout := cfg.Timeout
+	if timeout <= 0 {
+		timeout = 3 * time.Second
+	}
+
+	c := &yubicoClient{
+		clientID: cfg.ClientID,
+		timeout:  timeout,
+		http: &http.Client{
+			Transport: &http.Transport{
+				Proxy: http.ProxyFromEnvironment,
+				DialContext: (&net.Dialer{
+					Timeout:   timeout,
+					KeepAlive: 30 * time.Second,
+				}).DialContext,
+				ForceAttemptHTTP2:     true,
+				MaxIdleConns:          64,
+				MaxIdleConnsPerHost:   16,
+				IdleConnTimeout:       90 * time.Second,
+				TLSHandshakeTimeout:   timeout,
+				ResponseHeaderTimeout: timeout,
+			},
+			Timeout: timeout,
+		},
+	}
+	for _, u := range urls {
+		c.upstreams = append(c.upstreams, &yubicoUpstream{url: u})
+	}
+	if cfg.SecretKey != "" {
+		key, err := base64.StdEncoding.DecodeString(cfg.SecretKey)
+		if err != nil {
+			log.Printf("yubikey.secret_key is not base64, Yubico requests are not signed")
+		} else {
+			c.key = key
+		}
+	}
+	return c
+}
+
+// verify checks an OTP. It returns nil for status OK and an error naming the
+// status otherwise. Every server is asked at once, under ctx (the caller's
+// request) and the configured timeout; the rest are cancelled when one has
+// decided, or all when ctx ends.
+func (c *yubicoClient) verify(ctx context.Context, otp string) error {
+	nonceBytes := make([]byte, 20)
+	if _, err := rand.Read(nonceBytes); err != nil {
+		return fmt.Errorf("failed to generate nonce: %w", err)
+	}
+	nonce := hex.EncodeToString(nonceBytes)
+
+	params := url.Values{}
+	params.Set("id", c.clientID)
+	params.Set("otp", otp)
+	params.Set("nonce", nonce)
+	if c.key != nil {
+		params.Set("h", c.sign(params))
+	}
+	query := params.Encode()
+
+	ctx, cancel := context.WithTimeout(ctx, c.timeout)
+	defer cancel()
+
+	answers := make(chan yubicoAnswer, len(c.upstreams))
+	for _, up := range c.upstreams {
+		go func(up *yubicoUpstream) {
+			status, err := c.query(ctx, up, query, otp, nonce)
+			answers <- yubicoAnswer{upstream: up, status: status, err: err}
+		}(up)
+	}
+
+	// The first authoritative answer decides; a non-authoritative one is kept
+	// in case no server gives a better one
+	var fallback *yubicoAnswer
+	for pending := len(c.upstreams); pending > 0; pending-- {
+		ans := <-answers
+		if ans.err == nil && yubicoAuthoritative(ans.status) {
+			ans.upstream.stats.wins.Add(1)
+			cancel()
+			go drainYubicoAnswers(answers, pending-1)
+			return yubicoStatusError(ans.status)
+		}
+		if fallback == nil || (fallback.err != nil && ans.err == nil) {
+			fallback = &ans
+		}
+	}
+	if fallback.err != nil {
+		return fmt.Errorf("failed to verify OTP with Yubico: %w", fallback.err)
+	}
+	return yubicoStatusError(fallback.status)
+}
+
+// drainYubicoAnswers collects the answers of cancelled requests, so their
+// goroutines can finish
+func drainYubicoAnswers(answers <-chan yubicoAnswer, n int) {
+	for ; n > 0; n-- {
+		<-answers
+	}
+}
+
+// query sends one verification request and returns the status of a
+// response that matches the request
+func (c *yubicoClient) query(ctx context.Context, up *yubicoUpstream, query, otp, nonce string) (string, error) {
+	up.stats.requests.Add(1)
+	start := time.Now()
+
+	status, err := c.roundTrip(ctx, up.url+"?"+query, otp, nonce)
+	if err != nil {
+		if errors.Is(ctx.Err(), context.Canceled) {
+			up.stats.cancelled.Add(1)
+			return "", err
+		}
+		up.stats.failures.Add(1)
+		up.stats.observe(time.Since(start))
+		return "", err
+	}
+	up.stats.observe(time.Since(start))
+	if yubicoAuthoritative(status) {
+		up.stats.answers.Add(1)
+	} else {
+		up.stats.deferred.Add(1)
+	}
+	return status, nil
+}
+
+func (c *yubicoClient) roundTrip(ctx context.Context, rawURL, otp, nonce string) (string, error) {
+	req, err := http.NewRequestWithContext(ctx, http.MethodGet, rawURL, nil)
+	if err != nil {
+		return "", err
+	}
+	resp, err := c.http.Do(req)
+	if err != nil {
+		return "", err
+	}
+	defer resp.Body.Close()
+	if resp.StatusCode != http.StatusOK {
+		return "", fmt.Errorf("validation server returned HTTP %d", resp.StatusCode)
+	}
+	body, err := io.ReadAll(io.LimitReader(resp.Body, 4096))
+	if err != nil {
+		return "", fmt.Errorf("failed to read Yubico response: %w", err)
+	}
+
+	fields := parseYubicoResponse(body)
+	status := fields["status"]
+	if status == "" {
+		return "", fmt.Errorf("Yubico response has no status")
+	}
+	if c.key != nil && status != "BAD_SIGNATURE" && status != "NO_SUCH_CLIENT" {
+		if !hmac.Equal([]byte(fields["h"]), []byte(c.signFields(fields))) {
+			return "", fmt.Errorf("Yubico response signature mismatch")
+		}
+	}
+	// Only OK echoes the request; an answer to another request must not count
+	if status == "OK" && (fields["otp"] != otp || fields["nonce"] != nonce) {
+		return "", fmt.Errorf("Yubico response does not match the request")
+	}
+	return status, nil
+}
+
+// parseYubicoResponse splits a key=value per line response
+func parseYubicoResponse(body []byte) map[string]string {
+	fields := make(map[string]string, 8)
+	for _, line := range strings.Split(string(body), "\n") {
+		key, value, ok := strings.Cut(strings.TrimRight(line, "\r"), "=")
+		if ok {
+			fields[key] = value
+		}
+	}
+	return fields
+}
+
+// sign computes the request signature: HMAC-SHA1 over the parameters
+// sorted by key, joined as k=v&k=v without URL encoding
+func (c *yubicoClient) sign(params url.Values) string {
+	fields := make(map[string]string, len(params))
+	for k := range params {
+		fields[k] = params.Get(k)
+	}
+	return c.signFields(fields)
+}
+
+func (c *yubicoClient) signFields(fields map[string]string) string {
+	keys := make([]string, 0, len(fields))
+	for k := range fields {
+		if k != "h" {
+			keys = append(keys, k)
+		}
+	}
+	sort.Strings(keys)
+	mac := hmac.New(sha1.New, c.key)
+	for i, k := range keys {
+		if i > 0 {
+			mac.Write([]byte("&"))
+		}
+		mac.Write([]byte(k + "=" + fields[k]))
+	}
+	return base64.StdEncoding.EncodeToString(mac.Sum(nil))
+}
+
+// yubicoAuthoritative reports whether a status settles the OTP. The others
+// are the server's own trouble, and another server may still answer.
+func yubicoAuthoritative(status string) bool {
+	switch status {
+	case "BACKEND_ERROR", "NOT_ENOUGH_ANSWERS", "REPLAYED_REQUEST":
+		return false
+	}
+	return true
+}
+
+func yubicoStatusError(status string) error {
+	switch strings.ToLower(status) {
+	case "ok":
+		return nil
+	case "replayed_otp":
+		return fmt.Errorf("replayed OTP detected")
+	case "bad_otp":
+		return fmt.Errorf("invalid OTP format")
+	case "missing_parameter":
+		return fmt.Errorf("missing parameter in OTP verification")
+	case "no_such_client":
+		return fmt.Errorf("invalid client ID")
+	case "operation_not_allowed":
+		return fmt.Errorf("operation not allowed")
+	case "backend_error":
+		return fmt.Errorf("Yubico backend error")
+	default:
+		return fmt.Errorf("Yubico verification failed with status: %s", status)
+	}
+}
+
+func (s *yubicoStats) observe(d time.Duration) {
+	ns := uint64(d)
+	s.latencyNS.Add(ns)
+	for {
+		max := s.maxNS.Load()
+		if ns <= max || s.maxNS.CompareAndSwap(max, ns) {
+			break
+		}
+	}
+	ms := d.Milliseconds()
+	i := 0
+	for i < len(yubicoLatencyBuckets) && ms > yubicoLatencyBuckets[i] {
+		i++
+	}
+	s.buckets[i].Add(1)
+}
+
+func (c *yubicoClient) snapshot() []YubicoUpstreamStats {
+	out := make([]YubicoUpstreamStats, 0, len(c.upstreams))
+	for _, up := range c.upstreams {
+		st := &up.stats
+		snap := YubicoUpstreamStats{
+			URL:          up.url,
+			Requests:     st.requests.Load(),
+			Wins:         st.wins.Load(),
+			Answers:      st.answers.Load(),
+			Deferred:     st.deferred.Load(),
+			Failures:     st.failures.Load(),
+			Cancelled:    st.cancelled.Load(),
+			MaxMS:        float64(st.maxNS.Load()) / 1e6,
+			BucketsMS:    yubicoLatencyBuckets[:],
+			BucketCounts: make([]uint64, len(st.buckets)),
+		}
+		if done := snap.Answers + snap.Deferred + snap.Failures; done > 0 {
+			snap.MeanMS = float64(st.latencyNS.Load()) / 1e6 / float64(done)
+		}
+		for i := range st.buckets {
+			snap.BucketCounts[i] = st.buckets[i].Load()
+		}
+		out = append(out, snap)
+	}
+	return out
+}
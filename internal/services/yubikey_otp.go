@@ -0,0 +1,142 @@
+package services
+
+import (
+	"bytes"
+	"crypto/aes"
+	"encoding/hex"
+	"fmt"
+	"strings"
+
+	"github.com/google/uuid"
+	"gorm.io/gorm"
+)
+
+// Self-provisioned YubiKeys keep their AES key (and private ID) in
+// Device.Secret as "<aes key hex>:<private id hex>". Their OTPs are verified
+// here instead of by YubiCloud, and the highest usage counter seen is kept in
+// the device's properties as "otp_counter" (usage counter << 8 | session
+// counter, the same value pam_yubiapp reports for offline logins).
+
+const modhexAlphabet = "cbdefghijklnrtuv"
+
+// yubikeyToken is a decrypted OTP token
+type yubikeyToken struct {
+	PrivateID []byte
+	Counter   uint32
+}
+
+// parseYubikeySecret splits a device secret into AES key and private ID.
+// ok is false if the device is not self-provisioned.
+func parseYubikeySecret(secret string) (key, privateID []byte, ok bool) {
+	keyHex, idHex, found := strings.Cut(secret, ":")
+	if !found {
+		return nil, nil, false
+	}
+	key, err := hex.DecodeString(keyHex)
+	if err != nil || len(key) != aes.BlockSize {
+		return nil, nil, false
+	}
+	privateID, err = hex.DecodeString(idHex)
+	if err != nil || len(privateID) != 6 {
+		return nil, nil, false
+	}
+	return key, privateID, true
+}
+
+// FormatYubikeySecret builds the device secret for a self-provisioned key
+func FormatYubikeySecret(aesKey, privateID string) (string, error) {
+	secret := strings.ToLower(aesKey) + ":" + strings.ToLower(privateID)
+	if _, _, ok := parseYubikeySecret(secret); !ok {
+		return "", fmt.Errorf("AES key must be 32 and private ID 12 hex characters")
+	}
+	return secret, nil
+}
+
+// yubikeyCRC computes the ISO 13239 CRC used by Yubico OTP tokens
+func yubikeyCRC(data []byte) uint16 {
+	crc := uint16(0xffff)
+	for _, b := range data {
+		crc ^= uint16(b)
+		for i := 0; i < 8; i++ {
+			lsb := crc & 1
+			crc >>= 1
+			if lsb != 0 {
+				crc ^= 0x8408
+			}
+		}
+	}
+	return crc
+}
+
+// decryptYubikeyOTP decrypts the token part of an OTP (the 32 modhex
+// characters after the public ID) and checks its CRC
+func decryptYubikeyOTP(otp string, key []byte) (*yubikeyToken, error) {
+	if len(otp) < 32+1 {
+		return nil, fmt.Errorf("invalid YubiKey OTP format")
+	}
+	token := otp[len(otp)-32:]
+
+	var cipherText [aes.BlockSize]byte
+	for i := 0; i < len(cipherText); i++ {
+		hi := strings.IndexByte(modhexAlphabet, token[2*i])
+		lo := strings.IndexByte(modhexAlphabet, token[2*i+1])
+		if hi < 0 || lo < 0 {
+			return nil, fmt.Errorf("invalid YubiKey OTP format")
+		}
+		cipherText[i] = byte(hi<<4 | lo)
+	}
+
+	block, err := aes.NewCipher(key)
+	if err != nil {
+		return nil, err
+	}
+	var plain [aes.BlockSize]byte
+	block.Decrypt(plain[:], cipherText[:])
+
+	// A token with its CRC appended leaves the fixed residue 0xf0b8
+	if yubikeyCRC(plain[:]) != 0xf0b8 {
+		return nil, fmt.Errorf("OTP does not match the device key")
+	}
+
+	useCounter := uint32(plain[6]) | uint32(plain[7])<<8
+	return &yubikeyToken{
+		PrivateID: plain[:6],
+		Counter:   useCounter<<8 | uint32(plain[11]),
+	}, nil
+}
+
+// verifyLocalYubikeyOTP checks an OTP against the key of a self-provisioned
+// device and consumes it
+func verifyLocalYubikeyOTP(db *gorm.DB, deviceID uuid.UUID, otp string, key, privateID []byte) error {
+	token, err := decryptYubikeyOTP(otp, key)
+	if err != nil {
+		return err
+	}
+	if !bytes.Equal(token.PrivateID, privateID) {
+		return fmt.Errorf("OTP does not match the device key")
+	}
+	advanced, err := advanceOTPCounter(db, deviceID, token.Counter)
+	if err != nil {
+		return err
+	}
+	if !advanced {
+		return fmt.Errorf("replayed OTP")
+	}
+	return nil
+}
+
+// advanceOTPCounter records counter as the device's latest OTP counter if it
+// is higher than the one stored. It reports false for a replayed OTP. The
+// compare and update are one statement, so concurrent requests with the same
+// OTP cannot both succeed.
+func advanceOTPCounter(db *gorm.DB, deviceID uuid.UUID, counter uint32) (bool, error) {
+	result := db.Exec(`UPDATE devices
+		SET properties = jsonb_set(COALESCE(properties, '{}'::jsonb), '{otp_counter}', to_jsonb(?::bigint)),
+		    last_used_at = NOW()
+		WHERE id = ? AND COALESCE((properties->>'otp_counter')::bigint, -1) < ?`,
+		counter, deviceID, counter)
+	if result.Error != nil {
+		return false, fmt.Errorf("failed to update OTP counter: %w", result.Error)
+	}
+	return result.RowsAffected == 1, nil
+}